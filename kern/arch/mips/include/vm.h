@@ -111,12 +111,18 @@ void unset_ramsize(void);
  * We'll take up to 16 invalidations before just flushing the whole TLB.
  */
 
+struct semaphore;
+
 struct tlbshootdown {
 	/*
-	 * Change this to what you need for your VM design.
+	 * The page at ts_vaddr is being taken away from ts_addrspace.
+	 * The target CPU drops its mapping and then Vs ts_done, if set,
+	 * so the sender can wait until nobody can still be using the
+	 * page. Shootdowns sent as a batch only set it on the last one.
 	 */
 	struct addrspace *ts_addrspace;
 	vaddr_t ts_vaddr;
+	struct semaphore *ts_done;
 };
 
 #define TLBSHOOTDOWN_MAX 16
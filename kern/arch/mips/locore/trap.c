@@ -105,13 +105,9 @@ static void kill_curthread(vaddr_t epc, unsigned code, vaddr_t vaddr) {
 		break;
 	}
 
-	/*
-	 * You will probably want to change this.
-	 */
-
 	kprintf("Fatal user mode trap %u sig %d (%s, epc 0x%x, vaddr 0x%x)\n",
 		code, sig, trapcodenames[code], epc, vaddr);
-	panic("I don't know how to handle this\n");
+	sys__exit(sig);
 }
 
 /*
@@ -31,6 +31,7 @@
 #include <kern/errno.h>
 #include <kern/syscall.h>
 #include <lib.h>
+#include <endian.h>
 #include <mips/specialreg.h>
 #include <mips/trapframe.h>
 #include <thread.h>
@@ -38,6 +39,7 @@
 #include <current.h>
 #include <copyinout.h>
 #include <syscall.h>
+#include "opt-smartvm.h"
 
 
 /*
@@ -81,7 +83,17 @@
 void syscall(struct trapframe *tf) {
 	int callno;
 	int32_t retval;
+	off_t retval64;
+	bool use64;
 	int err;
+#ifdef UW
+	uint64_t pos;
+	int whence;
+#endif
+#if OPT_SMARTVM
+	int fd;
+	off_t offset;
+#endif
 
 	KASSERT(curthread != NULL);
 	KASSERT(curthread->t_curspl == 0);
@@ -99,6 +111,7 @@ void syscall(struct trapframe *tf) {
 	 */
 
 	retval = 0;
+	use64 = false;
 
 	switch (callno) {
 		case SYS_reboot:
@@ -108,16 +121,46 @@ void syscall(struct trapframe *tf) {
 		case SYS___time:
 			err = sys___time((userptr_t)tf->tf_a0, (userptr_t)tf->tf_a1);
 		break;
+
+		case SYS___kmprof:
+			err = sys___kmprof((int)tf->tf_a0, (userptr_t)tf->tf_a1,
+					   (size_t)tf->tf_a2, &retval);
+		break;
 #ifdef UW
+	case SYS_open:
+		err = sys_open((const_userptr_t)tf->tf_a0, (int)tf->tf_a1,
+			       (mode_t)tf->tf_a2, &retval);
+		break;
+	case SYS_read:
+		err = sys_read((int)tf->tf_a0, (userptr_t)tf->tf_a1,
+			       (size_t)tf->tf_a2, &retval);
+		break;
 	case SYS_write:
 		err = sys_write(
 			(int)tf->tf_a0,
 			(userptr_t)tf->tf_a1,
-			(int)tf->tf_a2,
+			(size_t)tf->tf_a2,
 			(int *)(&retval)
 		);
 
 	  break;
+	case SYS_close:
+		err = sys_close((int)tf->tf_a0);
+		break;
+	case SYS_lseek:
+		/* the 64-bit position is in a2/a3; whence is on the stack */
+		join32to64(tf->tf_a2, tf->tf_a3, &pos);
+		err = copyin((const_userptr_t)(tf->tf_sp + 16), &whence,
+			     sizeof(whence));
+		if (err == 0) {
+			err = sys_lseek((int)tf->tf_a0, (off_t)pos, whence,
+					&retval64);
+			use64 = true;
+		}
+		break;
+	case SYS_dup2:
+		err = sys_dup2((int)tf->tf_a0, (int)tf->tf_a1, &retval);
+		break;
 	case SYS__exit:
 		sys__exit((int)tf->tf_a0);
 		/* sys__exit does not return, execution should not get here */
@@ -143,6 +186,39 @@ void syscall(struct trapframe *tf) {
 	case SYS_execv:
 		err = sys_execv((const_userptr_t)tf->tf_a0, (const_userptr_t *)tf->tf_a1, &retval);
 		break;
+#if OPT_SMARTVM
+	case SYS_sbrk:
+		err = sys_sbrk((intptr_t)tf->tf_a0, &retval);
+		break;
+	case SYS_mmap:
+		/* fd and the (64-bit, aligned) offset are on the stack */
+		err = copyin((const_userptr_t)(tf->tf_sp + 16), &fd, sizeof(fd));
+		if (err == 0) {
+			err = copyin((const_userptr_t)(tf->tf_sp + 24), &offset,
+				     sizeof(offset));
+		}
+		if (err == 0) {
+			err = sys_mmap((userptr_t)tf->tf_a0, (size_t)tf->tf_a1,
+				       (int)tf->tf_a2, (int)tf->tf_a3, fd, offset,
+				       &retval);
+		}
+		break;
+	case SYS_munmap:
+		err = sys_munmap((userptr_t)tf->tf_a0, (size_t)tf->tf_a1);
+		break;
+	case SYS_shm_create:
+		err = sys_shm_create((int)tf->tf_a0, (size_t)tf->tf_a1, &retval);
+		break;
+	case SYS_shm_attach:
+		err = sys_shm_attach((int)tf->tf_a0, (userptr_t)tf->tf_a1, &retval);
+		break;
+	case SYS_shm_detach:
+		err = sys_shm_detach((userptr_t)tf->tf_a0);
+		break;
+	case SYS_shm_remove:
+		err = sys_shm_remove((int)tf->tf_a0);
+		break;
+#endif
 #endif // UW
 
 	    /* Add stuff here */
@@ -162,6 +238,10 @@ void syscall(struct trapframe *tf) {
 		 */
 		tf->tf_v0 = err;
 		tf->tf_a3 = 1;      /* signal an error */
+	} else if (use64) {
+		/* Success, with a 64-bit result in v0/v1. */
+		split64to32(retval64, &tf->tf_v0, &tf->tf_v1);
+		tf->tf_a3 = 0;      /* signal no error */
 	} else {
 		/* Success. */
 		tf->tf_v0 = retval;
@@ -29,15 +29,29 @@
 
 #include <types.h>
 #include <kern/errno.h>
+#include <kern/mman.h>
 #include <lib.h>
 #include <spl.h>
+#include <clock.h>
 #include <spinlock.h>
 #include <proc.h>
 #include <current.h>
 #include <mips/tlb.h>
+#include <platform/maxcpus.h>
 #include <addrspace.h>
 #include <vm.h>
-#include <syscall.h>
+#include <pagetable.h>
+#include <uio.h>
+#include <vnode.h>
+#include <stat.h>
+#include <synch.h>
+#include <wchan.h>
+#include <cpu.h>
+#include <thread.h>
+#include <swap.h>
+#include <vmobj.h>
+#include <shm.h>
+#include <uw-vmstats.h>
 
 /*
  * Dumb MIPS-only "VM system" that is intended to only be just barely
@@ -46,8 +60,15 @@
  * assignment, this file is not included in your kernel!
  */
 
-/* under smartvm, always have 48k of user stack */
-#define SMARTVM_STACKPAGES    12
+/*
+ * under smartvm, the user stack starts out one page long and grows down
+ * on demand, up to SMARTVM_STACKMAX pages (1M). At least
+ * SMARTVM_GUARDPAGES unmapped pages are always left between the stack
+ * and the region below it, so running off the end faults.
+ */
+#define SMARTVM_STACKPAGES    1
+#define SMARTVM_STACKMAX      256
+#define SMARTVM_GUARDPAGES    1
 
 /**
 	A coremap is an array of coremapentry instances
@@ -60,14 +81,186 @@ static struct coremapentry *coremap = NULL;
 
 static bool coremapsetup = false;
 
-// Is the TLB currently full?
-static bool tlbfull = false;
+/**
+	Buddy allocator state
+
+	freelists[k] is the coremap index of the first free block of 2^k pages
+	(or -1 if there are none). Blocks never grow past COREMAP_MAXORDER, so
+	a single allocation is limited to 2^COREMAP_MAXORDER pages (4M).
+*/
+#define COREMAP_MAXORDER 10
+#define COREMAP_NORDERS  (COREMAP_MAXORDER + 1)
+
+static int freelists[COREMAP_NORDERS];
+static unsigned freeblocks[COREMAP_NORDERS]; // number of blocks on each list
+static unsigned freepagecount = 0;
+
+/**
+	Pool of free pages that have already been zeroed
+
+	Idle CPUs take single pages off the buddy free lists and zero them
+	(vm_idle), so that faults on new anonymous, stack and BSS pages don't
+	have to. Pool pages are marked used, with no owner, but they're only
+	being kept warm: when the buddy allocator can't satisfy a request,
+	they all go back to it before anything is evicted.
+*/
+#define ZEROPOOL_MAX 32
+
+static int zeropool[ZEROPOOL_MAX];
+static unsigned zeropoolcount = 0;
+static unsigned zeropoolfilling = 0; // pages being zeroed right now
+static unsigned zeropoolhits = 0;
+static unsigned zeropoolmisses = 0;
+
+/*
+ * Per-CPU TLB bookkeeping, indexed by cpu number. Each CPU only touches
+ * its own, at splhigh.
+ *
+ * Entries are tagged with an ASID so that an address space's mappings
+ * can stay in the TLB while other processes run. Each CPU hands out its
+ * own ASIDs round-robin: tc_owner[a] is the as_id of the address space
+ * using ASID a on this CPU (0 if none), and before an ASID goes to
+ * somebody new, its old entries are thrown away.
+ *
+ * tc_slot[i] is 1 + the ASID of the entry in TLB slot i, or 0 if the
+ * slot is free. When no slot is free, tc_hand goes round the TLB
+ * picking the entry to replace.
+ */
+struct tlbcpu {
+	unsigned tc_asid;		/* current ASID */
+	unsigned tc_nextasid;		/* next ASID to hand out */
+	unsigned tc_owner[NUM_ASID];
+	unsigned char tc_slot[NUM_TLB];
+	unsigned tc_nused;		/* slots in use */
+	unsigned tc_hand;		/* next slot to replace */
+};
+
+static struct tlbcpu tlbcpus[MAXCPUS];
+
+/* Next as_id to hand out; 0 is never used */
+static unsigned nextasid_id = 1;
 
 /*
- * Wrap rma_stealmem in a spinlock.
+ * Wrap rma_stealmem and the coremap in a spinlock.
  */
 static struct spinlock stealmem_lock = SPINLOCK_INITIALIZER;
 
+/**
+	Eviction state
+
+	When memory runs out, user pages are pushed out to swap (or simply
+	dropped, if they are unchanged since they were read in) by a clock
+	sweep over the coremap. The pageout thread runs ahead of the hand
+	writing dirty pages to swap while memory is getting low, so that
+	eviction usually finds a clean page and doesn't have to wait for
+	the disk. Pages of vmobjs are evicted by the same sweep; see
+	vmobj_evict.
+
+	evict_lock serializes eviction and pageout. Pages on their way out
+	have PTE_INTRANSIT set in their PTE (or busy set in the coremap while
+	being cleaned); anyone who needs such a page sleeps on transit_wchan.
+*/
+#define PAGEOUT_LOWATER  (totalpagecount / 16)	// wake pageout below this
+#define PAGEOUT_SCAN     64	// coremap entries pageout looks at per pass
+#define PAGEOUT_BATCH    8	// most pages pageout writes per pass
+
+static int clockhand = 0;
+static struct lock *evict_lock = NULL;
+static struct lock *vmobj_lock = NULL; // see struct vmobj
+static struct wchan *transit_wchan = NULL;
+static struct semaphore *shootdown_sem = NULL;
+static struct semaphore *pageout_sem = NULL;
+static bool pageout_wanted = false;
+
+static int page_evict(void);
+static void pageout_thread(void *unused1, unsigned long unused2);
+static bool vmobj_pageinuse(int index);
+static int vmobj_evict(int index);
+
+/**
+	Smallest order whose block holds at least npages pages
+*/
+static unsigned order_for(unsigned long npages) {
+	unsigned order = 0;
+	while ((1UL << order) < npages) {
+		order++;
+	}
+	return order;
+}
+
+/**
+	Push the block starting at index onto the free list for its order
+*/
+static void freelist_push(int index, unsigned order) {
+	struct coremapentry *entry = coremap + index;
+
+	entry->freehead = true;
+	entry->order = order;
+	entry->prevfree = -1;
+	entry->nextfree = freelists[order];
+	if (freelists[order] >= 0) {
+		coremap[freelists[order]].prevfree = index;
+	}
+	freelists[order] = index;
+	freeblocks[order]++;
+}
+
+/**
+	Unlink a free block from whichever list it is on
+*/
+static void freelist_unlink(int index) {
+	struct coremapentry *entry = coremap + index;
+
+	KASSERT(entry->freehead);
+	if (entry->prevfree >= 0) {
+		coremap[entry->prevfree].nextfree = entry->nextfree;
+	} else {
+		freelists[entry->order] = entry->nextfree;
+	}
+	if (entry->nextfree >= 0) {
+		coremap[entry->nextfree].prevfree = entry->prevfree;
+	}
+	freeblocks[entry->order]--;
+	entry->freehead = false;
+	entry->nextfree = -1;
+	entry->prevfree = -1;
+}
+
+/**
+	Return a block of 2^order pages to the allocator, merging it with its
+	buddy for as long as the buddy is also a whole free block
+*/
+static void freeblock(int index, unsigned order) {
+	while (order < COREMAP_MAXORDER) {
+		int buddy = index ^ (1 << order);
+		if (buddy + (1 << order) > totalpagecount) break;
+		if (!coremap[buddy].freehead || coremap[buddy].order != order) break;
+
+		freelist_unlink(buddy);
+		if (buddy < index) index = buddy;
+		order++;
+	}
+	freelist_push(index, order);
+}
+
+/**
+	Return npages pages starting at index to the allocator. The range is
+	split into the largest naturally-aligned blocks that fit.
+*/
+static void freerange(int index, unsigned long npages) {
+	while (npages > 0) {
+		unsigned order = 0;
+		while (order < COREMAP_MAXORDER &&
+			(index & (1 << order)) == 0 &&
+			(2UL << order) <= npages) {
+			order++;
+		}
+		freeblock(index, order);
+		index += 1 << order;
+		npages -= 1UL << order;
+	}
+}
+
 /**
 	TODO: Rename to not-so-smartvm.c
 	TODO: Dynamic segments for processes using Segmentation and Paging translation
@@ -91,8 +284,26 @@ void vm_bootstrap(void) {
 	// Zero out all the core map entries
 	for (int i = 0; i < totalpagecount; i++) {
 		(coremap + i)->used = false;
-		(coremap + i)->nextentry = -1;
+		(coremap + i)->freehead = false;
+		(coremap + i)->order = 0;
+		(coremap + i)->npages = 0;
+		(coremap + i)->refcount = 0;
+		(coremap + i)->as = NULL;
+		(coremap + i)->obj = NULL;
+		(coremap + i)->vaddr = 0;
+		(coremap + i)->swapslot = -1;
+		(coremap + i)->busy = false;
+		(coremap + i)->nextfree = -1;
+		(coremap + i)->prevfree = -1;
+	}
+
+	// Hand every page to the buddy allocator
+	for (int k = 0; k < COREMAP_NORDERS; k++) {
+		freelists[k] = -1;
+		freeblocks[k] = 0;
 	}
+	freerange(0, totalpagecount);
+	freepagecount = totalpagecount;
 
 	// Recalc ramsize again
 	ram_getsize(&lo, &hi);
@@ -103,56 +314,198 @@ void vm_bootstrap(void) {
 	pmemstart = lo;
 	pmemend = hi;
 	coremapsetup = true;
+
+	vmstats_init();
+
+	evict_lock = lock_create("evict");
+	vmobj_lock = lock_create("vmobjs");
+	transit_wchan = wchan_create("vmtransit");
+	shootdown_sem = sem_create("shootdown", 0);
+	pageout_sem = sem_create("pageout", 0);
+	if (evict_lock == NULL || vmobj_lock == NULL || transit_wchan == NULL ||
+	    shootdown_sem == NULL || pageout_sem == NULL) {
+		panic("vm_bootstrap: out of memory\n");
+	}
+
+	swap_bootstrap();
+	shm_bootstrap();
+
+	int result = thread_fork("pageout", NULL, pageout_thread, NULL, 0);
+	if (result) {
+		panic("vm_bootstrap: thread_fork failed: %s\n", strerror(result));
+	}
 }
 
 /**
-	Get the address of a free physical page, allocating as we go
-	When more than one page is required, the coremap entry will have the index
-	of the next page (the last page will have an index of -1).
+	Get the index of a run of npages free, physically contiguous pages.
+
+	The smallest free block of at least npages pages is taken off the buddy
+	free lists and split down; whatever is left over past npages goes
+	straight back. Returns -1 if no block is big enough; the caller
+	may evict something and try again.
 */
 int getppageid(unsigned long npages) {
 
-	int result = -1;
-	struct coremapentry* previousrow = NULL;
-	int i;
+	KASSERT(spinlock_do_i_hold(&stealmem_lock));
+	KASSERT(npages > 0);
+
+	if (npages > freepagecount) {
+		return -1;
+	}
 
-	for (i = 0; i < totalpagecount && npages > 0; i++) {
-		struct coremapentry* row = (coremap + i);
-		if (row->used) continue;
-		row->used = true;
+	unsigned want = order_for(npages);
+	if (want > COREMAP_MAXORDER) {
+		return -1;
+	}
 
-		if (previousrow == NULL) {
-			result = i;
-		} else {
-			previousrow->nextentry = i;
-		}
-		previousrow = row;
+	unsigned order = want;
+	while (order < COREMAP_NORDERS && freelists[order] < 0) {
+		order++;
+	}
+	if (order == COREMAP_NORDERS) {
+		// Enough free pages, but too fragmented for this request
+		return -1;
+	}
 
-		if (--npages == 0) break;
+	int result = freelists[order];
+	freelist_unlink(result);
+
+	// Split until the block is the right size, keeping the lower half
+	while (order > want) {
+		order--;
+		freelist_push(result + (1 << order), order);
 	}
 
-	if (i == totalpagecount) {
-		// Did not break before finding a page
-		// TODO: Evict page from memory into swap file
-		panic("Out of memory. No more pages to allocate\n");
+	// Give back the tail of the block we don't need
+	freerange(result + npages, (1UL << want) - npages);
+
+	for (unsigned long i = 0; i < npages; i++) {
+		KASSERT(!coremap[result + i].used);
+		coremap[result + i].used = true;
+		coremap[result + i].npages = 0;
+	}
+	coremap[result].npages = npages;
+	coremap[result].refcount = 1;
+	freepagecount -= npages;
+
+	// Getting low: have the pageout thread start cleaning pages
+	if (freepagecount + zeropoolcount < (unsigned)PAGEOUT_LOWATER &&
+	    !pageout_wanted &&
+	    pageout_sem != NULL) {
+		pageout_wanted = true;
+		V(pageout_sem);
 	}
 
 	return result;
 }
 
+/**
+	Give every page in the zeroed-page pool back to the buddy allocator.
+	Returns true if there were any.
+*/
+static bool zeropool_drain(void) {
+	KASSERT(spinlock_do_i_hold(&stealmem_lock));
+
+	if (zeropoolcount == 0) {
+		return false;
+	}
+	while (zeropoolcount > 0) {
+		int index = zeropool[--zeropoolcount];
+		KASSERT(coremap[index].used && coremap[index].npages == 1);
+		coremap[index].used = false;
+		coremap[index].npages = 0;
+		coremap[index].refcount = 0;
+		freerange(index, 1);
+		freepagecount++;
+	}
+	return true;
+}
+
 static paddr_t getppages(unsigned long npages) {
 	paddr_t addr;
+	int pageid;
 
 	spinlock_acquire(&stealmem_lock);
 
-	if (coremapsetup) {
-		addr = (paddr_t)(pmemstart + getppageid(npages) * PAGE_SIZE);
-	} else {
+	if (!coremapsetup) {
 		addr = ram_stealmem(npages);
+		spinlock_release(&stealmem_lock);
+		return addr;
+	}
+
+	pageid = getppageid(npages);
+	if (pageid < 0 && zeropool_drain()) {
+		pageid = getppageid(npages);
+	}
+	spinlock_release(&stealmem_lock);
+
+	// Out of memory: push user pages out until there's room
+	while (pageid < 0) {
+		if (page_evict()) {
+			return 0;
+		}
+		spinlock_acquire(&stealmem_lock);
+		pageid = getppageid(npages);
+		spinlock_release(&stealmem_lock);
+	}
+
+	return (paddr_t)(pmemstart + pageid * PAGE_SIZE);
+}
+
+/**
+	Get a single zero-filled page, from the pool if there's one there.
+*/
+static paddr_t getzeroedpage(void) {
+	int index;
+	paddr_t paddr;
+
+	spinlock_acquire(&stealmem_lock);
+	if (zeropoolcount > 0) {
+		index = zeropool[--zeropoolcount];
+		zeropoolhits++;
+		spinlock_release(&stealmem_lock);
+		return pmemstart + index * PAGE_SIZE;
+	}
+	zeropoolmisses++;
+	spinlock_release(&stealmem_lock);
+
+	paddr = getppages(1);
+	if (paddr != 0) {
+		bzero((void *)PADDR_TO_KVADDR(paddr), PAGE_SIZE);
+	}
+	return paddr;
+}
+
+/**
+	Called by a CPU with nothing to run. Zero one free page for the pool
+	and return true, or return false if there's nothing to do: the pool
+	is full, or memory is short enough that the pages are better left
+	free.
+*/
+bool vm_idle(void) {
+	int index;
+
+	spinlock_acquire(&stealmem_lock);
+	if (!coremapsetup || zeropoolcount + zeropoolfilling >= ZEROPOOL_MAX ||
+	    freepagecount <= 2 * (unsigned)PAGEOUT_LOWATER) {
+		spinlock_release(&stealmem_lock);
+		return false;
 	}
+	index = getppageid(1);
+	if (index < 0) {
+		spinlock_release(&stealmem_lock);
+		return false;
+	}
+	zeropoolfilling++;
+	spinlock_release(&stealmem_lock);
 
+	bzero((void *)PADDR_TO_KVADDR(pmemstart + index * PAGE_SIZE), PAGE_SIZE);
+
+	spinlock_acquire(&stealmem_lock);
+	zeropoolfilling--;
+	zeropool[zeropoolcount++] = index;
 	spinlock_release(&stealmem_lock);
-	return addr;
+	return true;
 }
 
 /* Allocate/free some kernel-space virtual pages */
@@ -167,42 +520,1661 @@ vaddr_t alloc_kpages(int npages) {
 
 void free_kpages(vaddr_t addr) {
 
-	// (void)addr;
-	// TODO: check if physical address is in the right bounds?
-
 	paddr_t paddr = KVADDR_TO_PADDR(addr);
 	KASSERT(paddr % PAGE_SIZE == 0); // must be the address of a page
 
+	if (paddr < pmemstart) {
+		// Stolen before vm_bootstrap; the coremap doesn't own it.
+		return;
+	}
+	KASSERT(paddr < pmemend);
+
 	// convert physical address to page number
 	int pagenumber = (paddr - pmemstart) / PAGE_SIZE;
 
-	// Keep grabbing the next page and free it
-	do {
-		// Free the page
-		struct coremapentry * kpage = (coremap + pagenumber);
-		KASSERT(kpage->used); // Crash if this is an unused page
-		kpage->used = false;
-		pagenumber = kpage->nextentry;
-		kpage->nextentry = -1;
-	} while (pagenumber >= 0);
+	spinlock_acquire(&stealmem_lock);
+
+	struct coremapentry *kpage = coremap + pagenumber;
+	KASSERT(kpage->used); // Crash if this is an unused page
+	KASSERT(kpage->npages > 0); // ...or not the start of an allocation
+	KASSERT(kpage->refcount > 0);
+
+	// Still shared copy-on-write with someone else
+	if (--kpage->refcount > 0) {
+		spinlock_release(&stealmem_lock);
+		return;
+	}
+
+	KASSERT(!kpage->busy);
+	if (kpage->swapslot >= 0) {
+		swap_free(kpage->swapslot);
+	}
+	kpage->as = NULL;
+	kpage->obj = NULL;
+	kpage->swapslot = -1;
+
+	unsigned long npages = kpage->npages;
+	for (unsigned long i = 0; i < npages; i++) {
+		KASSERT(coremap[pagenumber + i].used);
+		coremap[pagenumber + i].used = false;
+		coremap[pagenumber + i].npages = 0;
+	}
+	freerange(pagenumber, npages);
+	freepagecount += npages;
+
+	spinlock_release(&stealmem_lock);
+}
+
+/**
+	Dump the state of the buddy allocator: free pages, free blocks per
+	order, and how fragmented the free memory is. Fragmentation is the
+	share of free memory that is not in the largest free block, so 0%
+	means all free memory is available as one contiguous block.
+*/
+void coremap_printstats(void) {
+	unsigned blocks[COREMAP_NORDERS];
+	unsigned freepages, largest = 0;
+	unsigned zeroed, hits, misses;
+
+	spinlock_acquire(&stealmem_lock);
+	for (int k = 0; k < COREMAP_NORDERS; k++) {
+		blocks[k] = freeblocks[k];
+		if (blocks[k] > 0) largest = k;
+	}
+	freepages = freepagecount;
+	zeroed = zeropoolcount;
+	hits = zeropoolhits;
+	misses = zeropoolmisses;
+	spinlock_release(&stealmem_lock);
+
+	kprintf("Coremap: %u of %d pages free\n", freepages, totalpagecount);
+	for (int k = 0; k < COREMAP_NORDERS; k++) {
+		kprintf("  order %2d (%4u pages): %u free blocks\n",
+			k, 1U << k, blocks[k]);
+	}
+	if (freepages > 0 && blocks[largest] > 0) {
+		kprintf("Largest free block: %u pages, fragmentation %u%%\n",
+			1U << largest,
+			100 - (100 * (1U << largest)) / freepages);
+	}
+	kprintf("Zeroed pages: %u ready, %u faults used one, %u zeroed their own\n",
+		zeroed, hits, misses);
+	swap_printstats();
+}
+
+/**
+	Take another reference to a (single) user page, so that it is shared
+	copy-on-write. The page goes away when every reference has been passed
+	to free_kpages. Shared pages have no owner, so they aren't evicted,
+	except for vmobj pages, and those not while anyone but the object and
+	the PTEs mapping them holds a reference; see vmobj_pageinuse.
+*/
+static void page_share(paddr_t paddr) {
+	KASSERT(spinlock_do_i_hold(&stealmem_lock));
+	KASSERT(paddr >= pmemstart && paddr < pmemend);
+	int pagenumber = (paddr - pmemstart) / PAGE_SIZE;
+
+	KASSERT(coremap[pagenumber].used);
+	KASSERT(coremap[pagenumber].npages == 1);
+	coremap[pagenumber].refcount++;
+	coremap[pagenumber].as = NULL;
+}
+
+/**
+	The coremap entry for the frame a (resident) PTE points to
+*/
+static struct coremapentry * pte_entry(pte_t pte) {
+	paddr_t paddr = pte & PTE_FRAME;
+	KASSERT(paddr >= pmemstart && paddr < pmemend);
+	return coremap + (paddr - pmemstart) / PAGE_SIZE;
+}
+
+/**
+	Sleep until some page finishes being written out. Called, and
+	returns, with stealmem_lock held.
+*/
+static void pte_wait(void) {
+	KASSERT(spinlock_do_i_hold(&stealmem_lock));
+	wchan_lock(transit_wchan);
+	spinlock_release(&stealmem_lock);
+	wchan_sleep(transit_wchan);
+	spinlock_acquire(&stealmem_lock);
+}
+
+/**
+	Empty slot i of this CPU's TLB. Call at splhigh.
+*/
+static void tlb_drop(struct tlbcpu *tc, unsigned i) {
+	tlb_write(TLBHI_INVALID(i), TLBLO_INVALID(), i);
+	if (tc->tc_slot[i] != 0) {
+		tc->tc_slot[i] = 0;
+		tc->tc_nused--;
+	}
+}
+
+/**
+	The ASID as has on this CPU, or -1 if it doesn't have one. Call at
+	splhigh.
+*/
+static int tlb_findasid(struct tlbcpu *tc, struct addrspace *as) {
+	for (unsigned a = 0; a < NUM_ASID; a++) {
+		if (tc->tc_owner[a] == as->as_id) {
+			return a;
+		}
+	}
+	return -1;
+}
+
+/**
+	Throw away this CPU's entries tagged with asid. Call at splhigh.
+*/
+static void tlb_flushasid(struct tlbcpu *tc, unsigned asid) {
+	bool any = false;
+
+	for (unsigned i = 0; tc->tc_nused > 0 && i < NUM_TLB; i++) {
+		if (tc->tc_slot[i] == asid + 1) {
+			tlb_drop(tc, i);
+			any = true;
+		}
+	}
+	if (any) {
+		vmstats_inc(VMSTAT_TLB_INVALIDATE);
+	}
+	tlb_setasid(tc->tc_asid);
+}
+
+/**
+	Throw away every entry in this CPU's TLB.
+*/
+static void tlb_flush(void) {
+	struct tlbcpu *tc;
+	int i, spl;
+
+	/* Disable interrupts on this CPU while frobbing the TLB. */
+	spl = splhigh();
+	tc = &tlbcpus[curcpu->c_number];
+
+	for (i=0; i<NUM_TLB; i++) {
+		tlb_drop(tc, i);
+	}
+	vmstats_inc(VMSTAT_TLB_INVALIDATE);
+	tlb_setasid(tc->tc_asid);
+
+	splx(spl);
+}
+
+/**
+	Throw away this CPU's entries for as.
+*/
+static void tlb_flushas(struct addrspace *as) {
+	struct tlbcpu *tc;
+	int asid, spl;
+
+	spl = splhigh();
+	tc = &tlbcpus[curcpu->c_number];
+	asid = tlb_findasid(tc, as);
+	if (asid >= 0) {
+		tlb_flushasid(tc, asid);
+	}
+	splx(spl);
+}
+
+/**
+	Drop this CPU's mapping of vaddr in as, if it has one.
+*/
+static void tlb_invalidate(struct addrspace *as, vaddr_t vaddr) {
+	struct tlbcpu *tc;
+	int asid, i, spl;
+
+	spl = splhigh();
+	tc = &tlbcpus[curcpu->c_number];
+	asid = tlb_findasid(tc, as);
+	if (asid >= 0) {
+		i = tlb_probe((vaddr & TLBHI_VPAGE) |
+			      ((uint32_t)asid << TLBHI_PIDSHIFT), 0);
+		if (i >= 0) {
+			tlb_drop(tc, i);
+		}
+		tlb_setasid(tc->tc_asid);
+	}
+	splx(spl);
 }
 
 void vm_tlbshootdown_all(void) {
-	panic("smartvm tried to do tlb shootdown?!\n");
+	/*
+	 * Happens if more than TLBSHOOTDOWN_MAX shootdowns pile up for
+	 * this CPU before it takes the IPI. vm_shootdown sends batches
+	 * (pageout's are PAGEOUT_BATCH pages) of at most that many, one
+	 * at a time, but if it ever does happen interprocessor_interrupt
+	 * still wakes whoever is waiting on the dropped ones.
+	 */
+	tlb_flush();
+}
+
+void vm_tlbshootdown(const struct tlbshootdown *ts) {
+	tlb_invalidate(ts->ts_addrspace, ts->ts_vaddr);
+	if (ts->ts_done != NULL) {
+		V(ts->ts_done);
+	}
+}
+
+/**
+	Make sure no CPU still has any of the n pages in ts mapped in its
+	TLB. Entries outlive context switches, so every CPU the address
+	spaces have run on might still have one; each of those gets the whole
+	batch in one IPI, and we wait until they have all dropped them.
+
+	Called with evict_lock held, which keeps us to one batch in flight at
+	a time. A CPU whose queue overflows anyway flushes its whole TLB and
+	still wakes us; see ipi_tlbshootdown in thread.c.
+*/
+static void vm_shootdown(struct tlbshootdown *ts, unsigned n) {
+	uint32_t cpus = 0;
+	unsigned i, sent;
+	time_t secs1, secs2;
+	uint32_t nsecs1, nsecs2;
+	int spl;
+
+	KASSERT(lock_do_i_hold(evict_lock));
+	KASSERT(n > 0 && n <= TLBSHOOTDOWN_MAX);
+
+	for (i = 0; i < n; i++) {
+		cpus |= ts[i].ts_addrspace->as_cpus;
+		ts[i].ts_done = NULL;
+	}
+	ts[n - 1].ts_done = shootdown_sem;
+
+	gettime(&secs1, &nsecs1);
+
+	/* Stay on this CPU until it's done and everyone else is asked */
+	spl = splhigh();
+	for (i = 0; i < n; i++) {
+		tlb_invalidate(ts[i].ts_addrspace, ts[i].ts_vaddr);
+	}
+	sent = ipi_tlbshootdown_cpus(cpus, ts, n);
+	splx(spl);
+
+	if (sent == 0) {
+		return;
+	}
+	for (i = 0; i < sent; i++) {
+		P(shootdown_sem);
+	}
+
+	gettime(&secs2, &nsecs2);
+	vmstats_inc(VMSTAT_TLB_SHOOTDOWN);
+	vmstats_add(VMSTAT_TLB_SHOOTDOWN_PAGES, n);
+	vmstats_add(VMSTAT_TLB_SHOOTDOWN_IPI, sent);
+	vmstats_add(VMSTAT_TLB_SHOOTDOWN_USEC,
+		    (secs2 - secs1) * 1000000 + nsecs2 / 1000 - nsecs1 / 1000);
+}
+
+/**
+	Could the page at index be pushed out? It has to be a private user
+	page, or a page of a vmobj, that nobody is already writing out.
+*/
+static bool page_evictable(int index) {
+	struct coremapentry *entry = coremap + index;
+	return entry->used && !entry->busy &&
+		(entry->obj != NULL ||
+		 (entry->as != NULL && entry->refcount == 1));
 }
 
-void vm_tlbshootdown(const struct tlbshootdown *ts) {
-	(void)ts;
-	panic("smartvm tried to do tlb shootdown?!\n");
+/**
+	The owner's PTE for the evictable page at index
+*/
+static pte_t * page_pte(int index) {
+	struct coremapentry *entry = coremap + index;
+	pte_t *pte;
+
+	pte = pt_lookup(entry->as->as_pt, entry->vaddr, false);
+	KASSERT(pte != NULL);
+	KASSERT(*pte & PTE_VALID);
+	KASSERT((*pte & PTE_FRAME) == pmemstart + index * PAGE_SIZE);
+	return pte;
+}
+
+/**
+	Pick a page to evict with the clock (second-chance) algorithm: go
+	round the coremap, clearing referenced bits, until we find a page
+	that hasn't been referenced since the last time round.
+
+	The referenced bit is set when the page is loaded into the TLB, so a
+	page that stays in a TLB the whole time looks unused. The TLB is
+	tiny next to memory, so that's a small error.
+*/
+static int clock_select(void) {
+	KASSERT(spinlock_do_i_hold(&stealmem_lock));
+
+	for (int n = 0; n < 2 * totalpagecount; n++) {
+		int index = clockhand;
+		clockhand = (clockhand + 1) % totalpagecount;
+
+		if (!page_evictable(index)) {
+			continue;
+		}
+		if (coremap[index].obj != NULL) {
+			if (vmobj_pageinuse(index)) {
+				continue;
+			}
+		} else {
+			pte_t *pte = page_pte(index);
+			if (*pte & PTE_REFERENCED) {
+				*pte &= ~PTE_REFERENCED;
+				continue;
+			}
+		}
+		coremap[index].busy = true;
+		return index;
+	}
+	return -1;
+}
+
+/**
+	Can this thread wait for a page to be evicted?
+*/
+static bool vm_canevict(void) {
+	return evict_lock != NULL &&
+		!curthread->t_in_interrupt &&
+		curthread->t_iplhigh_count == 0 &&
+		!lock_do_i_hold(evict_lock);
+}
+
+/**
+	Push one user page out of memory and free its frame. Pages with an
+	up-to-date copy in swap, or that are unchanged since they were first
+	read in, are simply dropped; anything else is written to swap first.
+	vmobj pages are handed to vmobj_evict. Returns 0 if a page was freed.
+*/
+static int page_evict(void) {
+	struct coremapentry *entry;
+	struct tlbshootdown ts;
+	paddr_t paddr;
+	pte_t *pte;
+	int index, result;
+	unsigned slot;
+	bool dirty;
+
+	if (!vm_canevict()) {
+		return ENOMEM;
+	}
+
+	lock_acquire(evict_lock);
+	spinlock_acquire(&stealmem_lock);
+
+	index = clock_select();
+	if (index < 0) {
+		spinlock_release(&stealmem_lock);
+		lock_release(evict_lock);
+		return ENOMEM;
+	}
+	paddr = pmemstart + index * PAGE_SIZE;
+
+	if (coremap[index].obj != NULL) {
+		result = vmobj_evict(index);
+		lock_release(evict_lock);
+		if (result) {
+			return result;
+		}
+		free_kpages(PADDR_TO_KVADDR(paddr));
+		return 0;
+	}
+
+	/* Unmap it, so the owner waits for us if it touches it again */
+	entry = coremap + index;
+	ts.ts_addrspace = entry->as;
+	ts.ts_vaddr = entry->vaddr;
+	pte = page_pte(index);
+	*pte = (*pte & ~PTE_VALID) | PTE_INTRANSIT;
+	dirty = entry->swapslot < 0 && (*pte & PTE_DIRTY) != 0;
+
+	spinlock_release(&stealmem_lock);
+
+	vm_shootdown(&ts, 1);
+
+	result = 0;
+	if (dirty) {
+		result = swap_alloc(&slot);
+		if (result == 0) {
+			result = swap_write(slot, paddr);
+			if (result) {
+				swap_free(slot);
+			}
+		}
+	}
+
+	spinlock_acquire(&stealmem_lock);
+	if (result) {
+		/* Couldn't write it out; put it back */
+		*pte = (*pte & ~PTE_INTRANSIT) | PTE_VALID;
+	} else {
+		if (dirty) {
+			entry->swapslot = slot;
+		}
+		if (entry->swapslot >= 0) {
+			// The PTE takes over the page's swap slot
+			*pte = PTE_MKSWAP(entry->swapslot) | (*pte & PTE_READONLY);
+			entry->swapslot = -1;
+		} else {
+			*pte = 0;
+		}
+		entry->as = NULL;
+	}
+	entry->busy = false;
+	spinlock_release(&stealmem_lock);
+
+	wchan_wakeall(transit_wchan);
+	lock_release(evict_lock);
+
+	if (result) {
+		return result;
+	}
+	free_kpages(PADDR_TO_KVADDR(paddr));
+	return 0;
+}
+
+/**
+	Write the dirty page at index, which belonged to as when it was
+	marked busy and clean, to swap, leaving it in memory, so that it can
+	be evicted later without waiting for the disk. If the owner writes to
+	the page again while it's going out, the copy in swap is thrown away.
+*/
+static int page_clean(int index, struct addrspace *as) {
+	struct coremapentry *entry = coremap + index;
+	paddr_t paddr = pmemstart + index * PAGE_SIZE;
+	pte_t *pte;
+	unsigned slot;
+	int result;
+
+	KASSERT(entry->busy);
+
+	result = swap_alloc(&slot);
+	if (result == 0) {
+		result = swap_write(slot, paddr);
+		if (result) {
+			swap_free(slot);
+		}
+	}
+
+	spinlock_acquire(&stealmem_lock);
+	if (entry->as != as) {
+		/* Shared by a fork meanwhile; can't tell who wrote what */
+		if (result == 0) {
+			swap_free(slot);
+		}
+		entry->busy = false;
+		spinlock_release(&stealmem_lock);
+		wchan_wakeall(transit_wchan);
+		return result;
+	}
+
+	pte = page_pte(index);
+	if (result) {
+		*pte |= PTE_DIRTY;
+	} else if (*pte & PTE_DIRTY) {
+		swap_free(slot);
+	} else {
+		entry->swapslot = slot;
+	}
+	entry->busy = false;
+	spinlock_release(&stealmem_lock);
+
+	wchan_wakeall(transit_wchan);
+	return result;
+}
+
+/**
+	Pick a dirty private page just ahead of the clock hand that pageout
+	should write out, or return -1. *scan is how far ahead we have
+	looked. (vmobj pages are left for eviction to write out.)
+*/
+static int pageout_select(int *scan) {
+	KASSERT(spinlock_do_i_hold(&stealmem_lock));
+
+	while (*scan < PAGEOUT_SCAN && *scan < totalpagecount) {
+		int index = (clockhand + *scan) % totalpagecount;
+		(*scan)++;
+
+		if (!page_evictable(index) || coremap[index].obj != NULL ||
+		    coremap[index].swapslot >= 0) {
+			continue;
+		}
+		pte_t *pte = page_pte(index);
+		if ((*pte & PTE_DIRTY) == 0 || (*pte & PTE_REFERENCED)) {
+			continue;
+		}
+		coremap[index].busy = true;
+		return index;
+	}
+	return -1;
+}
+
+/**
+	Pageout thread: whenever free memory gets low, write a batch of dirty
+	pages the clock hand will reach soon out to swap.
+
+	The whole batch is marked clean and shot down at once, so that the
+	next write to any of them faults and we notice it; then the pages
+	are written out one by one. They stay busy meanwhile, which keeps
+	eviction away from them without holding evict_lock over the disk.
+*/
+static void pageout_thread(void *unused1, unsigned long unused2) {
+	struct tlbshootdown ts[PAGEOUT_BATCH];
+	int batch[PAGEOUT_BATCH];
+	int index, scan, n;
+
+	(void)unused1;
+	(void)unused2;
+
+	while (true) {
+		P(pageout_sem);
+
+		lock_acquire(evict_lock);
+		spinlock_acquire(&stealmem_lock);
+		scan = 0;
+		for (n = 0; n < PAGEOUT_BATCH; n++) {
+			index = pageout_select(&scan);
+			if (index < 0) {
+				break;
+			}
+			*page_pte(index) &= ~PTE_DIRTY;
+			batch[n] = index;
+			ts[n].ts_addrspace = coremap[index].as;
+			ts[n].ts_vaddr = coremap[index].vaddr;
+		}
+		spinlock_release(&stealmem_lock);
+		if (n > 0) {
+			vm_shootdown(ts, n);
+		}
+		lock_release(evict_lock);
+
+		/* If swap fills up, the rest just go back to being dirty */
+		for (int i = 0; i < n; i++) {
+			page_clean(batch[i], ts[i].ts_addrspace);
+		}
+
+		spinlock_acquire(&stealmem_lock);
+		pageout_wanted = false;
+		spinlock_release(&stealmem_lock);
+	}
+}
+
+/**
+	The region containing vaddr, or NULL if it isn't in any region
+*/
+static struct region * as_findregion(struct addrspace *as, vaddr_t vaddr) {
+	unsigned num = array_num(&as->as_regions);
+
+	for (unsigned i = 0; i < num; i++) {
+		struct region *rg = array_get(&as->as_regions, i);
+		if (vaddr >= rg->rg_vbase &&
+		    vaddr < rg->rg_vbase + rg->rg_npages * PAGE_SIZE) {
+			return rg;
+		}
+	}
+	return NULL;
+}
+
+/**
+	Grow the stack down to cover vaddr, which lies below it. Returns the
+	stack region, or NULL if vaddr is too far down: past the maximum
+	stack size, or so close to the region below that the guard pages
+	would be used up.
+*/
+static struct region * as_growstack(struct addrspace *as, vaddr_t vaddr) {
+	struct region *stack = as->as_stack;
+	vaddr_t top, newbase;
+	size_t npages;
+	unsigned num;
+
+	if (stack == NULL || vaddr >= stack->rg_vbase) {
+		return NULL;
+	}
+
+	top = stack->rg_vbase + stack->rg_npages * PAGE_SIZE;
+	newbase = vaddr & PAGE_FRAME;
+	npages = (top - newbase) / PAGE_SIZE;
+	if (npages > SMARTVM_STACKMAX) {
+		return NULL;
+	}
+	if (newbase < SMARTVM_GUARDPAGES * PAGE_SIZE) {
+		return NULL;
+	}
+
+	num = array_num(&as->as_regions);
+	for (unsigned i = 0; i < num; i++) {
+		struct region *rg = array_get(&as->as_regions, i);
+		vaddr_t rgtop = rg->rg_vbase + rg->rg_npages * PAGE_SIZE;
+		if (rg != stack && rgtop <= stack->rg_vbase &&
+		    rgtop + SMARTVM_GUARDPAGES * PAGE_SIZE > newbase) {
+			return NULL;
+		}
+	}
+
+	/* The new pages are zero-filled when they're touched */
+	stack->rg_vbase = newbase;
+	stack->rg_fvaddr = newbase;
+	stack->rg_npages = npages;
+	return stack;
+}
+
+/**
+	Give the faulting process its own copy of a copy-on-write page. We
+	hold a reference to the old page while we copy it, which keeps it in
+	memory even if it belongs to a vmobj. If it was evicted while we
+	were getting the new page, there's nothing to copy; vm_fault goes
+	round again.
+*/
+static int as_breakcow(struct addrspace *as, vaddr_t vaddr, pte_t *pte) {
+	paddr_t oldpage;
+
+	paddr_t newpage = getppages(1);
+	if (newpage == 0) {
+		return ENOMEM;
+	}
+
+	spinlock_acquire(&stealmem_lock);
+	if ((*pte & PTE_VALID) == 0) {
+		spinlock_release(&stealmem_lock);
+		free_kpages(PADDR_TO_KVADDR(newpage));
+		return 0;
+	}
+	oldpage = *pte & PTE_FRAME;
+	page_share(oldpage);
+	spinlock_release(&stealmem_lock);
+
+	memmove((void *)PADDR_TO_KVADDR(newpage),
+		(const void *)PADDR_TO_KVADDR(oldpage),
+		PAGE_SIZE);
+
+	spinlock_acquire(&stealmem_lock);
+	KASSERT((*pte & (PTE_FRAME | PTE_VALID)) == (oldpage | PTE_VALID));
+	*pte = newpage | (*pte & ~PTE_FRAME) | PTE_DIRTY;
+	pte_entry(*pte)->as = as;
+	pte_entry(*pte)->vaddr = vaddr;
+	spinlock_release(&stealmem_lock);
+
+	// drop our share of the old page, and the one we took to copy it
+	free_kpages(PADDR_TO_KVADDR(oldpage));
+	free_kpages(PADDR_TO_KVADDR(oldpage));
+	return 0;
+}
+
+/**
+	Read the part of the page at vaddr that comes from the executable into
+	the (zeroed) frame at paddr. Sets *fromfile if any of the page came
+	from the file.
+*/
+static int region_read(struct vnode *v, struct region *rg, paddr_t paddr,
+		       vaddr_t vaddr, bool *fromfile) {
+	struct iovec iov;
+	struct uio ku;
+	vaddr_t start, end, fvaddr;
+	int result;
+
+	fvaddr = rg->rg_fvaddr;
+	start = vaddr > fvaddr ? vaddr : fvaddr;
+	end = vaddr + PAGE_SIZE < fvaddr + rg->rg_filesz ?
+		vaddr + PAGE_SIZE : fvaddr + rg->rg_filesz;
+	if (rg->rg_filesz == 0 || start >= end) {
+		*fromfile = false;
+		return 0;
+	}
+
+	uio_kinit(&iov, &ku, (void *)(PADDR_TO_KVADDR(paddr) + (start - vaddr)),
+		  end - start, rg->rg_foffset + (start - fvaddr), UIO_READ);
+	result = VOP_READ(v, &ku);
+	if (result) {
+		return result;
+	}
+	if (ku.uio_resid != 0) {
+		/* short read; problem with executable? */
+		kprintf("ELF: short read on segment - file truncated?\n");
+		return ENOEXEC;
+	}
+
+	*fromfile = true;
+	return 0;
+}
+
+/**
+	A vmobj is the set of pages behind every mapping of one thing: a file
+	mapped with mmap, or a piece of shared anonymous memory. Mappings
+	point straight at the object's frames, each taking a reference, so a
+	file's pages are only in memory once however many processes map it.
+	Private mappings share the frames copy-on-write; shared mappings
+	(PTE_SHARED) write to them in place, and dirty pages are written back
+	to the file when a shared mapping goes away. While a file is mapped,
+	read() and write() go through vmobj_rw, which keeps the pages and the
+	file in step, so writing a page back never undoes a write().
+
+	The pages are indexed by page number in a pagetable whose PTEs go
+	through the same states as an address space's. A page that isn't in
+	memory or swap comes from the file, or is zeroes. PTE_DIRTY means the
+	file doesn't have what's in the page yet: it's set when a shared
+	mapping that wrote to the page goes away, or when the page is evicted
+	from such a mapping. The object holds a reference to each of its
+	frames, and their coremap entries point back at it (obj, and the
+	offset in vaddr).
+
+	Pages are evicted like any others, but from every mapping at once:
+	vo_regions lists the regions mapping the object, so eviction can find
+	their PTEs. Clean pages of a file are dropped, since the file has
+	them; anything else goes to swap. A page is only evicted when the
+	object and those PTEs hold every reference to it, so anyone who needs
+	one to stay put for a moment takes a reference.
+
+	vmobj_lock protects vo_nmaps and every vnode's vn_vmobj, and is held
+	while an object is torn down so the file can't be mapped again until
+	its pages are back on disk. vo_lock is held while reading pages in or
+	writing them out; eviction can't take it, but it's the only thing
+	that changes a PTE in vo_pages without it, and only while the page is
+	in memory. The PTEs themselves, vo_regions, and the region fields
+	eviction looks at are protected by stealmem_lock. Lock order:
+	vmobj_lock, vo_lock, evict_lock, stealmem_lock.
+*/
+struct vmobj {
+	struct vnode *vo_vnode; // the file, or NULL for anonymous memory
+	struct lock *vo_lock;
+	unsigned vo_nmaps; // regions using it, and reads and writes under way
+	struct pagetable *vo_pages;
+	struct region *vo_regions; // regions mapping it, by rg_objnext
+};
+
+/**
+	Get v's vmobj, or a new anonymous one if v is NULL, with a reference
+	for one more region.
+*/
+int vmobj_get(struct vnode *v, struct vmobj **ret) {
+	struct vmobj *vo;
+
+	lock_acquire(vmobj_lock);
+	if (v != NULL && v->vn_vmobj != NULL) {
+		vo = v->vn_vmobj;
+		vo->vo_nmaps++;
+		lock_release(vmobj_lock);
+		*ret = vo;
+		return 0;
+	}
+
+	vo = kmalloc(sizeof(struct vmobj));
+	if (vo == NULL) {
+		lock_release(vmobj_lock);
+		return ENOMEM;
+	}
+	vo->vo_lock = lock_create("vmobj");
+	vo->vo_pages = pt_create();
+	if (vo->vo_lock == NULL || vo->vo_pages == NULL) {
+		if (vo->vo_lock != NULL) {
+			lock_destroy(vo->vo_lock);
+		}
+		if (vo->vo_pages != NULL) {
+			pt_destroy(vo->vo_pages);
+		}
+		kfree(vo);
+		lock_release(vmobj_lock);
+		return ENOMEM;
+	}
+	vo->vo_nmaps = 1;
+	vo->vo_vnode = v;
+	vo->vo_regions = NULL;
+	if (v != NULL) {
+		VOP_INCREF(v);
+		v->vn_vmobj = vo;
+	}
+	lock_release(vmobj_lock);
+
+	*ret = vo;
+	return 0;
+}
+
+/**
+	Take a reference to vo for another region
+*/
+void vmobj_ref(struct vmobj *vo) {
+	lock_acquire(vmobj_lock);
+	KASSERT(vo->vo_nmaps > 0);
+	vo->vo_nmaps++;
+	lock_release(vmobj_lock);
+}
+
+/**
+	Take a reference to v's vmobj, if it has one, or return NULL
+*/
+static struct vmobj * vmobj_find(struct vnode *v) {
+	struct vmobj *vo;
+
+	lock_acquire(vmobj_lock);
+	vo = v->vn_vmobj;
+	if (vo != NULL) {
+		vo->vo_nmaps++;
+	}
+	lock_release(vmobj_lock);
+	return vo;
+}
+
+/**
+	Take a reference to the page at offset in vo, whose PTE in the object
+	is pte, if it's in memory; if it was evicted to swap, read it back
+	first (counting that as a page fault if fault is set). Sets *ret to
+	0 if the page is in neither, and so hasn't changed since it was last
+	in the file (or is zeroes). Call with vo_lock held.
+*/
+static int vmobj_findpage(struct vmobj *vo, off_t offset, pte_t *pte,
+			  bool fault, paddr_t *ret) {
+	struct coremapentry *entry;
+	paddr_t paddr;
+	pte_t old;
+	int result;
+
+	KASSERT(lock_do_i_hold(vo->vo_lock));
+
+	spinlock_acquire(&stealmem_lock);
+	while (*pte & PTE_INTRANSIT) {
+		pte_wait();
+	}
+	old = *pte;
+	if (old & PTE_VALID) {
+		*pte |= PTE_REFERENCED;
+		page_share(old & PTE_FRAME);
+		spinlock_release(&stealmem_lock);
+		*ret = old & PTE_FRAME;
+		return 0;
+	}
+	spinlock_release(&stealmem_lock);
+
+	if ((old & PTE_SWAPPED) == 0) {
+		*ret = 0;
+		return 0;
+	}
+
+	/* Only eviction changes a PTE without vo_lock, and not this one */
+	paddr = getppages(1);
+	if (paddr == 0) {
+		return ENOMEM;
+	}
+	result = swap_read(PTE_SWAPSLOT(old), paddr);
+	if (result) {
+		free_kpages(PADDR_TO_KVADDR(paddr));
+		return result;
+	}
+	if (fault) {
+		vmstats_inc(VMSTAT_PAGE_FAULT_DISK);
+	}
+
+	/* The frame keeps the swap slot as its copy until it's written to */
+	spinlock_acquire(&stealmem_lock);
+	KASSERT(*pte == old);
+	*pte = paddr | PTE_VALID | PTE_REFERENCED | (old & PTE_DIRTY);
+	entry = pte_entry(*pte);
+	entry->obj = vo;
+	entry->vaddr = (vaddr_t)offset;
+	entry->swapslot = PTE_SWAPSLOT(old);
+	page_share(paddr);
+	spinlock_release(&stealmem_lock);
+
+	*ret = paddr;
+	return 0;
+}
+
+/**
+	Write the page at offset in vo, whose PTE in the object is pte, back
+	to the file, or the first len bytes of it. A page that was evicted is
+	read back from swap to do it, and then left to the file. Call with
+	vo_lock held.
+*/
+static int vmobj_writepage(struct vmobj *vo, off_t offset, pte_t *pte,
+			   size_t len) {
+	struct iovec iov;
+	struct uio ku;
+	paddr_t paddr;
+	pte_t old;
+	int result;
+
+	KASSERT(lock_do_i_hold(vo->vo_lock));
+
+	spinlock_acquire(&stealmem_lock);
+	while (*pte & PTE_INTRANSIT) {
+		pte_wait();
+	}
+	old = *pte;
+	if (old & PTE_VALID) {
+		/* Keep it in memory while we write it */
+		paddr = old & PTE_FRAME;
+		page_share(paddr);
+	}
+	spinlock_release(&stealmem_lock);
+
+	if ((old & PTE_VALID) == 0) {
+		KASSERT(old & PTE_SWAPPED);
+		paddr = getppages(1);
+		if (paddr == 0) {
+			return ENOMEM;
+		}
+		result = swap_read(PTE_SWAPSLOT(old), paddr);
+		if (result) {
+			free_kpages(PADDR_TO_KVADDR(paddr));
+			return result;
+		}
+	}
+
+	uio_kinit(&iov, &ku, (void *)PADDR_TO_KVADDR(paddr), len, offset,
+		  UIO_WRITE);
+	result = VOP_WRITE(vo->vo_vnode, &ku);
+
+	spinlock_acquire(&stealmem_lock);
+	if (result) {
+		/* leave it dirty */
+	} else if (old & PTE_VALID) {
+		/* Pinned, so eviction left it alone */
+		KASSERT((*pte & (PTE_FRAME | PTE_VALID)) ==
+			(old & (PTE_FRAME | PTE_VALID)));
+		*pte &= ~PTE_DIRTY;
+	} else {
+		KASSERT(*pte == old);
+		swap_free(PTE_SWAPSLOT(old));
+		*pte = 0;
+	}
+	spinlock_release(&stealmem_lock);
+
+	/* Our reference, or the copy read from swap */
+	free_kpages(PADDR_TO_KVADDR(paddr));
+	return result;
+}
+
+/**
+	Write vo's dirty pages back to its file. The last page only goes up
+	to the end of the file, so the file doesn't grow.
+*/
+static int vmobj_writeback(struct vmobj *vo) {
+	struct pagetable *pt = vo->vo_pages;
+	struct stat st;
+	off_t offset;
+	size_t len;
+	int result;
+
+	if (vo->vo_vnode == NULL) {
+		return 0;
+	}
+
+	lock_acquire(vo->vo_lock);
+	result = VOP_STAT(vo->vo_vnode, &st);
+	for (unsigned i = 0; result == 0 && i < PT_NENTRIES; i++) {
+		if (pt->pt_dir[i] == NULL) {
+			continue;
+		}
+		for (unsigned j = 0; j < PT_NENTRIES; j++) {
+			pte_t *pte = &pt->pt_dir[i][j];
+			if ((*pte & PTE_DIRTY) == 0) {
+				continue;
+			}
+			offset = PT_VADDR(i, j);
+			if (offset >= st.st_size) {
+				spinlock_acquire(&stealmem_lock);
+				*pte &= ~PTE_DIRTY;
+				spinlock_release(&stealmem_lock);
+				continue;
+			}
+			len = st.st_size - offset < PAGE_SIZE ?
+				st.st_size - offset : PAGE_SIZE;
+			result = vmobj_writepage(vo, offset, pte, len);
+			if (result) {
+				break;
+			}
+		}
+	}
+	lock_release(vo->vo_lock);
+	return result;
+}
+
+/**
+	Drop a region's reference to vo. When the last one goes, write its
+	pages back and free them.
+*/
+void vmobj_release(struct vmobj *vo) {
+	struct pagetable *pt = vo->vo_pages;
+	struct vnode *v = vo->vo_vnode;
+	pte_t old;
+	int result;
+
+	lock_acquire(vmobj_lock);
+	KASSERT(vo->vo_nmaps > 0);
+	if (--vo->vo_nmaps > 0) {
+		lock_release(vmobj_lock);
+		return;
+	}
+	KASSERT(vo->vo_regions == NULL);
+
+	result = vmobj_writeback(vo);
+	if (result) {
+		kprintf("smartvm: Warning: lost mmap writes: %s\n",
+			strerror(result));
+	}
+	if (v != NULL) {
+		KASSERT(v->vn_vmobj == vo);
+		v->vn_vmobj = NULL;
+	}
+	lock_release(vmobj_lock);
+
+	/* Eviction may still be busy with a page; wait for it */
+	for (unsigned i = 0; i < PT_NENTRIES; i++) {
+		if (pt->pt_dir[i] == NULL) {
+			continue;
+		}
+		for (unsigned j = 0; j < PT_NENTRIES; j++) {
+			pte_t *pte = &pt->pt_dir[i][j];
+			spinlock_acquire(&stealmem_lock);
+			while (*pte & PTE_INTRANSIT) {
+				pte_wait();
+			}
+			old = *pte;
+			*pte = 0;
+			if (old & PTE_VALID) {
+				pte_entry(old)->obj = NULL;
+			} else if (old & PTE_SWAPPED) {
+				swap_free(PTE_SWAPSLOT(old));
+			}
+			spinlock_release(&stealmem_lock);
+			if (old & PTE_VALID) {
+				free_kpages(PADDR_TO_KVADDR(old & PTE_FRAME));
+			}
+		}
+	}
+	pt_destroy(pt);
+	lock_destroy(vo->vo_lock);
+	kfree(vo);
+
+	if (v != NULL) {
+		VOP_DECREF(v);
+	}
+}
+
+/**
+	Get the page at offset in vo, reading it from the file (or zeroing
+	it) if it isn't in memory or swap, and take a reference to it for the
+	caller's PTE. Past the end of the file the page is zeroes.
+*/
+static int vmobj_getpage(struct vmobj *vo, off_t offset, paddr_t *ret) {
+	struct coremapentry *entry;
+	struct iovec iov;
+	struct uio ku;
+	paddr_t paddr;
+	pte_t *pte;
+	int result;
+
+	KASSERT(offset % PAGE_SIZE == 0);
+	KASSERT(offset < ((off_t)1 << 32));
+
+	lock_acquire(vo->vo_lock);
+	pte = pt_lookup(vo->vo_pages, (vaddr_t)offset, true);
+	if (pte == NULL) {
+		lock_release(vo->vo_lock);
+		return ENOMEM;
+	}
+
+	result = vmobj_findpage(vo, offset, pte, true, &paddr);
+	if (result) {
+		lock_release(vo->vo_lock);
+		return result;
+	}
+	if (paddr == 0) {
+		paddr = getzeroedpage();
+		if (paddr == 0) {
+			lock_release(vo->vo_lock);
+			return ENOMEM;
+		}
+		if (vo->vo_vnode != NULL) {
+			uio_kinit(&iov, &ku, (void *)PADDR_TO_KVADDR(paddr),
+				  PAGE_SIZE, offset, UIO_READ);
+			result = VOP_READ(vo->vo_vnode, &ku);
+			if (result) {
+				free_kpages(PADDR_TO_KVADDR(paddr));
+				lock_release(vo->vo_lock);
+				return result;
+			}
+			vmstats_inc(VMSTAT_PAGE_FAULT_DISK);
+		} else {
+			vmstats_inc(VMSTAT_PAGE_FAULT_ZERO);
+		}
+
+		spinlock_acquire(&stealmem_lock);
+		KASSERT(*pte == 0);
+		*pte = paddr | PTE_VALID | PTE_REFERENCED;
+		entry = pte_entry(*pte);
+		entry->obj = vo;
+		entry->vaddr = (vaddr_t)offset;
+		page_share(paddr);
+		spinlock_release(&stealmem_lock);
+	}
+	lock_release(vo->vo_lock);
+
+	*ret = paddr;
+	return 0;
+}
+
+/**
+	Bring the len bytes at offset in vo, which don't cross a page, into
+	line with buf, which has just been read from or written to the file
+	there. For a read, the page has the last word: a mapping may have
+	written to it. A write goes into the page as well. A page that
+	isn't in memory or swap has nothing to add. Call with vo_lock held.
+*/
+static int vmobj_copypage(struct vmobj *vo, off_t offset, void *buf,
+			  size_t len, enum uio_rw rw) {
+	off_t base = offset - offset % PAGE_SIZE;
+	struct coremapentry *entry;
+	paddr_t paddr;
+	pte_t *pte;
+	char *page;
+	int result;
+
+	if (base >= ((off_t)1 << 32)) {
+		return 0;
+	}
+	pte = pt_lookup(vo->vo_pages, (vaddr_t)base, false);
+	if (pte == NULL) {
+		return 0;
+	}
+	result = vmobj_findpage(vo, base, pte, false, &paddr);
+	if (result || paddr == 0) {
+		return result;
+	}
+
+	page = (char *)PADDR_TO_KVADDR(paddr) + (offset - base);
+	if (rw == UIO_READ) {
+		memcpy(buf, page, len);
+	} else {
+		memcpy(page, buf, len);
+
+		/* Its copy in swap is out of date now */
+		spinlock_acquire(&stealmem_lock);
+		entry = pte_entry(paddr);
+		if (entry->swapslot >= 0) {
+			swap_free(entry->swapslot);
+			entry->swapslot = -1;
+		}
+		spinlock_release(&stealmem_lock);
+	}
+
+	free_kpages(PADDR_TO_KVADDR(paddr));
+	return 0;
+}
+
+/**
+	Do the I/O in uio on vo's file a page at a time, through a kernel
+	buffer so that no lock is held while the user buffer is touched,
+	keeping vo's pages in step with the file.
+*/
+static int vmobj_rwpages(struct vmobj *vo, struct uio *uio) {
+	struct iovec iov;
+	struct uio ku;
+	off_t offset;
+	size_t len, done;
+	char *buf;
+	int result = 0, result2;
+
+	buf = kmalloc(PAGE_SIZE);
+	if (buf == NULL) {
+		return ENOMEM;
+	}
+
+	while (uio->uio_resid > 0) {
+		offset = uio->uio_offset;
+		len = PAGE_SIZE - offset % PAGE_SIZE;
+		if (len > uio->uio_resid) {
+			len = uio->uio_resid;
+		}
+
+		uio_kinit(&iov, &ku, buf, len, offset, uio->uio_rw);
+		if (uio->uio_rw == UIO_WRITE) {
+			/* uio is only advanced once we know what got written */
+			result = uiopeek(buf, len, uio);
+			if (result) {
+				break;
+			}
+		}
+
+		lock_acquire(vo->vo_lock);
+		if (uio->uio_rw == UIO_READ) {
+			result = VOP_READ(vo->vo_vnode, &ku);
+		} else {
+			result = VOP_WRITE(vo->vo_vnode, &ku);
+		}
+		done = len - ku.uio_resid;
+		if (done > 0) {
+			/* even after an error, for whatever did get through */
+			result2 = vmobj_copypage(vo, offset, buf, done,
+						 uio->uio_rw);
+			if (result == 0) {
+				result = result2;
+			}
+		}
+		lock_release(vo->vo_lock);
+
+		if (uio->uio_rw == UIO_WRITE) {
+			uioskip(done, uio);
+		}
+		else if (result == 0) {
+			result = uiomove(buf, done, uio);
+		}
+		if (result || done < len) {
+			/* error, fault, end of file, or short write */
+			break;
+		}
+	}
+
+	kfree(buf);
+	return result;
+}
+
+/**
+	Copy [start, end) of vo's file into whichever of vo's pages are in
+	memory or swap, after a write() that didn't go through them.
+*/
+static int vmobj_reread(struct vmobj *vo, off_t start, off_t end) {
+	struct iovec iov;
+	struct uio ku;
+	size_t len, done;
+	char *buf;
+	int result = 0;
+
+	buf = kmalloc(PAGE_SIZE);
+	if (buf == NULL) {
+		return ENOMEM;
+	}
+
+	lock_acquire(vo->vo_lock);
+	while (start < end) {
+		len = PAGE_SIZE - start % PAGE_SIZE;
+		if ((off_t)len > end - start) {
+			len = end - start;
+		}
+		uio_kinit(&iov, &ku, buf, len, start, UIO_READ);
+		result = VOP_READ(vo->vo_vnode, &ku);
+		done = len - ku.uio_resid;
+		if (result == 0 && done > 0) {
+			result = vmobj_copypage(vo, start, buf, done,
+						UIO_WRITE);
+		}
+		if (result || done < len) {
+			break;
+		}
+		start += len;
+	}
+	lock_release(vo->vo_lock);
+
+	kfree(buf);
+	return result;
+}
+
+int vmobj_rw(struct vnode *v, struct uio *uio) {
+	struct vmobj *vo = NULL;
+	off_t start = uio->uio_offset;
+	int result;
+
+	/* A peek is enough to skip files nobody has mapped */
+	if (v->vn_vmobj != NULL) {
+		vo = vmobj_find(v);
+	}
+	if (vo != NULL) {
+		result = vmobj_rwpages(vo, uio);
+		vmobj_release(vo);
+		return result;
+	}
+
+	if (uio->uio_rw == UIO_READ) {
+		return VOP_READ(v, uio);
+	}
+	result = VOP_WRITE(v, uio);
+
+	/*
+	 * If the file was mapped while we were writing it, the pages read
+	 * in meanwhile may not have all of what we wrote.
+	 */
+	if (v->vn_vmobj != NULL) {
+		vo = vmobj_find(v);
+	}
+	if (vo != NULL) {
+		if (uio->uio_offset > start) {
+			int result2 = vmobj_reread(vo, start, uio->uio_offset);
+			if (result == 0) {
+				result = result2;
+			}
+		}
+		vmobj_release(vo);
+	}
+	return result;
+}
+
+/**
+	The PTE through which rg maps the page at offset in its vmobj, if rg
+	covers it and the PTE points at paddr (a private mapping may have
+	its own copy by now), or NULL. Call with stealmem_lock held.
+*/
+static pte_t * region_objpte(struct region *rg, off_t offset, paddr_t paddr) {
+	pte_t *pte;
+
+	KASSERT(spinlock_do_i_hold(&stealmem_lock));
+
+	if (offset < rg->rg_objoffset ||
+	    offset >= rg->rg_objoffset + (off_t)rg->rg_npages * PAGE_SIZE) {
+		return NULL;
+	}
+	pte = pt_lookup(rg->rg_as->as_pt,
+			rg->rg_vbase + (vaddr_t)(offset - rg->rg_objoffset),
+			false);
+	if (pte == NULL || (*pte & PTE_VALID) == 0 ||
+	    (*pte & PTE_FRAME) != paddr) {
+		return NULL;
+	}
+	return pte;
+}
+
+/**
+	Should clock_select pass over the vmobj page at index? Yes if it, or
+	any mapping of it, has been used since the last time round (those
+	referenced bits are cleared, for a second chance), or if it can't be
+	evicted: somebody holds a reference that isn't a mapping's, or it's
+	mapped in more places than one shootdown can take.
+*/
+static bool vmobj_pageinuse(int index) {
+	struct coremapentry *entry = coremap + index;
+	paddr_t paddr = pmemstart + index * PAGE_SIZE;
+	struct region *rg;
+	pte_t *objpte, *pte;
+	unsigned nmapped = 0;
+	bool referenced;
+
+	KASSERT(spinlock_do_i_hold(&stealmem_lock));
+
+	objpte = pt_lookup(entry->obj->vo_pages, entry->vaddr, false);
+	KASSERT(objpte != NULL && (*objpte & PTE_FRAME) == paddr);
+	KASSERT(*objpte & PTE_VALID);
+	referenced = (*objpte & PTE_REFERENCED) != 0;
+	*objpte &= ~PTE_REFERENCED;
+
+	for (rg = entry->obj->vo_regions; rg != NULL; rg = rg->rg_objnext) {
+		pte = region_objpte(rg, entry->vaddr, paddr);
+		if (pte == NULL) {
+			continue;
+		}
+		if (*pte & PTE_REFERENCED) {
+			*pte &= ~PTE_REFERENCED;
+			referenced = true;
+		}
+		nmapped++;
+	}
+
+	return referenced || nmapped > TLBSHOOTDOWN_MAX ||
+		entry->refcount != nmapped + 1;
+}
+
+/**
+	Evict the vmobj page at index, which clock_select just picked: take
+	it away from every mapping, then drop it if it's a file page the
+	file already has, or write it to swap. Mappings fault it back in
+	from the object, which waits while its PTE is PTE_INTRANSIT.
+
+	Called with evict_lock and stealmem_lock held; returns without
+	stealmem_lock. Returns 0 if the caller should free the frame.
+*/
+static int vmobj_evict(int index) {
+	struct coremapentry *entry = coremap + index;
+	paddr_t paddr = pmemstart + index * PAGE_SIZE;
+	struct tlbshootdown ts[TLBSHOOTDOWN_MAX];
+	pte_t *ptes[TLBSHOOTDOWN_MAX];
+	struct region *rg;
+	pte_t *objpte, *pte;
+	unsigned i, n = 0, slot;
+	bool save, write;
+	int result;
+
+	KASSERT(spinlock_do_i_hold(&stealmem_lock));
+	KASSERT(entry->busy);
+
+	objpte = pt_lookup(entry->obj->vo_pages, entry->vaddr, false);
+	*objpte = (*objpte & ~PTE_VALID) | PTE_INTRANSIT;
+
+	/* What a shared mapping wrote is the file's to have, later */
+	for (rg = entry->obj->vo_regions; rg != NULL; rg = rg->rg_objnext) {
+		pte = region_objpte(rg, entry->vaddr, paddr);
+		if (pte == NULL) {
+			continue;
+		}
+		KASSERT(n < TLBSHOOTDOWN_MAX);
+		if ((*pte & (PTE_SHARED | PTE_DIRTY)) ==
+		    (PTE_SHARED | PTE_DIRTY)) {
+			*objpte |= PTE_DIRTY;
+		}
+		*pte = (*pte & ~PTE_VALID) | PTE_INTRANSIT;
+		ts[n].ts_addrspace = rg->rg_as;
+		ts[n].ts_vaddr = rg->rg_vbase +
+			(vaddr_t)(entry->vaddr - rg->rg_objoffset);
+		ptes[n++] = pte;
+	}
+	KASSERT(entry->refcount == n + 1);
+
+	save = entry->obj->vo_vnode == NULL || (*objpte & PTE_DIRTY) != 0;
+	write = save && entry->swapslot < 0;
+	spinlock_release(&stealmem_lock);
+
+	if (n > 0) {
+		vm_shootdown(ts, n);
+	}
+
+	result = 0;
+	if (write) {
+		result = swap_alloc(&slot);
+		if (result == 0) {
+			result = swap_write(slot, paddr);
+			if (result) {
+				swap_free(slot);
+			}
+		}
+	}
+
+	spinlock_acquire(&stealmem_lock);
+	for (i = 0; i < n; i++) {
+		*ptes[i] = 0;
+	}
+	entry->refcount -= n;
+	if (result) {
+		/* Couldn't write it out; the object keeps it */
+		*objpte = (*objpte & ~PTE_INTRANSIT) | PTE_VALID;
+	} else {
+		if (write) {
+			entry->swapslot = slot;
+		}
+		if (save) {
+			// The object's PTE takes over the page's swap slot
+			*objpte = PTE_MKSWAP(entry->swapslot) |
+				(*objpte & PTE_DIRTY);
+			entry->swapslot = -1;
+		} else {
+			*objpte = 0;
+		}
+		entry->obj = NULL;
+	}
+	entry->busy = false;
+	spinlock_release(&stealmem_lock);
+
+	wchan_wakeall(transit_wchan);
+	return result;
+}
+
+/**
+	Make rg map vo, starting offset bytes in, and take a reference to vo
+	for it
+*/
+static void region_setobj(struct region *rg, struct vmobj *vo, off_t offset) {
+	vmobj_ref(vo);
+
+	spinlock_acquire(&stealmem_lock);
+	rg->rg_obj = vo;
+	rg->rg_objoffset = offset;
+	rg->rg_objnext = vo->vo_regions;
+	vo->vo_regions = rg;
+	spinlock_release(&stealmem_lock);
+}
+
+/**
+	Undo region_setobj, once rg maps none of the pages any more
+*/
+static void region_clearobj(struct region *rg) {
+	struct vmobj *vo = rg->rg_obj;
+	struct region **rgp;
+
+	spinlock_acquire(&stealmem_lock);
+	for (rgp = &vo->vo_regions; *rgp != rg; rgp = &(*rgp)->rg_objnext) {
+		KASSERT(*rgp != NULL);
+	}
+	*rgp = rg->rg_objnext;
+	rg->rg_objnext = NULL;
+	rg->rg_obj = NULL;
+	spinlock_release(&stealmem_lock);
+
+	vmobj_release(vo);
+}
+
+/**
+	Note that the npages pages at vaddr in the shared region rg may have
+	been written to, before they're unmapped: any page the address space
+	wrote is marked dirty in the object, to be written back.
+*/
+static void region_syncdirty(struct addrspace *as, struct region *rg,
+			     vaddr_t vaddr, size_t npages) {
+	struct vmobj *vo = rg->rg_obj;
+	pte_t *pte, *objpte;
+
+	KASSERT(rg->rg_shared && vo != NULL);
+
+	lock_acquire(vo->vo_lock);
+	for (size_t i = 0; i < npages; i++) {
+		vaddr_t va = vaddr + i * PAGE_SIZE;
+		pte = pt_lookup(as->as_pt, va, false);
+		if (pte == NULL) {
+			continue;
+		}
+		/* A page being evicted passes its dirty bit on itself */
+		spinlock_acquire(&stealmem_lock);
+		if ((*pte & (PTE_VALID | PTE_SHARED | PTE_DIRTY)) ==
+		    (PTE_VALID | PTE_SHARED | PTE_DIRTY)) {
+			objpte = pt_lookup(vo->vo_pages,
+					   (vaddr_t)(rg->rg_objoffset +
+						     (va - rg->rg_vbase)),
+					   false);
+			KASSERT(objpte != NULL && (*objpte & PTE_VALID));
+			*objpte |= PTE_DIRTY;
+		}
+		spinlock_release(&stealmem_lock);
+	}
+	lock_release(vo->vo_lock);
+}
+
+/**
+	Map the page at vaddr in rg, which comes from rg's vmobj, in as
+*/
+static int as_pageinobj(struct addrspace *as, struct region *rg,
+			vaddr_t vaddr, pte_t *pte) {
+	pte_t old = *pte;
+	paddr_t paddr;
+	int result;
+
+	(void)as;
+	KASSERT(old == 0);
+
+	result = vmobj_getpage(rg->rg_obj,
+			       rg->rg_objoffset + (vaddr - rg->rg_vbase), &paddr);
+	if (result) {
+		return result;
+	}
+
+	spinlock_acquire(&stealmem_lock);
+	KASSERT(*pte == old);
+	*pte = paddr | PTE_VALID | PTE_REFERENCED |
+		(rg->rg_writeable ? 0 : PTE_READONLY) |
+		(rg->rg_shared ? PTE_SHARED : 0);
+	spinlock_release(&stealmem_lock);
+	return 0;
+}
+
+/**
+	Bring the page at vaddr into memory: read it back from swap if it was
+	evicted; otherwise this is its first touch, and it is filled from the
+	executable if the page has anything from the file in it and zeroed if
+	not, or it's taken from the region's vmobj if it has one. Then point
+	the PTE at it.
+
+	Only the owner changes a PTE that isn't resident or in transit, so
+	nobody touches *pte while we sleep.
+*/
+static int as_pagein(struct addrspace *as, struct region *rg, vaddr_t vaddr,
+		     pte_t *pte) {
+	pte_t old = *pte;
+	bool readonly, fromfile;
+	int result, slot = -1;
+
+	KASSERT((old & (PTE_VALID | PTE_INTRANSIT)) == 0);
+
+	/* Mapped pages are shared with everyone else mapping them */
+	if (old == 0 && rg->rg_obj != NULL) {
+		return as_pageinobj(as, rg, vaddr, pte);
+	}
+
+	/* Anything not coming back from swap starts out as zeroes */
+	paddr_t paddr = (old & PTE_SWAPPED) ? getppages(1) : getzeroedpage();
+	if (paddr == 0) {
+		return ENOMEM;
+	}
+
+	if (old & PTE_SWAPPED) {
+		slot = PTE_SWAPSLOT(old);
+		readonly = (old & PTE_READONLY) != 0;
+		fromfile = false;
+		result = swap_read(slot, paddr);
+	} else {
+		readonly = !rg->rg_writeable;
+		result = region_read(as->as_vnode, rg, paddr, vaddr, &fromfile);
+	}
+	if (result) {
+		free_kpages(PADDR_TO_KVADDR(paddr));
+		return result;
+	}
+
+	if (slot >= 0) {
+		vmstats_inc(VMSTAT_PAGE_FAULT_DISK);
+	} else if (fromfile) {
+		vmstats_inc(VMSTAT_PAGE_FAULT_DISK);
+		vmstats_inc(VMSTAT_ELF_FILE_READ);
+	} else {
+		vmstats_inc(VMSTAT_PAGE_FAULT_ZERO);
+	}
+
+	/*
+	 * The page starts out clean. If it came from swap, the frame keeps
+	 * the swap slot as its up-to-date copy until it's written to.
+	 */
+	spinlock_acquire(&stealmem_lock);
+	KASSERT(*pte == old);
+	*pte = paddr | PTE_VALID | PTE_REFERENCED | (readonly ? PTE_READONLY : 0);
+	pte_entry(*pte)->as = as;
+	pte_entry(*pte)->vaddr = vaddr;
+	pte_entry(*pte)->swapslot = slot;
+	spinlock_release(&stealmem_lock);
+	return 0;
 }
 
 int vm_fault(int faulttype, vaddr_t faultaddress) {
-	vaddr_t vbase1, vtop1, vbase2, vtop2, stackbase, stacktop;
+	struct coremapentry *entry;
+	struct region *rg;
 	paddr_t paddr;
-	int i;
+	pte_t *pte;
+	int i, result;
 	uint32_t ehi, elo;
 	struct addrspace *as;
+	struct tlbcpu *tc;
 	int spl;
+	bool writable, pagedin = false;
 
 	faultaddress &= PAGE_FRAME;
 
@@ -210,10 +2182,6 @@ int vm_fault(int faulttype, vaddr_t faultaddress) {
 
 	switch (faulttype) {
 	    case VM_FAULT_READONLY:
-		/* We always create pages read-write, so we can't get this */
-		kprintf("VM error: User process attempted write to read-only memory.\n");
-		sys__exit(faulttype);
-
 	    case VM_FAULT_READ:
 	    case VM_FAULT_WRITE:
 		break;
@@ -240,125 +2208,279 @@ int vm_fault(int faulttype, vaddr_t faultaddress) {
 	}
 
 	/* Assert that the address space has been set up properly. */
-	KASSERT(as->as_vbase1 != 0);
-	KASSERT(as->as_pbase1 != 0);
-	KASSERT(as->as_npages1 != 0);
-	KASSERT(as->as_vbase2 != 0);
-	KASSERT(as->as_pbase2 != 0);
-	KASSERT(as->as_npages2 != 0);
-	KASSERT(as->as_stackpbase != 0);
-	KASSERT((as->as_vbase1 & PAGE_FRAME) == as->as_vbase1);
-	KASSERT((as->as_pbase1 & PAGE_FRAME) == as->as_pbase1);
-	KASSERT((as->as_vbase2 & PAGE_FRAME) == as->as_vbase2);
-	KASSERT((as->as_pbase2 & PAGE_FRAME) == as->as_pbase2);
-	KASSERT((as->as_stackpbase & PAGE_FRAME) == as->as_stackpbase);
-
-	vbase1 = as->as_vbase1;
-	vtop1 = vbase1 + as->as_npages1 * PAGE_SIZE;
-	vbase2 = as->as_vbase2;
-	vtop2 = vbase2 + as->as_npages2 * PAGE_SIZE;
-	stackbase = USERSTACK - SMARTVM_STACKPAGES * PAGE_SIZE;
-	stacktop = USERSTACK;
-	bool dirtiable;
-
-	if (faultaddress >= vbase1 && faultaddress < vtop1) {
-		paddr = vaddr_to_paddr(faultaddress,  vbase1, as->as_pbase1);
-		dirtiable = as->as_dirtiable1;
-	} else if (faultaddress >= vbase2 && faultaddress < vtop2) {
-		paddr = vaddr_to_paddr(faultaddress,  vbase2, as->as_pbase2);
-		dirtiable = as->as_dirtiable2;
-	} else if (faultaddress >= stackbase && faultaddress < stacktop) {
-		paddr = vaddr_to_paddr(faultaddress, stackbase, as->as_stackpbase);
-		dirtiable = true;
-	} else {
-		return EFAULT;
+	KASSERT(as->as_pt != NULL);
+
+	rg = as_findregion(as, faultaddress);
+	if (rg == NULL) {
+		rg = as_growstack(as, faultaddress);
+		if (rg == NULL) {
+			return EFAULT;
+		}
+	}
+
+	/* One lookup in the page table, however big the segment is */
+	pte = pt_lookup(as->as_pt, faultaddress, true);
+	if (pte == NULL) {
+		return ENOMEM;
+	}
+
+	/*
+	 * Get the page resident and, if we're writing it, private. Each
+	 * step may sleep, and the page can be evicted again meanwhile, so
+	 * go round until it's all true at once under the lock.
+	 */
+	spinlock_acquire(&stealmem_lock);
+	while (true) {
+		if (*pte & PTE_INTRANSIT) {
+			pte_wait();
+			continue;
+		}
+
+		if ((*pte & PTE_VALID) == 0) {
+			spinlock_release(&stealmem_lock);
+			result = as_pagein(as, rg, faultaddress, pte);
+			if (result) {
+				return result;
+			}
+			pagedin = true;
+			spinlock_acquire(&stealmem_lock);
+			continue;
+		}
+
+		if (faulttype != VM_FAULT_READ && (*pte & PTE_READONLY)) {
+			/*
+			 * Leave it to mips_trap: a user access kills the
+			 * process, and copyout fails with EFAULT so the
+			 * system call can back out and drop its locks.
+			 */
+			spinlock_release(&stealmem_lock);
+			return EFAULT;
+		}
+
+		if (faulttype != VM_FAULT_READ && pte_entry(*pte)->refcount > 1 &&
+		    (*pte & PTE_SHARED) == 0) {
+			/* First write to a copy-on-write page: make it private. */
+			spinlock_release(&stealmem_lock);
+			result = as_breakcow(as, faultaddress, pte);
+			if (result) {
+				return result;
+			}
+			spinlock_acquire(&stealmem_lock);
+			continue;
+		}
+
+		break;
+	}
+
+	if (faulttype != VM_FAULT_READ) {
+		*pte |= PTE_DIRTY;
+	}
+	*pte |= PTE_REFERENCED;
+
+	paddr = *pte & PTE_FRAME;
+	entry = pte_entry(*pte);
+
+	/* Nobody else maps it any more, so it's ours to evict */
+	if (entry->refcount == 1 && entry->as == NULL) {
+		entry->as = as;
+		entry->vaddr = faultaddress;
 	}
 
-	// if not yet ready, we're still loading segments
-	// Will always be dirtiable in this case
-	if (!as->as_ready) dirtiable = true;
+	/*
+	 * Only let the TLB write the page once we know about it: clean
+	 * pages are mapped read-only so their first write faults and marks
+	 * them dirty. Shared pages stay read-only until someone writes to
+	 * them, since writing breaks the share, unless they're mapped
+	 * shared. Once the page may be written, its copy in swap (if any)
+	 * is out of date.
+	 */
+	writable = (*pte & PTE_READONLY) == 0 && (*pte & PTE_DIRTY) != 0 &&
+		(entry->refcount == 1 || (*pte & PTE_SHARED) != 0);
+	if (writable && entry->swapslot >= 0) {
+		swap_free(entry->swapslot);
+		entry->swapslot = -1;
+	}
 
 	/* make sure it's page-aligned */
 	KASSERT((paddr & PAGE_FRAME) == paddr);
 
-	/* Disable interrupts on this CPU while frobbing the TLB. */
-	spl = splhigh();
+	elo = paddr | (writable ? TLBLO_DIRTY : 0) | TLBLO_VALID;
 
-	for (i=0; !tlbfull && i < NUM_TLB; i++) {
-		tlb_read(&ehi, &elo, i);
-		if (elo & TLBLO_VALID) {
-			continue;
+	/*
+	 * Disable interrupts on this CPU while frobbing the TLB. We still
+	 * hold stealmem_lock, so the page can't be evicted before the
+	 * entry is in; eviction shoots it down afterwards.
+	 */
+	spl = splhigh();
+	tc = &tlbcpus[curcpu->c_number];
+	KASSERT(tc->tc_owner[tc->tc_asid] == as->as_id);
+	ehi = faultaddress | (tc->tc_asid << TLBHI_PIDSHIFT);
+
+	if (faulttype == VM_FAULT_READONLY) {
+		/* Replace the read-only entry that caused the fault */
+		i = tlb_probe(ehi, 0);
+		if (i >= 0) {
+			tlb_write(ehi, elo, i);
+			splx(spl);
+			spinlock_release(&stealmem_lock);
+			return 0;
 		}
-		ehi = faultaddress;
-		elo = paddr | (dirtiable ? TLBLO_DIRTY : 0) | TLBLO_VALID;
-		DEBUG(DB_VM, "smartvm: 0x%x -> 0x%x\n", faultaddress, paddr);
-		tlb_write(ehi, elo, i);
-		splx(spl);
-		return 0;
 	}
 
-	tlbfull = true;
+	/*
+	 * Everything from here on loads a new TLB entry, including a
+	 * read-only fault whose entry was shot down in the meantime, so
+	 * count it as a TLB fault; the statistics check that these add up.
+	 */
+	vmstats_inc(VMSTAT_TLB_FAULT);
+	if (!pagedin) {
+		vmstats_inc(VMSTAT_TLB_RELOAD);
+	}
 
-	// If we reached this point the TLB is full
-	// Evict and write to a random page for now
-	ehi = faultaddress;
-	elo = paddr | (dirtiable ? TLBLO_DIRTY : 0) | TLBLO_VALID;
-	tlb_random(ehi, elo);
+	/* Use a free slot if there is one, otherwise go round */
+	if (tc->tc_nused < NUM_TLB) {
+		for (i=0; tc->tc_slot[i] != 0; i++);
+		tc->tc_nused++;
+		vmstats_inc(VMSTAT_TLB_FAULT_FREE);
+	} else {
+		i = tc->tc_hand;
+		tc->tc_hand = (tc->tc_hand + 1) % NUM_TLB;
+		vmstats_inc(VMSTAT_TLB_FAULT_REPLACE);
+	}
+	DEBUG(DB_VM, "smartvm: 0x%x -> 0x%x\n", faultaddress, paddr);
+	tc->tc_slot[i] = tc->tc_asid + 1;
+	tlb_write(ehi, elo, i);
 	splx(spl);
+	spinlock_release(&stealmem_lock);
 	return 0;
 }
 
-/**
-	Follows the coremap to find the correct physical address
-*/
-paddr_t vaddr_to_paddr(vaddr_t addr, vaddr_t vbase, paddr_t pbase) {
-	int pagenumber = (pbase - pmemstart) / PAGE_SIZE;
-	struct coremapentry * entry = coremap + pagenumber;
-	for (size_t i = 0; i < (addr - vbase) / PAGE_SIZE; i++) {
-		pagenumber = entry->nextentry;
-		entry = coremap + pagenumber;
-	}
-	return (paddr_t)(pmemstart + (pagenumber * PAGE_SIZE) + (addr % PAGE_SIZE));
-}
-
 struct addrspace * as_create(void) {
 	struct addrspace *as = kmalloc(sizeof(struct addrspace));
 	if (as==NULL) {
 		return NULL;
 	}
 
-	as->as_vbase1 = 0;
-	as->as_pbase1 = 0;
-	as->as_npages1 = 0;
-	as->as_dirtiable1 = false;
+	as->as_pt = pt_create();
+	if (as->as_pt == NULL) {
+		kfree(as);
+		return NULL;
+	}
+
+	spinlock_acquire(&stealmem_lock);
+	as->as_id = nextasid_id++;
+	spinlock_release(&stealmem_lock);
+	as->as_cpu = 0;
+	as->as_cpus = 0;
 
-	as->as_vbase2 = 0;
-	as->as_pbase2 = 0;
-	as->as_npages2 = 0;
-	as->as_dirtiable2 = false;
+	array_init(&as->as_regions);
+	as->as_heap = NULL;
+	as->as_heapbreak = 0;
+	as->as_stack = NULL;
 
-	as->as_stackpbase = 0;
+	as->as_vnode = NULL;
 
 	as->as_ready = false;
 
 	return as;
 }
 
+/**
+	Drop the address space's reference to the page behind *pte, whether
+	it's in memory or in swap, and clear the PTE. Pages shared with
+	another address space survive. A page on its way out still needs the
+	page table, so we wait for it first.
+
+	Called, and returns, with stealmem_lock held.
+*/
+static void pte_release(struct addrspace *as, pte_t *pte) {
+	KASSERT(spinlock_do_i_hold(&stealmem_lock));
+
+	while ((*pte & PTE_INTRANSIT) ||
+	       ((*pte & PTE_VALID) && pte_entry(*pte)->busy)) {
+		pte_wait();
+	}
+
+	if (*pte & PTE_VALID) {
+		paddr_t paddr = *pte & PTE_FRAME;
+		if (pte_entry(*pte)->as == as) {
+			pte_entry(*pte)->as = NULL;
+		}
+		*pte = 0;
+		spinlock_release(&stealmem_lock);
+		free_kpages(PADDR_TO_KVADDR(paddr));
+		spinlock_acquire(&stealmem_lock);
+	} else if (*pte & PTE_SWAPPED) {
+		swap_free(PTE_SWAPSLOT(*pte));
+		*pte = 0;
+	}
+}
+
+/**
+	Throw away npages pages starting at vaddr. The address space must be
+	the current one.
+*/
+static void as_unmap(struct addrspace *as, vaddr_t vaddr, size_t npages) {
+	spinlock_acquire(&stealmem_lock);
+	for (size_t i = 0; i < npages; i++) {
+		pte_t *pte = pt_lookup(as->as_pt, vaddr + i * PAGE_SIZE, false);
+		if (pte != NULL) {
+			pte_release(as, pte);
+		}
+		tlb_invalidate(as, vaddr + i * PAGE_SIZE);
+	}
+	spinlock_release(&stealmem_lock);
+}
+
 void as_destroy(struct addrspace *as) {
-	// Delete all allocated segments
-	// quick way of cleaning by passing in physical page
-	// Should probably have a separate function for this.
-	free_kpages(PADDR_TO_KVADDR(as->as_pbase1));
-	free_kpages(PADDR_TO_KVADDR(as->as_pbase2));
-	free_kpages(PADDR_TO_KVADDR(as->as_stackpbase));
+	struct pagetable *pt = as->as_pt;
+	unsigned num = array_num(&as->as_regions);
+
+	// Remember what we wrote to shared mappings before letting go
+	for (unsigned i = 0; i < num; i++) {
+		struct region *rg = array_get(&as->as_regions, i);
+		if (rg->rg_obj != NULL && rg->rg_shared) {
+			region_syncdirty(as, rg, rg->rg_vbase, rg->rg_npages);
+		}
+	}
+
+	// Drop our reference to every page
+	spinlock_acquire(&stealmem_lock);
+	for (unsigned i = 0; i < PT_NENTRIES; i++) {
+		if (pt->pt_dir[i] == NULL) {
+			continue;
+		}
+		for (unsigned j = 0; j < PT_NENTRIES; j++) {
+			pte_release(as, &pt->pt_dir[i][j]);
+		}
+	}
+	spinlock_release(&stealmem_lock);
+
+	// Eviction looks up vmobj pages in our page table until this is done
+	while (array_num(&as->as_regions) > 0) {
+		unsigned last = array_num(&as->as_regions) - 1;
+		struct region *rg = array_get(&as->as_regions, last);
+		if (rg->rg_obj != NULL) {
+			region_clearobj(rg);
+		}
+		kfree(rg);
+		array_remove(&as->as_regions, last);
+	}
+	array_cleanup(&as->as_regions);
+	pt_destroy(pt);
+
+	if (as->as_vnode != NULL) {
+		VOP_DECREF(as->as_vnode);
+	}
 
 	// Finally, free up the actual address space structure
 	kfree(as);
 }
 
 void as_activate(void) {
-	int i, spl;
 	struct addrspace *as;
+	struct tlbcpu *tc;
+	int asid, spl;
 
 	as = curproc_getas();
 #ifdef UW
@@ -368,14 +2490,28 @@ void as_activate(void) {
 		return;
 	}
 
-	/* Disable interrupts on this CPU while frobbing the TLB. */
+	/*
+	 * Keep as's entries from last time if it still has an ASID here.
+	 * Mappings are only changed on the CPU the process is running on,
+	 * apart from evictions, which are shot down everywhere; so if it has
+	 * run somewhere else since, what we have for it may be stale.
+	 */
 	spl = splhigh();
-
-	for (i=0; i<NUM_TLB; i++) {
-		tlb_write(TLBHI_INVALID(i), TLBLO_INVALID(), i);
+	tc = &tlbcpus[curcpu->c_number];
+	asid = tlb_findasid(tc, as);
+	if (asid >= 0 && as->as_cpu != curcpu->c_number) {
+		tlb_flushasid(tc, asid);
 	}
-	tlbfull = false;
-
+	if (asid < 0) {
+		asid = tc->tc_nextasid;
+		tc->tc_nextasid = (tc->tc_nextasid + 1) % NUM_ASID;
+		tlb_flushasid(tc, asid);
+		tc->tc_owner[asid] = as->as_id;
+	}
+	as->as_cpu = curcpu->c_number;
+	as->as_cpus |= (uint32_t)1 << curcpu->c_number;
+	tc->tc_asid = asid;
+	tlb_setasid(asid);
 	splx(spl);
 }
 
@@ -383,6 +2519,60 @@ void as_deactivate(void) {
 	/* nothing */
 }
 
+/**
+	Does [vaddr, vaddr + npages pages) overlap any region other than
+	except?
+*/
+static bool as_overlaps(struct addrspace *as, vaddr_t vaddr, size_t npages,
+			struct region *except) {
+	vaddr_t top = vaddr + npages * PAGE_SIZE;
+	unsigned num = array_num(&as->as_regions);
+
+	for (unsigned i = 0; i < num; i++) {
+		struct region *rg = array_get(&as->as_regions, i);
+		vaddr_t rgtop = rg->rg_vbase + rg->rg_npages * PAGE_SIZE;
+		if (rg != except && vaddr < rgtop && rg->rg_vbase < top) {
+			return true;
+		}
+	}
+	return false;
+}
+
+/**
+	Add a region of npages pages at (page-aligned) vaddr
+*/
+static struct region * as_addregion(struct addrspace *as, vaddr_t vaddr,
+				    size_t npages, bool readable,
+				    bool writeable, bool executable) {
+	struct region *rg;
+
+	rg = kmalloc(sizeof(struct region));
+	if (rg == NULL) {
+		return NULL;
+	}
+	rg->rg_vbase = vaddr;
+	rg->rg_npages = npages;
+	rg->rg_readable = readable;
+	rg->rg_writeable = writeable;
+	rg->rg_executable = executable;
+	rg->rg_fvaddr = vaddr;
+	rg->rg_foffset = 0;
+	rg->rg_filesz = 0;
+	rg->rg_mmapped = false;
+	rg->rg_shared = false;
+	rg->rg_shm = false;
+	rg->rg_obj = NULL;
+	rg->rg_objoffset = 0;
+	rg->rg_as = as;
+	rg->rg_objnext = NULL;
+
+	if (array_add(&as->as_regions, rg, NULL)) {
+		kfree(rg);
+		return NULL;
+	}
+	return rg;
+}
+
 int as_define_region(
 	struct addrspace *as, vaddr_t vaddr, size_t sz,
 	int readable, int writeable, int executable
@@ -398,110 +2588,456 @@ int as_define_region(
 
 	npages = sz / PAGE_SIZE;
 
-	/* We don't use these - all pages are read-write */
-	bool dirtiable = (bool)(writeable >> 1);
-	(void)readable;
-	// (void)writeable;
-	(void)executable;
-
-	if (as->as_vbase1 == 0) {
-		as->as_vbase1 = vaddr;
-		as->as_npages1 = npages;
-		as->as_dirtiable1 = dirtiable;
-		return 0;
+	if (vaddr + sz > USERSPACETOP || vaddr + sz < vaddr) {
+		return EFAULT;
 	}
-
-	if (as->as_vbase2 == 0) {
-		as->as_vbase2 = vaddr;
-		as->as_npages2 = npages;
-		as->as_dirtiable2 = dirtiable;
-		return 0;
+	if (as_overlaps(as, vaddr, npages, NULL)) {
+		kprintf("smartvm: Warning: overlapping regions\n");
+		return EINVAL;
 	}
 
 	/*
-	 * Support for more than two regions is not available.
+	 * The hardware can only enforce writeable; read and execute
+	 * permission are kept for the record.
 	 */
-	kprintf("smartvm: Warning: too many regions\n");
-	return EUNIMP;
+	if (as_addregion(as, vaddr, npages, readable != 0, writeable != 0,
+			 executable != 0) == NULL) {
+		return ENOMEM;
+	}
+	return 0;
 }
 
-static void as_zero_region(paddr_t paddr, unsigned npages) {
-	bzero((void *)PADDR_TO_KVADDR(paddr), npages * PAGE_SIZE);
+/**
+	The region containing vaddr will be filled from filesz bytes of v,
+	starting at offset, instead of zeroes. Nothing is read until a page
+	of the region is touched.
+*/
+int as_define_backing(struct addrspace *as, struct vnode *v,
+		      off_t offset, vaddr_t vaddr, size_t filesz) {
+	struct region *rg;
+
+	KASSERT(as->as_vnode == NULL || as->as_vnode == v);
+
+	if (filesz == 0) {
+		return 0;
+	}
+
+	rg = as_findregion(as, vaddr);
+	if (rg == NULL ||
+	    vaddr + filesz > rg->rg_vbase + rg->rg_npages * PAGE_SIZE) {
+		return EINVAL;
+	}
+	rg->rg_fvaddr = vaddr;
+	rg->rg_foffset = offset;
+	rg->rg_filesz = filesz;
+
+	// Hang on to the executable until we're done faulting pages in
+	if (as->as_vnode == NULL) {
+		VOP_INCREF(v);
+		as->as_vnode = v;
+	}
+	return 0;
 }
 
 int as_prepare_load(struct addrspace *as) {
-	KASSERT(as->as_pbase1 == 0);
-	KASSERT(as->as_pbase2 == 0);
-	KASSERT(as->as_stackpbase == 0);
+	/* Pages are allocated when they're first touched */
+	(void)as;
+	return 0;
+}
+
+int as_complete_load(struct addrspace *as) {
+	vaddr_t heapbase = 0;
+	unsigned num = array_num(&as->as_regions);
+
+	KASSERT(as->as_heap == NULL);
 
-	as->as_pbase1 = getppages(as->as_npages1);
-	if (as->as_pbase1 == 0) {
+	/* The heap starts out empty, past everything that was loaded */
+	for (unsigned i = 0; i < num; i++) {
+		struct region *rg = array_get(&as->as_regions, i);
+		vaddr_t top = rg->rg_vbase + rg->rg_npages * PAGE_SIZE;
+		if (top > heapbase) {
+			heapbase = top;
+		}
+	}
+	as->as_heap = as_addregion(as, heapbase, 0, true, true, false);
+	if (as->as_heap == NULL) {
 		return ENOMEM;
 	}
+	as->as_heapbreak = heapbase;
 
-	as->as_pbase2 = getppages(as->as_npages2);
-	if (as->as_pbase2 == 0) {
+	as->as_ready = true;
+	return 0;
+}
+
+int as_define_stack(struct addrspace *as, vaddr_t *stackptr) {
+	vaddr_t stackbase = USERSTACK - SMARTVM_STACKPAGES * PAGE_SIZE;
+
+	KASSERT(as->as_ready);
+	KASSERT(as->as_stack == NULL);
+
+	if (as_overlaps(as, stackbase, SMARTVM_STACKPAGES, NULL)) {
+		return ENOMEM;
+	}
+	as->as_stack = as_addregion(as, stackbase, SMARTVM_STACKPAGES,
+				    true, true, false);
+	if (as->as_stack == NULL) {
 		return ENOMEM;
 	}
 
-	as->as_stackpbase = getppages(SMARTVM_STACKPAGES);
-	if (as->as_stackpbase == 0) {
+	*stackptr = USERSTACK;
+	return 0;
+}
+
+int as_sbrk(struct addrspace *as, intptr_t amount, vaddr_t *oldbreak) {
+	struct region *heap = as->as_heap;
+	vaddr_t newbreak;
+	size_t npages;
+
+	KASSERT(heap != NULL);
+
+	*oldbreak = as->as_heapbreak;
+
+	if (amount < 0 && (vaddr_t)-amount > as->as_heapbreak - heap->rg_vbase) {
+		return EINVAL;
+	}
+	newbreak = as->as_heapbreak + amount;
+	if (amount > 0 && (newbreak < as->as_heapbreak || newbreak > USERSPACETOP)) {
 		return ENOMEM;
 	}
 
-	as_zero_region(as->as_pbase1, as->as_npages1);
-	as_zero_region(as->as_pbase2, as->as_npages2);
-	as_zero_region(as->as_stackpbase, SMARTVM_STACKPAGES);
+	npages = (newbreak - heap->rg_vbase + PAGE_SIZE - 1) / PAGE_SIZE;
+	if (npages > heap->rg_npages) {
+		/* Don't grow into anything else, or the stack's guard pages */
+		if (as_overlaps(as, heap->rg_vbase, npages, heap)) {
+			return ENOMEM;
+		}
+		if (as->as_stack != NULL && as->as_stack->rg_vbase > heap->rg_vbase &&
+		    heap->rg_vbase + (npages + SMARTVM_GUARDPAGES) * PAGE_SIZE >
+		    as->as_stack->rg_vbase) {
+			return ENOMEM;
+		}
+	} else if (npages < heap->rg_npages) {
+		as_unmap(as, heap->rg_vbase + npages * PAGE_SIZE,
+			 heap->rg_npages - npages);
+	}
 
+	heap->rg_npages = npages;
+	as->as_heapbreak = newbreak;
 	return 0;
 }
 
-int as_complete_load(struct addrspace *as) {
-	as->as_ready = true;
+/**
+	Find room for npages pages of mmap below the stack, leaving the stack
+	room to grow to its maximum (and its guard pages below that). Maps go
+	in the highest gap that fits.
+*/
+static int as_mmapplace(struct addrspace *as, size_t npages, vaddr_t *ret) {
+	vaddr_t top = USERSTACK -
+		(SMARTVM_STACKMAX + SMARTVM_GUARDPAGES) * PAGE_SIZE;
+	vaddr_t base, lowest;
+	unsigned num = array_num(&as->as_regions);
+
+	while (top >= (npages + 1) * PAGE_SIZE) {
+		base = top - npages * PAGE_SIZE;
+
+		/* Go below the lowest region in the way, if any */
+		lowest = top;
+		for (unsigned i = 0; i < num; i++) {
+			struct region *rg = array_get(&as->as_regions, i);
+			vaddr_t rgtop = rg->rg_vbase + rg->rg_npages * PAGE_SIZE;
+			if (base <= rg->rg_vbase ? rg->rg_vbase < top : base < rgtop) {
+				if (rg->rg_vbase < lowest) {
+					lowest = rg->rg_vbase;
+				}
+			}
+		}
+		if (lowest == top) {
+			*ret = base;
+			return 0;
+		}
+		top = lowest;
+	}
+	return ENOMEM;
+}
+
+int as_mapobj(struct addrspace *as, vaddr_t vaddr, size_t len, int prot,
+	      int flags, struct vmobj *vo, off_t offset, vaddr_t *ret) {
+	struct region *rg;
+	size_t npages;
+	bool shared;
+	int result;
+
+	switch (flags & (MAP_SHARED | MAP_PRIVATE)) {
+	    case MAP_SHARED: shared = true; break;
+	    case MAP_PRIVATE: shared = false; break;
+	    default: return EINVAL;
+	}
+	if (len == 0 || len > USERSPACETOP || (vaddr & ~PAGE_FRAME) != 0) {
+		return EINVAL;
+	}
+	npages = (len + PAGE_SIZE - 1) / PAGE_SIZE;
+
+	/* Sharing needs something to share; vmobj pages have 32-bit offsets */
+	if (vo == NULL && shared) {
+		return EINVAL;
+	}
+	if (vo != NULL && (offset < 0 || offset % PAGE_SIZE != 0 ||
+			   offset + (off_t)npages * PAGE_SIZE > ((off_t)1 << 32))) {
+		return EINVAL;
+	}
+
+	if (flags & MAP_FIXED) {
+		if (vaddr == 0 || vaddr + npages * PAGE_SIZE > USERSPACETOP ||
+		    vaddr + npages * PAGE_SIZE < vaddr) {
+			return EINVAL;
+		}
+		/* We don't replace existing mappings */
+		if (as_overlaps(as, vaddr, npages, NULL)) {
+			return ENOMEM;
+		}
+	} else if (vaddr == 0 || vaddr + npages * PAGE_SIZE > USERSPACETOP ||
+		   vaddr + npages * PAGE_SIZE < vaddr ||
+		   as_overlaps(as, vaddr, npages, NULL)) {
+		result = as_mmapplace(as, npages, &vaddr);
+		if (result) {
+			return result;
+		}
+	}
+
+	rg = as_addregion(as, vaddr, npages, (prot & PROT_READ) != 0,
+			  (prot & PROT_WRITE) != 0, (prot & PROT_EXEC) != 0);
+	if (rg == NULL) {
+		return ENOMEM;
+	}
+	rg->rg_mmapped = true;
+	rg->rg_shared = shared;
+	rg->rg_shm = (flags & AS_MAP_SHM) != 0;
+	if (vo != NULL) {
+		region_setobj(rg, vo, offset);
+	}
+
+	*ret = vaddr;
 	return 0;
 }
 
-int as_define_stack(struct addrspace *as, vaddr_t *stackptr) {
-	KASSERT(as->as_stackpbase != 0);
+int as_mmap(struct addrspace *as, vaddr_t vaddr, size_t len, int prot,
+	    int flags, struct vnode *v, off_t offset, vaddr_t *ret) {
+	struct vmobj *vo = NULL;
+	int result;
 
-	*stackptr = USERSTACK;
+	/* Only shm_attach makes those */
+	if (flags & AS_MAP_SHM) {
+		return EINVAL;
+	}
+
+	/*
+	 * Files always go through their vmobj. So does shared anonymous
+	 * memory, so that a fork shares it; private anonymous memory is
+	 * just zero-filled pages like the heap's.
+	 */
+	if (v != NULL || (flags & MAP_SHARED)) {
+		result = vmobj_get(v, &vo);
+		if (result) {
+			return result;
+		}
+	}
+
+	result = as_mapobj(as, vaddr, len, prot, flags, vo,
+			   v != NULL ? offset : 0, ret);
+	if (vo != NULL) {
+		vmobj_release(vo);
+	}
+	return result;
+}
+
+struct vmobj * as_shmat(struct addrspace *as, vaddr_t vaddr, size_t *len) {
+	struct region *rg = as_findregion(as, vaddr);
+
+	if (rg == NULL || !rg->rg_shm || rg->rg_vbase != vaddr) {
+		return NULL;
+	}
+	KASSERT(rg->rg_obj != NULL);
+	*len = rg->rg_npages * PAGE_SIZE;
+	return rg->rg_obj;
+}
+
+int as_munmap(struct addrspace *as, vaddr_t vaddr, size_t len) {
+	struct region *rg, *top = NULL;
+	vaddr_t end, rgend;
+	size_t npages;
+	unsigned num, i;
+	int result;
+
+	if (len == 0 || (vaddr & ~PAGE_FRAME) != 0) {
+		return EINVAL;
+	}
+	npages = (len + PAGE_SIZE - 1) / PAGE_SIZE;
+	end = vaddr + npages * PAGE_SIZE;
+
+	rg = as_findregion(as, vaddr);
+	if (rg == NULL || !rg->rg_mmapped) {
+		return EINVAL;
+	}
+	rgend = rg->rg_vbase + rg->rg_npages * PAGE_SIZE;
+	if (end > rgend || end < vaddr) {
+		return EINVAL;
+	}
+
+	/* Unmapping from the middle splits the region in two */
+	if (vaddr > rg->rg_vbase && end < rgend) {
+		top = as_addregion(as, end, (rgend - end) / PAGE_SIZE,
+				   rg->rg_readable, rg->rg_writeable,
+				   rg->rg_executable);
+		if (top == NULL) {
+			return ENOMEM;
+		}
+		top->rg_mmapped = true;
+		top->rg_shared = rg->rg_shared;
+		top->rg_shm = rg->rg_shm;
+		top->rg_objoffset = rg->rg_objoffset + (end - rg->rg_vbase);
+		if (rg->rg_obj != NULL) {
+			region_setobj(top, rg->rg_obj, top->rg_objoffset);
+		}
+	}
+
+	if (rg->rg_obj != NULL && rg->rg_shared) {
+		region_syncdirty(as, rg, vaddr, npages);
+	}
+	as_unmap(as, vaddr, npages);
+
+	/* Let the file see what was written */
+	if (rg->rg_obj != NULL && rg->rg_shared) {
+		result = vmobj_writeback(rg->rg_obj);
+		if (result) {
+			kprintf("smartvm: Warning: lost mmap writes: %s\n",
+				strerror(result));
+		}
+	}
+
+	/* Eviction may be looking at rg if it maps a vmobj */
+	spinlock_acquire(&stealmem_lock);
+	if (top != NULL || end == rgend) {
+		/* Keep the bottom part */
+		rg->rg_npages = (vaddr - rg->rg_vbase) / PAGE_SIZE;
+	} else {
+		/* Keep the top part */
+		rg->rg_objoffset += end - rg->rg_vbase;
+		rg->rg_npages = (rgend - end) / PAGE_SIZE;
+		rg->rg_vbase = end;
+		rg->rg_fvaddr = end;
+	}
+	spinlock_release(&stealmem_lock);
+
+	if (rg->rg_npages == 0) {
+		num = array_num(&as->as_regions);
+		for (i = 0; i < num; i++) {
+			if (array_get(&as->as_regions, i) == rg) {
+				break;
+			}
+		}
+		KASSERT(i < num);
+		array_remove(&as->as_regions, i);
+		if (rg->rg_obj != NULL) {
+			region_clearobj(rg);
+		}
+		kfree(rg);
+	}
 	return 0;
 }
 
 int as_copy(struct addrspace *old, struct addrspace **ret) {
 	struct addrspace *new;
+	struct pagetable *from, *to;
+	unsigned num;
 
 	new = as_create();
 	if (new==NULL) {
 		return ENOMEM;
 	}
 
-	new->as_vbase1 = old->as_vbase1;
-	new->as_npages1 = old->as_npages1;
-	new->as_vbase2 = old->as_vbase2;
-	new->as_npages2 = old->as_npages2;
-
-	/* (Mis)use as_prepare_load to allocate some physical memory. */
-	if (as_prepare_load(new)) {
-		as_destroy(new);
-		return ENOMEM;
+	num = array_num(&old->as_regions);
+	for (unsigned i = 0; i < num; i++) {
+		struct region *rg = array_get(&old->as_regions, i);
+		struct region *newrg;
+
+		newrg = as_addregion(new, rg->rg_vbase, rg->rg_npages,
+				     rg->rg_readable, rg->rg_writeable,
+				     rg->rg_executable);
+		if (newrg == NULL) {
+			as_destroy(new);
+			return ENOMEM;
+		}
+		newrg->rg_fvaddr = rg->rg_fvaddr;
+		newrg->rg_foffset = rg->rg_foffset;
+		newrg->rg_filesz = rg->rg_filesz;
+		newrg->rg_mmapped = rg->rg_mmapped;
+		newrg->rg_shared = rg->rg_shared;
+		newrg->rg_shm = rg->rg_shm;
+		newrg->rg_objoffset = rg->rg_objoffset;
+		if (rg->rg_obj != NULL) {
+			region_setobj(newrg, rg->rg_obj, rg->rg_objoffset);
+		}
+		if (rg == old->as_heap) {
+			new->as_heap = newrg;
+		}
+		if (rg == old->as_stack) {
+			new->as_stack = newrg;
+		}
 	}
+	new->as_heapbreak = old->as_heapbreak;
+	new->as_ready = old->as_ready;
 
-	KASSERT(new->as_pbase1 != 0);
-	KASSERT(new->as_pbase2 != 0);
-	KASSERT(new->as_stackpbase != 0);
-
-	memmove((void *)PADDR_TO_KVADDR(new->as_pbase1),
-		(const void *)PADDR_TO_KVADDR(old->as_pbase1),
-		old->as_npages1*PAGE_SIZE);
+	if (old->as_vnode != NULL) {
+		VOP_INCREF(old->as_vnode);
+		new->as_vnode = old->as_vnode;
+	}
 
-	memmove((void *)PADDR_TO_KVADDR(new->as_pbase2),
-		(const void *)PADDR_TO_KVADDR(old->as_pbase2),
-		old->as_npages2*PAGE_SIZE);
+	/*
+	 * Copy the page table, sharing every page copy-on-write instead of
+	 * copying it now; pages in swap share their swap slot the same way.
+	 * Pages of shared mappings (PTE_SHARED) stay shared for real.
+	 * Pages the parent never touched are left for the child to fault
+	 * in itself.
+	 */
+	from = old->as_pt;
+	to = new->as_pt;
+	for (unsigned i = 0; i < PT_NENTRIES; i++) {
+		if (from->pt_dir[i] == NULL) {
+			continue;
+		}
+		for (unsigned j = 0; j < PT_NENTRIES; j++) {
+			pte_t *oldpte = &from->pt_dir[i][j];
+			if (*oldpte == 0) {
+				continue;
+			}
+			pte_t *newpte = pt_lookup(to, PT_VADDR(i, j), true);
+			if (newpte == NULL) {
+				as_destroy(new);
+				return ENOMEM;
+			}
+
+			spinlock_acquire(&stealmem_lock);
+			while (*oldpte & PTE_INTRANSIT) {
+				pte_wait();
+			}
+			if (*oldpte & PTE_VALID) {
+				page_share(*oldpte & PTE_FRAME);
+			} else if (*oldpte & PTE_SWAPPED) {
+				swap_share(PTE_SWAPSLOT(*oldpte));
+			}
+			*newpte = *oldpte & ~PTE_REFERENCED;
+			spinlock_release(&stealmem_lock);
+		}
+	}
 
-	memmove((void *)PADDR_TO_KVADDR(new->as_stackpbase),
-		(const void *)PADDR_TO_KVADDR(old->as_stackpbase),
-		SMARTVM_STACKPAGES*PAGE_SIZE);
+	/*
+	 * The parent may still have writable TLB entries for pages that
+	 * are now shared. Drop them so its next write faults and copies.
+	 * (The parent is the only thread using its address space, and it
+	 * is running on this CPU; any other CPU drops its entries when the
+	 * parent next runs there.)
+	 */
+	tlb_flushas(old);
 
 	*ret = new;
 	return 0;
@@ -2,9 +2,6 @@
 SRCS+=$(TOP)/common/libc/printf/__printf.c
 SRCS+=$(TOP)/common/libc/printf/snprintf.c
 SRCS+=$(TOP)/common/libc/stdlib/atoi.c
-SRCS+=$(TOP)/common/libc/string/bzero.c
-SRCS+=$(TOP)/common/libc/string/memcpy.c
-SRCS+=$(TOP)/common/libc/string/memmove.c
 SRCS+=$(TOP)/common/libc/string/strcat.c
 SRCS+=$(TOP)/common/libc/string/strchr.c
 SRCS+=$(TOP)/common/libc/string/strcmp.c
@@ -45,6 +42,7 @@ SRCS+=$(KTOP)/lib/kprintf.c
 SRCS+=$(KTOP)/lib/misc.c
 SRCS+=$(KTOP)/lib/queue.c
 SRCS+=$(KTOP)/lib/uio.c
+SRCS+=$(KTOP)/proc/filetable.c
 SRCS+=$(KTOP)/proc/proc.c
 SRCS+=$(KTOP)/startup/main.c
 SRCS+=$(KTOP)/startup/menu.c
@@ -52,6 +50,7 @@ SRCS+=$(KTOP)/synchprobs/catmouse.c
 SRCS+=$(KTOP)/synchprobs/catmouse_synch.c
 SRCS+=$(KTOP)/synchprobs/whalemating.c
 SRCS+=$(KTOP)/syscall/file_syscalls.c
+SRCS+=$(KTOP)/syscall/kmprof_syscalls.c
 SRCS+=$(KTOP)/syscall/loadelf.c
 SRCS+=$(KTOP)/syscall/proc_syscalls.c
 SRCS+=$(KTOP)/syscall/runprogram.c
@@ -70,6 +69,8 @@ SRCS+=$(KTOP)/thread/spl.c
 SRCS+=$(KTOP)/thread/synch.c
 SRCS+=$(KTOP)/thread/thread.c
 SRCS+=$(KTOP)/thread/threadlist.c
+SRCS+=$(KTOP)/vfs/buf.c
+SRCS+=$(KTOP)/vfs/dcache.c
 SRCS+=$(KTOP)/vfs/device.c
 SRCS+=$(KTOP)/vfs/devnull.c
 SRCS+=$(KTOP)/vfs/vfscwd.c
@@ -78,6 +79,8 @@ SRCS+=$(KTOP)/vfs/vfslookup.c
 SRCS+=$(KTOP)/vfs/vfspath.c
 SRCS+=$(KTOP)/vfs/vnode.c
 SRCS+=$(KTOP)/vm/kmalloc.c
+SRCS+=$(KTOP)/vm/kmem_cache.c
+SRCS+=$(KTOP)/vm/kmprof.c
 SRCS+=$(KTOP)/vm/uw-vmstats.c
 SRCS.MACHINE.mips+=$(TOP)/common/gcc-millicode/adddi3.c
 SRCS.MACHINE.mips+=$(TOP)/common/gcc-millicode/anddi3.c
@@ -98,6 +101,9 @@ SRCS.MACHINE.mips+=$(TOP)/common/gcc-millicode/ucmpdi2.c
 SRCS.MACHINE.mips+=$(TOP)/common/gcc-millicode/udivdi3.c
 SRCS.MACHINE.mips+=$(TOP)/common/gcc-millicode/umoddi3.c
 SRCS.MACHINE.mips+=$(TOP)/common/gcc-millicode/xordi3.c
+SRCS.MACHINE.mips+=$(TOP)/common/libc/arch/mips/bzero.S
+SRCS.MACHINE.mips+=$(TOP)/common/libc/arch/mips/memcpy.S
+SRCS.MACHINE.mips+=$(TOP)/common/libc/arch/mips/memmove.S
 SRCS.MACHINE.mips+=$(TOP)/common/libc/arch/mips/setjmp.S
 SRCS.MACHINE.mips+=$(KTOP)/arch/mips/locore/trap.c
 SRCS.MACHINE.mips+=$(KTOP)/arch/mips/syscall/syscall.c
@@ -259,6 +259,16 @@ emu_close(struct emu_softc *sc, uint32_t handle)
 	return result;
 }
 
+/*
+ * Copying to or from a user buffer can fault, and the fault may need
+ * to read a file on this device (program text, or a mapped file), so
+ * it mustn't happen with e_lock held. Reads and writes of user memory
+ * go through a kernel buffer of up to EMU_BOUNCESIZE bytes instead,
+ * which is copied to or from the I/O buffer under the lock. Callers
+ * loop until the uio is done, so the smaller transfers are fine.
+ */
+#define EMU_BOUNCESIZE  4096
+
 /*
  * Common code for read and readdir.
  */
@@ -267,10 +277,23 @@ int
 emu_doread(struct emu_softc *sc, uint32_t handle, uint32_t len,
 	   uint32_t op, struct uio *uio)
 {
+	char *bounce = NULL;
+	uint32_t amt;
+	off_t newoffset;
 	int result;
 
 	KASSERT(uio->uio_rw == UIO_READ);
 
+	if (uio->uio_segflg != UIO_SYSSPACE) {
+		if (len > EMU_BOUNCESIZE) {
+			len = EMU_BOUNCESIZE;
+		}
+		bounce = kmalloc(len);
+		if (bounce == NULL) {
+			return ENOMEM;
+		}
+	}
+
 	lock_acquire(sc->e_lock);
 
 	emu_wreg(sc, REG_HANDLE, handle);
@@ -279,15 +302,29 @@ emu_doread(struct emu_softc *sc, uint32_t handle, uint32_t len,
 	emu_wreg(sc, REG_OPER, op);
 	result = emu_waitdone(sc);
 	if (result) {
+		lock_release(sc->e_lock);
 		goto out;
 	}
 
-	result = uiomove(sc->e_iobuf, emu_rreg(sc, REG_IOLEN), uio);
+	amt = emu_rreg(sc, REG_IOLEN);
+	newoffset = emu_rreg(sc, REG_OFFSET);
+	if (bounce == NULL) {
+		result = uiomove(sc->e_iobuf, amt, uio);
+		lock_release(sc->e_lock);
+	}
+	else {
+		KASSERT(amt <= len);
+		memcpy(bounce, sc->e_iobuf, amt);
+		lock_release(sc->e_lock);
+		result = uiomove(bounce, amt, uio);
+	}
 
-	uio->uio_offset = emu_rreg(sc, REG_OFFSET);
+	uio->uio_offset = newoffset;
 
  out:
-	lock_release(sc->e_lock);
+	if (bounce != NULL) {
+		kfree(bounce);
+	}
 	return result;
 }
 
@@ -321,26 +358,59 @@ int
 emu_write(struct emu_softc *sc, uint32_t handle, uint32_t len,
 	  struct uio *uio)
 {
+	char *bounce = NULL;
+	off_t offset;
 	int result;
 
 	KASSERT(uio->uio_rw == UIO_WRITE);
 
+	/*
+	 * Take the data from a user buffer before locking (see above),
+	 * but leave uio alone until the write has succeeded.
+	 */
+	offset = uio->uio_offset;
+	if (uio->uio_segflg != UIO_SYSSPACE) {
+		if (len > EMU_BOUNCESIZE) {
+			len = EMU_BOUNCESIZE;
+		}
+		bounce = kmalloc(len);
+		if (bounce == NULL) {
+			return ENOMEM;
+		}
+		result = uiopeek(bounce, len, uio);
+		if (result) {
+			kfree(bounce);
+			return result;
+		}
+	}
+
 	lock_acquire(sc->e_lock);
 
 	emu_wreg(sc, REG_HANDLE, handle);
 	emu_wreg(sc, REG_IOLEN, len);
-	emu_wreg(sc, REG_OFFSET, uio->uio_offset);
+	emu_wreg(sc, REG_OFFSET, offset);
 
-	result = uiomove(sc->e_iobuf, len, uio);
-	if (result) {
-		goto out;
+	if (bounce == NULL) {
+		result = uiomove(sc->e_iobuf, len, uio);
+		if (result) {
+			goto out;
+		}
+	}
+	else {
+		memcpy(sc->e_iobuf, bounce, len);
 	}
 
 	emu_wreg(sc, REG_OPER, EMU_OP_WRITE);
 	result = emu_waitdone(sc);
+	if (result == 0 && bounce != NULL) {
+		uioskip(len, uio);
+	}
 
  out:
 	lock_release(sc->e_lock);
+	if (bounce != NULL) {
+		kfree(bounce);
+	}
 	return result;
 }
 
@@ -472,24 +542,27 @@ emufs_reclaim(struct vnode *v)
 	int result;
 
 	/*
-	 * Need both of these locks, e_lock to protect the device
-	 * and vfs_biglock to protect the fs-related material.
+	 * e_lock protects both the device and the vnode table, and
+	 * emufs_loadvnode only hands out references while holding it.
 	 */
 
-	vfs_biglock_acquire();
 	lock_acquire(ef->ef_emu->e_lock);
 
-	if (ev->ev_v.vn_refcount != 1) {
+	spinlock_acquire(&v->vn_countlock);
+	if (v->vn_refcount != 1) {
+		/* consume the reference VOP_DECREF gave us */
+		KASSERT(v->vn_refcount > 1);
+		v->vn_refcount--;
+		spinlock_release(&v->vn_countlock);
 		lock_release(ef->ef_emu->e_lock);
-		vfs_biglock_release();
 		return EBUSY;
 	}
+	spinlock_release(&v->vn_countlock);
 
 	/* emu_close retries on I/O error */
 	result = emu_close(ev->ev_emu, ev->ev_handle);
 	if (result) {
 		lock_release(ef->ef_emu->e_lock);
-		vfs_biglock_release();
 		return result;
 	}
 
@@ -513,7 +586,6 @@ emufs_reclaim(struct vnode *v)
 	VOP_CLEANUP(&ev->ev_v);
 
 	lock_release(ef->ef_emu->e_lock);
-	vfs_biglock_release();
 
 	kfree(ev);
 	return 0;
@@ -837,13 +909,16 @@ emufs_namefile(struct vnode *v, struct uio *uio)
 
 /*
  * VOP_MMAP
+ *
+ * Files can be mapped; the VM system reads and writes their pages
+ * with emufs_read and emufs_write.
  */
 static
 int
 emufs_mmap(struct vnode *v)
 {
 	(void)v;
-	return EUNIMP;
+	return 0;
 }
 
 //////////////////////////////
@@ -1153,7 +1228,6 @@ emufs_loadvnode(struct emufs_fs *ef, uint32_t handle, int isdir,
 	unsigned i, num;
 	int result;
 
-	vfs_biglock_acquire();
 	lock_acquire(ef->ef_emu->e_lock);
 
 	num = vnodearray_num(ef->ef_vnodes);
@@ -1166,7 +1240,6 @@ emufs_loadvnode(struct emufs_fs *ef, uint32_t handle, int isdir,
 			VOP_INCREF(&ev->ev_v);
 
 			lock_release(ef->ef_emu->e_lock);
-			vfs_biglock_release();
 			*ret = ev;
 			return 0;
 		}
@@ -1187,7 +1260,6 @@ emufs_loadvnode(struct emufs_fs *ef, uint32_t handle, int isdir,
 			   &ef->ef_fs, ev);
 	if (result) {
 		lock_release(ef->ef_emu->e_lock);
-		vfs_biglock_release();
 		kfree(ev);
 		return result;
 	}
@@ -1197,13 +1269,11 @@ emufs_loadvnode(struct emufs_fs *ef, uint32_t handle, int isdir,
 		/* note: VOP_CLEANUP undoes VOP_INIT - it does not kfree */
 		VOP_CLEANUP(&ev->ev_v);
 		lock_release(ef->ef_emu->e_lock);
-		vfs_biglock_release();
 		kfree(ev);
 		return result;
 	}
 
 	lock_release(ef->ef_emu->e_lock);
-	vfs_biglock_release();
 
 	*ret = ev;
 	return 0;
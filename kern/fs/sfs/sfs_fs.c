@@ -39,9 +39,11 @@
 #include <array.h>
 #include <bitmap.h>
 #include <uio.h>
+#include <synch.h>
 #include <vfs.h>
 #include <device.h>
 #include <sfs.h>
+#include <buf.h>
 
 /* Shortcuts for the size macros in kern/sfs.h */
 #define SFS_FS_BITMAPSIZE(sfs)  SFS_BITMAPSIZE((sfs)->sfs_super.sp_nblocks)
@@ -111,11 +113,8 @@ int
 sfs_sync(struct fs *fs)
 {
 	struct sfs_fs *sfs;
-	unsigned i, num;
 	int result;
 
-	vfs_biglock_acquire();
-
 	/*
 	 * Get the sfs_fs from the generic abstract fs.
 	 *
@@ -148,18 +147,28 @@ sfs_sync(struct fs *fs)
 
 	sfs = fs->fs_data;
 
-	/* Go over the array of loaded vnodes, syncing as we go. */
-	num = vnodearray_num(sfs->sfs_vnodes);
-	for (i=0; i<num; i++) {
-		struct vnode *v = vnodearray_get(sfs->sfs_vnodes, i);
-		VOP_FSYNC(v);
+	/* Write the inodes of the loaded vnodes to the buffer cache. */
+	result = sfs_syncvnodes(sfs);
+	if (result) {
+		return result;
 	}
 
+	/*
+	 * Write back everything in the buffer cache: those inodes, the
+	 * ones of idle or unloaded files, directories, and data.
+	 */
+	result = buf_sync(sfs->sfs_device);
+	if (result) {
+		return result;
+	}
+
+	lock_acquire(sfs->sfs_freemaplock);
+
 	/* If the free block map needs to be written, write it. */
 	if (sfs->sfs_freemapdirty) {
 		result = sfs_mapio(sfs, UIO_WRITE);
 		if (result) {
-			vfs_biglock_release();
+			lock_release(sfs->sfs_freemaplock);
 			return result;
 		}
 		sfs->sfs_freemapdirty = false;
@@ -169,13 +178,13 @@ sfs_sync(struct fs *fs)
 	if (sfs->sfs_superdirty) {
 		result = sfs_wblock(sfs, &sfs->sfs_super, SFS_SB_LOCATION);
 		if (result) {
-			vfs_biglock_release();
+			lock_release(sfs->sfs_freemaplock);
 			return result;
 		}
 		sfs->sfs_superdirty = false;
 	}
 
-	vfs_biglock_release();
+	lock_release(sfs->sfs_freemaplock);
 	return 0;
 }
 
@@ -183,19 +192,16 @@ sfs_sync(struct fs *fs)
  * Routine to retrieve the volume name. Filesystems can be referred
  * to by their volume name followed by a colon as well as the name
  * of the device they're mounted on.
+ *
+ * The name is never changed after mount, so no lock is needed.
  */
 static
 const char *
 sfs_getvolname(struct fs *fs)
 {
 	struct sfs_fs *sfs = fs->fs_data;
-	const char *ret;
-
-	vfs_biglock_acquire();
-	ret = sfs->sfs_super.sp_volname;
-	vfs_biglock_release();
 
-	return ret;
+	return sfs->sfs_super.sp_volname;
 }
 
 /*
@@ -208,13 +214,17 @@ int
 sfs_unmount(struct fs *fs)
 {
 	struct sfs_fs *sfs = fs->fs_data;
+	int result;
 
-	vfs_biglock_acquire();
-
-	/* Do we have any files open? If so, can't unmount. */
-	if (vnodearray_num(sfs->sfs_vnodes) > 0) {
-		vfs_biglock_release();
-		return EBUSY;
+	/*
+	 * Do we have any files open? If so, can't unmount. Otherwise,
+	 * get rid of the idle vnodes. (The VFS layer's device table
+	 * lock keeps anyone from getting at the root to load more, so
+	 * once there are none there stay none.)
+	 */
+	result = sfs_dropvnodes(sfs);
+	if (result) {
+		return result;
 	}
 
 	/* We should have just had sfs_sync called. */
@@ -222,17 +232,20 @@ sfs_unmount(struct fs *fs)
 	KASSERT(sfs->sfs_freemapdirty == false);
 
 	/* Once we start nuking stuff we can't fail. */
-	vnodearray_destroy(sfs->sfs_vnodes);
 	bitmap_destroy(sfs->sfs_freemap);
 
+	/* The buffers for our blocks are clean, since we were synced. */
+	buf_purge(sfs->sfs_device);
+
 	/* The vfs layer takes care of the device for us */
 	(void)sfs->sfs_device;
 
 	/* Destroy the fs object */
+	lock_destroy(sfs->sfs_freemaplock);
+	lock_destroy(sfs->sfs_vnlock);
 	kfree(sfs);
 
 	/* nothing else to do */
-	vfs_biglock_release();
 	return 0;
 }
 
@@ -255,10 +268,9 @@ int
 sfs_domount(void *options, struct device *dev, struct fs **ret)
 {
 	int result;
+	unsigned i;
 	struct sfs_fs *sfs;
 
-	vfs_biglock_acquire();
-
 	/* We don't pass any options through mount */
 	(void)options;
 
@@ -278,24 +290,22 @@ sfs_domount(void *options, struct device *dev, struct fs **ret)
 	 * don't do that in sfs.)
 	 */
 	if (dev->d_blocksize != SFS_BLOCKSIZE) {
-		vfs_biglock_release();
 		return ENXIO;
 	}
 
 	/* Allocate object */
 	sfs = kmalloc(sizeof(struct sfs_fs));
 	if (sfs==NULL) {
-		vfs_biglock_release();
 		return ENOMEM;
 	}
 
-	/* Allocate array */
-	sfs->sfs_vnodes = vnodearray_create();
-	if (sfs->sfs_vnodes == NULL) {
-		kfree(sfs);
-		vfs_biglock_release();
-		return ENOMEM;
+	/* No vnodes loaded yet */
+	for (i=0; i<SFS_VNHASHSIZE; i++) {
+		sfs->sfs_vnhash[i] = NULL;
 	}
+	sfs->sfs_nvnodes = 0;
+	sfs->sfs_lruhead = sfs->sfs_lrutail = NULL;
+	sfs->sfs_nidle = 0;
 
 	/* Set the device so we can use sfs_rblock() */
 	sfs->sfs_device = dev;
@@ -303,9 +313,7 @@ sfs_domount(void *options, struct device *dev, struct fs **ret)
 	/* Load superblock */
 	result = sfs_rblock(sfs, &sfs->sfs_super, SFS_SB_LOCATION);
 	if (result) {
-		vnodearray_destroy(sfs->sfs_vnodes);
 		kfree(sfs);
-		vfs_biglock_release();
 		return result;
 	}
 
@@ -316,9 +324,7 @@ sfs_domount(void *options, struct device *dev, struct fs **ret)
 			"(0x%x, should be 0x%x)\n",
 			sfs->sfs_super.sp_magic,
 			SFS_MAGIC);
-		vnodearray_destroy(sfs->sfs_vnodes);
 		kfree(sfs);
-		vfs_biglock_release();
 		return EINVAL;
 	}
 
@@ -333,20 +339,31 @@ sfs_domount(void *options, struct device *dev, struct fs **ret)
 	/* Load free space bitmap */
 	sfs->sfs_freemap = bitmap_create(SFS_FS_BITMAPSIZE(sfs));
 	if (sfs->sfs_freemap == NULL) {
-		vnodearray_destroy(sfs->sfs_vnodes);
 		kfree(sfs);
-		vfs_biglock_release();
 		return ENOMEM;
 	}
 	result = sfs_mapio(sfs, UIO_READ);
 	if (result) {
 		bitmap_destroy(sfs->sfs_freemap);
-		vnodearray_destroy(sfs->sfs_vnodes);
 		kfree(sfs);
-		vfs_biglock_release();
 		return result;
 	}
 
+	/* Make the locks. (Until we return, nobody else can see the fs.) */
+	sfs->sfs_vnlock = lock_create("sfs_vnlock");
+	sfs->sfs_freemaplock = lock_create("sfs_freemaplock");
+	if (sfs->sfs_vnlock == NULL || sfs->sfs_freemaplock == NULL) {
+		if (sfs->sfs_vnlock != NULL) {
+			lock_destroy(sfs->sfs_vnlock);
+		}
+		if (sfs->sfs_freemaplock != NULL) {
+			lock_destroy(sfs->sfs_freemaplock);
+		}
+		bitmap_destroy(sfs->sfs_freemap);
+		kfree(sfs);
+		return ENOMEM;
+	}
+
 	/* Set up abstract fs calls */
 	sfs->sfs_absfs.fs_sync = sfs_sync;
 	sfs->sfs_absfs.fs_getvolname = sfs_getvolname;
@@ -361,7 +378,6 @@ sfs_domount(void *options, struct device *dev, struct fs **ret)
 	/* Hand back the abstract fs */
 	*ret = &sfs->sfs_absfs;
 
-	vfs_biglock_release();
 	return 0;
 }
 
@@ -43,6 +43,11 @@
 // early in mount, before sfs is fully (or even mostly)
 // initialized, and so may not use anything from sfs
 // except sfs_device.
+//
+// Only the superblock and free block bitmap are read and
+// written with these; inodes, indirect blocks, directories,
+// and file data go through the buffer cache (buf.h). After
+// mount, callers hold sfs_freemaplock.
 
 int
 sfs_rwblock(struct sfs_fs *sfs, struct uio *uio)
@@ -50,8 +55,6 @@ sfs_rwblock(struct sfs_fs *sfs, struct uio *uio)
 	int result;
 	int tries=0;
 
-	KASSERT(vfs_biglock_do_i_hold());
-
 	DEBUG(DB_SFS, "sfs: %s %llu\n",
 	      uio->uio_rw == UIO_READ ? "read" : "write",
 	      uio->uio_offset / SFS_BLOCKSIZE);
@@ -44,6 +44,39 @@
 #include <vfs.h>
 #include <device.h>
 #include <sfs.h>
+#include <buf.h>
+#include <kmem_cache.h>
+
+/*
+ * In-memory vnodes come from an object cache. The constructor makes
+ * the vnode's lock, which stays with it while it's in the cache;
+ * sfs_loadvnode fills in everything else.
+ */
+static
+int
+sfs_vnode_ctor(void *obj)
+{
+	struct sfs_vnode *sv = obj;
+
+	sv->sv_lock = lock_create("sfs_vnode");
+	if (sv->sv_lock == NULL) {
+		return ENOMEM;
+	}
+	return 0;
+}
+
+static
+void
+sfs_vnode_dtor(void *obj)
+{
+	struct sfs_vnode *sv = obj;
+
+	lock_destroy(sv->sv_lock);
+}
+
+static struct kmem_cache sfs_vnode_cache =
+	KMEM_CACHE_INITIALIZER("sfs_vnode", sizeof(struct sfs_vnode),
+			       sfs_vnode_ctor, sfs_vnode_dtor);
 
 /* At bottom of file */
 static int sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int type,
@@ -53,27 +86,46 @@ static int sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int type,
 //
 // Simple stuff
 
-/* Zero out a disk block. */
+/* Zero out a disk block (in the buffer cache). */
 static
 int
 sfs_clearblock(struct sfs_fs *sfs, uint32_t block)
 {
-	/* static -> automatically initialized to zero */
-	static char zeros[SFS_BLOCKSIZE];
-	return sfs_wblock(sfs, zeros, block);
+	struct buf *b;
+	int result;
+
+	result = buf_get(sfs->sfs_device, block, &b);
+	if (result) {
+		return result;
+	}
+	bzero(buf_data(b), SFS_BLOCKSIZE);
+	buf_markdirty(b);
+	buf_release(b);
+	return 0;
 }
 
-/* Write an on-disk inode structure back out to disk. */
+/*
+ * Write an on-disk inode structure back to its block in the buffer
+ * cache, from which buf_sync or eviction will write it to disk.
+ */
 static
 int
 sfs_sync_inode(struct sfs_vnode *sv)
 {
+	KASSERT(lock_do_i_hold(sv->sv_lock));
+
 	if (sv->sv_dirty) {
 		struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
-		int result = sfs_wblock(sfs, &sv->sv_i, sv->sv_ino);
+		struct buf *b;
+		int result;
+
+		result = buf_get(sfs->sfs_device, sv->sv_ino, &b);
 		if (result) {
 			return result;
 		}
+		memcpy(buf_data(b), &sv->sv_i, SFS_BLOCKSIZE);
+		buf_markdirty(b);
+		buf_release(b);
 		sv->sv_dirty = false;
 	}
 	return 0;
@@ -85,6 +137,9 @@ sfs_sync_inode(struct sfs_vnode *sv)
 
 /*
  * Allocate a block.
+ *
+ * The free map lock is only held for the bitmap itself; nothing else
+ * can use the block until we hand it back.
  */
 static
 int
@@ -92,11 +147,14 @@ sfs_balloc(struct sfs_fs *sfs, uint32_t *diskblock)
 {
 	int result;
 
+	lock_acquire(sfs->sfs_freemaplock);
 	result = bitmap_alloc(sfs->sfs_freemap, diskblock);
 	if (result) {
+		lock_release(sfs->sfs_freemaplock);
 		return result;
 	}
 	sfs->sfs_freemapdirty = true;
+	lock_release(sfs->sfs_freemaplock);
 
 	if (*diskblock >= sfs->sfs_super.sp_nblocks) {
 		panic("sfs: balloc: invalid block %u\n", *diskblock);
@@ -113,8 +171,13 @@ static
 void
 sfs_bfree(struct sfs_fs *sfs, uint32_t diskblock)
 {
+	lock_acquire(sfs->sfs_freemaplock);
 	bitmap_unmark(sfs->sfs_freemap, diskblock);
 	sfs->sfs_freemapdirty = true;
+	lock_release(sfs->sfs_freemaplock);
+
+	/* Whatever was in the block doesn't need writing any more */
+	buf_forget(sfs->sfs_device, diskblock);
 }
 
 /*
@@ -124,11 +187,16 @@ static
 int
 sfs_bused(struct sfs_fs *sfs, uint32_t diskblock)
 {
+	int ret;
+
 	if (diskblock >= sfs->sfs_super.sp_nblocks) {
 		panic("sfs: sfs_bused called on out of range block %u\n",
 		      diskblock);
 	}
-	return bitmap_isset(sfs->sfs_freemap, diskblock);
+	lock_acquire(sfs->sfs_freemaplock);
+	ret = bitmap_isset(sfs->sfs_freemap, diskblock);
+	lock_release(sfs->sfs_freemaplock);
+	return ret;
 }
 
 ////////////////////////////////////////////////////////////
@@ -146,22 +214,15 @@ int
 sfs_bmap(struct sfs_vnode *sv, uint32_t fileblock, int doalloc,
 	 uint32_t *diskblock)
 {
-	/*
-	 * I/O buffer for handling indirect blocks.
-	 *
-	 * Note: in real life (and when you've done the fs assignment)
-	 * you would get space from the disk buffer cache for this,
-	 * not use a static area.
-	 */
-	static uint32_t idbuf[SFS_DBPERIDB];
-
 	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
+	struct buf *idb;
+	uint32_t *idbuf;
 	uint32_t block;
 	uint32_t idblock;
 	uint32_t idnum, idoff;
 	int result;
 
-	KASSERT(sizeof(idbuf)==SFS_BLOCKSIZE);
+	KASSERT(SFS_DBPERIDB * sizeof(uint32_t) == SFS_BLOCKSIZE);
 
 	/*
 	 * If the block we want is one of the direct blocks...
@@ -247,18 +308,15 @@ sfs_bmap(struct sfs_vnode *sv, uint32_t fileblock, int doalloc,
 		/* Mark the inode dirty */
 		sv->sv_dirty = true;
 
-		/* Clear the indirect block buffer */
-		bzero(idbuf, sizeof(idbuf));
+		/* (sfs_balloc left the new block zeroed in the cache) */
 	}
-	else {
-		/*
-		 * We already have an indirect block allocated; load it.
-		 */
-		result = sfs_rblock(sfs, idbuf, idblock);
-		if (result) {
-			return result;
-		}
+
+	/* Get the indirect block from the buffer cache */
+	result = buf_read(sfs->sfs_device, idblock, &idb);
+	if (result) {
+		return result;
 	}
+	idbuf = buf_data(idb);
 
 	/* Get the block out of the indirect block buffer */
 	block = idbuf[idoff];
@@ -267,18 +325,15 @@ sfs_bmap(struct sfs_vnode *sv, uint32_t fileblock, int doalloc,
 	if (block==0 && doalloc) {
 		result = sfs_balloc(sfs, &block);
 		if (result) {
+			buf_release(idb);
 			return result;
 		}
 
-		/* Remember the block we allocated */
+		/* Remember the block we allocated; the indirect block is dirty */
 		idbuf[idoff] = block;
-
-		/* The indirect block is now dirty; write it back */
-		result = sfs_wblock(sfs, idbuf, idblock);
-		if (result) {
-			return result;
-		}
+		buf_markdirty(idb);
 	}
+	buf_release(idb);
 
 	/* Hand back the result and return. */
 	if (block != 0 && !sfs_bused(sfs, block)) {
@@ -289,15 +344,106 @@ sfs_bmap(struct sfs_vnode *sv, uint32_t fileblock, int doalloc,
 	return 0;
 }
 
+/*
+ * Truncate (or extend) a file to LEN bytes. For sfs_truncate and
+ * sfs_reclaim, which hold the vnode's lock.
+ */
+static
+int
+sfs_itrunc(struct sfs_vnode *sv, off_t len)
+{
+	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
+	struct buf *idb;
+	uint32_t *idbuf;
+
+	/* Length in blocks (divide rounding up) */
+	uint32_t blocklen = DIVROUNDUP(len, SFS_BLOCKSIZE);
+
+	uint32_t i, j, block;
+	uint32_t idblock, baseblock, highblock;
+	int result;
+	int hasnonzero, iddirty;
+
+	KASSERT(lock_do_i_hold(sv->sv_lock));
+
+	/*
+	 * Go through the direct blocks. Discard any that are
+	 * past the limit we're truncating to.
+	 */
+	for (i=0; i<SFS_NDIRECT; i++) {
+		block = sv->sv_i.sfi_direct[i];
+		if (i >= blocklen && block != 0) {
+			sfs_bfree(sfs, block);
+			sv->sv_i.sfi_direct[i] = 0;
+			sv->sv_dirty = true;
+		}
+	}
+
+	/* Indirect block number */
+	idblock = sv->sv_i.sfi_indirect;
+
+	/* The lowest block in the indirect block */
+	baseblock = SFS_NDIRECT;
+
+	/* The highest block in the indirect block */
+	highblock = baseblock + SFS_DBPERIDB - 1;
+
+	if (blocklen < highblock && idblock != 0) {
+		/* We're past the proposed EOF; may need to free stuff */
+
+		/* Get the indirect block */
+		result = buf_read(sfs->sfs_device, idblock, &idb);
+		if (result) {
+			return result;
+		}
+		idbuf = buf_data(idb);
+
+		hasnonzero = 0;
+		iddirty = 0;
+		for (j=0; j<SFS_DBPERIDB; j++) {
+			/* Discard any blocks that are past the new EOF */
+			if (blocklen < baseblock+j && idbuf[j] != 0) {
+				sfs_bfree(sfs, idbuf[j]);
+				idbuf[j] = 0;
+				iddirty = 1;
+			}
+			/* Remember if we see any nonzero blocks in here */
+			if (idbuf[j]!=0) {
+				hasnonzero=1;
+			}
+		}
+
+		if (iddirty) {
+			buf_markdirty(idb);
+		}
+		buf_release(idb);
+
+		if (!hasnonzero) {
+			/* The whole indirect block is empty now; free it */
+			sfs_bfree(sfs, idblock);
+			sv->sv_i.sfi_indirect = 0;
+			sv->sv_dirty = true;
+		}
+	}
+
+	/* Set the file size */
+	sv->sv_i.sfi_size = len;
+
+	/* Mark the inode dirty */
+	sv->sv_dirty = true;
+
+	return 0;
+}
+
 ////////////////////////////////////////////////////////////
 //
 // File-level I/O
 
 /*
- * Do I/O to a block of a file that doesn't cover the whole block.  We
- * need to read in the original block first, even if we're writing, so
- * we don't clobber the portion of the block we're not intending to
- * write over.
+ * Do I/O to part or all of a block of a file, through the buffer
+ * cache. Unless we're going to overwrite the whole block, we need the
+ * original block first, even if we're writing, so we don't clobber
+ * the portion of the block we're not intending to write over.
  *
  * skipstart is the number of bytes to skip past at the beginning of
  * the sector; len is the number of bytes to actually read or write.
@@ -308,16 +454,8 @@ int
 sfs_partialio(struct sfs_vnode *sv, struct uio *uio,
 	      uint32_t skipstart, uint32_t len)
 {
-	/*
-	 * I/O buffer for handling partial sectors.
-	 *
-	 * Note: in real life (and when you've done the fs assignment)
-	 * you would get space from the disk buffer cache for this,
-	 * not use a static area.
-	 */
-	static char iobuf[SFS_BLOCKSIZE];
-
 	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
+	struct buf *b;
 	uint32_t diskblock;
 	uint32_t fileblock;
 	int result;
@@ -338,41 +476,45 @@ sfs_partialio(struct sfs_vnode *sv, struct uio *uio,
 
 	if (diskblock == 0) {
 		/*
-		 * There was no block mapped at this point in the file.
-		 * Zero the buffer.
+		 * There was no block mapped at this point in the file,
+		 * so it reads as zeros.
 		 */
 		KASSERT(uio->uio_rw == UIO_READ);
-		bzero(iobuf, sizeof(iobuf));
-	}
-	else {
-		/*
-		 * Read the block.
-		 */
-		result = sfs_rblock(sfs, iobuf, diskblock);
-		if (result) {
-			return result;
-		}
+		return uiomovezeros(len, uio);
 	}
 
 	/*
-	 * Now perform the requested operation into/out of the buffer.
+	 * Get the block, or just a buffer for it if we're about to
+	 * write over all of it.
 	 */
-	result = uiomove(iobuf+skipstart, len, uio);
+	if (uio->uio_rw == UIO_WRITE && len == SFS_BLOCKSIZE) {
+		result = buf_get(sfs->sfs_device, diskblock, &b);
+	}
+	else {
+		result = buf_read(sfs->sfs_device, diskblock, &b);
+	}
 	if (result) {
 		return result;
 	}
 
 	/*
-	 * If it was a write, write back the modified block.
+	 * Now perform the requested operation into/out of the buffer.
 	 */
-	if (uio->uio_rw == UIO_WRITE) {
-		result = sfs_wblock(sfs, iobuf, diskblock);
-		if (result) {
-			return result;
-		}
+	result = uiomove((char *)buf_data(b) + skipstart, len, uio);
+
+	/*
+	 * If it was a write, the buffer is dirty; it gets written back
+	 * later. If uiomove failed part way, part of the buffer may
+	 * have changed, which is still a write if the buffer held the
+	 * block; but one from buf_get that didn't still has some other
+	 * block's data in the rest, so it's just thrown away.
+	 */
+	if (uio->uio_rw == UIO_WRITE && (result == 0 || buf_valid(b))) {
+		buf_markdirty(b);
 	}
+	buf_release(b);
 
-	return 0;
+	return result;
 }
 
 /*
@@ -382,62 +524,8 @@ static
 int
 sfs_blockio(struct sfs_vnode *sv, struct uio *uio)
 {
-	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
-	uint32_t diskblock;
-	uint32_t fileblock;
-	int result;
-	int doalloc = (uio->uio_rw==UIO_WRITE);
-	off_t saveoff;
-	off_t diskoff;
-	off_t saveres;
-	off_t diskres;
-
-	/* Get the block number within the file */
-	fileblock = uio->uio_offset / SFS_BLOCKSIZE;
-
-	/* Look up the disk block number */
-	result = sfs_bmap(sv, fileblock, doalloc, &diskblock);
-	if (result) {
-		return result;
-	}
-
-	if (diskblock == 0) {
-		/*
-		 * No block - fill with zeros.
-		 *
-		 * We must be reading, or sfs_bmap would have
-		 * allocated a block for us.
-		 */
-		KASSERT(uio->uio_rw == UIO_READ);
-		return uiomovezeros(SFS_BLOCKSIZE, uio);
-	}
-
-	/*
-	 * Do the I/O directly to the uio region. Save the uio_offset,
-	 * and substitute one that makes sense to the device.
-	 */
-	saveoff = uio->uio_offset;
-	diskoff = diskblock * SFS_BLOCKSIZE;
-	uio->uio_offset = diskoff;
-
-	/*
-	 * Temporarily set the residue to be one block size.
-	 */
 	KASSERT(uio->uio_resid >= SFS_BLOCKSIZE);
-	saveres = uio->uio_resid;
-	diskres = SFS_BLOCKSIZE;
-	uio->uio_resid = diskres;
-
-	result = sfs_rwblock(sfs, uio);
-
-	/*
-	 * Now, restore the original uio_offset and uio_resid and update
-	 * them by the amount of I/O done.
-	 */
-	uio->uio_offset = (uio->uio_offset - diskoff) + saveoff;
-	uio->uio_resid = (uio->uio_resid - diskres) + saveres;
-
-	return result;
+	return sfs_partialio(sv, uio, 0, SFS_BLOCKSIZE);
 }
 
 /*
@@ -541,6 +629,85 @@ sfs_io(struct sfs_vnode *sv, struct uio *uio)
 	return result;
 }
 
+/*
+ * Do sfs_io for read() or write(), holding sv_lock.
+ *
+ * Touching a user buffer can fault, and the fault can need to read a
+ * mapped file or program text, which might be this very file. So the
+ * lock is never held while a user buffer is copied: that I/O goes
+ * through a kernel buffer a chunk at a time, with the lock held only
+ * while moving data between that and the file.
+ */
+static
+int
+sfs_fileio(struct sfs_vnode *sv, struct uio *uio)
+{
+	struct iovec iov;
+	struct uio ku;
+	char *bounce;
+	size_t len, done;
+	int result = 0;
+
+	if (uio->uio_segflg == UIO_SYSSPACE) {
+		lock_acquire(sv->sv_lock);
+		result = sfs_io(sv, uio);
+		lock_release(sv->sv_lock);
+		return result;
+	}
+
+	bounce = kmalloc(SFS_BOUNCESIZE);
+	if (bounce == NULL) {
+		return ENOMEM;
+	}
+
+	while (uio->uio_resid > 0) {
+		len = uio->uio_resid;
+		if (len > SFS_BOUNCESIZE) {
+			len = SFS_BOUNCESIZE;
+		}
+
+		if (uio->uio_rw == UIO_WRITE) {
+			/*
+			 * Take the data first, but only advance uio by
+			 * what sfs_io actually wrote.
+			 */
+			uio_kinit(&iov, &ku, bounce, len, uio->uio_offset,
+				  UIO_WRITE);
+			result = uiopeek(bounce, len, uio);
+			if (result) {
+				break;
+			}
+			lock_acquire(sv->sv_lock);
+			result = sfs_io(sv, &ku);
+			lock_release(sv->sv_lock);
+			done = len - ku.uio_resid;
+			uioskip(done, uio);
+			if (result || done < len) {
+				break;
+			}
+		}
+		else {
+			uio_kinit(&iov, &ku, bounce, len, uio->uio_offset,
+				  UIO_READ);
+			lock_acquire(sv->sv_lock);
+			result = sfs_io(sv, &ku);
+			lock_release(sv->sv_lock);
+			if (result) {
+				break;
+			}
+			done = len - ku.uio_resid;
+			result = uiomove(bounce, done, uio);
+			if (result || done < len) {
+				/* fault, or end of file */
+				break;
+			}
+		}
+	}
+
+	kfree(bounce);
+	return result;
+}
+
 ////////////////////////////////////////////////////////////
 //
 // Directory I/O
@@ -813,6 +980,210 @@ sfs_makeobj(struct sfs_fs *sfs, int type, struct sfs_vnode **ret)
 	return sfs_loadvnode(sfs, ino, type, ret);
 }
 
+////////////////////////////////////////////////////////////
+//
+// Vnode table; call with sfs_vnlock held
+
+static
+unsigned
+sfs_vnhashfn(uint32_t ino)
+{
+	return ino % SFS_VNHASHSIZE;
+}
+
+/*
+ * Find a loaded vnode by inode number.
+ */
+static
+struct sfs_vnode *
+sfs_vnfind(struct sfs_fs *sfs, uint32_t ino)
+{
+	struct sfs_vnode *sv;
+
+	KASSERT(lock_do_i_hold(sfs->sfs_vnlock));
+
+	for (sv = sfs->sfs_vnhash[sfs_vnhashfn(ino)]; sv != NULL;
+	     sv = sv->sv_hashnext) {
+		if (sv->sv_ino == ino) {
+			return sv;
+		}
+	}
+	return NULL;
+}
+
+static
+void
+sfs_vninsert(struct sfs_fs *sfs, struct sfs_vnode *sv)
+{
+	unsigned h = sfs_vnhashfn(sv->sv_ino);
+
+	KASSERT(lock_do_i_hold(sfs->sfs_vnlock));
+
+	sv->sv_hashnext = sfs->sfs_vnhash[h];
+	sfs->sfs_vnhash[h] = sv;
+	sfs->sfs_nvnodes++;
+}
+
+static
+void
+sfs_vnremove(struct sfs_fs *sfs, struct sfs_vnode *sv)
+{
+	struct sfs_vnode **svp;
+
+	KASSERT(lock_do_i_hold(sfs->sfs_vnlock));
+
+	for (svp = &sfs->sfs_vnhash[sfs_vnhashfn(sv->sv_ino)]; *svp != sv;
+	     svp = &(*svp)->sv_hashnext) {
+		if (*svp == NULL) {
+			panic("sfs: vnode %u not in vnode table\n",
+			      sv->sv_ino);
+		}
+	}
+	*svp = sv->sv_hashnext;
+	sv->sv_hashnext = NULL;
+	KASSERT(sfs->sfs_nvnodes > 0);
+	sfs->sfs_nvnodes--;
+}
+
+/*
+ * Put a vnode whose last reference has gone away at the end of the
+ * idle list.
+ */
+static
+void
+sfs_lruappend(struct sfs_fs *sfs, struct sfs_vnode *sv)
+{
+	KASSERT(!sv->sv_idle);
+
+	sv->sv_lruprev = sfs->sfs_lrutail;
+	sv->sv_lrunext = NULL;
+	if (sfs->sfs_lrutail != NULL) {
+		sfs->sfs_lrutail->sv_lrunext = sv;
+	}
+	else {
+		sfs->sfs_lruhead = sv;
+	}
+	sfs->sfs_lrutail = sv;
+	sv->sv_idle = true;
+	sfs->sfs_nidle++;
+}
+
+static
+void
+sfs_lruremove(struct sfs_fs *sfs, struct sfs_vnode *sv)
+{
+	KASSERT(sv->sv_idle);
+
+	if (sv->sv_lruprev != NULL) {
+		sv->sv_lruprev->sv_lrunext = sv->sv_lrunext;
+	}
+	else {
+		sfs->sfs_lruhead = sv->sv_lrunext;
+	}
+	if (sv->sv_lrunext != NULL) {
+		sv->sv_lrunext->sv_lruprev = sv->sv_lruprev;
+	}
+	else {
+		sfs->sfs_lrutail = sv->sv_lruprev;
+	}
+	sv->sv_lruprev = sv->sv_lrunext = NULL;
+	sv->sv_idle = false;
+	KASSERT(sfs->sfs_nidle > 0);
+	sfs->sfs_nidle--;
+}
+
+/*
+ * Take a vnode out of the table and free it. Its inode must already
+ * be synced (or freed), and nobody may have a reference to it but us.
+ */
+static
+void
+sfs_vndestroy(struct sfs_fs *sfs, struct sfs_vnode *sv)
+{
+	KASSERT(!sv->sv_dirty);
+
+	if (sv->sv_idle) {
+		sfs_lruremove(sfs, sv);
+	}
+	sfs_vnremove(sfs, sv);
+	VOP_CLEANUP(&sv->sv_v);
+	kmem_cache_free(&sfs_vnode_cache, sv);
+}
+
+/*
+ * Write the inodes of all the vnodes in use back to the buffer cache,
+ * for sfs_sync. (Idle vnodes were synced when they went idle.)
+ *
+ * Syncing an inode takes its vnode's lock, which comes before
+ * sfs_vnlock, so get a reference to each vnode first and do them
+ * after letting go of the table.
+ */
+int
+sfs_syncvnodes(struct sfs_fs *sfs)
+{
+	struct vnodearray *vnodes;
+	struct sfs_vnode *sv;
+	unsigned h, i, num;
+	int result, err = 0;
+
+	vnodes = vnodearray_create();
+	if (vnodes == NULL) {
+		return ENOMEM;
+	}
+
+	lock_acquire(sfs->sfs_vnlock);
+	for (h=0; err == 0 && h<SFS_VNHASHSIZE; h++) {
+		for (sv = sfs->sfs_vnhash[h]; sv != NULL; sv = sv->sv_hashnext) {
+			if (sv->sv_idle) {
+				continue;
+			}
+			result = vnodearray_add(vnodes, &sv->sv_v, NULL);
+			if (result) {
+				err = result;
+				break;
+			}
+			VOP_INCREF(&sv->sv_v);
+		}
+	}
+	lock_release(sfs->sfs_vnlock);
+
+	num = vnodearray_num(vnodes);
+	for (i=0; i<num; i++) {
+		sv = vnodearray_get(vnodes, i)->vn_data;
+		lock_acquire(sv->sv_lock);
+		result = sfs_sync_inode(sv);
+		lock_release(sv->sv_lock);
+		if (result && err == 0) {
+			err = result;
+		}
+		VOP_DECREF(&sv->sv_v);
+	}
+	vnodearray_setsize(vnodes, 0);
+	vnodearray_destroy(vnodes);
+
+	return err;
+}
+
+/*
+ * Throw out all the idle vnodes, for unmount. Fails with EBUSY, and
+ * leaves everything alone, if any vnode is still in use.
+ */
+int
+sfs_dropvnodes(struct sfs_fs *sfs)
+{
+	lock_acquire(sfs->sfs_vnlock);
+	if (sfs->sfs_nvnodes > sfs->sfs_nidle) {
+		lock_release(sfs->sfs_vnlock);
+		return EBUSY;
+	}
+	while (sfs->sfs_lruhead != NULL) {
+		sfs_vndestroy(sfs, sfs->sfs_lruhead);
+	}
+	KASSERT(sfs->sfs_nvnodes == 0);
+	lock_release(sfs->sfs_vnlock);
+	return 0;
+}
+
 ////////////////////////////////////////////////////////////
 //
 // Vnode ops
@@ -882,6 +1253,10 @@ sfs_close(struct vnode *v)
 /*
  * Called when the vnode refcount (in-memory usage count) hits zero.
  *
+ * If the file still exists, the vnode goes on the idle list (see
+ * sfs.h) instead of being freed, keeping the reference we were given;
+ * otherwise the file is erased and the vnode freed.
+ *
  * This function should try to avoid returning errors other than EBUSY.
  */
 static
@@ -890,77 +1265,85 @@ sfs_reclaim(struct vnode *v)
 {
 	struct sfs_vnode *sv = v->vn_data;
 	struct sfs_fs *sfs = v->vn_fs->fs_data;
-	unsigned ix, i, num;
 	int result;
 
-	vfs_biglock_acquire();
+	lock_acquire(sv->sv_lock);
+	lock_acquire(sfs->sfs_vnlock);
 
 	/*
 	 * Make sure someone else hasn't picked up the vnode since the
-	 * decision was made to reclaim it. (You must also synchronize
-	 * this with sfs_loadvnode.)
+	 * decision was made to reclaim it. sfs_loadvnode only hands
+	 * out references with sfs_vnlock held, so once we have that
+	 * the count can't go up behind our back.
 	 */
+	spinlock_acquire(&v->vn_countlock);
 	if (v->vn_refcount != 1) {
 
 		/* consume the reference VOP_DECREF gave us */
 		KASSERT(v->vn_refcount>1);
 		v->vn_refcount--;
 
-		vfs_biglock_release();
+		spinlock_release(&v->vn_countlock);
+		lock_release(sfs->sfs_vnlock);
+		lock_release(sv->sv_lock);
 		return EBUSY;
 	}
+	spinlock_release(&v->vn_countlock);
+	KASSERT(!sv->sv_idle);
 
 	/* If there are no on-disk references to the file either, erase it. */
 	if (sv->sv_i.sfi_linkcount==0) {
-		result = VOP_TRUNCATE(&sv->sv_v, 0);
+		result = sfs_itrunc(sv, 0);
 		if (result) {
-			vfs_biglock_release();
+			lock_release(sfs->sfs_vnlock);
+			lock_release(sv->sv_lock);
 			return result;
 		}
 	}
 
-	/* Sync the inode to disk */
+	/*
+	 * Sync the inode to disk. This has to happen before the vnode
+	 * leaves the table, or someone could load the inode again from
+	 * the old copy.
+	 */
 	result = sfs_sync_inode(sv);
 	if (result) {
-		vfs_biglock_release();
+		lock_release(sfs->sfs_vnlock);
+		lock_release(sv->sv_lock);
 		return result;
 	}
 
-	/* If there are no on-disk references, discard the inode */
-	if (sv->sv_i.sfi_linkcount==0) {
-		sfs_bfree(sfs, sv->sv_ino);
-	}
-
-	/* Remove the vnode structure from the table in the struct sfs_fs. */
-	num = vnodearray_num(sfs->sfs_vnodes);
-	ix = num;
-	for (i=0; i<num; i++) {
-		struct vnode *v2 = vnodearray_get(sfs->sfs_vnodes, i);
-		struct sfs_vnode *sv2 = v2->vn_data;
-		if (sv2 == sv) {
-			ix = i;
-			break;
+	if (sv->sv_i.sfi_linkcount > 0) {
+		/* Keep it around, making room if there are too many. */
+		sfs_lruappend(sfs, sv);
+		if (sfs->sfs_nidle > SFS_VNIDLEMAX) {
+			/*
+			 * Nobody can be using the oldest one, or even
+			 * holding its lock, since it's idle and we have
+			 * the table.
+			 */
+			KASSERT(sfs->sfs_lruhead != sv);
+			sfs_vndestroy(sfs, sfs->sfs_lruhead);
 		}
+		lock_release(sfs->sfs_vnlock);
+		lock_release(sv->sv_lock);
+		return 0;
 	}
-	if (ix == num) {
-		panic("sfs: reclaim vnode %u not in vnode pool\n",
-		      sv->sv_ino);
-	}
-	vnodearray_remove(sfs->sfs_vnodes, ix);
 
-	VOP_CLEANUP(&sv->sv_v);
+	/* There are no on-disk references, so discard the inode */
+	sfs_bfree(sfs, sv->sv_ino);
 
-	vfs_biglock_release();
-
-	/* Release the storage for the vnode structure itself. */
-	kfree(sv);
+	/* The lock goes back to the cache with the vnode, so let go first. */
+	lock_release(sv->sv_lock);
+	sfs_vndestroy(sfs, sv);
+	lock_release(sfs->sfs_vnlock);
 
 	/* Done */
 	return 0;
 }
 
 /*
- * Called for read(). sfs_io() does the work.
+ * Called for read(). sfs_fileio() does the work.
  */
 static
 int
@@ -971,15 +1354,13 @@ sfs_read(struct vnode *v, struct uio *uio)
 
 	KASSERT(uio->uio_rw==UIO_READ);
 
-	vfs_biglock_acquire();
-	result = sfs_io(sv, uio);
-	vfs_biglock_release();
+	result = sfs_fileio(sv, uio);
 
 	return result;
 }
 
 /*
- * Called for write(). sfs_io() does the work.
+ * Called for write(). sfs_fileio() does the work.
  */
 static
 int
@@ -990,9 +1371,7 @@ sfs_write(struct vnode *v, struct uio *uio)
 
 	KASSERT(uio->uio_rw==UIO_WRITE);
 
-	vfs_biglock_acquire();
-	result = sfs_io(sv, uio);
-	vfs_biglock_release();
+	result = sfs_fileio(sv, uio);
 
 	return result;
 }
@@ -1033,7 +1412,9 @@ sfs_stat(struct vnode *v, struct stat *statbuf)
 		return result;
 	}
 
+	lock_acquire(sv->sv_lock);
 	statbuf->st_size = sv->sv_i.sfi_size;
+	lock_release(sv->sv_lock);
 
 	/* We don't support these yet; you get to implement them */
 	statbuf->st_nlink = 0;
@@ -1046,6 +1427,8 @@ sfs_stat(struct vnode *v, struct stat *statbuf)
 
 /*
  * Return the type of the file (types as per kern/stat.h)
+ *
+ * The type doesn't change once the vnode is loaded, so no lock.
  */
 static
 int
@@ -1053,16 +1436,12 @@ sfs_gettype(struct vnode *v, uint32_t *ret)
 {
 	struct sfs_vnode *sv = v->vn_data;
 
-	vfs_biglock_acquire();
-
 	switch (sv->sv_i.sfi_type) {
 	case SFS_TYPE_FILE:
 		*ret = S_IFREG;
-		vfs_biglock_release();
 		return 0;
 	case SFS_TYPE_DIR:
 		*ret = S_IFDIR;
-		vfs_biglock_release();
 		return 0;
 	}
 	panic("sfs: gettype: Invalid inode type (inode %u, type %u)\n",
@@ -1100,128 +1479,48 @@ int
 sfs_fsync(struct vnode *v)
 {
 	struct sfs_vnode *sv = v->vn_data;
+	struct sfs_fs *sfs = v->vn_fs->fs_data;
 	int result;
 
-	vfs_biglock_acquire();
+	lock_acquire(sv->sv_lock);
 	result = sfs_sync_inode(sv);
-	vfs_biglock_release();
+	lock_release(sv->sv_lock);
+	if (result) {
+		return result;
+	}
 
-	return result;
+	/* The buffer cache has its own locking; don't hold up the file. */
+	return buf_sync(sfs->sfs_device);
 }
 
 /*
- * Called for mmap().
+ * Called for mmap(). Only regular files get here (directories have
+ * ISDIR), and the VM system reads and writes their pages with
+ * sfs_read and sfs_write, so there's nothing to do.
  */
 static
 int
-sfs_mmap(struct vnode *v   /* add stuff as needed */)
+sfs_mmap(struct vnode *v)
 {
 	(void)v;
-	return EUNIMP;
+	return 0;
 }
 
 /*
- * Called for ftruncate() and from sfs_reclaim.
+ * Called for ftruncate().
  */
 static
 int
 sfs_truncate(struct vnode *v, off_t len)
 {
-	/*
-	 * I/O buffer for handling the indirect block.
-	 *
-	 * Note: in real life (and when you've done the fs assignment)
-	 * you would get space from the disk buffer cache for this,
-	 * not use a static area.
-	 */
-	static uint32_t idbuf[SFS_DBPERIDB];
-
 	struct sfs_vnode *sv = v->vn_data;
-	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
-
-	/* Length in blocks (divide rounding up) */
-	uint32_t blocklen = DIVROUNDUP(len, SFS_BLOCKSIZE);
-
-	uint32_t i, j, block;
-	uint32_t idblock, baseblock, highblock;
 	int result;
-	int hasnonzero, iddirty;
-
-	KASSERT(sizeof(idbuf)==SFS_BLOCKSIZE);
-
-	vfs_biglock_acquire();
-
-	/*
-	 * Go through the direct blocks. Discard any that are
-	 * past the limit we're truncating to.
-	 */
-	for (i=0; i<SFS_NDIRECT; i++) {
-		block = sv->sv_i.sfi_direct[i];
-		if (i >= blocklen && block != 0) {
-			sfs_bfree(sfs, block);
-			sv->sv_i.sfi_direct[i] = 0;
-			sv->sv_dirty = true;
-		}
-	}
-
-	/* Indirect block number */
-	idblock = sv->sv_i.sfi_indirect;
-
-	/* The lowest block in the indirect block */
-	baseblock = SFS_NDIRECT;
-
-	/* The highest block in the indirect block */
-	highblock = baseblock + SFS_DBPERIDB - 1;
-
-	if (blocklen < highblock && idblock != 0) {
-		/* We're past the proposed EOF; may need to free stuff */
-
-		/* Read the indirect block */
-		result = sfs_rblock(sfs, idbuf, idblock);
-		if (result) {
-			vfs_biglock_release();
-			return result;
-		}
-
-		hasnonzero = 0;
-		iddirty = 0;
-		for (j=0; j<SFS_DBPERIDB; j++) {
-			/* Discard any blocks that are past the new EOF */
-			if (blocklen < baseblock+j && idbuf[j] != 0) {
-				sfs_bfree(sfs, idbuf[j]);
-				idbuf[j] = 0;
-				iddirty = 1;
-			}
-			/* Remember if we see any nonzero blocks in here */
-			if (idbuf[j]!=0) {
-				hasnonzero=1;
-			}
-		}
-
-		if (!hasnonzero) {
-			/* The whole indirect block is empty now; free it */
-			sfs_bfree(sfs, idblock);
-			sv->sv_i.sfi_indirect = 0;
-			sv->sv_dirty = true;
-		}
-		else if (iddirty) {
-			/* The indirect block is dirty; write it back */
-			result = sfs_wblock(sfs, idbuf, idblock);
-			if (result) {
-				vfs_biglock_release();
-				return result;
-			}
-		}
-	}
-
-	/* Set the file size */
-	sv->sv_i.sfi_size = len;
 
-	/* Mark the inode dirty */
-	sv->sv_dirty = true;
+	lock_acquire(sv->sv_lock);
+	result = sfs_itrunc(sv, len);
+	lock_release(sv->sv_lock);
 
-	vfs_biglock_release();
-	return 0;
+	return result;
 }
 
 /*
@@ -1259,37 +1558,36 @@ sfs_creat(struct vnode *v, const char *name, bool excl, mode_t mode,
 	uint32_t ino;
 	int result;
 
-	vfs_biglock_acquire();
+	lock_acquire(sv->sv_lock);
 
 	/* Look up the name */
 	result = sfs_dir_findname(sv, name, &ino, NULL, NULL);
 	if (result!=0 && result!=ENOENT) {
-		vfs_biglock_release();
+		lock_release(sv->sv_lock);
 		return result;
 	}
 
 	/* If it exists and we didn't want it to, fail */
 	if (result==0 && excl) {
-		vfs_biglock_release();
+		lock_release(sv->sv_lock);
 		return EEXIST;
 	}
 
 	if (result==0) {
 		/* We got a file; load its vnode and return */
 		result = sfs_loadvnode(sfs, ino, SFS_TYPE_INVAL, &newguy);
+		lock_release(sv->sv_lock);
 		if (result) {
-			vfs_biglock_release();
 			return result;
 		}
 		*ret = &newguy->sv_v;
-		vfs_biglock_release();
 		return 0;
 	}
 
 	/* Didn't exist - create it */
 	result = sfs_makeobj(sfs, SFS_TYPE_FILE, &newguy);
 	if (result) {
-		vfs_biglock_release();
+		lock_release(sv->sv_lock);
 		return result;
 	}
 
@@ -1300,19 +1598,21 @@ sfs_creat(struct vnode *v, const char *name, bool excl, mode_t mode,
 	result = sfs_dir_link(sv, name, newguy->sv_ino, NULL);
 	if (result) {
 		VOP_DECREF(&newguy->sv_v);
-		vfs_biglock_release();
+		lock_release(sv->sv_lock);
 		return result;
 	}
 
 	/* Update the linkcount of the new file */
+	lock_acquire(newguy->sv_lock);
 	newguy->sv_i.sfi_linkcount++;
 
 	/* and consequently mark it dirty. */
 	newguy->sv_dirty = true;
+	lock_release(newguy->sv_lock);
 
-	*ret = &newguy->sv_v;
+	lock_release(sv->sv_lock);
 
-	vfs_biglock_release();
+	*ret = &newguy->sv_v;
 	return 0;
 }
 
@@ -1331,20 +1631,29 @@ sfs_link(struct vnode *dir, const char *name, struct vnode *file)
 
 	KASSERT(file->vn_fs == dir->vn_fs);
 
-	vfs_biglock_acquire();
+	lock_acquire(sv->sv_lock);
 
 	/* Just create a link */
 	result = sfs_dir_link(sv, name, f->sv_ino, NULL);
 	if (result) {
-		vfs_biglock_release();
+		lock_release(sv->sv_lock);
 		return result;
 	}
 
-	/* and update the link count, marking the inode dirty */
+	/*
+	 * and update the link count, marking the inode dirty. (The
+	 * file can be the directory itself, which we already hold.)
+	 */
+	if (f != sv) {
+		lock_acquire(f->sv_lock);
+	}
 	f->sv_i.sfi_linkcount++;
 	f->sv_dirty = true;
+	if (f != sv) {
+		lock_release(f->sv_lock);
+	}
 
-	vfs_biglock_release();
+	lock_release(sv->sv_lock);
 	return 0;
 }
 
@@ -1360,12 +1669,12 @@ sfs_remove(struct vnode *dir, const char *name)
 	int slot;
 	int result;
 
-	vfs_biglock_acquire();
+	lock_acquire(sv->sv_lock);
 
 	/* Look for the file and fetch a vnode for it. */
 	result = sfs_lookonce(sv, name, &victim, &slot);
 	if (result) {
-		vfs_biglock_release();
+		lock_release(sv->sv_lock);
 		return result;
 	}
 
@@ -1373,15 +1682,18 @@ sfs_remove(struct vnode *dir, const char *name)
 	result = sfs_dir_unlink(sv, slot);
 	if (result==0) {
 		/* If we succeeded, decrement the link count. */
+		lock_acquire(victim->sv_lock);
 		KASSERT(victim->sv_i.sfi_linkcount > 0);
 		victim->sv_i.sfi_linkcount--;
 		victim->sv_dirty = true;
+		lock_release(victim->sv_lock);
 	}
 
+	lock_release(sv->sv_lock);
+
 	/* Discard the reference that sfs_lookonce got us */
 	VOP_DECREF(&victim->sv_v);
 
-	vfs_biglock_release();
 	return result;
 }
 
@@ -1401,15 +1713,15 @@ sfs_rename(struct vnode *d1, const char *n1,
 	int slot1, slot2;
 	int result, result2;
 
-	vfs_biglock_acquire();
-
 	KASSERT(d1==d2);
 	KASSERT(sv->sv_ino == SFS_ROOT_LOCATION);
 
+	lock_acquire(sv->sv_lock);
+
 	/* Look up the old name of the file and get its inode and slot number*/
 	result = sfs_lookonce(sv, n1, &g1, &slot1);
 	if (result) {
-		vfs_biglock_release();
+		lock_release(sv->sv_lock);
 		return result;
 	}
 
@@ -1430,8 +1742,10 @@ sfs_rename(struct vnode *d1, const char *n1,
 	}
 
 	/* Increment the link count, and mark inode dirty */
+	lock_acquire(g1->sv_lock);
 	g1->sv_i.sfi_linkcount++;
 	g1->sv_dirty = true;
+	lock_release(g1->sv_lock);
 
 	/* Unlink the old slot */
 	result = sfs_dir_unlink(sv, slot1);
@@ -1443,14 +1757,17 @@ sfs_rename(struct vnode *d1, const char *n1,
 	 * Decrement the link count again, and mark the inode dirty again,
 	 * in case it's been synced behind our back.
 	 */
+	lock_acquire(g1->sv_lock);
 	KASSERT(g1->sv_i.sfi_linkcount>0);
 	g1->sv_i.sfi_linkcount--;
 	g1->sv_dirty = true;
+	lock_release(g1->sv_lock);
+
+	lock_release(sv->sv_lock);
 
 	/* Let go of the reference to g1 */
 	VOP_DECREF(&g1->sv_v);
 
-	vfs_biglock_release();
 	return 0;
 
  puke_harder:
@@ -1464,11 +1781,13 @@ sfs_rename(struct vnode *d1, const char *n1,
 			strerror(result2));
 		panic("sfs: rename: Cannot recover\n");
 	}
+	lock_acquire(g1->sv_lock);
 	g1->sv_i.sfi_linkcount--;
+	lock_release(g1->sv_lock);
  puke:
+	lock_release(sv->sv_lock);
 	/* Let go of the reference to g1 */
 	VOP_DECREF(&g1->sv_v);
-	vfs_biglock_release();
 	return result;
 }
 
@@ -1477,7 +1796,8 @@ sfs_rename(struct vnode *d1, const char *n1,
  * directory it's in as a vnode.
  *
  * Since we don't support subdirectories, this is very easy -
- * return the root dir and copy the path.
+ * return the root dir and copy the path. (Nothing here needs the
+ * directory's lock, since its type never changes.)
  */
 static
 int
@@ -1486,15 +1806,11 @@ sfs_lookparent(struct vnode *v, char *path, struct vnode **ret,
 {
 	struct sfs_vnode *sv = v->vn_data;
 
-	vfs_biglock_acquire();
-
 	if (sv->sv_i.sfi_type != SFS_TYPE_DIR) {
-		vfs_biglock_release();
 		return ENOTDIR;
 	}
 
 	if (strlen(path)+1 > buflen) {
-		vfs_biglock_release();
 		return ENAMETOOLONG;
 	}
 	strcpy(buf, path);
@@ -1502,7 +1818,6 @@ sfs_lookparent(struct vnode *v, char *path, struct vnode **ret,
 	VOP_INCREF(&sv->sv_v);
 	*ret = &sv->sv_v;
 
-	vfs_biglock_release();
 	return 0;
 }
 
@@ -1520,22 +1835,18 @@ sfs_lookup(struct vnode *v, char *path, struct vnode **ret)
 	struct sfs_vnode *final;
 	int result;
 
-	vfs_biglock_acquire();
-
 	if (sv->sv_i.sfi_type != SFS_TYPE_DIR) {
-		vfs_biglock_release();
 		return ENOTDIR;
 	}
 
+	lock_acquire(sv->sv_lock);
 	result = sfs_lookonce(sv, path, &final, NULL);
+	lock_release(sv->sv_lock);
 	if (result) {
-		vfs_biglock_release();
 		return result;
 	}
 
 	*ret = &final->sv_v;
-
-	vfs_biglock_release();
 	return 0;
 }
 
@@ -1645,48 +1956,51 @@ static const struct vnode_ops sfs_dirops = {
 /*
  * Function to load a inode into memory as a vnode, or dig up one
  * that's already resident.
+ *
+ * All new references to vnodes are made here, with sfs_vnlock held,
+ * which is what sfs_reclaim relies on.
  */
 static
 int
 sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
 		 struct sfs_vnode **ret)
 {
-	struct vnode *v;
 	struct sfs_vnode *sv;
 	const struct vnode_ops *ops = NULL;
-	unsigned i, num;
+	struct buf *b;
 	int result;
 
-	/* Look in the vnodes table */
-	num = vnodearray_num(sfs->sfs_vnodes);
-
-	/* Linear search. Is this too slow? You decide. */
-	for (i=0; i<num; i++) {
-		v = vnodearray_get(sfs->sfs_vnodes, i);
-		sv = v->vn_data;
+	lock_acquire(sfs->sfs_vnlock);
 
+	/* Look in the vnodes table */
+	sv = sfs_vnfind(sfs, ino);
+	if (sv != NULL) {
 		/* Every inode in memory must be in an allocated block */
 		if (!sfs_bused(sfs, sv->sv_ino)) {
 			panic("sfs: Found inode %u in unallocated block\n",
 			      sv->sv_ino);
 		}
 
-		if (sv->sv_ino==ino) {
-			/* Found */
-
-			/* May only be set when creating new objects */
-			KASSERT(forcetype==SFS_TYPE_INVAL);
+		/* May only be set when creating new objects */
+		KASSERT(forcetype==SFS_TYPE_INVAL);
 
+		if (sv->sv_idle) {
+			/* Take over the idle list's reference */
+			sfs_lruremove(sfs, sv);
+		}
+		else {
 			VOP_INCREF(&sv->sv_v);
-			*ret = sv;
-			return 0;
 		}
+		lock_release(sfs->sfs_vnlock);
+		*ret = sv;
+		return 0;
 	}
 
 	/* Didn't have it loaded; load it */
 
-	sv = kmalloc(sizeof(struct sfs_vnode));
+	sv = kmem_cache_alloc(&sfs_vnode_cache);
 	if (sv==NULL) {
+		lock_release(sfs->sfs_vnlock);
 		return ENOMEM;
 	}
 
@@ -1697,11 +2011,14 @@ sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
 	}
 
 	/* Read the block the inode is in */
-	result = sfs_rblock(sfs, &sv->sv_i, ino);
+	result = buf_read(sfs->sfs_device, ino, &b);
 	if (result) {
-		kfree(sv);
+		kmem_cache_free(&sfs_vnode_cache, sv);
+		lock_release(sfs->sfs_vnlock);
 		return result;
 	}
+	memcpy(&sv->sv_i, buf_data(b), SFS_BLOCKSIZE);
+	buf_release(b);
 
 	/* Not dirty yet */
 	sv->sv_dirty = false;
@@ -1736,20 +2053,20 @@ sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
 	/* Call the common vnode initializer */
 	result = VOP_INIT(&sv->sv_v, ops, &sfs->sfs_absfs, sv);
 	if (result) {
-		kfree(sv);
+		kmem_cache_free(&sfs_vnode_cache, sv);
+		lock_release(sfs->sfs_vnlock);
 		return result;
 	}
 
 	/* Set the other fields in our vnode structure */
 	sv->sv_ino = ino;
+	sv->sv_idle = false;
+	sv->sv_lruprev = sv->sv_lrunext = NULL;
 
 	/* Add it to our table */
-	result = vnodearray_add(sfs->sfs_vnodes, &sv->sv_v, NULL);
-	if (result) {
-		VOP_CLEANUP(&sv->sv_v);
-		kfree(sv);
-		return result;
-	}
+	sfs_vninsert(sfs, sv);
+
+	lock_release(sfs->sfs_vnlock);
 
 	/* Hand it back */
 	*ret = sv;
@@ -1767,14 +2084,10 @@ sfs_getroot(struct fs *fs)
 	struct sfs_vnode *sv;
 	int result;
 
-	vfs_biglock_acquire();
-
 	result = sfs_loadvnode(sfs, SFS_ROOT_LOCATION, SFS_TYPE_INVAL, &sv);
 	if (result) {
 		panic("sfs: getroot: Cannot load root vnode\n");
 	}
 
-	vfs_biglock_release();
-
 	return &sv->sv_v;
 }
@@ -35,9 +35,13 @@
  */
 
 
+#include <array.h>
 #include <vm.h>
+#include "opt-smartvm.h"
 
 struct vnode;
+struct pagetable;
+struct vmobj;
 
 
 /*
@@ -47,21 +51,84 @@ struct vnode;
  * You write this.
  */
 
+#if OPT_SMARTVM
+/*
+ * A region is a run of pages with the same permissions. Its pages are
+ * zero-filled when first touched, except that the rg_filesz bytes at
+ * rg_fvaddr are read from the address space's executable, starting at
+ * rg_foffset.
+ *
+ * Regions made by mmap can be unmapped again. If they map a file, or
+ * shared anonymous memory, their pages are the ones in rg_obj, starting
+ * rg_objoffset bytes in; with rg_shared they're written to in place,
+ * otherwise they're copied on the first write. Such regions are also
+ * on their object's list of regions (rg_objnext), with the address
+ * space they belong to, so eviction can find every PTE that maps one
+ * of the object's pages. Regions that attach a shared memory segment
+ * (see shm.h) have rg_shm set, so shm_detach can tell them from mmap's.
+ */
+struct region {
+  vaddr_t rg_vbase;
+  size_t rg_npages;
+  bool rg_readable;
+  bool rg_writeable;
+  bool rg_executable;
+
+  vaddr_t rg_fvaddr;
+  off_t rg_foffset;
+  size_t rg_filesz;
+
+  bool rg_mmapped;
+  bool rg_shared;
+  bool rg_shm;
+  struct vmobj *rg_obj;
+  off_t rg_objoffset;
+  struct addrspace *rg_as;
+  struct region *rg_objnext;
+};
+#endif
+
 struct addrspace {
+#if OPT_SMARTVM
+  /*
+   * The regions say which addresses are legal; the page table maps
+   * each of their pages that has been touched to a physical frame.
+   * Frames may be shared copy-on-write with other address spaces after
+   * a fork; the coremap's per-page refcount says how many share a frame.
+   *
+   * The heap and the stack are regions like any other. The heap starts
+   * out empty just past the highest region loaded from the executable,
+   * and sbrk moves as_heapbreak; the region always covers the pages up
+   * to the break. The stack grows down on demand from vm_fault, up to
+   * a fixed maximum, leaving guard pages between it and the heap.
+   */
+  struct array as_regions;  // of struct region *
+  struct region *as_heap;
+  vaddr_t as_heapbreak;
+  struct region *as_stack;
+
+  struct pagetable *as_pt;
+
+  // Never reused, so TLB entries can be tagged with whose they are
+  unsigned as_id;
+  // The CPU it last ran on, and a bit for every CPU it has run on
+  unsigned as_cpu;
+  uint32_t as_cpus;
+
+  // The executable that regions' file contents are read from
+  struct vnode *as_vnode;
+
+  // The address space is officially ready
+  bool as_ready;
+#else
   vaddr_t as_vbase1;
   paddr_t as_pbase1;
   size_t as_npages1;
-  bool as_dirtiable1;
-
   vaddr_t as_vbase2;
   paddr_t as_pbase2;
   size_t as_npages2;
-  bool as_dirtiable2;
-
   paddr_t as_stackpbase;
-
-  // The address space is officially ready
-  bool as_ready;
+#endif
 };
 
 /*
@@ -95,6 +162,30 @@ struct addrspace {
  *    as_complete_load - this is called when loading from an executable
  *                is complete.
  *
+ *    as_define_backing - say where the initial contents of the region at
+ *                vaddr come from: filesz bytes of the file v, starting
+ *                at offset. (smartvm only; pages are read on demand.)
+ *
+ *    as_sbrk   - move the heap's break by amount bytes, handing back the
+ *                old break. (smartvm only.)
+ *
+ *    as_mmap   - map len bytes of v from offset (or anonymous memory if
+ *                v is NULL) with the given PROT_ and MAP_ flags, handing
+ *                back where. vaddr is where to put it; it's a hint unless
+ *                MAP_FIXED is set. (smartvm only.)
+ *
+ *    as_mapobj - like as_mmap, but map the pages of vo (see vmobj.h)
+ *                from offset. vo may only be NULL for MAP_PRIVATE.
+ *                flags may also have AS_MAP_SHM, for shm_attach; as_mmap
+ *                doesn't take it. (smartvm only.)
+ *
+ *    as_munmap - remove the mapping of len bytes at vaddr, which must
+ *                all be in one region made by as_mmap. (smartvm only.)
+ *
+ *    as_shmat  - the vmobj of the shared memory segment attached at
+ *                vaddr, and its length, or NULL if there isn't one
+ *                there. (smartvm only.)
+ *
  *    as_define_stack - set up the stack region in the address space.
  *                (Normally called *after* as_complete_load().) Hands
  *                back the initial stack pointer for the new process.
@@ -113,6 +204,23 @@ int               as_define_region(struct addrspace *as,
                                    int executable);
 int               as_prepare_load(struct addrspace *as);
 int               as_complete_load(struct addrspace *as);
+#if OPT_SMARTVM
+#define AS_MAP_SHM  0x10000	/* as_mapobj: attaching a shm segment */
+
+int               as_define_backing(struct addrspace *as, struct vnode *v,
+                                    off_t offset, vaddr_t vaddr,
+                                    size_t filesz);
+int               as_sbrk(struct addrspace *as, intptr_t amount,
+                          vaddr_t *oldbreak);
+int               as_mmap(struct addrspace *as, vaddr_t vaddr, size_t len,
+                          int prot, int flags, struct vnode *v, off_t offset,
+                          vaddr_t *ret);
+int               as_mapobj(struct addrspace *as, vaddr_t vaddr, size_t len,
+                            int prot, int flags, struct vmobj *vo,
+                            off_t offset, vaddr_t *ret);
+int               as_munmap(struct addrspace *as, vaddr_t vaddr, size_t len);
+struct vmobj     *as_shmat(struct addrspace *as, vaddr_t vaddr, size_t *len);
+#endif
 int               as_define_stack(struct addrspace *as, vaddr_t *initstackptr);
 
 
@@ -0,0 +1,59 @@
+#ifndef _BUF_H_
+#define _BUF_H_
+
+/*
+ * Buffer cache.
+ *
+ * Caches BUF_SIZE-byte blocks of block devices in memory, found by
+ * (device, block number) through a hash table. A buffer that nobody is
+ * using sits on an LRU list, and when the cache is full the least
+ * recently used one is reused for the next block asked for, being
+ * written back first if it's dirty. Otherwise dirty buffers are only
+ * written when buf_sync is called for their device.
+ *
+ * A buffer handed out by buf_read or buf_get is locked (with its own
+ * sleep lock) until the caller gives it back with buf_release, so
+ * different blocks can be used concurrently.
+ *
+ * Functions:
+ *     buf_read       - get a block, reading it from the device if it
+ *                      isn't cached.
+ *     buf_get        - get a block without reading it, for when the
+ *                      caller is about to overwrite all of it. Unless
+ *                      the block was cached already, the data is
+ *                      garbage until then.
+ *     buf_data       - the BUF_SIZE bytes of data in a buffer.
+ *     buf_valid      - whether the data holds the block (always so
+ *                      for buf_read).
+ *     buf_markdirty  - note that the caller has changed the data. For
+ *                      a buffer that wasn't valid, the caller must
+ *                      have filled in all of it; if it didn't, it
+ *                      just releases the buffer and it's thrown away.
+ *     buf_release    - give a buffer back.
+ *     buf_forget     - drop any changes to a block that's been freed,
+ *                      so they never get written.
+ *     buf_sync       - write back all the dirty buffers of a device.
+ *     buf_purge      - throw out all the buffers of a device, which
+ *                      must have been synced and not be in use; for
+ *                      unmount.
+ *     buf_printstats - print hit/miss and writeback counts.
+ */
+
+#define BUF_SIZE 512
+
+struct buf;	/* Opaque. */
+struct device;
+
+int   buf_read(struct device *dev, daddr_t block, struct buf **ret);
+int   buf_get(struct device *dev, daddr_t block, struct buf **ret);
+void *buf_data(struct buf *b);
+bool  buf_valid(struct buf *b);
+void  buf_markdirty(struct buf *b);
+void  buf_release(struct buf *b);
+void  buf_forget(struct device *dev, daddr_t block);
+int   buf_sync(struct device *dev);
+void  buf_purge(struct device *dev);
+void  buf_printstats(void);
+
+
+#endif /* _BUF_H_ */
@@ -36,6 +36,28 @@
 #include <machine/vm.h>  /* for TLBSHOOTDOWN_MAX */
 
 
+/*
+ * kmalloc's per-cpu cache ("magazine") of free blocks for one subpage
+ * size class. Blocks go in and out of it without taking the kmalloc
+ * lock, and move between it and the shared subpage pages in batches.
+ * See kmalloc.c.
+ */
+#define KMALLOC_NSIZES   8	/* subpage size classes */
+#define KMALLOC_MAGSIZE  16	/* most blocks a magazine holds */
+
+struct kmalloc_mag {
+	unsigned km_nobjs;
+	void *km_objs[KMALLOC_MAGSIZE];
+};
+
+/*
+ * Exited threads, each still holding its kernel stack, kept per-cpu so
+ * thread_fork can reuse them instead of allocating both again. A cpu
+ * starts with THREADPOOL_PREFILL of them. See thread.c.
+ */
+#define THREADPOOL_MAX      4
+#define THREADPOOL_PREFILL  2
+
 /*
  * Per-cpu structure
  *
@@ -60,6 +82,10 @@ struct cpu {
 	struct thread *c_curthread;	/* Current thread on cpu */
 	struct threadlist c_zombies;	/* List of exited threads */
 	unsigned c_hardclocks;		/* Counter of hardclock() calls */
+	struct kmalloc_mag c_kmalloc[KMALLOC_NSIZES]; /* Touched at splhigh */
+	struct threadlist c_threadpool;	/* Threads to recycle; at splhigh */
+	unsigned c_threadpool_hits;	/* thread_creates it served */
+	unsigned c_threadpool_misses;	/* ...and didn't */
 
 	/*
 	 * Accessed by other cpus.
@@ -77,7 +103,9 @@ struct cpu {
 	 * should be invalidated. This is used if more than
 	 * TLBSHOOTDOWN_MAX mappings are going to be invalidated at
 	 * once. TLBSHOOTDOWN_MAX is MD and chosen based on when it
-	 * becomes more efficient just to flush the whole TLB.
+	 * becomes more efficient just to flush the whole TLB. In that
+	 * state the first c_numshootwait entries of c_shootdown are
+	 * the dropped shootdowns whose ts_done still has to be V'd.
 	 *
 	 * struct tlbshootdown is machine-dependent and might
 	 * reasonably be either an address space and vaddr pair, or a
@@ -86,6 +114,7 @@ struct cpu {
 	uint32_t c_ipi_pending;		/* One bit for each IPI number */
 	struct tlbshootdown c_shootdown[TLBSHOOTDOWN_MAX];
 	int c_numshootdown;
+	int c_numshootwait;
 	struct spinlock c_ipi_lock;
 };
 
@@ -152,6 +181,9 @@ void cpu_halt(void);
  * ipi_send sends an IPI to one CPU.
  * ipi_broadcast sends an IPI to all CPUs except the current one.
  * ipi_tlbshootdown is like ipi_send but carries TLB shootdown data.
+ * ipi_tlbshootdown_cpus sends a batch of N shootdowns, in one IPI each,
+ * to the CPUs whose numbers are set in CPUMASK (except the current
+ * one), and returns how many CPUs it was sent to.
  *
  * interprocessor_interrupt is called on the target CPU when an IPI is
  * received.
@@ -166,6 +198,8 @@ void cpu_halt(void);
 void ipi_send(struct cpu *target, int code);
 void ipi_broadcast(int code);
 void ipi_tlbshootdown(struct cpu *target, const struct tlbshootdown *mapping);
+unsigned ipi_tlbshootdown_cpus(uint32_t cpumask,
+			       const struct tlbshootdown *mappings, unsigned n);
 
 void interprocessor_interrupt(void);
 
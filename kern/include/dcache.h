@@ -0,0 +1,54 @@
+#ifndef _DCACHE_H_
+#define _DCACHE_H_
+
+/*
+ * Name lookup cache.
+ *
+ * Remembers the result of looking up one pathname component in one
+ * directory, keyed by (directory vnode, name), so the path walker in
+ * vfslookup.c can skip VOP_LOOKUP for names it has already seen. An
+ * entry is either positive (the name refers to a vnode, which the
+ * entry holds a reference to) or negative (the name doesn't exist).
+ * Every entry also holds a reference to its directory. There are a
+ * fixed number of entries; the least recently used one is reused when
+ * they run out.
+ *
+ * Anything that adds, removes, or renames a directory entry must call
+ * dcache_invalidate for the name afterwards. Each invalidation bumps a
+ * generation number; a lookup that missed passes the generation it saw
+ * to dcache_enter, which then doesn't cache a result that might have
+ * been overtaken by a change made while the lookup was running.
+ *
+ * Names longer than DCACHE_NAMELEN, ".", and ".." are never cached.
+ *
+ * Functions:
+ *     dcache_bootstrap  - initialize the cache.
+ *     dcache_lookup     - look for NAME in DIR. Returns true on a hit,
+ *                         with *RET set to the vnode (with a reference
+ *                         added) or NULL for a negative entry. On a
+ *                         miss returns false and sets *GEN.
+ *     dcache_enter      - remember that NAME in DIR is VN (or nothing,
+ *                         if VN is NULL), unless GEN is out of date.
+ *     dcache_invalidate - forget NAME in DIR.
+ *     dcache_purgefs    - forget everything on a filesystem, so it
+ *                         can be unmounted.
+ *     dcache_printstats - print hit/miss counts.
+ */
+
+#define DCACHE_SIZE     256	/* Number of entries */
+#define DCACHE_NAMELEN  31	/* Longest name cached */
+
+struct vnode;
+struct fs;
+
+void dcache_bootstrap(void);
+bool dcache_lookup(struct vnode *dir, const char *name,
+		   struct vnode **ret, unsigned *gen);
+void dcache_enter(struct vnode *dir, const char *name, struct vnode *vn,
+		  unsigned gen);
+void dcache_invalidate(struct vnode *dir, const char *name);
+void dcache_purgefs(struct fs *fs);
+void dcache_printstats(void);
+
+
+#endif /* _DCACHE_H_ */
@@ -0,0 +1,80 @@
+#ifndef _FILETABLE_H_
+#define _FILETABLE_H_
+
+/*
+ * Open files and per-process file tables.
+ *
+ * An openfile is what open() creates: a vnode, the access mode it was
+ * opened with, and the seek offset. File descriptors that come from the
+ * same open() -- by dup2, or by fork copying the file table -- share one
+ * openfile and so share the offset. Openfiles are reference counted;
+ * the vnode is closed when the last reference goes away.
+ *
+ * of_offset is covered by of_lock. A read or write takes the offset
+ * under it, does the I/O without it, and then stores the new offset,
+ * so the lock is never held while a user buffer is copied (a fault in
+ * the copy can sleep for a long time, or kill the process). Two
+ * threads sharing an openfile that do I/O at once may therefore use
+ * the same offset. Devices that can't seek (the console) have no
+ * offset and don't take the lock.
+ *
+ * A filetable belongs to one process and is only touched by that
+ * process's thread (fork copies the parent's table from the parent's
+ * thread), so it has no lock of its own.
+ *
+ * Functions:
+ *     openfile_open     - vfs_open a path and wrap it in an openfile
+ *                         with one reference.
+ *     openfile_incref   - add a reference.
+ *     openfile_decref   - drop a reference; the last one closes the file.
+ *
+ *     filetable_create  - make an empty table. Returns NULL if out of
+ *                         memory.
+ *     filetable_copy    - make a table sharing all of src's openfiles,
+ *                         for fork.
+ *     filetable_destroy - drop every openfile in the table and free it.
+ *     filetable_place   - put an openfile in the lowest free slot, taking
+ *                         over the caller's reference. EMFILE if full.
+ *     filetable_get     - look up fd. EBADF if it isn't open.
+ *     filetable_dup2    - make newfd refer to oldfd's openfile, closing
+ *                         whatever newfd referred to before.
+ *     filetable_close   - close fd. EBADF if it isn't open.
+ */
+
+#include <limits.h>
+#include <spinlock.h>
+
+struct vnode;
+struct lock;
+
+struct openfile {
+	struct vnode *of_vnode;
+	int of_accmode;			/* O_RDONLY, O_WRONLY, or O_RDWR */
+	bool of_append;			/* O_APPEND: writes go at EOF */
+	bool of_seekable;		/* has an offset */
+
+	struct lock *of_lock;		/* covers of_offset */
+	off_t of_offset;
+
+	struct spinlock of_reflock;	/* covers of_refcount */
+	unsigned of_refcount;
+};
+
+struct filetable {
+	struct openfile *ft_files[OPEN_MAX];
+};
+
+int  openfile_open(char *path, int flags, mode_t mode, struct openfile **ret);
+void openfile_incref(struct openfile *of);
+void openfile_decref(struct openfile *of);
+
+struct filetable *filetable_create(void);
+int  filetable_copy(struct filetable *src, struct filetable **ret);
+void filetable_destroy(struct filetable *ft);
+int  filetable_place(struct filetable *ft, struct openfile *of, int *fd);
+int  filetable_get(struct filetable *ft, int fd, struct openfile **ret);
+int  filetable_dup2(struct filetable *ft, int oldfd, int newfd);
+int  filetable_close(struct filetable *ft, int fd);
+
+
+#endif /* _FILETABLE_H_ */
@@ -0,0 +1,35 @@
+#ifndef _KERN_KMPROF_H_
+#define _KERN_KMPROF_H_
+
+/*
+ * Kernel heap profiler interface, for __kmprof().
+ *
+ * While profiling is on, every kmalloc is charged to its call site,
+ * the address kmalloc was called from. A site is one (pc, size) pair,
+ * where size is what kmalloc really handed out: the subpage block
+ * size, or a whole number of pages.
+ *
+ *    __kmprof(KMPROF_GET, buf, n) copies up to n struct kmprof_site
+ *        into buf, largest live bytes first, and returns how many.
+ *    __kmprof(KMPROF_START / KMPROF_STOP / KMPROF_RESET, NULL, 0)
+ *        turns profiling on or off, or clears all counts. Blocks
+ *        allocated while profiling was on are still credited back to
+ *        their site when freed after it's turned off.
+ */
+
+#define KMPROF_GET      0
+#define KMPROF_START    1
+#define KMPROF_STOP     2
+#define KMPROF_RESET    3
+
+struct kmprof_site {
+	__u32 ks_pc;		/* where kmalloc was called from */
+	__u32 ks_size;		/* bytes per allocation */
+	__u32 ks_allocs;	/* allocations made */
+	__u32 ks_frees;		/* allocations freed */
+	__u32 ks_live;		/* bytes allocated now */
+	__u32 ks_peak;		/* most bytes ever allocated at once, or
+				   a bit more (see kmprof.h) */
+};
+
+#endif /* _KERN_KMPROF_H_ */
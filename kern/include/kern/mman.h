@@ -0,0 +1,24 @@
+#ifndef _KERN_MMAN_H_
+#define _KERN_MMAN_H_
+
+/*
+ * Flags for mmap().
+ *
+ * A mapping is either MAP_SHARED, where writes go to the file (or, for
+ * anonymous memory, are seen by every process sharing it after a fork),
+ * or MAP_PRIVATE, where the process gets its own copy of each page it
+ * writes to. MAP_ANON mappings are zero-filled and take no file.
+ */
+
+#define PROT_NONE       0x0	/* page can't be used (not enforced) */
+#define PROT_READ       0x1	/* page can be read */
+#define PROT_WRITE      0x2	/* page can be written */
+#define PROT_EXEC       0x4	/* page can be executed */
+
+#define MAP_SHARED      0x0001	/* writes change the underlying object */
+#define MAP_PRIVATE     0x0002	/* writes are private to the process */
+#define MAP_FIXED       0x0010	/* map exactly at addr */
+#define MAP_ANON        0x1000	/* anonymous memory, not a file */
+#define MAP_ANONYMOUS   MAP_ANON
+
+#endif /* _KERN_MMAN_H_ */
@@ -0,0 +1,20 @@
+#ifndef _KERN_SHM_H_
+#define _KERN_SHM_H_
+
+/*
+ * Shared memory segments.
+ *
+ *    shm_create(key, size) finds the segment with that key, or makes a
+ *        new zero-filled one of size bytes, and returns its id. Key
+ *        SHM_PRIVATE always makes a new segment.
+ *    shm_attach(id, addr) maps the whole segment read/write, at addr if
+ *        that's free (NULL for anywhere), and returns where. The mapping
+ *        is shared with children after fork, not copied.
+ *    shm_detach(addr) unmaps the segment attached at addr.
+ *    shm_remove(id) takes the segment out of the table. Its memory goes
+ *        away once it's no longer attached anywhere.
+ */
+
+#define SHM_PRIVATE     0
+
+#endif /* _KERN_SHM_H_ */
@@ -196,6 +196,12 @@
 #define SYS_sync         118
 #define SYS_reboot       119
 //#define SYS___sysctl   120
+//                              -- OS/161-specific --
+#define SYS___kmprof     121
+#define SYS_shm_create   122
+#define SYS_shm_attach   123
+#define SYS_shm_detach   124
+#define SYS_shm_remove   125
 
 /*CALLEND*/
 
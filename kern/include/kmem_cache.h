@@ -0,0 +1,65 @@
+#ifndef _KMEM_CACHE_H_
+#define _KMEM_CACHE_H_
+
+/*
+ * Object caches for kernel structures that are created and destroyed
+ * often (slab allocator).
+ *
+ * A cache hands out objects of one type, carved from whole pages
+ * ("slabs"). An object freed back to the cache is left constructed:
+ * whatever its constructor set up (wait channels, spinlocks, lists)
+ * is still there the next time it's allocated, so only the per-use
+ * fields need setting again.
+ *
+ * The constructor runs the first time an object is handed out, and
+ * must return 0 or an errno value; the destructor runs when a slab
+ * goes back to the VM system, on each object that was constructed.
+ * Either may be NULL. Both are called with no locks held.
+ *
+ * Caches are declared statically with KMEM_CACHE_INITIALIZER, so they
+ * can be used from the earliest point kmalloc can.
+ *
+ * Functions:
+ *     kmem_cache_alloc      - get a constructed object. Returns NULL if
+ *                             out of memory or the constructor failed.
+ *     kmem_cache_free       - give an object back. It must be in the
+ *                             state the constructor left it in.
+ *     kmem_cache_printstats - print usage and hit/miss counts for every
+ *                             cache that has been used.
+ */
+
+#include <spinlock.h>
+
+struct kmem_slab;
+
+struct kmem_cache {
+	const char *kc_name;
+	size_t kc_size;			/* size of an object */
+	int (*kc_ctor)(void *obj);
+	void (*kc_dtor)(void *obj);
+
+	struct spinlock kc_lock;
+	struct kmem_slab *kc_partial;	/* slabs with free objects */
+	struct kmem_slab *kc_full;	/* slabs with none */
+	unsigned kc_nempty;		/* slabs with nothing allocated */
+	bool kc_listed;			/* on the list of all caches */
+	struct kmem_cache *kc_next;	/* next on that list */
+
+	/* statistics */
+	unsigned kc_slabs;		/* slabs now held */
+	unsigned kc_inuse;		/* objects now allocated */
+	unsigned kc_hits;		/* allocations of a constructed object */
+	unsigned kc_misses;		/* allocations that ran the ctor */
+	unsigned kc_frees;
+};
+
+#define KMEM_CACHE_INITIALIZER(name, size, ctor, dtor) \
+	{ name, size, ctor, dtor, SPINLOCK_INITIALIZER, NULL, NULL, 0, \
+	  false, NULL, 0, 0, 0, 0, 0 }
+
+void *kmem_cache_alloc(struct kmem_cache *kc);
+void  kmem_cache_free(struct kmem_cache *kc, void *obj);
+void  kmem_cache_printstats(void);
+
+
+#endif /* _KMEM_CACHE_H_ */
@@ -0,0 +1,47 @@
+#ifndef _KMPROF_H_
+#define _KMPROF_H_
+
+/*
+ * Kernel heap profiler: per-call-site accounting for kmalloc.
+ * See kern/kmprof.h for what's counted.
+ *
+ * Blocks are tracked in a table that's allocated the first time
+ * profiling is started and kept after that. It's split into stripes
+ * by block address, each with its own lock, so that profiling doesn't
+ * serialize kmalloc across cpus (see kmprof.c). If a stripe fills up,
+ * further allocations in it are counted as untracked and not charged
+ * to a site. Sites past KMPROF_NSITES are lumped together under pc 0.
+ * A site's peak is added up over the stripes, so it can overstate.
+ *
+ * Allocations made through a wrapper (kstrdup, array_setsize) are
+ * charged to the wrapper.
+ *
+ * Functions:
+ *     kmprof_alloc      - called by kmalloc while kmprof_active.
+ *     kmprof_free       - called by kfree while kmprof_tracking.
+ *     kmprof_start      - turn profiling on. Returns ENOMEM if the
+ *                         table can't be allocated.
+ *     kmprof_stop       - turn it off.
+ *     kmprof_reset      - forget every site and tracked block.
+ *     kmprof_get        - copy out up to max sites, largest live bytes
+ *                         first; returns how many.
+ *     kmprof_printstats - print the sites (menu command kmprof).
+ */
+
+#include <kern/kmprof.h>
+
+#define KMPROF_NSITES   128
+
+extern volatile bool kmprof_active;	/* record new allocations */
+extern volatile bool kmprof_tracking;	/* some blocks may be tracked */
+
+void     kmprof_alloc(void *ptr, size_t size, vaddr_t pc);
+void     kmprof_free(void *ptr);
+int      kmprof_start(void);
+void     kmprof_stop(void);
+void     kmprof_reset(void);
+unsigned kmprof_get(struct kmprof_site *buf, unsigned max);
+void     kmprof_printstats(void);
+
+
+#endif /* _KMPROF_H_ */
@@ -0,0 +1,72 @@
+#ifndef _PAGETABLE_H_
+#define _PAGETABLE_H_
+
+/*
+ * Two-level page table for smartvm address spaces.
+ *
+ * A virtual page number is split in two: the top 10 bits pick an entry
+ * in the directory, which points to a second-level table (one page of
+ * 1024 PTEs, covering 4M of address space); the low 10 bits pick the
+ * PTE in that table. Second-level tables are only allocated for parts
+ * of the address space that are actually in use.
+ *
+ * Functions:
+ *     pt_create  - allocate an empty page table. Returns NULL on error.
+ *     pt_destroy - free the page table. Does not touch the pages the
+ *                  PTEs refer to; the caller must release those first.
+ *     pt_lookup  - return a pointer to the PTE for a virtual address.
+ *                  If CREATE is set, the second-level table is allocated
+ *                  if needed (returns NULL if out of memory); otherwise
+ *                  returns NULL if there is no table for the address.
+ */
+
+#include <vm.h>
+
+/*
+ * A PTE holds the physical page number in the same bits as a TLB
+ * EntryLo, and software status bits in the low bits. A PTE is in one
+ * of these states:
+ *
+ *     0                   never touched (or dropped while still clean);
+ *                         the next fault reads it from the executable
+ *                         or zero-fills it, or takes it from the
+ *                         region's vmobj
+ *     PTE_VALID           in memory at PTE_FRAME
+ *     PTE_INTRANSIT       being evicted from PTE_FRAME; wait for it
+ *     PTE_SWAPPED         in swap, in slot PTE_SWAPSLOT
+ *
+ * PTE_READONLY is kept in every state but 0. PTE_SHARED marks a page of
+ * a shared mapping (see as_mmap): the frame belongs to a vmobj, and
+ * writes go straight to it instead of breaking copy-on-write. A vmobj
+ * keeps its own pages in a page table of the same kind, indexed by
+ * offset instead of address.
+ */
+typedef uint32_t pte_t;
+
+#define PTE_FRAME       0xfffff000	/* physical page address */
+#define PTE_VALID       0x00000001	/* page is in memory at PTE_FRAME */
+#define PTE_DIRTY       0x00000002	/* page has been written to */
+#define PTE_REFERENCED  0x00000004	/* page has been used recently */
+#define PTE_READONLY    0x00000008	/* page may not be written */
+#define PTE_SWAPPED     0x00000010	/* page is in swap */
+#define PTE_INTRANSIT   0x00000020	/* page is on its way out */
+#define PTE_SHARED      0x00000040	/* writes go to the shared frame */
+
+#define PTE_SWAPSLOT(pte)   ((pte) >> 12)
+#define PTE_MKSWAP(slot)    (((pte_t)(slot) << 12) | PTE_SWAPPED)
+
+#define PT_NENTRIES     (PAGE_SIZE / sizeof(pte_t))	/* 1024 */
+#define PT_L1INDEX(va)  (((va) >> 22) & 0x3ff)
+#define PT_L2INDEX(va)  (((va) >> 12) & 0x3ff)
+#define PT_VADDR(l1, l2) (((vaddr_t)(l1) << 22) | ((vaddr_t)(l2) << 12))
+
+struct pagetable {
+	pte_t *pt_dir[PT_NENTRIES];	/* second-level tables, or NULL */
+};
+
+struct pagetable *pt_create(void);
+void              pt_destroy(struct pagetable *pt);
+pte_t            *pt_lookup(struct pagetable *pt, vaddr_t vaddr, bool create);
+
+
+#endif /* _PAGETABLE_H_ */
@@ -42,6 +42,8 @@
 #include <thread.h> /* required for struct threadarray */
 
 struct addrspace;
+struct exitrec;
+struct filetable;
 struct vnode;
 #ifdef UW
 struct semaphore;
@@ -79,26 +81,15 @@ struct proc {
 
 	/* VFS */ // forked processes can have the same one
 	struct vnode *p_cwd;		/* current working directory */
-
-#ifdef UW
-	/* a vnode to refer to the console device */
-	/* this is a quick-and-dirty way to get console writes working */
-	/* you will probably need to change this when implementing file-related
-	 system calls, since each process will need to keep track of all files
-	 it has opened, not just the console. */
-	struct vnode *console;			/* a vnode for the console device */
-
-#endif
+	struct filetable *p_ft;		/* open files */
 
  	pid_t p_id;						/* process ID */
-	struct array p_children;/* Child processes for this process */
-
-	bool p_did_exit;				/* Did the thread exit yet? */
-	int p_exitcode;					/* Exit code for this process */
+	struct array p_children;/* Exit records of this process's children */
+	struct proc *p_pidnext;			/* Next in this PID table chain */
 
-	struct lock *p_exit_lk;			/* Grabbing this lock prevents this thread from exiting */
-	struct lock *p_wait_lk;			/* Use with p_wait_cv to check when lock exists */
-	struct cv *p_wait_cv;			/* Conditional variable for checking whether we've existed */
+	int p_exitcode;					/* Exit status for this process */
+	struct exitrec *p_exitrec;		/* Our record on the parent's p_children, if forked */
+	struct cv *p_wait_cv;			/* Signalled when a child exits */
 
 };
 
@@ -131,34 +122,23 @@ struct addrspace *curproc_getas(void);
 /* Change the address space of the current process, and return the old one. */
 struct addrspace *curproc_setas(struct addrspace *);
 
-// PID and processes helpers
-
-/**
-	A list of processes is a dynamic array ordered by PID
-*/
-
-/**
-	Returns the process for the given process ID
-*/
-unsigned procarray_proc_index_by_pid(struct array *procs, pid_t pid); // returns index for process (or -1 if fail)
-struct proc * procarray_proc_by_pid(struct array *procs, pid_t pid); // returns actual process
-struct proc * procarray_allprocs_proc_by_pid(pid_t pid);
+/* Whether a live process has this PID (which may change right after). */
+bool proc_exists(pid_t pid);
 
-/**
-	Add a process to the complete list of processes.
-	At this point it can be looked up with proc_by_pid
-*/
-void procarray_add_proc(struct array *procs, struct proc *p);
-void procarray_allprocs_add_proc(struct proc *p);
-
-/**
-	Remove a process from the complete list of processes
-	This should only be called by proc_destroy
-*/
-void procarray_remove_proc(struct array *procs, pid_t pid);
-void procarray_allprocs_remove_proc(pid_t pid);
-
-// Generates a unique process ID
-pid_t gen_pid(void);
+/*
+ * Parent/child bookkeeping for fork, _exit, and waitpid.
+ *
+ * proc_addchild       - link a newly forked child to its parent; call
+ *                       before the child can run.
+ * proc_remchild       - undo proc_addchild for a child that never ran.
+ * proc_orphanchildren - on exit, drop the records of exited children
+ *                       and orphan the rest.
+ * proc_reap           - wait for a child to exit and collect its status.
+ *                       Returns ECHILD if pid isn't a child.
+ */
+int proc_addchild(struct proc *parent, struct proc *child);
+void proc_remchild(struct proc *parent, struct proc *child);
+void proc_orphanchildren(struct proc *p);
+int proc_reap(struct proc *parent, pid_t pid, int *status);
 
 #endif /* _PROC_H_ */
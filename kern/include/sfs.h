@@ -48,11 +48,42 @@
  */
 #include <kern/sfs.h>
 
+/*
+ * Loaded vnodes are found by inode number through sfs_vnhash. When a
+ * vnode's last reference goes away it isn't destroyed right away (so
+ * long as the file still exists) but kept, with its inode synced, on
+ * an LRU list of idle vnodes that sfs_loadvnode can pick back up. The
+ * list holds the idle vnode's one reference. Past SFS_VNIDLEMAX idle
+ * vnodes, the least recently used one is thrown out.
+ *
+ * Locking: sv_lock protects sv_i and sv_dirty, and is held for the
+ * whole of each vnode operation that uses them, except that read and
+ * write never hold it while copying to or from a user buffer (see
+ * sfs_fileio). (sv_ino never changes, and neither does the type in
+ * sv_i once the vnode is loaded, so those may be looked at without
+ * it.) sfs_vnlock protects the hash table, the idle list, and the
+ * counts, including the sv_hashnext, sv_lru*, and sv_idle fields of
+ * each vnode. sfs_freemaplock protects sfs_freemap, sfs_freemapdirty,
+ * and the superblock. The order is: vnode locks (a directory before
+ * the files in it), then sfs_vnlock, then buffers, then
+ * sfs_freemaplock.
+ * See vfs.h for how this fits with the rest of the system.
+ */
+
+#define SFS_VNHASHSIZE  256     /* hash chains for loaded vnodes */
+#define SFS_VNIDLEMAX   128     /* most unreferenced vnodes kept */
+#define SFS_BOUNCESIZE  4096    /* chunk size for user reads/writes */
+
 struct sfs_vnode {
 	struct vnode sv_v;              /* abstract vnode structure */
+	struct lock *sv_lock;           /* lock for sv_i and sv_dirty */
 	struct sfs_inode sv_i;		/* on-disk inode */
 	uint32_t sv_ino;                /* inode number */
 	bool sv_dirty;                  /* true if sv_i modified */
+	bool sv_idle;                   /* true if on the idle list */
+	struct sfs_vnode *sv_hashnext;  /* next in hash chain */
+	struct sfs_vnode *sv_lruprev;   /* idle list links */
+	struct sfs_vnode *sv_lrunext;
 };
 
 struct sfs_fs {
@@ -60,7 +91,13 @@ struct sfs_fs {
 	struct sfs_super sfs_super;	/* on-disk superblock */
 	bool sfs_superdirty;            /* true if superblock modified */
 	struct device *sfs_device;      /* device mounted on */
-	struct vnodearray *sfs_vnodes;  /* vnodes loaded into memory */
+	struct lock *sfs_vnlock;        /* lock for the vnode table */
+	struct sfs_vnode *sfs_vnhash[SFS_VNHASHSIZE]; /* loaded vnodes */
+	unsigned sfs_nvnodes;           /* number loaded */
+	struct sfs_vnode *sfs_lruhead;  /* idle vnodes, oldest first */
+	struct sfs_vnode *sfs_lrutail;
+	unsigned sfs_nidle;             /* number idle */
+	struct lock *sfs_freemaplock;   /* lock for freemap and superblock */
 	struct bitmap *sfs_freemap;     /* blocks in use are marked 1 */
 	bool sfs_freemapdirty;          /* true if freemap modified */
 };
@@ -87,5 +124,9 @@ int sfs_wblock(struct sfs_fs *sfs, void *data, uint32_t block);
 /* Get root vnode */
 struct vnode *sfs_getroot(struct fs *fs);
 
+/* Loaded vnodes, for sync and unmount */
+int sfs_syncvnodes(struct sfs_fs *sfs);
+int sfs_dropvnodes(struct sfs_fs *sfs);
+
 
 #endif /* _SFS_H_ */
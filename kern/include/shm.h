@@ -0,0 +1,48 @@
+#ifndef _SHM_H_
+#define _SHM_H_
+
+/*
+ * Shared memory segments for smartvm. See kern/shm.h for the interface
+ * user programs see.
+ *
+ * A segment is an anonymous vmobj with a key and a size. The segment
+ * table holds one reference to it until shm_remove; each attachment
+ * is a shared mapping of it (see as_mapobj), which holds another. So
+ * a removed segment lives on until the last attachment is detached or
+ * its process exits.
+ *
+ * Segment pages are evicted to swap like any other user memory. Even
+ * so, the segments in the table may only add up to half of what memory
+ * and swap hold together, so that shared memory nobody is using can't
+ * crowd out everything else. (Removed segments that are still attached
+ * no longer count.)
+ *
+ * Functions:
+ *     shm_bootstrap - set up the segment table.
+ *     shm_create    - find the segment for key, or make one of size
+ *                     bytes, and hand back its id. Returns EINVAL if an
+ *                     existing segment is smaller than size, ENOSPC if
+ *                     the table is full, ENOMEM if a new segment would
+ *                     go over the limit above.
+ *     shm_attach    - map segment id into as, at vaddr if possible.
+ *     shm_detach    - unmap the segment attached at vaddr. Returns
+ *                     EINVAL if there's no segment attached there,
+ *                     including for other shared mappings.
+ *     shm_remove    - take segment id out of the table.
+ */
+
+#include <kern/shm.h>
+
+#define SHM_MAX         64	/* segments in the table */
+#define SHM_MAXPAGES    1024	/* biggest segment, in pages */
+
+struct addrspace;
+
+void shm_bootstrap(void);
+int  shm_create(int key, size_t size, int *id);
+int  shm_attach(struct addrspace *as, int id, vaddr_t vaddr, vaddr_t *ret);
+int  shm_detach(struct addrspace *as, vaddr_t vaddr);
+int  shm_remove(int id);
+
+
+#endif /* _SHM_H_ */
@@ -0,0 +1,39 @@
+#ifndef _SWAP_H_
+#define _SWAP_H_
+
+/*
+ * Swap space for smartvm.
+ *
+ * Swap lives on the raw disk SWAP_DEVICE and is divided into page-sized
+ * slots. Each slot has a reference count, so that a swapped-out page can
+ * be shared between a parent and child after fork the same way a frame
+ * in memory can.
+ *
+ * Functions:
+ *     swap_bootstrap - open the swap device. If it's missing, the system
+ *                      runs without swap (dirty pages can't be evicted).
+ *     swap_alloc     - get a free slot, with one reference. Returns ENOSPC
+ *                      if swap is full or there isn't any.
+ *     swap_share     - take another reference to a slot.
+ *     swap_free      - drop a reference to a slot.
+ *     swap_read      - read a slot into the page at paddr.
+ *     swap_write     - write the page at paddr out to a slot.
+ *     swap_npages    - how many pages swap holds (0 if there's none).
+ *     swap_printstats - print how much of swap is in use.
+ */
+
+#include <vm.h>
+
+#define SWAP_DEVICE "lhd0raw:"
+
+void swap_bootstrap(void);
+int  swap_alloc(unsigned *slot);
+void swap_share(unsigned slot);
+void swap_free(unsigned slot);
+int  swap_read(unsigned slot, paddr_t paddr);
+int  swap_write(unsigned slot, paddr_t paddr);
+unsigned swap_npages(void);
+void swap_printstats(void);
+
+
+#endif /* _SWAP_H_ */
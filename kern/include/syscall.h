@@ -30,6 +30,7 @@
 #ifndef _SYSCALL_H_
 #define _SYSCALL_H_
 
+#include "opt-smartvm.h"
 
 struct trapframe; /* from <machine/trapframe.h> */
 
@@ -55,9 +56,15 @@ void enter_new_process(int argc, userptr_t argv, vaddr_t stackptr, vaddr_t entry
 
 int sys_reboot(int code);
 int sys___time(userptr_t user_seconds, userptr_t user_nanoseconds);
+int sys___kmprof(int op, userptr_t buf, size_t nsites, int32_t *retval);
 
 #ifdef UW
-int sys_write(int fdesc,userptr_t ubuf,unsigned int nbytes,int *retval);
+int sys_open(const_userptr_t upath, int flags, mode_t mode, int *retval);
+int sys_read(int fdesc, userptr_t ubuf, size_t nbytes, int *retval);
+int sys_write(int fdesc, userptr_t ubuf, size_t nbytes, int *retval);
+int sys_close(int fdesc);
+int sys_lseek(int fdesc, off_t pos, int whence, off_t *retval);
+int sys_dup2(int oldfd, int newfd, int *retval);
 void sys__exit(int exitcode);
 int sys_fork(struct trapframe *ctf, pid_t *retval);
 int sys_getpid(pid_t *retval);
@@ -69,6 +76,17 @@ int sys_waitpid(pid_t pid, userptr_t status, int options, pid_t *retval);
 */
 int sys_execv(const_userptr_t program, const_userptr_t args[], int *retval);
 
+#if OPT_SMARTVM
+int sys_sbrk(intptr_t amount, int32_t *retval);
+int sys_mmap(userptr_t addr, size_t len, int prot, int flags, int fd,
+             off_t offset, int32_t *retval);
+int sys_munmap(userptr_t addr, size_t len);
+int sys_shm_create(int key, size_t size, int32_t *retval);
+int sys_shm_attach(int id, userptr_t addr, int32_t *retval);
+int sys_shm_detach(userptr_t addr);
+int sys_shm_remove(int id);
+#endif
+
 #endif // UW
 
 #endif /* _SYSCALL_H_ */
@@ -157,6 +157,14 @@ void thread_exit(void);
  */
 void thread_yield(void);
 
+/*
+ * Turn recycling of exited threads (see thread.c) on or off, and print
+ * how often each cpu's pool had a thread for thread_create. Turning it
+ * off lets fork+exit be timed with and without the pool on one kernel.
+ */
+void threadpool_enable(bool on);
+void threadpool_printstats(void);
+
 /*
  * Reshuffle the run queue. Called from the timer interrupt.
  */
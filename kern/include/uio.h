@@ -104,6 +104,16 @@ int uiomove(void *kbuffer, size_t len, struct uio *uio);
  */
 int uiomovezeros(size_t len, struct uio *uio);
 
+/*
+ * For writes that go through a kernel buffer: uiopeek copies the next
+ * len bytes of a UIO_WRITE uio into kbuffer without advancing the uio,
+ * and uioskip then advances it by however many of them were actually
+ * written, so a failed or short write doesn't count bytes that never
+ * got anywhere.
+ */
+int uiopeek(void *kbuffer, size_t len, struct uio *uio);
+void uioskip(size_t len, struct uio *uio);
+
 /*
  * Initialize a uio suitable for I/O from a kernel buffer.
  *
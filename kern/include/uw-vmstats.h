@@ -36,7 +36,11 @@
 #define VMSTAT_ELF_FILE_READ          (7)
 #define VMSTAT_SWAP_FILE_READ         (8)
 #define VMSTAT_SWAP_FILE_WRITE        (9)
-#define VMSTAT_COUNT                 (10)
+#define VMSTAT_TLB_SHOOTDOWN         (10)
+#define VMSTAT_TLB_SHOOTDOWN_PAGES   (11)
+#define VMSTAT_TLB_SHOOTDOWN_IPI     (12)
+#define VMSTAT_TLB_SHOOTDOWN_USEC    (13)
+#define VMSTAT_COUNT                 (14)
 
 /* ----------------------------------------------------------------------- */
 
@@ -52,6 +56,13 @@ void _vmstats_init(void);                    /* atomicity must be ensured elsewh
 void vmstats_inc(unsigned int index);    /* uses locking */
 void _vmstats_inc(unsigned int index);   /* atomicity must be ensured elsewhere */
 
+/* Add to the specified count, for stats that aren't just event counts
+ * Example use:
+ *   vmstats_add(VMSTAT_TLB_SHOOTDOWN_USEC, usecs);
+ */
+void vmstats_add(unsigned int index, unsigned int amount);    /* uses locking */
+void _vmstats_add(unsigned int index, unsigned int amount);   /* atomicity must be ensured elsewhere */
+
 /* Print the statistics: assumes that at least vmstats_init has been called */
 void vmstats_print(void);                    /* Does NOT use locking */
 
@@ -185,12 +185,34 @@ DECLARRAY(vnode);
 DEFARRAY(vnode, VFSINLINE);
 
 /*
- * Global one-big-lock for all filesystem operations.
- * You must remove this for the filesystem assignment.
+ * Filesystem locking.
+ *
+ * There is no global filesystem lock. Each layer locks its own data,
+ * and the locks are always taken in this order:
+ *
+ *    1. the VFS device table lock (vfslist.c), held by mount,
+ *       unmount, sync, and the lookup of a device's root;
+ *    2. filesystem vnode locks, a directory before anything in it
+ *       (for sfs, sv_lock in struct sfs_vnode);
+ *    3. the filesystem's vnode table lock (sfs_vnlock; for emufs,
+ *       the device lock e_lock, which also covers the vnode table);
+ *    4. buffer cache buffers (buf.h);
+ *    5. the filesystem's free map lock (sfs_freemaplock), and then
+ *    6. spinlocks: the name cache lock (dcache.h), which may be held
+ *       while taking vn_countlock; vn_countlock; the buffer cache's
+ *       index lock; and bootfs_lock in vfslookup.c.
+ *
+ * Nothing takes a lock from an earlier level while holding one from a
+ * later level. In particular, VOP_DECREF may reclaim the vnode, which
+ * locks it and then the vnode table, so it must not be called with
+ * anything past level 2 held, or with any vnode lock other than that
+ * of the vnode's directory.
+ *
+ * A page fault while copying to or from a user buffer may need to read
+ * a mapped file or program text, which takes that file's locks. So no
+ * filesystem lock is ever held across such a copy: sfs and emufs move
+ * user data through a kernel buffer and copy it outside their locks.
  */
-void vfs_biglock_acquire(void);
-void vfs_biglock_release(void);
-bool vfs_biglock_do_i_hold(void);
 
 
 #endif /* _VFS_H_ */
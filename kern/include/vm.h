@@ -39,6 +39,9 @@
 
 #include <machine/vm.h>
 
+struct addrspace;
+struct vmobj;
+
 /* Fault-type arguments to vm_fault() */
 #define VM_FAULT_READ        0    /* A read was attempted */
 #define VM_FAULT_WRITE       1    /* A write was attempted */
@@ -50,32 +53,58 @@ paddr_t pmemstart;
 paddr_t pmemend;
 
 /**
-	Core map ent
+	Core map entry
+
+	Free pages are managed with a binary buddy allocator. Every free block
+	of 2^order pages is headed by the entry of its first page, which links
+	it into the free list for that order. The first page of an allocation
+	remembers how many pages were handed out so free_kpages can give back
+	exactly that many.
+
+	User pages are allocated one at a time and may be shared copy-on-write
+	between address spaces after a fork. refcount counts the sharers; the
+	page is only really freed when the last one lets go of it.
+
+	A user page mapped by exactly one address space records where it is
+	mapped (as, vaddr) so that it can be evicted. A page of a vmobj
+	records the object and its offset in it (obj, vaddr) instead, and the
+	object holds a reference of its own. Kernel pages and other shared
+	pages have no owner and stay in memory.
 */
 struct coremapentry {
 	bool used; // is this core-map entry being used
-	int nextentry; // if this is a contiguous entry, the next entry should >= 0
-
-	// TODO: RWX here maybe? Could be a quick way of doing it.
+	bool freehead; // does this page head a free block?
+	uint8_t order; // log2 of the free block's size (valid if freehead)
+	unsigned npages; // length of the allocation starting here (if used)
+	unsigned refcount; // number of address spaces mapping this page
+	struct addrspace *as; // owner of an evictable user page, or NULL
+	struct vmobj *obj; // vmobj the page belongs to, or NULL
+	vaddr_t vaddr; // where the owner maps it, or the offset in obj
+	int swapslot; // up-to-date copy of the page in swap, or -1
+	bool busy; // being written out; leave it alone
+	int nextfree; // free list links for the block's order (if freehead)
+	int prevfree;
 };
 
 // Coremap helper method
 int getppageid(unsigned long npages);
 
+// Print free-page and fragmentation statistics for the coremap
+void coremap_printstats(void);
+
 /* Initialization function */
 void vm_bootstrap(void);
 
 /* Fault handling function called by trap code */
 int vm_fault(int faulttype, vaddr_t faultaddress);
 
-/* Convert virtual address to physical
-(so long as virtual page is in Coremap) */
-paddr_t vaddr_to_paddr(vaddr_t addr, vaddr_t vbase, paddr_t pbase);
-
 /* Allocate/free kernel heap pages (called by kmalloc/kfree) */
 vaddr_t alloc_kpages(int npages);
 void free_kpages(vaddr_t addr);
 
+/* Do some background work on an idle CPU; false if there was none */
+bool vm_idle(void);
+
 /* TLB shootdown handling called from interprocessor_interrupt */
 void vm_tlbshootdown_all(void);
 void vm_tlbshootdown(const struct tlbshootdown *);
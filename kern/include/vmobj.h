@@ -0,0 +1,35 @@
+#ifndef _VMOBJ_H_
+#define _VMOBJ_H_
+
+/*
+ * VM objects for smartvm: the pages behind shared mappings.
+ *
+ * A vmobj holds the in-memory pages of a file that's mapped with mmap,
+ * or of a piece of anonymous memory that's shared between address
+ * spaces (a shared memory segment, or a MAP_SHARED|MAP_ANON mapping).
+ * Every region mapping it points at the same frames. The pages can be
+ * evicted like any others; when the last reference is dropped, a
+ * file's dirty pages are written back and everything is freed.
+ *
+ * Functions:
+ *     vmobj_get     - get v's vmobj, making it if need be, or a new
+ *                     anonymous one if v is NULL, with one reference.
+ *     vmobj_ref     - take another reference.
+ *     vmobj_release - drop a reference.
+ *     vmobj_rw      - VOP_READ or VOP_WRITE on v for read() and write().
+ *                     If v is mapped, the I/O goes through its vmobj's
+ *                     pages too, so reads see what mappings have written
+ *                     and writing the pages back doesn't undo writes.
+ */
+
+struct vnode;
+struct vmobj;
+struct uio;
+
+int  vmobj_get(struct vnode *v, struct vmobj **ret);
+void vmobj_ref(struct vmobj *vo);
+void vmobj_release(struct vmobj *vo);
+int  vmobj_rw(struct vnode *v, struct uio *uio);
+
+
+#endif /* _VMOBJ_H_ */
@@ -30,9 +30,11 @@
 #ifndef _VNODE_H_
 #define _VNODE_H_
 
+#include <spinlock.h>
 
 struct uio;
 struct stat;
+struct vmobj;
 
 /*
  * A struct vnode is an abstract representation of a file.
@@ -50,8 +52,16 @@ struct stat;
  * vn_opencount is managed using VOP_INCOPEN and VOP_DECOPEN by
  * vfs_open() and vfs_close(). Code above the VFS layer should not
  * need to worry about it.
+ *
+ * vn_vmobj belongs to the VM system: while the file is mapped with
+ * mmap, it points to the file's pages in memory, and read() and write()
+ * go through them (see vmobj_rw).
+ *
+ * vn_countlock protects vn_refcount and vn_opencount. Everything else
+ * in the vnode is the filesystem's to lock.
  */
 struct vnode {
+	struct spinlock vn_countlock;   /* Lock for the counts */
 	int vn_refcount;                /* Reference count */
 	int vn_opencount;
 
@@ -60,6 +70,8 @@ struct vnode {
 	void *vn_data;                  /* Filesystem-specific data */
 
 	const struct vnode_ops *vn_ops; /* Functions on this vnode */
+
+	struct vmobj *vn_vmobj;         /* Pages mapped with mmap, or NULL */
 };
 
 /*
@@ -91,6 +103,14 @@ struct vnode {
  *                      this may be substantially after vop_close is
  *                      called.
  *
+ *                      VOP_DECREF passes its reference (the last one,
+ *                      when it was called) to vop_reclaim. Since the
+ *                      filesystem may have handed out a new reference
+ *                      in the meantime, vop_reclaim must check the
+ *                      refcount again under whatever lock it uses to
+ *                      find vnodes; if it's no longer 1, it drops the
+ *                      reference it was given and returns EBUSY.
+ *
  *****************************************
  *
  *    vop_read        - Read data from file to uio, at offset specified
@@ -135,9 +155,9 @@ struct vnode {
  *    vop_fsync       - Force any dirty buffers associated with this file
  *                      to stable storage.
  *
- *    vop_mmap        - Map file into memory. If you implement this
- *                      feature, you're responsible for choosing the
- *                      arguments for this operation.
+ *    vop_mmap        - Check that the file can be mapped into memory,
+ *                      which the VM system does by reading and writing
+ *                      it a page at a time with vop_read and vop_write.
  *
  *    vop_truncate    - Forcibly set size of file to the length passed
  *                      in, discarding any excess blocks.
@@ -209,7 +229,7 @@ struct vnode_ops {
 	int (*vop_gettype)(struct vnode *object, mode_t *result);
 	int (*vop_tryseek)(struct vnode *object, off_t pos);
 	int (*vop_fsync)(struct vnode *object);
-	int (*vop_mmap)(struct vnode *file /* add stuff */);
+	int (*vop_mmap)(struct vnode *file);
 	int (*vop_truncate)(struct vnode *file, off_t len);
 	int (*vop_namefile)(struct vnode *file, struct uio *uio);
 
@@ -254,7 +274,7 @@ struct vnode_ops {
 #define VOP_GETTYPE(vn, result)         (__VOP(vn, gettype)(vn, result))
 #define VOP_TRYSEEK(vn, pos)            (__VOP(vn, tryseek)(vn, pos))
 #define VOP_FSYNC(vn)                   (__VOP(vn, fsync)(vn))
-#define VOP_MMAP(vn /*add stuff */)     (__VOP(vn, mmap)(vn /*add stuff */))
+#define VOP_MMAP(vn)                    (__VOP(vn, mmap)(vn))
 #define VOP_TRUNCATE(vn, pos)           (__VOP(vn, truncate)(vn, pos))
 #define VOP_NAMEFILE(vn, uio)           (__VOP(vn, namefile)(vn, uio))
 
@@ -145,6 +145,75 @@ uiomovezeros(size_t n, struct uio *uio)
 	return 0;
 }
 
+int
+uiopeek(void *ptr, size_t n, struct uio *uio)
+{
+	struct iovec iov;
+	struct uio u;
+	unsigned i;
+	size_t size;
+	int result;
+
+	KASSERT(uio->uio_rw == UIO_WRITE);
+	KASSERT(n <= uio->uio_resid);
+
+	/* Move from copies, so the caller's uio and iovecs stay put */
+	for (i = 0; n > 0; i++) {
+		KASSERT(i < uio->uio_iovcnt);
+		iov = uio->uio_iov[i];
+		size = iov.iov_len;
+		if (size > n) {
+			size = n;
+		}
+		u = *uio;
+		u.uio_iov = &iov;
+		u.uio_iovcnt = 1;
+		u.uio_resid = size;
+		result = uiomove(ptr, size, &u);
+		if (result) {
+			return result;
+		}
+		ptr = ((char *)ptr + size);
+		n -= size;
+	}
+
+	return 0;
+}
+
+void
+uioskip(size_t n, struct uio *uio)
+{
+	struct iovec *iov;
+	size_t size;
+
+	KASSERT(n <= uio->uio_resid);
+
+	while (n > 0) {
+		iov = uio->uio_iov;
+		size = iov->iov_len;
+		if (size > n) {
+			size = n;
+		}
+		if (size == 0) {
+			uio->uio_iov++;
+			uio->uio_iovcnt--;
+			KASSERT(uio->uio_iovcnt > 0);
+			continue;
+		}
+
+		if (uio->uio_segflg == UIO_SYSSPACE) {
+			iov->iov_kbase = ((char *)iov->iov_kbase + size);
+		}
+		else {
+			iov->iov_ubase += size;
+		}
+		iov->iov_len -= size;
+		uio->uio_resid -= size;
+		uio->uio_offset += size;
+		n -= size;
+	}
+}
+
 /*
  * Convenience function to initialize an iovec and uio for kernel I/O.
  */
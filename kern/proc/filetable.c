@@ -0,0 +1,182 @@
+/*
+ * Open files and per-process file tables. See filetable.h.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <kern/fcntl.h>
+#include <lib.h>
+#include <synch.h>
+#include <vnode.h>
+#include <vfs.h>
+#include <filetable.h>
+
+/**
+	Opens path and hands back a new openfile holding the only reference
+	to it.
+*/
+int openfile_open(char *path, int flags, mode_t mode, struct openfile **ret) {
+	struct openfile *of;
+	struct vnode *v;
+	int result;
+
+	of = kmalloc(sizeof(*of));
+	if (of == NULL) {
+		return ENOMEM;
+	}
+	of->of_lock = lock_create("of_lock");
+	if (of->of_lock == NULL) {
+		kfree(of);
+		return ENOMEM;
+	}
+
+	result = vfs_open(path, flags, mode, &v);
+	if (result) {
+		lock_destroy(of->of_lock);
+		kfree(of);
+		return result;
+	}
+
+	of->of_vnode = v;
+	of->of_accmode = flags & O_ACCMODE;
+	of->of_append = (flags & O_APPEND) != 0;
+	of->of_seekable = VOP_TRYSEEK(v, 0) == 0;
+	of->of_offset = 0;
+	spinlock_init(&of->of_reflock);
+	of->of_refcount = 1;
+
+	*ret = of;
+	return 0;
+}
+
+void openfile_incref(struct openfile *of) {
+	spinlock_acquire(&of->of_reflock);
+	KASSERT(of->of_refcount > 0);
+	of->of_refcount++;
+	spinlock_release(&of->of_reflock);
+}
+
+void openfile_decref(struct openfile *of) {
+	unsigned refs;
+
+	spinlock_acquire(&of->of_reflock);
+	KASSERT(of->of_refcount > 0);
+	refs = --of->of_refcount;
+	spinlock_release(&of->of_reflock);
+
+	if (refs == 0) {
+		vfs_close(of->of_vnode);
+		lock_destroy(of->of_lock);
+		spinlock_cleanup(&of->of_reflock);
+		kfree(of);
+	}
+}
+
+struct filetable * filetable_create(void) {
+	struct filetable *ft;
+	int fd;
+
+	ft = kmalloc(sizeof(*ft));
+	if (ft == NULL) {
+		return NULL;
+	}
+	for (fd = 0; fd < OPEN_MAX; fd++) {
+		ft->ft_files[fd] = NULL;
+	}
+	return ft;
+}
+
+/**
+	Makes a copy of src for a forked child. The copy shares every
+	openfile with src, offsets included.
+*/
+int filetable_copy(struct filetable *src, struct filetable **ret) {
+	struct filetable *ft;
+	int fd;
+
+	ft = filetable_create();
+	if (ft == NULL) {
+		return ENOMEM;
+	}
+	for (fd = 0; fd < OPEN_MAX; fd++) {
+		ft->ft_files[fd] = src->ft_files[fd];
+		if (ft->ft_files[fd] != NULL) {
+			openfile_incref(ft->ft_files[fd]);
+		}
+	}
+	*ret = ft;
+	return 0;
+}
+
+void filetable_destroy(struct filetable *ft) {
+	int fd;
+
+	for (fd = 0; fd < OPEN_MAX; fd++) {
+		if (ft->ft_files[fd] != NULL) {
+			openfile_decref(ft->ft_files[fd]);
+		}
+	}
+	kfree(ft);
+}
+
+int filetable_place(struct filetable *ft, struct openfile *of, int *fd) {
+	int i;
+
+	for (i = 0; i < OPEN_MAX; i++) {
+		if (ft->ft_files[i] == NULL) {
+			ft->ft_files[i] = of;
+			*fd = i;
+			return 0;
+		}
+	}
+	return EMFILE;
+}
+
+/**
+	Looks up fd. The openfile stays valid while fd is open, and only the
+	calling process can close it, so no reference is taken.
+*/
+int filetable_get(struct filetable *ft, int fd, struct openfile **ret) {
+	if (fd < 0 || fd >= OPEN_MAX || ft->ft_files[fd] == NULL) {
+		return EBADF;
+	}
+	*ret = ft->ft_files[fd];
+	return 0;
+}
+
+int filetable_dup2(struct filetable *ft, int oldfd, int newfd) {
+	struct openfile *of, *old;
+	int result;
+
+	result = filetable_get(ft, oldfd, &of);
+	if (result) {
+		return result;
+	}
+	if (newfd < 0 || newfd >= OPEN_MAX) {
+		return EBADF;
+	}
+	if (oldfd == newfd) {
+		return 0;
+	}
+
+	openfile_incref(of);
+	old = ft->ft_files[newfd];
+	ft->ft_files[newfd] = of;
+	if (old != NULL) {
+		openfile_decref(old);
+	}
+	return 0;
+}
+
+int filetable_close(struct filetable *ft, int fd) {
+	struct openfile *of;
+	int result;
+
+	result = filetable_get(ft, fd, &of);
+	if (result) {
+		return result;
+	}
+	ft->ft_files[fd] = NULL;
+	openfile_decref(of);
+	return 0;
+}
@@ -43,6 +43,7 @@
  */
 
 #include <types.h>
+#include <kern/errno.h>
 #include <proc.h>
 #include <current.h>
 #include <addrspace.h>
@@ -51,6 +52,10 @@
 #include <synch.h>
 #include <kern/fcntl.h>
 #include <array.h>
+#include <bitmap.h>
+#include <limits.h>
+#include <kmem_cache.h>
+#include <filetable.h>
 
 /*
  * The process for the kernel; this holds all the kernel-only threads.
@@ -70,99 +75,341 @@ static struct semaphore *proc_count_mutex;
 struct semaphore *no_proc_sem;
 #endif  // UW
 
-// The complete array of all active processes
-// Processes are active if they have not exited or if their parent has not existed
-struct array *allprocs;
+/*
+ * PID table.
+ *
+ * Live processes are found by PID through a fixed hash table of
+ * PIDTAB_BUCKETS chains, threaded through p_pidnext and hashed on the
+ * low bits of the PID. Each chain has its own spinlock, so lookups and
+ * updates for different PIDs don't contend with each other.
+ *
+ * Which PIDs are in use is kept separately in a bitmap under pid_lock.
+ * New PIDs are handed out from a cursor that moves forward and wraps
+ * around at PID_MAX, so a PID that has just been freed is the last one
+ * to be reused rather than the first.
+ */
+
+// Number of hash chains; a power of two
+#define PIDTAB_BUCKETS 128
 
-// PIDs will be > 0
-pid_t base_pid = 0;
+struct pidbucket {
+	struct spinlock pb_lock;
+	struct proc *pb_head;
+};
+
+static struct pidbucket pidtab[PIDTAB_BUCKETS];
+
+// PIDs in use, and where to start looking for the next free one
+static struct bitmap *pid_map;
+static pid_t pid_next;
+static struct spinlock pid_lock = SPINLOCK_INITIALIZER;
+
+static struct pidbucket * pidtab_bucket(pid_t pid) {
+	return &pidtab[(unsigned)pid & (PIDTAB_BUCKETS - 1)];
+}
 
 /**
-	Returns the index of the given process in the processes array
-	Binary search implementation
+	Sets up the PID table. PID 0 is never handed out, so the kernel
+	process, which is created first, gets PID 1 (below PID_MIN) and user
+	processes start at PID_MIN.
 */
-unsigned procarray_proc_index_by_pid(struct array *procs, pid_t pid) {
-	unsigned low = 0;
-	unsigned high = array_num(procs) - 1;
-
-	while (high >= low) {
-		unsigned probe = (high + low) / 2;
-		struct proc * p = array_get(procs, probe);
-		if (pid == p->p_id) {
-			return probe;
-		} else if (pid < p->p_id) {
-			high = probe - 1;
-		} else {
-			low = probe + 1;
-		}
+static void pidtab_bootstrap(void) {
+	unsigned i;
+
+	for (i = 0; i < PIDTAB_BUCKETS; i++) {
+		spinlock_init(&pidtab[i].pb_lock);
+		pidtab[i].pb_head = NULL;
 	}
 
-	// No process found for this pid
-	return -1;
+	pid_map = bitmap_create(PID_MAX + 1);
+	if (pid_map == NULL) {
+		panic("proc: could not create the PID bitmap\n");
+	}
+	bitmap_mark(pid_map, 0);
+	pid_next = 1;
 }
 
 /**
-	proc_by_pid returns the process for a given PID by performing a binary
-	search on the processes array.
+	Allocates an unused PID, scanning forward from the last one handed
+	out. Returns ENPROC if every PID is taken.
 */
-struct proc * procarray_proc_by_pid(struct array *procs, pid_t pid) {
-	return array_get(procs, procarray_proc_index_by_pid(procs, pid));
+static int pid_alloc(pid_t *ret) {
+	pid_t pid;
+	unsigned tries;
+
+	spinlock_acquire(&pid_lock);
+	pid = pid_next;
+	for (tries = 0; tries < PID_MAX; tries++) {
+		if (!bitmap_isset(pid_map, pid)) {
+			bitmap_mark(pid_map, pid);
+			pid_next = (pid == PID_MAX) ? PID_MIN : pid + 1;
+			spinlock_release(&pid_lock);
+			*ret = pid;
+			return 0;
+		}
+		pid = (pid == PID_MAX) ? PID_MIN : pid + 1;
+	}
+	spinlock_release(&pid_lock);
+	return ENPROC;
+}
+
+static void pid_free(pid_t pid) {
+	spinlock_acquire(&pid_lock);
+	KASSERT(bitmap_isset(pid_map, pid));
+	bitmap_unmark(pid_map, pid);
+	spinlock_release(&pid_lock);
 }
 
-struct proc * procarray_allprocs_proc_by_pid(pid_t pid) {
-	return procarray_proc_by_pid(allprocs, pid);
+/**
+	Makes a process findable by proc_exists.
+	To be called by proc_create once the PID is allocated.
+*/
+static void pidtab_insert(struct proc *p) {
+	struct pidbucket *pb = pidtab_bucket(p->p_id);
+
+	spinlock_acquire(&pb->pb_lock);
+	p->p_pidnext = pb->pb_head;
+	pb->pb_head = p;
+	spinlock_release(&pb->pb_lock);
 }
 
 /**
-	Adds a newly created process to the end of the processes array
-	To be called by proc_create
+	To be called by proc_destroy, before the PID is freed.
 */
-void procarray_add_proc(struct array *procs, struct proc *p) {
-	array_add(procs, p, NULL);
+static void pidtab_remove(struct proc *p) {
+	struct pidbucket *pb = pidtab_bucket(p->p_id);
+	struct proc **pp;
+
+	spinlock_acquire(&pb->pb_lock);
+	for (pp = &pb->pb_head; *pp != p; pp = &(*pp)->p_pidnext) {
+		KASSERT(*pp != NULL);
+	}
+	*pp = p->p_pidnext;
+	p->p_pidnext = NULL;
+	spinlock_release(&pb->pb_lock);
 }
 
-void procarray_allprocs_add_proc(struct proc *p) {
-	if (allprocs == NULL) {
-		allprocs = array_create();
-		array_init(allprocs);
+/**
+	Returns whether there is a live process with the given PID. It
+	doesn't hand back the process: nothing keeps one alive once the
+	bucket lock is dropped, so the answer may be out of date by the
+	time the caller sees it.
+*/
+bool proc_exists(pid_t pid) {
+	struct pidbucket *pb;
+	struct proc *p;
+
+	if (pid < PID_MIN || pid > PID_MAX) {
+		return false;
+	}
+
+	pb = pidtab_bucket(pid);
+	spinlock_acquire(&pb->pb_lock);
+	for (p = pb->pb_head; p != NULL; p = p->p_pidnext) {
+		if (p->p_id == pid) {
+			break;
+		}
 	}
-	procarray_add_proc(allprocs, p);
+	spinlock_release(&pb->pb_lock);
+	return p != NULL;
+}
+
+/*
+ * Exit records.
+ *
+ * A forked process gets an exit record that is shared with its parent
+ * and lives on the parent's p_children array. When the child exits it
+ * leaves its status in the record and tears the rest of itself down
+ * straight away; the record, which still owns the child's PID, is all
+ * that stays behind until the parent collects it with waitpid. If the
+ * parent exits first it frees the records of children that have
+ * already exited and orphans the rest, which then free their own
+ * records on the way out.
+ *
+ * Record state and the parent links are covered by exitrec_lock. A
+ * parent waits on its own p_wait_cv, which children signal with
+ * exitrec_lock held.
+ */
+
+struct exitrec {
+	pid_t er_pid;
+	int er_status;			/* _MKWAIT_* status, once exited */
+	bool er_exited;
+	struct proc *er_parent;		/* NULL once orphaned */
+};
+
+static struct lock *exitrec_lock;
+
+static struct kmem_cache exitrec_cache =
+	KMEM_CACHE_INITIALIZER("exitrec", sizeof(struct exitrec), NULL, NULL);
+
+/**
+	Frees a record together with the PID it holds.
+	Call with exitrec_lock held.
+*/
+static void exitrec_free(struct exitrec *er) {
+	pid_free(er->er_pid);
+	kmem_cache_free(&exitrec_cache, er);
 }
 
 /**
-	To be called by proc_destroy
+	Makes child a child of parent. To be called by fork before the child
+	can run, so that it can't exit before its record exists.
 */
-void procarray_remove_proc(struct array *procs, pid_t pid) {
-	array_remove(procs, procarray_proc_index_by_pid(procs, pid));
+int proc_addchild(struct proc *parent, struct proc *child) {
+	struct exitrec *er;
+	int result;
+
+	KASSERT(child->p_exitrec == NULL);
+
+	er = kmem_cache_alloc(&exitrec_cache);
+	if (er == NULL) {
+		return ENOMEM;
+	}
+	er->er_pid = child->p_id;
+	er->er_status = 0;
+	er->er_exited = false;
+	er->er_parent = parent;
+
+	lock_acquire(exitrec_lock);
+	result = array_add(&parent->p_children, er, NULL);
+	lock_release(exitrec_lock);
+	if (result) {
+		kmem_cache_free(&exitrec_cache, er);
+		return result;
+	}
+	child->p_exitrec = er;
+	return 0;
 }
 
-void procarray_allprocs_remove_proc(pid_t pid) {
-	procarray_remove_proc(allprocs, pid);
+/**
+	Undoes proc_addchild for a child that never ran.
+*/
+void proc_remchild(struct proc *parent, struct proc *child) {
+	struct exitrec *er = child->p_exitrec;
+	unsigned i;
 
-	// Deinit the processes array
-	if (array_num(allprocs) == 0) {
-		array_cleanup(allprocs);
-		array_destroy(allprocs);
-		allprocs = NULL;
+	KASSERT(er != NULL);
+
+	lock_acquire(exitrec_lock);
+	for (i = 0; array_get(&parent->p_children, i) != er; i++) {
+		KASSERT(i < array_num(&parent->p_children));
 	}
+	array_remove(&parent->p_children, i);
+	lock_release(exitrec_lock);
+
+	kmem_cache_free(&exitrec_cache, er);
+	child->p_exitrec = NULL;
 }
 
 /**
-	Generates a unique PID for a process.
+	Called by an exiting process: frees the records of children that
+	have exited and orphans the others.
+*/
+void proc_orphanchildren(struct proc *p) {
+	struct exitrec *er;
+	unsigned i;
+
+	lock_acquire(exitrec_lock);
+	for (i = array_num(&p->p_children); i > 0; i--) {
+		er = array_get(&p->p_children, i - 1);
+		if (er->er_exited) {
+			exitrec_free(er);
+		} else {
+			er->er_parent = NULL;
+		}
+	}
+	array_setsize(&p->p_children, 0);
+	lock_release(exitrec_lock);
+}
 
-	TODO: I didn't have time to get to this by refactor this to allow
-	(potentially) unlimited different processes to run by allowing recycling of
-	process IDs that have exited and been fully removed.
+/**
+	Posts p's exit status to its record and wakes the parent, or frees
+	the record if there's no parent left to collect it.
+	To be called by proc_destroy.
+*/
+static void proc_postexit(struct proc *p) {
+	struct exitrec *er = p->p_exitrec;
+
+	p->p_exitrec = NULL;
+
+	lock_acquire(exitrec_lock);
+	er->er_status = p->p_exitcode;
+	er->er_exited = true;
+	if (er->er_parent == NULL) {
+		exitrec_free(er);
+	} else {
+		cv_broadcast(er->er_parent->p_wait_cv, exitrec_lock);
+	}
+	lock_release(exitrec_lock);
+}
 
-	We would have to generate the PID by finding the largest array index `i` in
-	allprocesses whose process ID is <= i (specified binary search) then insert
-	into the allprocesses array when we create the new process in that order (to
-	maintion ordering by PID).
+/**
+	Waits for parent's child pid to exit, returns its status, and frees
+	its record. Returns ECHILD if pid isn't a child of parent (or has
+	already been reaped).
 */
-pid_t gen_pid() {
-	return ++base_pid;
+int proc_reap(struct proc *parent, pid_t pid, int *status) {
+	struct exitrec *er;
+	unsigned i, num;
+
+	lock_acquire(exitrec_lock);
+	num = array_num(&parent->p_children);
+	for (i = 0; i < num; i++) {
+		er = array_get(&parent->p_children, i);
+		if (er->er_pid == pid) {
+			break;
+		}
+	}
+	if (i == num) {
+		lock_release(exitrec_lock);
+		return ECHILD;
+	}
+
+	// Only the parent's own thread changes its children array, so the
+	// record stays at index i while we sleep.
+	while (!er->er_exited) {
+		cv_wait(parent->p_wait_cv, exitrec_lock);
+	}
+	*status = er->er_status;
+	array_remove(&parent->p_children, i);
+	exitrec_free(er);
+	lock_release(exitrec_lock);
+	return 0;
+}
+
+/*
+ * Object cache constructor for procs: set up the parts of a proc that
+ * stay with it while it's in the cache, which are the spinlock, the cv,
+ * and the (empty) arrays.
+ */
+static int proc_ctor(void *obj) {
+	struct proc *proc = obj;
+
+	threadarray_init(&proc->p_threads);
+	spinlock_init(&proc->p_lock);
+	array_init(&proc->p_children);
+
+	proc->p_wait_cv = cv_create("p_wait_cv");
+	if (proc->p_wait_cv == NULL) {
+		return ENOMEM;
+	}
+	return 0;
 }
 
+static void proc_dtor(void *obj) {
+	struct proc *proc = obj;
+
+	cv_destroy(proc->p_wait_cv);
+	array_cleanup(&proc->p_children);
+	threadarray_cleanup(&proc->p_threads);
+	spinlock_cleanup(&proc->p_lock);
+}
+
+static struct kmem_cache proc_cache =
+	KMEM_CACHE_INITIALIZER("proc", sizeof(struct proc),
+			       proc_ctor, proc_dtor);
+
 /*
  * Create a proc structure.
  */
@@ -170,64 +417,36 @@ static struct proc * proc_create(const char *name) {
 
 	struct proc *proc;
 
-	proc = kmalloc(sizeof(*proc));
+	proc = kmem_cache_alloc(&proc_cache);
 	if (proc == NULL) {
 		return NULL;
 	}
 	proc->p_name = kstrdup(name);
 	if (proc->p_name == NULL) {
-		kfree(proc);
+		kmem_cache_free(&proc_cache, proc);
 		return NULL;
 	}
 
-	threadarray_init(&proc->p_threads);
-	spinlock_init(&proc->p_lock);
-
 	/* VM fields */
 	proc->p_addrspace = NULL;
 
 	/* VFS fields */
 	proc->p_cwd = NULL;
-
-#ifdef UW
-	proc->console = NULL;
-#endif // UW
+	proc->p_ft = NULL;
 
 	// Added for A2
 
-	// Generate a process ID and add it to the processes array
-	proc->p_id = gen_pid();
-	proc->p_did_exit = false;
-	proc->p_exitcode = 0;
-
-	proc->p_exit_lk = lock_create("p_exit_lk");
-	if (proc->p_exit_lk == NULL) {
-		kfree(proc->p_name);
-		kfree(proc);
-		return NULL;
-	}
-	proc->p_wait_lk = lock_create("p_wait_lk");
-	if (proc->p_exit_lk == NULL) {
-		lock_destroy(proc->p_exit_lk);
-		kfree(proc->p_name);
-		kfree(proc);
-		return NULL;
-	}
-
-	proc->p_wait_cv = cv_create("p_wait_cv");
-	if (proc->p_exit_lk == NULL) {
-		lock_destroy(proc->p_wait_lk);
-		lock_destroy(proc->p_exit_lk);
+	// Allocate a process ID; we're out of processes if there isn't one
+	if (pid_alloc(&proc->p_id)) {
 		kfree(proc->p_name);
-		kfree(proc);
+		kmem_cache_free(&proc_cache, proc);
 		return NULL;
 	}
+	proc->p_exitcode = 0;
+	proc->p_exitrec = NULL;
 
-	proc->p_children = *array_create();
-	array_init(&proc->p_children); // initialize the children
-
-	// Process created successfully, add it to the array of all processes
-	procarray_allprocs_add_proc(proc);
+	// Process created successfully, make it findable by its PID
+	pidtab_insert(proc);
 
 	return proc;
 }
@@ -248,8 +467,14 @@ void proc_destroy(struct proc *proc) {
 	KASSERT(proc != NULL);
 	KASSERT(proc != kproc);
 
-	// Remove the process from the global process array.
-	procarray_allprocs_remove_proc(proc->p_id);
+	// Remove the process from the PID table. A forked process's PID
+	// stays taken until its parent has collected the exit record.
+	pidtab_remove(proc);
+	if (proc->p_exitrec != NULL) {
+		proc_postexit(proc);
+	} else {
+		pid_free(proc->p_id);
+	}
 
 	/*
 	 * We don't take p_lock in here because we must have the only
@@ -285,23 +510,20 @@ void proc_destroy(struct proc *proc) {
 	}
 #endif // UW
 
-#ifdef UW
-	if (proc->console) {
-	  vfs_close(proc->console);
+	if (proc->p_ft) {
+		filetable_destroy(proc->p_ft);
+		proc->p_ft = NULL;
 	}
-#endif // UW
-
-	threadarray_cleanup(&proc->p_threads);
-	spinlock_cleanup(&proc->p_lock);
 
-	// Added for A2
-	array_cleanup(&proc->p_children);
-	lock_destroy(proc->p_exit_lk);
-	lock_destroy(proc->p_wait_lk);
-	cv_destroy(proc->p_wait_cv);
+	/*
+	 * The spinlock, cv, and arrays go back to the cache with the proc,
+	 * so they have to be in the state proc_ctor left them in.
+	 */
+	KASSERT(threadarray_num(&proc->p_threads) == 0);
+	KASSERT(array_num(&proc->p_children) == 0);
 
 	kfree(proc->p_name);
-	kfree(proc);
+	kmem_cache_free(&proc_cache, proc);
 
 #ifdef UW
 	/* decrement the process count */
@@ -326,6 +548,13 @@ void proc_destroy(struct proc *proc) {
  */
 void proc_bootstrap(void) {
 
+	pidtab_bootstrap();
+
+	exitrec_lock = lock_create("exitrec_lock");
+	if (exitrec_lock == NULL) {
+		panic("could not create exitrec_lock\n");
+	}
+
 	kproc = proc_create("[kernel]");
 	if (kproc == NULL) {
 		panic("proc_create for kproc failed\n");
@@ -343,33 +572,54 @@ void proc_bootstrap(void) {
 #endif // UW
 }
 
+/*
+ * Give a new process a file table with the console open on stdin,
+ * stdout, and stderr. This should always succeed.
+ */
+static void proc_openstdio(struct proc *proc) {
+	static const int modes[3] = { O_RDONLY, O_WRONLY, O_WRONLY };
+	struct openfile *of;
+	char *console_path;
+	int fd, i;
+
+	proc->p_ft = filetable_create();
+	if (proc->p_ft == NULL) {
+		panic("unable to create a file table during process creation\n");
+	}
+	for (i = 0; i < 3; i++) {
+		/* vfs_open may change the path, so it gets a fresh copy each time */
+		console_path = kstrdup("con:");
+		if (console_path == NULL) {
+			panic("unable to copy console path name during process creation\n");
+		}
+		if (openfile_open(console_path, modes[i], 0, &of)) {
+			panic("unable to open the console during process creation\n");
+		}
+		kfree(console_path);
+		if (filetable_place(proc->p_ft, of, &fd)) {
+			panic("unable to place the console in a new file table\n");
+		}
+		KASSERT(fd == i);
+	}
+}
+
 /*
  * Create a fresh proc for use by runprogram.
  *
  * It will have no address space and will inherit the current
- * process's (that is, the kernel menu's) current directory.
+ * process's (that is, the kernel menu's) current directory. When the
+ * current process is a user process calling fork, it also inherits its
+ * open files.
  */
 struct proc * proc_create_runprogram(const char *name) {
 	struct proc *proc;
-	char *console_path;
+	int result;
 
 	proc = proc_create(name);
 	if (proc == NULL) {
 		return NULL;
 	}
 
-#ifdef UW
-	/* open the console - this should always succeed */
-	console_path = kstrdup("con:");
-	if (console_path == NULL) {
-	  panic("unable to copy console path name during process creation\n");
-	}
-	if (vfs_open(console_path,O_WRONLY,0,&(proc->console))) {
-	  panic("unable to open the console during process creation\n");
-	}
-	kfree(console_path);
-#endif // UW
-
 	/* VM fields */
 
 	proc->p_addrspace = NULL;
@@ -402,6 +652,20 @@ struct proc * proc_create_runprogram(const char *name) {
 	V(proc_count_mutex);
 #endif // UW
 
+	/*
+	 * Open files: a forked process shares its parent's. A process
+	 * started from the kernel menu gets the console instead.
+	 */
+	if (curproc->p_ft != NULL) {
+		result = filetable_copy(curproc->p_ft, &proc->p_ft);
+		if (result) {
+			proc_destroy(proc);
+			return NULL;
+		}
+	} else {
+		proc_openstdio(proc);
+	}
+
 	return proc;
 }
 
@@ -50,6 +50,10 @@
 #include <test.h>
 #include <version.h>
 #include "autoconf.h"  // for pseudoconfig
+#include "opt-smartvm.h"
+#if OPT_SMARTVM
+#include <uw-vmstats.h>
+#endif
 
 
 /*
@@ -146,6 +150,9 @@ shutdown(void)
 {
 
 	kprintf("Shutting down.\n");
+#if OPT_SMARTVM
+	vmstats_print();
+#endif
 
 	vfs_clearbootfs();
 	vfs_clearcurdir();
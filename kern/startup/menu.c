@@ -38,6 +38,10 @@
 #include <thread.h>
 #include <proc.h>
 #include <synch.h>
+#include <vm.h>
+#include <kmprof.h>
+#include <buf.h>
+#include <dcache.h>
 #include <vfs.h>
 #include <sfs.h>
 #include <syscall.h>
@@ -45,6 +49,7 @@
 #include "opt-synchprobs.h"
 #include "opt-sfs.h"
 #include "opt-net.h"
+#include "opt-smartvm.h"
 
 /*
  * In-kernel menu and command dispatcher.
@@ -401,6 +406,99 @@ cmd_kheapstats(int nargs, char **args)
 	return 0;
 }
 
+static
+int
+cmd_bufstats(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+	buf_printstats();
+
+	return 0;
+}
+
+static
+int
+cmd_dcachestats(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+	dcache_printstats();
+
+	return 0;
+}
+
+/*
+ * Command for the kmalloc profiler: "kmprof on", "kmprof off",
+ * "kmprof reset", or just "kmprof" to show the call sites.
+ */
+static
+int
+cmd_kmprof(int nargs, char **args)
+{
+	if (nargs == 1) {
+		kmprof_printstats();
+		return 0;
+	}
+	if (nargs == 2) {
+		if (!strcmp(args[1], "on")) {
+			return kmprof_start();
+		}
+		if (!strcmp(args[1], "off")) {
+			kmprof_stop();
+			return 0;
+		}
+		if (!strcmp(args[1], "reset")) {
+			kmprof_reset();
+			return 0;
+		}
+	}
+	kprintf("Usage: kmprof [on|off|reset]\n");
+	return EINVAL;
+}
+
+/*
+ * Command for the thread pool: "tp on", "tp off", or just "tp" to
+ * show its statistics.
+ */
+static
+int
+cmd_threadpool(int nargs, char **args)
+{
+	if (nargs == 1) {
+		threadpool_printstats();
+		return 0;
+	}
+	if (nargs == 2) {
+		if (!strcmp(args[1], "on")) {
+			threadpool_enable(true);
+			return 0;
+		}
+		if (!strcmp(args[1], "off")) {
+			threadpool_enable(false);
+			return 0;
+		}
+	}
+	kprintf("Usage: tp [on|off]\n");
+	return EINVAL;
+}
+
+#if OPT_SMARTVM
+static
+int
+cmd_coremapstats(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+	coremap_printstats();
+
+	return 0;
+}
+#endif
+
 ////////////////////////////////////////
 //
 // Menus.
@@ -510,6 +608,13 @@ static const char *mainmenu[] = {
 #endif /* UW */
 #endif
 	"[kh] Kernel heap stats              ",
+	"[kmprof] kmalloc profiler           ",
+	"[bc] Buffer cache stats             ",
+	"[dc] Name cache stats               ",
+	"[tp] Thread pool stats/on/off       ",
+#if OPT_SMARTVM
+	"[cm] Coremap (physical page) stats  ",
+#endif
 	"[q] Quit and shut down              ",
 	NULL
 };
@@ -566,6 +671,13 @@ static struct {
 
 	/* stats */
 	{ "kh",         cmd_kheapstats },
+	{ "kmprof",     cmd_kmprof },
+	{ "bc",         cmd_bufstats },
+	{ "dc",         cmd_dcachestats },
+	{ "tp",         cmd_threadpool },
+#if OPT_SMARTVM
+	{ "cm",         cmd_coremapstats },
+#endif
 
 	/* base system tests */
 	{ "at",		arraytest },
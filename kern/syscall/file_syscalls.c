@@ -1,60 +1,242 @@
 #include <types.h>
 #include <kern/errno.h>
+#include <kern/fcntl.h>
+#include <kern/seek.h>
+#include <kern/stat.h>
 #include <kern/unistd.h>
 #include <lib.h>
+#include <limits.h>
 #include <uio.h>
 #include <syscall.h>
+#include <synch.h>
 #include <vnode.h>
 #include <vfs.h>
+#include <copyinout.h>
 #include <current.h>
 #include <proc.h>
+#include <filetable.h>
+#include <vmobj.h>
+#include "opt-smartvm.h"
 
-/* handler for write() system call                  */
 /*
- * n.b.
- * This implementation handles only writes to standard output
- * and standard error, both of which go to the console.
- * Also, it does not provide any synchronization, so writes
- * are not atomic.
+ * File system calls. Descriptors index the process's file table; see
+ * filetable.h for how open files are shared and locked.
+ */
+
+int
+sys_open(const_userptr_t upath, int flags, mode_t mode, int *retval)
+{
+	const int allflags = O_ACCMODE | O_CREAT | O_EXCL | O_TRUNC |
+		O_APPEND | O_NOCTTY;
+	struct openfile *of;
+	char *path;
+	int fd, result;
+
+	if ((flags & ~allflags) != 0 || (flags & O_ACCMODE) == O_ACCMODE) {
+		return EINVAL;
+	}
+
+	path = kmalloc(PATH_MAX);
+	if (path == NULL) {
+		return ENOMEM;
+	}
+	result = copyinstr(upath, path, PATH_MAX, NULL);
+	if (result) {
+		kfree(path);
+		return result;
+	}
+
+	DEBUG(DB_SYSCALL,"Syscall: open(%s,0x%x)\n",path,flags);
+
+	result = openfile_open(path, flags, mode, &of);
+	kfree(path);
+	if (result) {
+		return result;
+	}
+
+	result = filetable_place(curproc->p_ft, of, &fd);
+	if (result) {
+		openfile_decref(of);
+		return result;
+	}
+
+	*retval = fd;
+	return 0;
+}
+
+/*
+ * Common code for read and write.
  *
- * You will need to improve this implementation
+ * The offset lock is per open file, so only processes sharing the
+ * same open file (through fork or dup2) wait for each other here.
+ *
+ * Under smartvm, a file that's mapped with mmap has pages in memory
+ * that the file may not have yet; vmobj_rw keeps the two in step.
  */
+static
+int
+file_rw(int fdesc, userptr_t ubuf, size_t nbytes, enum uio_rw rw,
+	int *retval)
+{
+	struct openfile *of;
+	struct iovec iov;
+	struct uio u;
+	struct stat st;
+	int result;
+
+	KASSERT(curproc != NULL);
+	KASSERT(curproc->p_addrspace != NULL);
+
+	result = filetable_get(curproc->p_ft, fdesc, &of);
+	if (result) {
+		return result;
+	}
+	if (of->of_accmode == (rw == UIO_READ ? O_WRONLY : O_RDONLY)) {
+		return EBADF;
+	}
+
+	/* set up a uio structure to refer to the user program's buffer (ubuf) */
+	iov.iov_ubase = ubuf;
+	iov.iov_len = nbytes;
+	u.uio_iov = &iov;
+	u.uio_iovcnt = 1;
+	u.uio_offset = 0;  /* stays 0 for the console */
+	u.uio_resid = nbytes;
+	u.uio_segflg = UIO_USERSPACE;
+	u.uio_rw = rw;
+	u.uio_space = curproc->p_addrspace;
+
+	if (of->of_seekable) {
+		lock_acquire(of->of_lock);
+		if (rw == UIO_WRITE && of->of_append) {
+			result = VOP_STAT(of->of_vnode, &st);
+			if (result) {
+				lock_release(of->of_lock);
+				return result;
+			}
+			of->of_offset = st.st_size;
+		}
+		u.uio_offset = of->of_offset;
+		lock_release(of->of_lock);
+	}
+
+#if OPT_SMARTVM
+	result = vmobj_rw(of->of_vnode, &u);
+#else
+	if (rw == UIO_READ) {
+		result = VOP_READ(of->of_vnode, &u);
+	} else {
+		result = VOP_WRITE(of->of_vnode, &u);
+	}
+#endif
+
+	if (result) {
+		/* the call failed, so the offset doesn't move */
+		return result;
+	}
+	if (of->of_seekable) {
+		lock_acquire(of->of_lock);
+		of->of_offset = u.uio_offset;
+		lock_release(of->of_lock);
+	}
+
+	/* pass back the number of bytes actually transferred */
+	*retval = nbytes - u.uio_resid;
+	KASSERT(*retval >= 0);
+	return 0;
+}
 
 int
-sys_write(int fdesc,userptr_t ubuf,unsigned int nbytes,int *retval)
+sys_read(int fdesc, userptr_t ubuf, size_t nbytes, int *retval)
 {
-  struct iovec iov;
-  struct uio u;
-  int res;
-
-  DEBUG(DB_SYSCALL,"Syscall: write(%d,%x,%d)\n",fdesc,(unsigned int)ubuf,nbytes);
-
-  /* only stdout and stderr writes are currently implemented */
-  if (!((fdesc==STDOUT_FILENO)||(fdesc==STDERR_FILENO))) {
-    return EUNIMP;
-  }
-  KASSERT(curproc != NULL);
-  KASSERT(curproc->console != NULL);
-  KASSERT(curproc->p_addrspace != NULL);
-
-  /* set up a uio structure to refer to the user program's buffer (ubuf) */
-  iov.iov_ubase = ubuf;
-  iov.iov_len = nbytes;
-  u.uio_iov = &iov;
-  u.uio_iovcnt = 1;
-  u.uio_offset = 0;  /* not needed for the console */
-  u.uio_resid = nbytes;
-  u.uio_segflg = UIO_USERSPACE;
-  u.uio_rw = UIO_WRITE;
-  u.uio_space = curproc->p_addrspace;
-
-  res = VOP_WRITE(curproc->console,&u);
-  if (res) {
-    return res;
-  }
-
-  /* pass back the number of bytes actually written */
-  *retval = nbytes - u.uio_resid;
-  KASSERT(*retval >= 0);
-  return 0;
+	DEBUG(DB_SYSCALL,"Syscall: read(%d,%x,%d)\n",fdesc,(unsigned int)ubuf,nbytes);
+
+	return file_rw(fdesc, ubuf, nbytes, UIO_READ, retval);
+}
+
+int
+sys_write(int fdesc, userptr_t ubuf, size_t nbytes, int *retval)
+{
+	DEBUG(DB_SYSCALL,"Syscall: write(%d,%x,%d)\n",fdesc,(unsigned int)ubuf,nbytes);
+
+	return file_rw(fdesc, ubuf, nbytes, UIO_WRITE, retval);
+}
+
+int
+sys_close(int fdesc)
+{
+	DEBUG(DB_SYSCALL,"Syscall: close(%d)\n",fdesc);
+
+	return filetable_close(curproc->p_ft, fdesc);
+}
+
+int
+sys_lseek(int fdesc, off_t pos, int whence, off_t *retval)
+{
+	struct openfile *of;
+	struct stat st;
+	off_t newpos;
+	int result;
+
+	DEBUG(DB_SYSCALL,"Syscall: lseek(%d,%lld,%d)\n",fdesc,pos,whence);
+
+	result = filetable_get(curproc->p_ft, fdesc, &of);
+	if (result) {
+		return result;
+	}
+	if (!of->of_seekable) {
+		return ESPIPE;
+	}
+
+	lock_acquire(of->of_lock);
+	switch (whence) {
+	    case SEEK_SET:
+		newpos = pos;
+		break;
+	    case SEEK_CUR:
+		newpos = of->of_offset + pos;
+		break;
+	    case SEEK_END:
+		result = VOP_STAT(of->of_vnode, &st);
+		if (result) {
+			lock_release(of->of_lock);
+			return result;
+		}
+		newpos = st.st_size + pos;
+		break;
+	    default:
+		lock_release(of->of_lock);
+		return EINVAL;
+	}
+
+	if (newpos < 0) {
+		lock_release(of->of_lock);
+		return EINVAL;
+	}
+	result = VOP_TRYSEEK(of->of_vnode, newpos);
+	if (result) {
+		lock_release(of->of_lock);
+		return result;
+	}
+	of->of_offset = newpos;
+	lock_release(of->of_lock);
+
+	*retval = newpos;
+	return 0;
+}
+
+int
+sys_dup2(int oldfd, int newfd, int *retval)
+{
+	int result;
+
+	DEBUG(DB_SYSCALL,"Syscall: dup2(%d,%d)\n",oldfd,newfd);
+
+	result = filetable_dup2(curproc->p_ft, oldfd, newfd);
+	if (result) {
+		return result;
+	}
+
+	*retval = newfd;
+	return 0;
 }
@@ -0,0 +1,53 @@
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <copyinout.h>
+#include <syscall.h>
+#include <kmprof.h>
+
+/**
+	__kmprof: control the kernel heap profiler, or copy out up to nsites
+	of its call sites into buf. See kern/kmprof.h.
+*/
+int sys___kmprof(int op, userptr_t buf, size_t nsites, int32_t *retval) {
+	struct kmprof_site *sites;
+	unsigned n;
+	int result;
+
+	*retval = 0;
+	switch (op) {
+	case KMPROF_GET:
+		break;
+	case KMPROF_START:
+		return kmprof_start();
+	case KMPROF_STOP:
+		kmprof_stop();
+		return 0;
+	case KMPROF_RESET:
+		kmprof_reset();
+		return 0;
+	default:
+		return EINVAL;
+	}
+
+	if (nsites > KMPROF_NSITES) {
+		nsites = KMPROF_NSITES;
+	}
+	if (nsites == 0) {
+		return 0;
+	}
+
+	sites = kmalloc(nsites * sizeof(*sites));
+	if (sites == NULL) {
+		return ENOMEM;
+	}
+	n = kmprof_get(sites, nsites);
+	result = copyout(sites, buf, n * sizeof(*sites));
+	kfree(sites);
+	if (result) {
+		return result;
+	}
+
+	*retval = n;
+	return 0;
+}
@@ -59,7 +59,9 @@
 #include <addrspace.h>
 #include <vnode.h>
 #include <elf.h>
+#include "opt-smartvm.h"
 
+#if !OPT_SMARTVM
 /*
  * Load a segment at virtual address VADDR. The segment in memory
  * extends from VADDR up to (but not including) VADDR+MEMSIZE. The
@@ -144,6 +146,7 @@ load_segment(struct addrspace *as, struct vnode *v,
 
 	return result;
 }
+#endif /* !OPT_SMARTVM */
 
 /*
  * Load an ELF executable user program into the current address space.
@@ -288,9 +291,22 @@ load_elf(struct vnode *v, vaddr_t *entrypoint)
 			return ENOEXEC;
 		}
 
+#if OPT_SMARTVM
+		/*
+		 * Don't read anything yet: each page is read from the
+		 * file (or zero-filled) when it's first touched.
+		 */
+		if (ph.p_filesz > ph.p_memsz) {
+			kprintf("ELF: warning: segment filesize > segment memsize\n");
+			ph.p_filesz = ph.p_memsz;
+		}
+		result = as_define_backing(as, v, ph.p_offset, ph.p_vaddr,
+					   ph.p_filesz);
+#else
 		result = load_segment(as, v, ph.p_offset, ph.p_vaddr,
 				      ph.p_memsz, ph.p_filesz,
 				      ph.p_flags & PF_X);
+#endif
 		if (result) {
 			return result;
 		}
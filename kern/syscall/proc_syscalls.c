@@ -30,19 +30,9 @@ void sys__exit(int exitcode) {
 
 	KASSERT(curproc->p_addrspace != NULL);
 
-	// Signal all the child processes that it is now OKAY to kill themselves
-	for (unsigned int i = array_num(&p->p_children); i > 0 ; i--) {
-
-		// This allows children to destroy themselves
-		struct proc *cproc = array_get(&p->p_children, i - 1);
-		lock_release(cproc->p_exit_lk);
-
-		// Remove the child from the children array
-		array_remove(&p->p_children, i - 1);
-	}
-
-	// All children must have been removed from the array
-	KASSERT(array_num(&p->p_children) == 0);
+	// Our children don't need us to stay around: drop the exit records
+	// of any that have already exited, and orphan the rest.
+	proc_orphanchildren(p);
 
 	as_deactivate();
 	/*
@@ -59,19 +49,10 @@ void sys__exit(int exitcode) {
 	/* note: curproc cannot be used after this call */
 	proc_remthread(curthread);
 
-	p->p_did_exit = true;
 	p->p_exitcode = _MKWAIT_EXIT(exitcode);
 
-	// Let anyone waiting for this thread know that it has exited
-	cv_broadcast(p->p_wait_cv, p->p_wait_lk);
-
-	// Signal parent processes that we're finished!
-
-	// Okay, at this point, we need to wait for the parent process to exit
-	// before fully destroying ourselves. This way, the parent process can call
-	// waitpid on its children at any time.
-	lock_acquire(p->p_exit_lk);
-	lock_release(p->p_exit_lk);
+	// proc_destroy leaves our status in the exit record, if we have
+	// one, and wakes the parent; everything else goes now.
 
 	/* if this is the last user process in the system, proc_destroy()
 		 will wake up the kernel menu thread */
@@ -120,11 +101,21 @@ int sys_fork(struct trapframe *ctf, pid_t *retval) {
 	memcpy(ntf, ctf, sizeof(struct trapframe));
 	DEBUG(DB_SYSCALL, "sys_fork: New trap frame created.\n");
 
+	// Link the child to us before it can run, so that it can't exit
+	// without leaving a record for waitpid
+	int addchild_err = proc_addchild(curp, newp);
+	if (addchild_err) {
+		proc_destroy(newp);
+		kfree(ntf);
+		return addchild_err;
+	}
+
 	// Fork the current thread into the new process and enter it
 	// The current trap frame should have the same virtual address...?
 	int thread_fork_err = thread_fork(curthread->t_name, newp, &enter_forked_process, ntf, 0);
 	if (thread_fork_err) {
 		DEBUG(DB_SYSCALL, "sys_fork error: Could not fork curren thread.\n");
+		proc_remchild(curp, newp);
 		proc_destroy(newp); // removes address space as well
 		kfree(ntf);
 		ntf = NULL;
@@ -132,12 +123,6 @@ int sys_fork(struct trapframe *ctf, pid_t *retval) {
 	}
 	DEBUG(DB_SYSCALL, "sys_fork: Current thread forked successfully.\n");
 
-	// Add the child process to the current one's children array
-	array_add(&curp->p_children, newp, NULL);
-
-	// Grab the child's exit lock to prevent it from exiting
-	lock_acquire(newp->p_exit_lk);
-
 	// Return the new processes's ID
 	*retval = newp->p_id;
 
@@ -158,31 +143,20 @@ int sys_waitpid(pid_t pid, userptr_t status, int options, pid_t *retval) {
 	int exitstatus;
 	int result;
 
-	// Get the process for the given PID
-	struct proc * p = procarray_allprocs_proc_by_pid(pid);
-
-	if (p == NULL) {
-		// Requested PID does not exist
-		return ESRCH;
-	}
-
-	if (p == curproc) {
-		// Current process can't wait on itself
-		return ECHILD;
-	}
-
 	if (options != 0) {
 		return EINVAL;
 	}
 
-	// Wait for the thread to exit before returning.
-	lock_acquire(p->p_wait_lk);
-		while (!p->p_did_exit) {
-			cv_wait(p->p_wait_cv, p->p_wait_lk);
+	// Wait for the child to exit and collect its exit record
+	result = proc_reap(curproc, pid, &exitstatus);
+	if (result) {
+		// ESRCH if there's no such process at all
+		if (result == ECHILD && !proc_exists(pid)) {
+			return ESRCH;
 		}
-	lock_release(p->p_wait_lk);
+		return result;
+	}
 
-	exitstatus = p->p_exitcode;
 	result = copyout((void *)&exitstatus, status, sizeof(int));
 
 	if (result) {
@@ -0,0 +1,165 @@
+#include <types.h>
+#include <kern/errno.h>
+#include <kern/fcntl.h>
+#include <kern/mman.h>
+#include <lib.h>
+#include <syscall.h>
+#include <current.h>
+#include <proc.h>
+#include <addrspace.h>
+#include <vnode.h>
+#include <filetable.h>
+#include <shm.h>
+
+/**
+	sbrk: move the end of the heap by amount bytes and hand back where it
+	used to be. amount may be negative, but the heap can't shrink past
+	where it started. Unaligned amounts are fine.
+*/
+int sys_sbrk(intptr_t amount, int32_t *retval) {
+	struct addrspace *as;
+	vaddr_t oldbreak;
+	int result;
+
+	DEBUG(DB_SYSCALL, "Syscall: sbrk(%d)\n", (int)amount);
+
+	as = curproc_getas();
+	KASSERT(as != NULL);
+
+	result = as_sbrk(as, amount, &oldbreak);
+	if (result) {
+		return result;
+	}
+
+	*retval = (int32_t)oldbreak;
+	return 0;
+}
+
+/**
+	mmap: map len bytes at (or near) addr, anonymous memory if flags has
+	MAP_ANON and the file open on fd otherwise, and hand back where. See
+	as_mmap.
+*/
+int sys_mmap(userptr_t addr, size_t len, int prot, int flags, int fd,
+	     off_t offset, int32_t *retval) {
+	struct addrspace *as;
+	struct openfile *of;
+	struct vnode *v = NULL;
+	vaddr_t vaddr;
+	int result;
+
+	DEBUG(DB_SYSCALL, "Syscall: mmap(%p, %u, 0x%x, 0x%x, %d)\n",
+	      addr, (unsigned)len, prot, flags, fd);
+
+	as = curproc_getas();
+	KASSERT(as != NULL);
+
+	if ((flags & MAP_ANON) == 0) {
+		result = filetable_get(curproc->p_ft, fd, &of);
+		if (result) {
+			return result;
+		}
+		/*
+		 * The file has to be readable, and writable too if writes
+		 * to the mapping are going to end up in it.
+		 */
+		if (of->of_accmode == O_WRONLY) {
+			return EACCES;
+		}
+		if ((flags & MAP_SHARED) && (prot & PROT_WRITE) &&
+		    of->of_accmode != O_RDWR) {
+			return EACCES;
+		}
+		result = VOP_MMAP(of->of_vnode);
+		if (result) {
+			return result;
+		}
+		v = of->of_vnode;
+	}
+
+	result = as_mmap(as, (vaddr_t)addr, len, prot, flags, v, offset, &vaddr);
+	if (result) {
+		return result;
+	}
+
+	*retval = (int32_t)vaddr;
+	return 0;
+}
+
+/**
+	munmap: remove the mapping of len bytes at addr
+*/
+int sys_munmap(userptr_t addr, size_t len) {
+	struct addrspace *as;
+
+	DEBUG(DB_SYSCALL, "Syscall: munmap(%p, %u)\n", addr, (unsigned)len);
+
+	as = curproc_getas();
+	KASSERT(as != NULL);
+
+	return as_munmap(as, (vaddr_t)addr, len);
+}
+
+/**
+	shm_create: find or make the shared memory segment for key, and
+	hand back its id. See kern/shm.h.
+*/
+int sys_shm_create(int key, size_t size, int32_t *retval) {
+	int id, result;
+
+	DEBUG(DB_SYSCALL, "Syscall: shm_create(%d, %u)\n", key, (unsigned)size);
+
+	result = shm_create(key, size, &id);
+	if (result) {
+		return result;
+	}
+
+	*retval = id;
+	return 0;
+}
+
+/**
+	shm_attach: map segment id, at addr if possible, and hand back where
+*/
+int sys_shm_attach(int id, userptr_t addr, int32_t *retval) {
+	struct addrspace *as;
+	vaddr_t vaddr;
+	int result;
+
+	DEBUG(DB_SYSCALL, "Syscall: shm_attach(%d, %p)\n", id, addr);
+
+	as = curproc_getas();
+	KASSERT(as != NULL);
+
+	result = shm_attach(as, id, (vaddr_t)addr, &vaddr);
+	if (result) {
+		return result;
+	}
+
+	*retval = (int32_t)vaddr;
+	return 0;
+}
+
+/**
+	shm_detach: unmap the segment attached at addr
+*/
+int sys_shm_detach(userptr_t addr) {
+	struct addrspace *as;
+
+	DEBUG(DB_SYSCALL, "Syscall: shm_detach(%p)\n", addr);
+
+	as = curproc_getas();
+	KASSERT(as != NULL);
+
+	return shm_detach(as, (vaddr_t)addr);
+}
+
+/**
+	shm_remove: take segment id out of the table; it goes away when the
+	last process detaches it
+*/
+int sys_shm_remove(int id) {
+	DEBUG(DB_SYSCALL, "Syscall: shm_remove(%d)\n", id);
+
+	return shm_remove(id);
+}
@@ -32,6 +32,7 @@
  */
 #include <types.h>
 #include <lib.h>
+#include <clock.h>
 #include <thread.h>
 #include <synch.h>
 #include <test.h>
@@ -44,13 +45,18 @@
  * available memory.
  *
  * mallocstress does the same thing, but from NTHREADS different
- * threads at once.
+ * threads at once. Then it times NTHREADS threads all doing small
+ * kmalloc/kfree pairs, the sizes kernel objects like locks and
+ * threads come in, to see how well kmalloc copes with contention.
  */
 
 #define NTRIES   1200
 #define ITEMSIZE  997
 #define NTHREADS  8
 
+#define NBENCHLOOPS  500
+#define NBENCHITEMS  8
+
 static
 void
 mallocthread(void *sm, unsigned long num)
@@ -90,6 +96,68 @@ mallocthread(void *sm, unsigned long num)
 	}
 }
 
+static
+void
+mallocbenchthread(void *sm, unsigned long num)
+{
+	struct semaphore *sem = sm;
+	void *ptrs[NBENCHITEMS];
+	int i, j;
+
+	for (i=0; i<NBENCHLOOPS; i++) {
+		for (j=0; j<NBENCHITEMS; j++) {
+			/* 16 to 256 bytes */
+			ptrs[j] = kmalloc(16 << (j % 5));
+			if (ptrs[j] == NULL) {
+				kprintf("thread %lu: kmalloc returned NULL\n",
+					num);
+				while (j-- > 0) {
+					kfree(ptrs[j]);
+				}
+				V(sem);
+				return;
+			}
+		}
+		for (j=0; j<NBENCHITEMS; j++) {
+			kfree(ptrs[j]);
+		}
+	}
+	V(sem);
+}
+
+static
+void
+mallocbench(struct semaphore *sem)
+{
+	time_t secs1, secs2, rsecs;
+	uint32_t nsecs1, nsecs2, rnsecs;
+	unsigned long nops;
+	int i, result;
+
+	kprintf("Timing kmalloc contention...\n");
+
+	gettime(&secs1, &nsecs1);
+	for (i=0; i<NTHREADS; i++) {
+		result = thread_fork("mallocbench", NULL,
+				     mallocbenchthread, sem, i);
+		if (result) {
+			panic("mallocstress: thread_fork failed: %s\n",
+			      strerror(result));
+		}
+	}
+	for (i=0; i<NTHREADS; i++) {
+		P(sem);
+	}
+	gettime(&secs2, &nsecs2);
+
+	getinterval(secs1, nsecs1, secs2, nsecs2, &rsecs, &rnsecs);
+	nops = (unsigned long)NTHREADS * NBENCHLOOPS * NBENCHITEMS;
+	kprintf("%d threads, %lu kmalloc/kfree pairs: %lu.%09lu seconds, "
+		"%lu ns per pair\n", NTHREADS, nops,
+		(unsigned long)rsecs, (unsigned long)rnsecs,
+		(unsigned long)rsecs * (1000000000UL / nops) + rnsecs / nops);
+}
+
 int
 malloctest(int nargs, char **args)
 {
@@ -132,6 +200,8 @@ mallocstress(int nargs, char **args)
 		P(sem);
 	}
 
+	mallocbench(sem);
+
 	sem_destroy(sem);
 	kprintf("kmalloc stress test done\n");
 
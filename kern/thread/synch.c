@@ -33,41 +33,65 @@
  */
 
 #include <types.h>
+#include <kern/errno.h>
 #include <lib.h>
 #include <spinlock.h>
 #include <wchan.h>
 #include <thread.h>
 #include <current.h>
 #include <synch.h>
+#include <kmem_cache.h>
+
+/*
+ * Semaphores, locks, and CVs come from object caches. The wait channel
+ * and spinlock are set up once, by the constructor, and stay with the
+ * object while it sits in the cache; creating one only has to copy the
+ * name and reset the state.
+ */
 
 ////////////////////////////////////////////////////////////
 //
 // Semaphore.
 
+static int sem_ctor(void *obj) {
+	struct semaphore *sem = obj;
+
+	sem->sem_wchan = wchan_create("semaphore");
+	if (sem->sem_wchan == NULL) {
+		return ENOMEM;
+	}
+	spinlock_init(&sem->sem_lock);
+	return 0;
+}
+
+static void sem_dtor(void *obj) {
+	struct semaphore *sem = obj;
+
+	spinlock_cleanup(&sem->sem_lock);
+	wchan_destroy(sem->sem_wchan);
+}
+
+static struct kmem_cache sem_cache =
+	KMEM_CACHE_INITIALIZER("semaphore", sizeof(struct semaphore),
+			       sem_ctor, sem_dtor);
+
 struct semaphore * sem_create(const char *name, int initial_count) {
 	struct semaphore *sem;
 
 	KASSERT(initial_count >= 0);
 
-	sem = kmalloc(sizeof(struct semaphore));
+	sem = kmem_cache_alloc(&sem_cache);
 	if (sem == NULL) {
 		return NULL;
 	}
 
 	sem->sem_name = kstrdup(name);
 	if (sem->sem_name == NULL) {
-			kfree(sem);
+			kmem_cache_free(&sem_cache, sem);
 			return NULL;
 	}
+	wchan_setname(sem->sem_wchan, sem->sem_name);
 
-	sem->sem_wchan = wchan_create(sem->sem_name);
-	if (sem->sem_wchan == NULL) {
-		kfree(sem->sem_name);
-		kfree(sem);
-		return NULL;
-	}
-
-	spinlock_init(&sem->sem_lock);
 	sem->sem_count = initial_count;
 
 	return sem;
@@ -76,11 +100,11 @@ struct semaphore * sem_create(const char *name, int initial_count) {
 void sem_destroy(struct semaphore *sem) {
 		KASSERT(sem != NULL);
 
-	/* wchan_cleanup will assert if anyone's waiting on it */
-	spinlock_cleanup(&sem->sem_lock);
-	wchan_destroy(sem->sem_wchan);
+	/* It goes back in the cache; nobody may be waiting on it */
+	KASSERT(wchan_isempty(sem->sem_wchan));
+	wchan_setname(sem->sem_wchan, "semaphore");
 	kfree(sem->sem_name);
-	kfree(sem);
+	kmem_cache_free(&sem_cache, sem);
 }
 
 void P(struct semaphore *sem) {
@@ -140,11 +164,39 @@ void V(struct semaphore *sem) {
 //
 // Lock.
 
+static int lock_ctor(void *obj) {
+	struct lock *lock = obj;
+
+	// Initialize the lock's channel
+	// The channel will control access to threads accessing this same lock
+	lock->lk_wchan = wchan_create("lock");
+	if (lock->lk_wchan == NULL) {
+		// No channel, noo!!!
+		return ENOMEM;
+	}
+
+	// Initalize the internal spinlock
+	// The spinlock is used to enforce atomic lock functionality
+	spinlock_init(&lock->lk_slk);
+	return 0;
+}
+
+static void lock_dtor(void *obj) {
+	struct lock *lock = obj;
+
+	wchan_destroy(lock->lk_wchan);
+	spinlock_cleanup(&lock->lk_slk);
+}
+
+static struct kmem_cache lock_cache =
+	KMEM_CACHE_INITIALIZER("lock", sizeof(struct lock),
+			       lock_ctor, lock_dtor);
+
 struct lock * lock_create(const char *name) {
 	struct lock *lock;
 
-	// Initialize the primary lock data structure
-	lock = kmalloc(sizeof(struct lock));
+	// Get a lock with its channel and spinlock already set up
+	lock = kmem_cache_alloc(&lock_cache);
 	if (lock == NULL) {
 		return NULL;
 	}
@@ -152,23 +204,10 @@ struct lock * lock_create(const char *name) {
 	// Initialize the lock's name
 	lock->lk_name = kstrdup(name);
 	if (lock->lk_name == NULL) {
-		kfree(lock);
-		return NULL;
-	}
-
-	// Initialize the lock's channel
-	// The channel will control access to threads accessing this same lock
-	lock->lk_wchan = wchan_create(name);
-	if (lock->lk_wchan == NULL) {
-		// No channel, noo!!!
-		kfree(lock->lk_name);
-		kfree(lock);
+		kmem_cache_free(&lock_cache, lock);
 		return NULL;
 	}
-
-	// Initalize the internal spinlock
-	// The spinlock is used to enforce atomic lock functionality
-	spinlock_init(&lock->lk_slk);
+	wchan_setname(lock->lk_wchan, lock->lk_name);
 
 	// Set the holding thread to NULL initially
 	lock->lk_holder = NULL;
@@ -184,12 +223,12 @@ void lock_destroy(struct lock *lock) {
 	// Make sure it's unlocked
 	KASSERT(lock != NULL && !lock->locked && lock->lk_holder == NULL);
 
-	// Free up pointers and cleanup spinlock
-	wchan_destroy(lock->lk_wchan);
-	spinlock_cleanup(&lock->lk_slk);
+	// Back to the cache, with the channel and spinlock left set up
+	KASSERT(wchan_isempty(lock->lk_wchan));
+	wchan_setname(lock->lk_wchan, "lock");
 
 	kfree(lock->lk_name);
-	kfree(lock);
+	kmem_cache_free(&lock_cache, lock);
 }
 
 void lock_acquire(struct lock *lock) {
@@ -244,28 +283,41 @@ bool lock_do_i_hold(struct lock *lock) {
 // CV
 
 
+static int cv_ctor(void *obj) {
+	struct cv *cv = obj;
+
+	// Initialize the CV's channel
+	cv->cv_wchan = wchan_create("cv");
+	if (cv->cv_wchan == NULL) {
+		// No channel, noo!!!
+		return ENOMEM;
+	}
+	return 0;
+}
+
+static void cv_dtor(void *obj) {
+	struct cv *cv = obj;
+
+	wchan_destroy(cv->cv_wchan);
+}
+
+static struct kmem_cache cv_cache =
+	KMEM_CACHE_INITIALIZER("cv", sizeof(struct cv), cv_ctor, cv_dtor);
+
 struct cv * cv_create(const char *name) {
 	struct cv *cv;
 
-	cv = kmalloc(sizeof(struct cv));
+	cv = kmem_cache_alloc(&cv_cache);
 	if (cv == NULL) {
 		return NULL;
 	}
 
 	cv->cv_name = kstrdup(name);
 	if (cv->cv_name == NULL) {
-		kfree(cv);
-		return NULL;
-	}
-
-	// Initialize the CV's channel
-	cv->cv_wchan = wchan_create(name);
-	if (cv->cv_wchan == NULL) {
-		// No channel, noo!!!
-		kfree(cv->cv_name);
-		kfree(cv);
+		kmem_cache_free(&cv_cache, cv);
 		return NULL;
 	}
+	wchan_setname(cv->cv_wchan, cv->cv_name);
 
 	return cv;
 }
@@ -273,11 +325,12 @@ struct cv * cv_create(const char *name) {
 void cv_destroy(struct cv *cv) {
 	KASSERT(cv != NULL);
 
-	// Free up the wait channel
-	wchan_destroy(cv->cv_wchan);
+	// The wait channel stays with the cv in the cache
+	KASSERT(wchan_isempty(cv->cv_wchan));
+	wchan_setname(cv->cv_wchan, "cv");
 
 	kfree(cv->cv_name);
-	kfree(cv);
+	kmem_cache_free(&cv_cache, cv);
 }
 
 void cv_wait(struct cv *cv, struct lock *lock) {
@@ -50,8 +50,11 @@
 #include <addrspace.h>
 #include <mainbus.h>
 #include <vnode.h>
+#include <vm.h>
+#include <kmem_cache.h>
 
 #include "opt-synchprobs.h"
+#include "opt-smartvm.h"
 
 
 /* Magic number used as a guard value on kernel thread stacks. */
@@ -64,6 +67,22 @@ struct wchan {
 	struct spinlock wc_lock;	/* lock for mutual exclusion */
 };
 
+/*
+ * Threads and wait channels come from object caches; see
+ * thread_ctor and wchan_ctor for what stays set up while they're
+ * in there.
+ */
+static int thread_ctor(void *obj);
+static int wchan_ctor(void *obj);
+static void wchan_dtor(void *obj);
+
+static struct kmem_cache thread_cache =
+	KMEM_CACHE_INITIALIZER("thread", sizeof(struct thread),
+			       thread_ctor, NULL);
+static struct kmem_cache wchan_cache =
+	KMEM_CACHE_INITIALIZER("wchan", sizeof(struct wchan),
+			       wchan_ctor, wchan_dtor);
+
 /* Master array of CPUs. */
 DECLARRAY(cpu);
 DEFARRAY(cpu, /*no inline*/ );
@@ -111,9 +130,137 @@ thread_checkstack(struct thread *thread)
 	}
 }
 
+/*
+ * Object cache constructor for threads. The list node always points
+ * back at its own thread, so that only needs doing once.
+ */
+static
+int
+thread_ctor(void *obj)
+{
+	struct thread *thread = obj;
+
+	threadlistnode_init(&thread->t_listnode, thread);
+	return 0;
+}
+
+/*
+ * Per-cpu pool of threads to recycle (c_threadpool). When a thread is
+ * destroyed, its struct thread goes into the pool of the cpu doing it
+ * with the kernel stack still attached, and the next thread_create on
+ * that cpu takes it back out, so a fork after an exit needs neither a
+ * new thread nor a new stack. The stack magic is checked on the way in
+ * and so doesn't need setting again.
+ *
+ * The pool is only touched by its own cpu, at splhigh.
+ *
+ * threadpool_enable can switch the pool off from the menu, to time
+ * things without it; the threads already in it then just stay there.
+ */
+static bool threadpool_on = true;
+
+static
+struct thread *
+threadpool_get(void)
+{
+	struct thread *thread;
+	int spl;
+
+	if (!CURCPU_EXISTS()) {
+		return NULL;
+	}
+	spl = splhigh();
+	thread = NULL;
+	if (threadpool_on) {
+		thread = threadlist_remhead(&curcpu->c_threadpool);
+	}
+	if (thread != NULL) {
+		curcpu->c_threadpool_hits++;
+	}
+	else {
+		curcpu->c_threadpool_misses++;
+	}
+	splx(spl);
+	return thread;
+}
+
+static
+bool
+threadpool_put(struct thread *thread)
+{
+	bool ret = false;
+	int spl;
+
+	KASSERT(thread->t_stack != NULL);
+
+	if (!CURCPU_EXISTS()) {
+		return false;
+	}
+	spl = splhigh();
+	if (threadpool_on &&
+	    curcpu->c_threadpool.tl_count < THREADPOOL_MAX) {
+		threadlist_addhead(&curcpu->c_threadpool, thread);
+		ret = true;
+	}
+	splx(spl);
+	return ret;
+}
+
+/*
+ * Put THREADPOOL_PREFILL threads with stacks in a new cpu's pool.
+ * Not having them isn't fatal; the pool fills up as threads exit.
+ */
+static
+void
+threadpool_fill(struct cpu *c)
+{
+	struct thread *thread;
+	unsigned i;
+
+	for (i=0; i<THREADPOOL_PREFILL; i++) {
+		thread = kmem_cache_alloc(&thread_cache);
+		if (thread == NULL) {
+			break;
+		}
+		thread->t_stack = kmalloc(STACK_SIZE);
+		if (thread->t_stack == NULL) {
+			kmem_cache_free(&thread_cache, thread);
+			break;
+		}
+		thread_checkstack_init(thread);
+		thread->t_name = NULL;
+		thread->t_wchan_name = "POOL";
+		threadlist_addtail(&c->c_threadpool, thread);
+	}
+}
+
+void
+threadpool_enable(bool on)
+{
+	threadpool_on = on;
+}
+
+void
+threadpool_printstats(void)
+{
+	unsigned i;
+	struct cpu *c;
+
+	kprintf("Thread pool: %s\n", threadpool_on ? "on" : "off");
+	for (i=0; i < cpuarray_num(&allcpus); i++) {
+		c = cpuarray_get(&allcpus, i);
+		/* another cpu's counters; good enough for a report */
+		kprintf("    cpu%u: %u pooled, %u hits, %u misses\n",
+			c->c_number, c->c_threadpool.tl_count,
+			c->c_threadpool_hits, c->c_threadpool_misses);
+	}
+}
+
 /*
  * Create a thread. This is used both to create a first thread
  * for each CPU and to create subsequent forked threads.
+ *
+ * If the thread comes from the pool, it already has a stack.
  */
 static
 struct thread *
@@ -123,14 +270,21 @@ thread_create(const char *name)
 
 	DEBUGASSERT(name != NULL);
 
-	thread = kmalloc(sizeof(*thread));
+	thread = threadpool_get();
 	if (thread == NULL) {
-		return NULL;
+		thread = kmem_cache_alloc(&thread_cache);
+		if (thread == NULL) {
+			return NULL;
+		}
+		thread->t_stack = NULL;
 	}
 
 	thread->t_name = kstrdup(name);
 	if (thread->t_name == NULL) {
-		kfree(thread);
+		if (thread->t_stack != NULL) {
+			kfree(thread->t_stack);
+		}
+		kmem_cache_free(&thread_cache, thread);
 		return NULL;
 	}
 	thread->t_wchan_name = "NEW";
@@ -138,8 +292,6 @@ thread_create(const char *name)
 
 	/* Thread subsystem fields */
 	thread_machdep_init(&thread->t_machdep);
-	threadlistnode_init(&thread->t_listnode, thread);
-	thread->t_stack = NULL;
 	thread->t_context = NULL;
 	thread->t_cpu = NULL;
 	thread->t_proc = NULL;
@@ -167,6 +319,7 @@ cpu_create(unsigned hardware_number)
 {
 	struct cpu *c;
 	int result;
+	unsigned i;
 	char namebuf[16];
 
 	c = kmalloc(sizeof(*c));
@@ -180,6 +333,12 @@ cpu_create(unsigned hardware_number)
 	c->c_curthread = NULL;
 	threadlist_init(&c->c_zombies);
 	c->c_hardclocks = 0;
+	for (i=0; i<KMALLOC_NSIZES; i++) {
+		c->c_kmalloc[i].km_nobjs = 0;
+	}
+	threadlist_init(&c->c_threadpool);
+	c->c_threadpool_hits = 0;
+	c->c_threadpool_misses = 0;
 
 	c->c_isidle = false;
 	threadlist_init(&c->c_runqueue);
@@ -187,6 +346,7 @@ cpu_create(unsigned hardware_number)
 
 	c->c_ipi_pending = 0;
 	c->c_numshootdown = 0;
+	c->c_numshootwait = 0;
 	spinlock_init(&c->c_ipi_lock);
 
 	result = cpuarray_add(&allcpus, c, &c->c_number);
@@ -210,10 +370,13 @@ cpu_create(unsigned hardware_number)
 		 * cpu. This means we're using the boot stack, which
 		 * can't be freed. (Exercise: what would it take to
 		 * make it possible to free the boot stack?)
+		 *
+		 * (There's no curcpu yet, so it didn't come from the
+		 * pool with a stack.)
 		 */
-		/*c->c_curthread->t_stack = ... */
+		KASSERT(c->c_curthread->t_stack == NULL);
 	}
-	else {
+	else if (c->c_curthread->t_stack == NULL) {
 		c->c_curthread->t_stack = kmalloc(STACK_SIZE);
 		if (c->c_curthread->t_stack == NULL) {
 			panic("cpu_create: couldn't allocate stack");
@@ -222,6 +385,8 @@ cpu_create(unsigned hardware_number)
 	}
 	c->c_curthread->t_cpu = c;
 
+	threadpool_fill(c);
+
 	cpu_machdep_init(c);
 
 	return c;
@@ -249,9 +414,6 @@ thread_destroy(struct thread *thread)
 
 	/* Thread subsystem fields */
 	KASSERT(thread->t_proc == NULL);
-	if (thread->t_stack != NULL) {
-		kfree(thread->t_stack);
-	}
 	threadlistnode_cleanup(&thread->t_listnode);
 	thread_machdep_cleanup(&thread->t_machdep);
 
@@ -259,7 +421,17 @@ thread_destroy(struct thread *thread)
 	thread->t_wchan_name = "DESTROYED";
 
 	kfree(thread->t_name);
-	kfree(thread);
+	thread->t_name = NULL;
+
+	if (thread->t_stack != NULL) {
+		/* Keep it, stack and all, for the next thread_create */
+		thread_checkstack(thread);
+		if (threadpool_put(thread)) {
+			return;
+		}
+		kfree(thread->t_stack);
+	}
+	kmem_cache_free(&thread_cache, thread);
 }
 
 /*
@@ -492,13 +664,15 @@ thread_fork(const char *name,
 		return ENOMEM;
 	}
 
-	/* Allocate a stack */
-	newthread->t_stack = kmalloc(STACK_SIZE);
+	/* Allocate a stack, unless it came with one from the pool */
 	if (newthread->t_stack == NULL) {
-		thread_destroy(newthread);
-		return ENOMEM;
+		newthread->t_stack = kmalloc(STACK_SIZE);
+		if (newthread->t_stack == NULL) {
+			thread_destroy(newthread);
+			return ENOMEM;
+		}
+		thread_checkstack_init(newthread);
 	}
-	thread_checkstack_init(newthread);
 
 	/*
 	 * Now we clone various fields from the parent thread.
@@ -635,7 +809,14 @@ thread_switch(threadstate_t newstate, struct wchan *wc)
 		next = threadlist_remhead(&curcpu->c_runqueue);
 		if (next == NULL) {
 			spinlock_release(&curcpu->c_runqueue_lock);
+#if OPT_SMARTVM
+			/* Zero pages for the VM system before sleeping */
+			if (!vm_idle()) {
+				cpu_idle();
+			}
+#else
 			cpu_idle();
+#endif
 			spinlock_acquire(&curcpu->c_runqueue_lock);
 		}
 	} while (next == NULL);
@@ -976,26 +1157,56 @@ wchan_create(const char *name)
 {
 	struct wchan *wc;
 
-	wc = kmalloc(sizeof(*wc));
+	wc = kmem_cache_alloc(&wchan_cache);
 	if (wc == NULL) {
 		return NULL;
 	}
-	spinlock_init(&wc->wc_lock);
-	threadlist_init(&wc->wc_threads);
 	wc->wc_name = name;
 	return wc;
 }
 
 /*
  * Destroy a wait channel. Must be empty and unlocked.
- * (The corresponding cleanup functions require this.)
+ * (The corresponding cleanup functions require this. They only check,
+ * so call them now as well as when the cache lets go of it.)
  */
 void
 wchan_destroy(struct wchan *wc)
 {
 	spinlock_cleanup(&wc->wc_lock);
 	threadlist_cleanup(&wc->wc_threads);
-	kfree(wc);
+	wc->wc_name = "DESTROYED";
+	kmem_cache_free(&wchan_cache, wc);
+}
+
+/*
+ * Change a wait channel's name, as for wchan_create.
+ */
+void
+wchan_setname(struct wchan *wc, const char *name)
+{
+	wc->wc_name = name;
+}
+
+static
+int
+wchan_ctor(void *obj)
+{
+	struct wchan *wc = obj;
+
+	spinlock_init(&wc->wc_lock);
+	threadlist_init(&wc->wc_threads);
+	return 0;
+}
+
+static
+void
+wchan_dtor(void *obj)
+{
+	struct wchan *wc = obj;
+
+	spinlock_cleanup(&wc->wc_lock);
+	threadlist_cleanup(&wc->wc_threads);
 }
 
 /*
@@ -1140,28 +1351,85 @@ ipi_broadcast(int code)
 	}
 }
 
+/*
+ * Queue one shootdown for C; call with its IPI lock held.
+ *
+ * Once more than TLBSHOOTDOWN_MAX are queued, C flushes its whole TLB
+ * instead, but whoever is waiting on a ts_done must still be woken.
+ * So on the switch the entries without a ts_done are thrown away, and
+ * from then on c_shootdown holds only the c_numshootwait that have one.
+ * Every waiter is a thread blocked in its own shootdown, which sets
+ * ts_done on one entry per CPU, so there can't be more of them than
+ * there are slots unless that many threads are shooting down at once.
+ */
+static
 void
-ipi_tlbshootdown(struct cpu *target, const struct tlbshootdown *mapping)
+ipi_queueshootdown(struct cpu *c, const struct tlbshootdown *mapping)
 {
-	int n;
+	int i, n;
 
-	spinlock_acquire(&target->c_ipi_lock);
-
-	n = target->c_numshootdown;
-	if (n == TLBSHOOTDOWN_MAX) {
-		target->c_numshootdown = TLBSHOOTDOWN_ALL;
+	if (c->c_numshootdown == TLBSHOOTDOWN_MAX) {
+		n = 0;
+		for (i=0; i<TLBSHOOTDOWN_MAX; i++) {
+			if (c->c_shootdown[i].ts_done != NULL) {
+				c->c_shootdown[n++] = c->c_shootdown[i];
+			}
+		}
+		c->c_numshootdown = TLBSHOOTDOWN_ALL;
+		c->c_numshootwait = n;
 	}
-	else {
-		target->c_shootdown[n] = *mapping;
-		target->c_numshootdown = n+1;
+
+	if (c->c_numshootdown == TLBSHOOTDOWN_ALL) {
+		if (mapping->ts_done != NULL) {
+			KASSERT(c->c_numshootwait < TLBSHOOTDOWN_MAX);
+			c->c_shootdown[c->c_numshootwait++] = *mapping;
+		}
+		return;
 	}
 
+	c->c_shootdown[c->c_numshootdown++] = *mapping;
+}
+
+void
+ipi_tlbshootdown(struct cpu *target, const struct tlbshootdown *mapping)
+{
+	spinlock_acquire(&target->c_ipi_lock);
+
+	ipi_queueshootdown(target, mapping);
+
 	target->c_ipi_pending |= (uint32_t)1 << IPI_TLBSHOOTDOWN;
 	mainbus_send_ipi(target);
 
 	spinlock_release(&target->c_ipi_lock);
 }
 
+unsigned
+ipi_tlbshootdown_cpus(uint32_t cpumask, const struct tlbshootdown *mappings,
+		      unsigned n)
+{
+	unsigned i, j, sent = 0;
+	struct cpu *c;
+
+	for (i=0; i < cpuarray_num(&allcpus); i++) {
+		c = cpuarray_get(&allcpus, i);
+		if (c == curcpu->c_self ||
+		    (cpumask & ((uint32_t)1 << c->c_number)) == 0) {
+			continue;
+		}
+
+		spinlock_acquire(&c->c_ipi_lock);
+		for (j=0; j<n; j++) {
+			ipi_queueshootdown(c, &mappings[j]);
+		}
+		c->c_ipi_pending |= (uint32_t)1 << IPI_TLBSHOOTDOWN;
+		mainbus_send_ipi(c);
+		spinlock_release(&c->c_ipi_lock);
+
+		sent++;
+	}
+	return sent;
+}
+
 void
 interprocessor_interrupt(void)
 {
@@ -1195,6 +1463,10 @@ interprocessor_interrupt(void)
 	if (bits & (1U << IPI_TLBSHOOTDOWN)) {
 		if (curcpu->c_numshootdown == TLBSHOOTDOWN_ALL) {
 			vm_tlbshootdown_all();
+			for (i=0; i<curcpu->c_numshootwait; i++) {
+				V(curcpu->c_shootdown[i].ts_done);
+			}
+			curcpu->c_numshootwait = 0;
 		}
 		else {
 			for (i=0; i<curcpu->c_numshootdown; i++) {
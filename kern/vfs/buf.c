@@ -0,0 +1,531 @@
+/*
+ * Buffer cache. See buf.h.
+ *
+ * buf_spinlock covers the hash chains, the LRU list, buf_count, the
+ * statistics, and each buffer's b_refcount; it's never held across
+ * I/O. A buffer's identity (b_dev, b_block) only changes while it has
+ * no references, and the rest of it (b_valid, b_dirty, the data)
+ * belongs to whoever holds b_lock.
+ *
+ * Buffers with no references are on the LRU list, oldest first. That
+ * includes spares, which have no device, aren't hashed, and are kept
+ * at the front so they're reused first.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <uio.h>
+#include <spinlock.h>
+#include <synch.h>
+#include <device.h>
+#include <buf.h>
+
+/* Buffers to keep before reusing old ones (128 is 64K of data) */
+#define BUF_MAX       128
+
+/* Hash chains; a power of two */
+#define BUF_HASHSIZE  64
+
+struct buf {
+	struct device *b_dev;		/* NULL for a spare */
+	daddr_t b_block;
+	void *b_data;
+
+	struct lock *b_lock;		/* held while handed out */
+	bool b_valid;			/* b_data holds the block */
+	bool b_dirty;			/* b_data is newer than the disk */
+
+	unsigned b_refcount;		/* handed out or waited for */
+	struct buf *b_hashnext;
+	struct buf *b_lruprev;
+	struct buf *b_lrunext;
+};
+
+static struct spinlock buf_spinlock = SPINLOCK_INITIALIZER;
+static struct buf *buf_hash[BUF_HASHSIZE];
+static struct buf *buf_lruhead, *buf_lrutail;
+static unsigned buf_count;
+
+/* statistics */
+static unsigned buf_hits, buf_misses, buf_reads, buf_writes;
+
+////////////////////////////////////////////////////////////
+//
+// Hash and LRU list; call with buf_spinlock held
+
+static
+unsigned
+buf_hashfn(struct device *dev, daddr_t block)
+{
+	return (block ^ ((uintptr_t)dev >> 4)) & (BUF_HASHSIZE - 1);
+}
+
+static
+struct buf *
+buf_lookup(struct device *dev, daddr_t block)
+{
+	struct buf *b;
+
+	for (b = buf_hash[buf_hashfn(dev, block)]; b != NULL;
+	     b = b->b_hashnext) {
+		if (b->b_dev == dev && b->b_block == block) {
+			return b;
+		}
+	}
+	return NULL;
+}
+
+static
+void
+buf_hashinsert(struct buf *b)
+{
+	unsigned h = buf_hashfn(b->b_dev, b->b_block);
+
+	b->b_hashnext = buf_hash[h];
+	buf_hash[h] = b;
+}
+
+static
+void
+buf_hashremove(struct buf *b)
+{
+	struct buf **bp;
+
+	if (b->b_dev == NULL) {
+		return;
+	}
+	bp = &buf_hash[buf_hashfn(b->b_dev, b->b_block)];
+	while (*bp != b) {
+		KASSERT(*bp != NULL);
+		bp = &(*bp)->b_hashnext;
+	}
+	*bp = b->b_hashnext;
+	b->b_hashnext = NULL;
+}
+
+static
+void
+buf_lruremove(struct buf *b)
+{
+	if (b->b_lruprev != NULL) {
+		b->b_lruprev->b_lrunext = b->b_lrunext;
+	}
+	else {
+		buf_lruhead = b->b_lrunext;
+	}
+	if (b->b_lrunext != NULL) {
+		b->b_lrunext->b_lruprev = b->b_lruprev;
+	}
+	else {
+		buf_lrutail = b->b_lruprev;
+	}
+	b->b_lruprev = b->b_lrunext = NULL;
+}
+
+/* Put b at the end of the LRU list, as the most recently used. */
+static
+void
+buf_lruappend(struct buf *b)
+{
+	b->b_lrunext = NULL;
+	b->b_lruprev = buf_lrutail;
+	if (buf_lrutail != NULL) {
+		buf_lrutail->b_lrunext = b;
+	}
+	else {
+		buf_lruhead = b;
+	}
+	buf_lrutail = b;
+}
+
+/* Put b at the front of the LRU list, to be reused next. */
+static
+void
+buf_lruprepend(struct buf *b)
+{
+	b->b_lruprev = NULL;
+	b->b_lrunext = buf_lruhead;
+	if (buf_lruhead != NULL) {
+		buf_lruhead->b_lruprev = b;
+	}
+	else {
+		buf_lrutail = b;
+	}
+	buf_lruhead = b;
+}
+
+/* Turn b into a spare. */
+static
+void
+buf_makespare(struct buf *b)
+{
+	KASSERT(b->b_refcount == 0);
+
+	buf_hashremove(b);
+	b->b_dev = NULL;
+	b->b_valid = false;
+	b->b_dirty = false;
+	buf_lruprepend(b);
+}
+
+/* Drop a reference (not the lock). */
+static
+void
+buf_unref(struct buf *b)
+{
+	KASSERT(b->b_refcount > 0);
+	b->b_refcount--;
+	if (b->b_refcount == 0) {
+		if (b->b_valid) {
+			buf_lruappend(b);
+		}
+		else {
+			/* a read failed; don't keep it */
+			buf_makespare(b);
+		}
+	}
+}
+
+////////////////////////////////////////////////////////////
+//
+// Allocation and I/O
+
+static
+struct buf *
+buf_create(void)
+{
+	struct buf *b;
+
+	b = kmalloc(sizeof(*b));
+	if (b == NULL) {
+		return NULL;
+	}
+	b->b_data = kmalloc(BUF_SIZE);
+	if (b->b_data == NULL) {
+		kfree(b);
+		return NULL;
+	}
+	b->b_lock = lock_create("buf");
+	if (b->b_lock == NULL) {
+		kfree(b->b_data);
+		kfree(b);
+		return NULL;
+	}
+	b->b_dev = NULL;
+	b->b_block = 0;
+	b->b_valid = false;
+	b->b_dirty = false;
+	b->b_refcount = 0;
+	b->b_hashnext = NULL;
+	b->b_lruprev = b->b_lrunext = NULL;
+	return b;
+}
+
+/* Read or write a buffer's block. Call with b_lock held. */
+static
+int
+buf_io(struct buf *b, enum uio_rw rw)
+{
+	struct iovec iov;
+	struct uio ku;
+	int result;
+
+	KASSERT(lock_do_i_hold(b->b_lock));
+
+	uio_kinit(&iov, &ku, b->b_data, BUF_SIZE,
+		  ((off_t)b->b_block) * BUF_SIZE, rw);
+	result = b->b_dev->d_io(b->b_dev, &ku);
+	if (result) {
+		kprintf("buf: block %u: %s error %d\n", b->b_block,
+			rw == UIO_READ ? "read" : "write", result);
+		return result;
+	}
+
+	spinlock_acquire(&buf_spinlock);
+	if (rw == UIO_READ) {
+		buf_reads++;
+	}
+	else {
+		buf_writes++;
+	}
+	spinlock_release(&buf_spinlock);
+	return 0;
+}
+
+/* Write back a buffer if it's dirty. Call with b_lock held. */
+static
+int
+buf_writeback(struct buf *b)
+{
+	int result;
+
+	if (!b->b_dirty) {
+		return 0;
+	}
+	result = buf_io(b, UIO_WRITE);
+	if (result) {
+		return result;
+	}
+	b->b_dirty = false;
+	return 0;
+}
+
+/*
+ * Find the buffer for (dev, block), or take one to hold it, and lock
+ * it. Its contents are only there if b_valid is set.
+ */
+static
+int
+buf_acquire(struct device *dev, daddr_t block, struct buf **ret)
+{
+	struct buf *b, *newbuf = NULL;
+	int result;
+
+	spinlock_acquire(&buf_spinlock);
+	while (1) {
+		b = buf_lookup(dev, block);
+		if (b != NULL) {
+			buf_hits++;
+			if (b->b_refcount == 0) {
+				buf_lruremove(b);
+			}
+			b->b_refcount++;
+			break;
+		}
+
+		if (newbuf == NULL && buf_count >= BUF_MAX &&
+		    buf_lruhead != NULL) {
+			/* Reuse the least recently used buffer. */
+			b = buf_lruhead;
+			buf_lruremove(b);
+			if (b->b_dirty) {
+				/*
+				 * Clean it first, and leave it at the
+				 * front to be taken next time round.
+				 * Someone might want it meanwhile, or
+				 * bring our block in, so look again.
+				 */
+				b->b_refcount++;
+				spinlock_release(&buf_spinlock);
+				lock_acquire(b->b_lock);
+				result = buf_writeback(b);
+				lock_release(b->b_lock);
+				spinlock_acquire(&buf_spinlock);
+				if (result) {
+					buf_unref(b);
+					spinlock_release(&buf_spinlock);
+					return result;
+				}
+				if (--b->b_refcount == 0) {
+					buf_lruprepend(b);
+				}
+				continue;
+			}
+			buf_hashremove(b);
+		}
+		else if (newbuf == NULL && buf_lruhead != NULL &&
+			 buf_lruhead->b_dev == NULL) {
+			/* Use a spare. */
+			b = buf_lruhead;
+			buf_lruremove(b);
+		}
+		else if (newbuf == NULL) {
+			/* Make a new one; then look again. */
+			spinlock_release(&buf_spinlock);
+			newbuf = buf_create();
+			if (newbuf == NULL) {
+				return ENOMEM;
+			}
+			spinlock_acquire(&buf_spinlock);
+			buf_count++;
+			continue;
+		}
+		else {
+			b = newbuf;
+			newbuf = NULL;
+		}
+
+		buf_misses++;
+		b->b_dev = dev;
+		b->b_block = block;
+		b->b_valid = false;
+		b->b_dirty = false;
+		b->b_refcount = 1;
+		buf_hashinsert(b);
+		break;
+	}
+	if (newbuf != NULL) {
+		/* Someone else brought the block in; keep ours spare. */
+		buf_makespare(newbuf);
+	}
+	spinlock_release(&buf_spinlock);
+
+	lock_acquire(b->b_lock);
+	*ret = b;
+	return 0;
+}
+
+////////////////////////////////////////////////////////////
+//
+// Interface
+
+int
+buf_read(struct device *dev, daddr_t block, struct buf **ret)
+{
+	struct buf *b;
+	int result;
+
+	result = buf_acquire(dev, block, &b);
+	if (result) {
+		return result;
+	}
+	if (!b->b_valid) {
+		result = buf_io(b, UIO_READ);
+		if (result) {
+			buf_release(b);
+			return result;
+		}
+		b->b_valid = true;
+	}
+	*ret = b;
+	return 0;
+}
+
+int
+buf_get(struct device *dev, daddr_t block, struct buf **ret)
+{
+	struct buf *b;
+	int result;
+
+	result = buf_acquire(dev, block, &b);
+	if (result) {
+		return result;
+	}
+	/* The caller is going to fill it in; see buf_markdirty. */
+	*ret = b;
+	return 0;
+}
+
+void *
+buf_data(struct buf *b)
+{
+	KASSERT(lock_do_i_hold(b->b_lock));
+	return b->b_data;
+}
+
+bool
+buf_valid(struct buf *b)
+{
+	KASSERT(lock_do_i_hold(b->b_lock));
+	return b->b_valid;
+}
+
+void
+buf_markdirty(struct buf *b)
+{
+	KASSERT(lock_do_i_hold(b->b_lock));
+	b->b_valid = true;
+	b->b_dirty = true;
+}
+
+void
+buf_release(struct buf *b)
+{
+	lock_release(b->b_lock);
+
+	spinlock_acquire(&buf_spinlock);
+	buf_unref(b);
+	spinlock_release(&buf_spinlock);
+}
+
+void
+buf_forget(struct device *dev, daddr_t block)
+{
+	struct buf *b;
+
+	spinlock_acquire(&buf_spinlock);
+	b = buf_lookup(dev, block);
+	if (b != NULL && b->b_refcount == 0) {
+		buf_lruremove(b);
+		buf_makespare(b);
+	}
+	spinlock_release(&buf_spinlock);
+}
+
+int
+buf_sync(struct device *dev)
+{
+	struct buf *b;
+	unsigned i;
+	int result;
+
+	for (i = 0; i < BUF_HASHSIZE; i++) {
+		spinlock_acquire(&buf_spinlock);
+		b = buf_hash[i];
+		while (b != NULL) {
+			if (b->b_dev != dev || !b->b_dirty) {
+				b = b->b_hashnext;
+				continue;
+			}
+
+			if (b->b_refcount == 0) {
+				buf_lruremove(b);
+			}
+			b->b_refcount++;
+			spinlock_release(&buf_spinlock);
+
+			lock_acquire(b->b_lock);
+			result = buf_writeback(b);
+			buf_release(b);
+			if (result) {
+				return result;
+			}
+
+			/* The chain may have changed; start it over. */
+			spinlock_acquire(&buf_spinlock);
+			b = buf_hash[i];
+		}
+		spinlock_release(&buf_spinlock);
+	}
+	return 0;
+}
+
+void
+buf_purge(struct device *dev)
+{
+	struct buf *b, *next;
+	unsigned i;
+
+	spinlock_acquire(&buf_spinlock);
+	for (i = 0; i < BUF_HASHSIZE; i++) {
+		for (b = buf_hash[i]; b != NULL; b = next) {
+			next = b->b_hashnext;
+			if (b->b_dev == dev) {
+				KASSERT(b->b_refcount == 0);
+				KASSERT(!b->b_dirty);
+				buf_lruremove(b);
+				buf_makespare(b);
+			}
+		}
+	}
+	spinlock_release(&buf_spinlock);
+}
+
+void
+buf_printstats(void)
+{
+	unsigned count, hits, misses, reads, writes;
+
+	spinlock_acquire(&buf_spinlock);
+	count = buf_count;
+	hits = buf_hits;
+	misses = buf_misses;
+	reads = buf_reads;
+	writes = buf_writes;
+	spinlock_release(&buf_spinlock);
+
+	kprintf("Buffer cache: %u of %u buffers\n", count, BUF_MAX);
+	kprintf("    %u hits, %u misses; %u blocks read, %u written\n",
+		hits, misses, reads, writes);
+}
@@ -0,0 +1,334 @@
+/*
+ * Name lookup cache. See dcache.h.
+ *
+ * dcache_spinlock covers the hash chains, the LRU list, the generation
+ * number, and the statistics. Taking a reference to a vnode under it
+ * is fine (vn_countlock nests inside it), but dropping one isn't,
+ * because VOP_DECREF can reclaim the vnode; so entries are taken off
+ * the lists with the spinlock held and their references dropped after
+ * it's released.
+ *
+ * All the entries are always on the LRU list, oldest first. Unused
+ * ones have no directory, aren't hashed, and are kept at the front so
+ * they're used first.
+ */
+
+#include <types.h>
+#include <lib.h>
+#include <spinlock.h>
+#include <vnode.h>
+#include <dcache.h>
+
+/* Hash chains; a power of two */
+#define DCACHE_HASHSIZE  64
+
+struct dcentry {
+	struct vnode *de_dir;		/* NULL if unused */
+	struct vnode *de_vn;		/* NULL for a negative entry */
+	char de_name[DCACHE_NAMELEN+1];
+
+	struct dcentry *de_hashnext;
+	struct dcentry *de_lruprev;
+	struct dcentry *de_lrunext;
+};
+
+static struct spinlock dcache_spinlock = SPINLOCK_INITIALIZER;
+static struct dcentry dcache_entries[DCACHE_SIZE];
+static struct dcentry *dcache_hash[DCACHE_HASHSIZE];
+static struct dcentry *dcache_lruhead, *dcache_lrutail;
+static unsigned dcache_gen;
+
+/* statistics */
+static unsigned dcache_hits, dcache_neghits, dcache_misses;
+
+////////////////////////////////////////////////////////////
+//
+// Hash and LRU list; call with dcache_spinlock held
+
+static
+unsigned
+dcache_hashfn(struct vnode *dir, const char *name)
+{
+	unsigned h = (uintptr_t)dir >> 4;
+
+	while (*name) {
+		h = h * 31 + (unsigned char)*name++;
+	}
+	return h & (DCACHE_HASHSIZE - 1);
+}
+
+static
+struct dcentry *
+dcache_find(struct vnode *dir, const char *name)
+{
+	struct dcentry *de;
+
+	for (de = dcache_hash[dcache_hashfn(dir, name)]; de != NULL;
+	     de = de->de_hashnext) {
+		if (de->de_dir == dir && !strcmp(de->de_name, name)) {
+			return de;
+		}
+	}
+	return NULL;
+}
+
+static
+void
+dcache_hashremove(struct dcentry *de)
+{
+	struct dcentry **dp;
+
+	dp = &dcache_hash[dcache_hashfn(de->de_dir, de->de_name)];
+	while (*dp != de) {
+		KASSERT(*dp != NULL);
+		dp = &(*dp)->de_hashnext;
+	}
+	*dp = de->de_hashnext;
+	de->de_hashnext = NULL;
+}
+
+static
+void
+dcache_lruremove(struct dcentry *de)
+{
+	if (de->de_lruprev != NULL) {
+		de->de_lruprev->de_lrunext = de->de_lrunext;
+	}
+	else {
+		dcache_lruhead = de->de_lrunext;
+	}
+	if (de->de_lrunext != NULL) {
+		de->de_lrunext->de_lruprev = de->de_lruprev;
+	}
+	else {
+		dcache_lrutail = de->de_lruprev;
+	}
+	de->de_lruprev = de->de_lrunext = NULL;
+}
+
+static
+void
+dcache_lruappend(struct dcentry *de)
+{
+	de->de_lrunext = NULL;
+	de->de_lruprev = dcache_lrutail;
+	if (dcache_lrutail != NULL) {
+		dcache_lrutail->de_lrunext = de;
+	}
+	else {
+		dcache_lruhead = de;
+	}
+	dcache_lrutail = de;
+}
+
+static
+void
+dcache_lruprepend(struct dcentry *de)
+{
+	de->de_lruprev = NULL;
+	de->de_lrunext = dcache_lruhead;
+	if (dcache_lruhead != NULL) {
+		dcache_lruhead->de_lruprev = de;
+	}
+	else {
+		dcache_lrutail = de;
+	}
+	dcache_lruhead = de;
+}
+
+/*
+ * Take an entry out of use, moving it to the front of the LRU list.
+ * The references it held are handed back for the caller to drop once
+ * the spinlock is released.
+ */
+static
+void
+dcache_clear(struct dcentry *de, struct vnode **dir, struct vnode **vn)
+{
+	KASSERT(de->de_dir != NULL);
+
+	dcache_hashremove(de);
+	*dir = de->de_dir;
+	*vn = de->de_vn;
+	de->de_dir = NULL;
+	de->de_vn = NULL;
+	de->de_name[0] = 0;
+
+	dcache_lruremove(de);
+	dcache_lruprepend(de);
+}
+
+/*
+ * Drop the references left over from dcache_clear.
+ */
+static
+void
+dcache_release(struct vnode *dir, struct vnode *vn)
+{
+	if (vn != NULL) {
+		VOP_DECREF(vn);
+	}
+	if (dir != NULL) {
+		VOP_DECREF(dir);
+	}
+}
+
+////////////////////////////////////////////////////////////
+//
+// Interface
+
+void
+dcache_bootstrap(void)
+{
+	unsigned i;
+
+	spinlock_acquire(&dcache_spinlock);
+	for (i=0; i<DCACHE_SIZE; i++) {
+		dcache_lruappend(&dcache_entries[i]);
+	}
+	spinlock_release(&dcache_spinlock);
+}
+
+bool
+dcache_lookup(struct vnode *dir, const char *name,
+	      struct vnode **ret, unsigned *gen)
+{
+	struct dcentry *de;
+
+	spinlock_acquire(&dcache_spinlock);
+	de = dcache_find(dir, name);
+	if (de == NULL) {
+		dcache_misses++;
+		*gen = dcache_gen;
+		spinlock_release(&dcache_spinlock);
+		return false;
+	}
+
+	if (de->de_vn != NULL) {
+		VOP_INCREF(de->de_vn);
+		dcache_hits++;
+	}
+	else {
+		dcache_neghits++;
+	}
+	*ret = de->de_vn;
+	dcache_lruremove(de);
+	dcache_lruappend(de);
+	spinlock_release(&dcache_spinlock);
+	return true;
+}
+
+void
+dcache_enter(struct vnode *dir, const char *name, struct vnode *vn,
+	     unsigned gen)
+{
+	struct dcentry *de;
+	struct vnode *olddir = NULL, *oldvn = NULL;
+
+	if (strlen(name) > DCACHE_NAMELEN) {
+		return;
+	}
+
+	spinlock_acquire(&dcache_spinlock);
+	if (gen != dcache_gen || dcache_find(dir, name) != NULL) {
+		/* changed underneath us, or someone else got there first */
+		spinlock_release(&dcache_spinlock);
+		return;
+	}
+
+	de = dcache_lruhead;
+	KASSERT(de != NULL);
+	if (de->de_dir != NULL) {
+		dcache_clear(de, &olddir, &oldvn);
+	}
+
+	VOP_INCREF(dir);
+	if (vn != NULL) {
+		VOP_INCREF(vn);
+	}
+	de->de_dir = dir;
+	de->de_vn = vn;
+	strcpy(de->de_name, name);
+	de->de_hashnext = dcache_hash[dcache_hashfn(dir, name)];
+	dcache_hash[dcache_hashfn(dir, name)] = de;
+	dcache_lruremove(de);
+	dcache_lruappend(de);
+	spinlock_release(&dcache_spinlock);
+
+	dcache_release(olddir, oldvn);
+}
+
+void
+dcache_invalidate(struct vnode *dir, const char *name)
+{
+	struct dcentry *de;
+	struct vnode *olddir = NULL, *oldvn = NULL;
+
+	spinlock_acquire(&dcache_spinlock);
+	dcache_gen++;
+	de = dcache_find(dir, name);
+	if (de != NULL) {
+		dcache_clear(de, &olddir, &oldvn);
+	}
+	spinlock_release(&dcache_spinlock);
+
+	dcache_release(olddir, oldvn);
+}
+
+/*
+ * Drop every entry whose directory is on FS. Since dcache_clear moves
+ * entries to the front of the list, start over from the back after
+ * each one; this only happens at unmount.
+ */
+void
+dcache_purgefs(struct fs *fs)
+{
+	struct dcentry *de;
+	struct vnode *olddir, *oldvn;
+
+	while (1) {
+		olddir = oldvn = NULL;
+
+		spinlock_acquire(&dcache_spinlock);
+		dcache_gen++;
+		for (de = dcache_lrutail; de != NULL; de = de->de_lruprev) {
+			if (de->de_dir == NULL) {
+				/* the rest are unused */
+				de = NULL;
+				break;
+			}
+			if (de->de_dir->vn_fs == fs) {
+				dcache_clear(de, &olddir, &oldvn);
+				break;
+			}
+		}
+		spinlock_release(&dcache_spinlock);
+
+		if (de == NULL) {
+			return;
+		}
+		dcache_release(olddir, oldvn);
+	}
+}
+
+void
+dcache_printstats(void)
+{
+	unsigned count, hits, neghits, misses;
+	struct dcentry *de;
+
+	count = 0;
+	spinlock_acquire(&dcache_spinlock);
+	for (de = dcache_lrutail; de != NULL && de->de_dir != NULL;
+	     de = de->de_lruprev) {
+		count++;
+	}
+	hits = dcache_hits;
+	neghits = dcache_neghits;
+	misses = dcache_misses;
+	spinlock_release(&dcache_spinlock);
+
+	kprintf("Name cache: %u of %u entries\n", count, DCACHE_SIZE);
+	kprintf("    %u hits, %u negative hits, %u misses\n",
+		hits, neghits, misses);
+}
@@ -39,8 +39,10 @@
 #include <vfs.h>
 #include <fs.h>
 #include <vnode.h>
+#include <dcache.h>
 
 static struct vnode *bootfs_vnode = NULL;
+static struct spinlock bootfs_lock = SPINLOCK_INITIALIZER;
 
 /*
  * Helper function for actually changing bootfs_vnode.
@@ -51,8 +53,10 @@ change_bootfs(struct vnode *newvn)
 {
 	struct vnode *oldvn;
 
+	spinlock_acquire(&bootfs_lock);
 	oldvn = bootfs_vnode;
 	bootfs_vnode = newvn;
+	spinlock_release(&bootfs_lock);
 
 	if (oldvn != NULL) {
 		VOP_DECREF(oldvn);
@@ -75,14 +79,11 @@ vfs_setbootfs(const char *fsname)
 	int result;
 	struct vnode *newguy;
 
-	vfs_biglock_acquire();
-
 	snprintf(tmp, sizeof(tmp)-1, "%s", fsname);
 	s = strchr(tmp, ':');
 	if (s) {
 		/* If there's a colon, it must be at the end */
 		if (strlen(s)>0) {
-			vfs_biglock_release();
 			return EINVAL;
 		}
 	}
@@ -92,19 +93,16 @@ vfs_setbootfs(const char *fsname)
 
 	result = vfs_chdir(tmp);
 	if (result) {
-		vfs_biglock_release();
 		return result;
 	}
 
 	result = vfs_getcurdir(&newguy);
 	if (result) {
-		vfs_biglock_release();
 		return result;
 	}
 
 	change_bootfs(newguy);
 
-	vfs_biglock_release();
 	return 0;
 }
 
@@ -114,9 +112,7 @@ vfs_setbootfs(const char *fsname)
 void
 vfs_clearbootfs(void)
 {
-	vfs_biglock_acquire();
 	change_bootfs(NULL);
-	vfs_biglock_release();
 }
 
 
@@ -133,8 +129,6 @@ getdevice(char *path, char **subpath, struct vnode **startvn)
 	struct vnode *vn;
 	int result;
 
-	KASSERT(vfs_biglock_do_i_hold());
-
 	/*
 	 * Locate the first colon or slash.
 	 */
@@ -188,11 +182,16 @@ getdevice(char *path, char **subpath, struct vnode **startvn)
 	KASSERT(colon==0 || slash==0);
 
 	if (path[0]=='/') {
-		if (bootfs_vnode==NULL) {
+		spinlock_acquire(&bootfs_lock);
+		vn = bootfs_vnode;
+		if (vn != NULL) {
+			VOP_INCREF(vn);
+		}
+		spinlock_release(&bootfs_lock);
+		if (vn == NULL) {
 			return ENOENT;
 		}
-		VOP_INCREF(bootfs_vnode);
-		*startvn = bootfs_vnode;
+		*startvn = vn;
 	}
 	else {
 		KASSERT(path[0]==':');
@@ -223,23 +222,108 @@ getdevice(char *path, char **subpath, struct vnode **startvn)
 	return 0;
 }
 
+/*
+ * Look up one pathname component NAME in DIR, going through the name
+ * cache. Only results from filesystems are cached (device vnodes have
+ * no fs), and only ENOENT among the failures.
+ */
+static
+int
+lookonce(struct vnode *dir, char *name, struct vnode **retval)
+{
+	struct vnode *vn;
+	unsigned gen;
+	int result;
+
+	if (dir->vn_fs == NULL || !strcmp(name, ".") || !strcmp(name, "..")) {
+		return VOP_LOOKUP(dir, name, retval);
+	}
+
+	if (dcache_lookup(dir, name, &vn, &gen)) {
+		if (vn == NULL) {
+			return ENOENT;
+		}
+		*retval = vn;
+		return 0;
+	}
+
+	result = VOP_LOOKUP(dir, name, &vn);
+	if (result == ENOENT) {
+		dcache_enter(dir, name, NULL, gen);
+	}
+	if (result) {
+		return result;
+	}
+	dcache_enter(dir, name, vn, gen);
+	*retval = vn;
+	return 0;
+}
+
+/*
+ * Walk PATH from DIR one component at a time and hand back the vnode
+ * at the end. Empty components (from doubled or trailing slashes) are
+ * skipped. Consumes the caller's reference to DIR.
+ */
+static
+int
+walkpath(struct vnode *dir, char *path, struct vnode **retval)
+{
+	struct vnode *next;
+	char *name, *s;
+	int result;
+
+	name = path;
+	while (1) {
+		while (*name == '/') {
+			name++;
+		}
+		if (*name == 0) {
+			*retval = dir;
+			return 0;
+		}
+
+		s = strchr(name, '/');
+		if (s != NULL) {
+			*s = 0;
+		}
+		result = lookonce(dir, name, &next);
+		if (s != NULL) {
+			*s = '/';
+		}
+
+		VOP_DECREF(dir);
+		if (result) {
+			return result;
+		}
+		dir = next;
+
+		if (s == NULL) {
+			*retval = dir;
+			return 0;
+		}
+		name = s+1;
+	}
+}
+
 /*
  * Name-to-vnode translation.
  * (In BSD, both of these are subsumed by namei().)
+ *
+ * Every component but the last is looked up here with walkpath; the
+ * last is handed to the filesystem (VOP_LOOKPARENT) or looked up too
+ * (vfs_lookup).
  */
 
 int
 vfs_lookparent(char *path, struct vnode **retval,
 	       char *buf, size_t buflen)
 {
-	struct vnode *startvn;
+	struct vnode *startvn, *dir;
+	char *name;
 	int result;
 
-	vfs_biglock_acquire();
-
 	result = getdevice(path, &path, &startvn);
 	if (result) {
-		vfs_biglock_release();
 		return result;
 	}
 
@@ -249,15 +333,29 @@ vfs_lookparent(char *path, struct vnode **retval,
 		 * a context where "lookparent" is the desired
 		 * operation.
 		 */
-		result = EINVAL;
+		VOP_DECREF(startvn);
+		return EINVAL;
+	}
+
+	name = strrchr(path, '/');
+	if (name == NULL) {
+		dir = startvn;
+		name = path;
 	}
 	else {
-		result = VOP_LOOKPARENT(startvn, path, retval, buf, buflen);
+		*name = 0;
+		result = walkpath(startvn, path, &dir);
+		*name = '/';
+		if (result) {
+			return result;
+		}
+		name++;
 	}
 
-	VOP_DECREF(startvn);
+	result = VOP_LOOKPARENT(dir, name, retval, buf, buflen);
+
+	VOP_DECREF(dir);
 
-	vfs_biglock_release();
 	return result;
 }
 
@@ -267,23 +365,15 @@ vfs_lookup(char *path, struct vnode **retval)
 	struct vnode *startvn;
 	int result;
 
-	vfs_biglock_acquire();
-
 	result = getdevice(path, &path, &startvn);
 	if (result) {
-		vfs_biglock_release();
 		return result;
 	}
 
 	if (strlen(path)==0) {
 		*retval = startvn;
-		vfs_biglock_release();
 		return 0;
 	}
 
-	result = VOP_LOOKUP(startvn, path, retval);
-
-	VOP_DECREF(startvn);
-	vfs_biglock_release();
-	return result;
+	return walkpath(startvn, path, retval);
 }
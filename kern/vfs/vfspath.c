@@ -38,6 +38,7 @@
 #include <lib.h>
 #include <vfs.h>
 #include <vnode.h>
+#include <dcache.h>
 
 
 /* Does most of the work for open(). */
@@ -75,6 +76,12 @@ vfs_open(char *path, int openflags, mode_t mode, struct vnode **ret)
 
 		result = VOP_CREAT(dir, name, excl, mode, &vn);
 
+		/*
+		 * Whenever a directory is changed the name cache has to
+		 * hear about it afterwards, whether or not the change
+		 * worked; see dcache.h.
+		 */
+		dcache_invalidate(dir, name);
 		VOP_DECREF(dir);
 	}
 	else {
@@ -150,6 +157,7 @@ vfs_remove(char *path)
 	}
 
 	result = VOP_REMOVE(dir, name);
+	dcache_invalidate(dir, name);
 	VOP_DECREF(dir);
 
 	return result;
@@ -183,6 +191,8 @@ vfs_rename(char *oldpath, char *newpath)
 	}
 
 	result = VOP_RENAME(olddir, oldname, newdir, newname);
+	dcache_invalidate(olddir, oldname);
+	dcache_invalidate(newdir, newname);
 
 	VOP_DECREF(newdir);
 	VOP_DECREF(olddir);
@@ -217,6 +227,7 @@ vfs_link(char *oldpath, char *newpath)
 	}
 
 	result = VOP_LINK(newdir, newname, oldfile);
+	dcache_invalidate(newdir, newname);
 
 	VOP_DECREF(newdir);
 	VOP_DECREF(oldfile);
@@ -244,6 +255,7 @@ vfs_symlink(const char *contents, char *path)
 	}
 
 	result = VOP_SYMLINK(newdir, newname, contents);
+	dcache_invalidate(newdir, newname);
 	VOP_DECREF(newdir);
 
 	return result;
@@ -290,6 +302,7 @@ vfs_mkdir(char *path, mode_t mode)
 	}
 
 	result = VOP_MKDIR(parent, name, mode);
+	dcache_invalidate(parent, name);
 
 	VOP_DECREF(parent);
 
@@ -312,6 +325,7 @@ vfs_rmdir(char *path)
 	}
 
 	result = VOP_RMDIR(parent, name);
+	dcache_invalidate(parent, name);
 
 	VOP_DECREF(parent);
 
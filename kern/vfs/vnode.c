@@ -49,10 +49,12 @@ vnode_init(struct vnode *vn, const struct vnode_ops *ops,
 	KASSERT(ops!=NULL);
 
 	vn->vn_ops = ops;
+	spinlock_init(&vn->vn_countlock);
 	vn->vn_refcount = 1;
 	vn->vn_opencount = 0;
 	vn->vn_fs = fs;
 	vn->vn_data = fsdata;
+	vn->vn_vmobj = NULL;
 	return 0;
 }
 
@@ -65,7 +67,9 @@ vnode_cleanup(struct vnode *vn)
 {
 	KASSERT(vn->vn_refcount==1);
 	KASSERT(vn->vn_opencount==0);
+	KASSERT(vn->vn_vmobj==NULL);
 
+	spinlock_cleanup(&vn->vn_countlock);
 	vn->vn_ops = NULL;
 	vn->vn_refcount = 0;
 	vn->vn_opencount = 0;
@@ -83,32 +87,40 @@ vnode_incref(struct vnode *vn)
 {
 	KASSERT(vn != NULL);
 
-	vfs_biglock_acquire();
-
+	spinlock_acquire(&vn->vn_countlock);
 	vn->vn_refcount++;
-
-	vfs_biglock_release();
+	spinlock_release(&vn->vn_countlock);
 }
 
 /*
  * Decrement refcount.
  * Called by VOP_DECREF.
  * Calls VOP_RECLAIM if the refcount hits zero.
+ *
+ * The last reference isn't dropped here but handed to VOP_RECLAIM,
+ * which has to recheck the count against anyone who found the vnode
+ * again before it got the filesystem's locks (see vnode.h).
  */
 void
 vnode_decref(struct vnode *vn)
 {
+	bool destroy;
 	int result;
 
 	KASSERT(vn != NULL);
 
-	vfs_biglock_acquire();
-
+	spinlock_acquire(&vn->vn_countlock);
 	KASSERT(vn->vn_refcount>0);
 	if (vn->vn_refcount>1) {
 		vn->vn_refcount--;
+		destroy = false;
 	}
 	else {
+		destroy = true;
+	}
+	spinlock_release(&vn->vn_countlock);
+
+	if (destroy) {
 		result = VOP_RECLAIM(vn);
 		if (result != 0 && result != EBUSY) {
 			// XXX: lame.
@@ -116,8 +128,6 @@ vnode_decref(struct vnode *vn)
 				strerror(result));
 		}
 	}
-
-	vfs_biglock_release();
 }
 
 /*
@@ -129,9 +139,9 @@ vnode_incopen(struct vnode *vn)
 {
 	KASSERT(vn != NULL);
 
-	vfs_biglock_acquire();
+	spinlock_acquire(&vn->vn_countlock);
 	vn->vn_opencount++;
-	vfs_biglock_release();
+	spinlock_release(&vn->vn_countlock);
 }
 
 /*
@@ -141,17 +151,18 @@ vnode_incopen(struct vnode *vn)
 void
 vnode_decopen(struct vnode *vn)
 {
+	bool last;
 	int result;
 
 	KASSERT(vn != NULL);
 
-	vfs_biglock_acquire();
-
+	spinlock_acquire(&vn->vn_countlock);
 	KASSERT(vn->vn_opencount>0);
 	vn->vn_opencount--;
+	last = (vn->vn_opencount == 0);
+	spinlock_release(&vn->vn_countlock);
 
-	if (vn->vn_opencount > 0) {
-		vfs_biglock_release();
+	if (!last) {
 		return;
 	}
 
@@ -162,8 +173,6 @@ vnode_decopen(struct vnode *vn)
 		// doesn't get reached...
 		kprintf("vfs: Warning: VOP_CLOSE: %s\n", strerror(result));
 	}
-
-	vfs_biglock_release();
 }
 
 /*
@@ -173,7 +182,7 @@ vnode_decopen(struct vnode *vn)
 void
 vnode_check(struct vnode *v, const char *opstr)
 {
-	vfs_biglock_acquire();
+	int refcount, opencount;
 
 	if (v == NULL) {
 		panic("vnode_check: vop_%s: null vnode\n", opstr);
@@ -202,26 +211,29 @@ vnode_check(struct vnode *v, const char *opstr)
 		panic("vnode_check: vop_%s: deadbeef fs pointer\n", opstr);
 	}
 
-	if (v->vn_refcount < 0) {
+	spinlock_acquire(&v->vn_countlock);
+	refcount = v->vn_refcount;
+	opencount = v->vn_opencount;
+	spinlock_release(&v->vn_countlock);
+
+	if (refcount < 0) {
 		panic("vnode_check: vop_%s: negative refcount %d\n", opstr,
-		      v->vn_refcount);
+		      refcount);
 	}
-	else if (v->vn_refcount == 0 && strcmp(opstr, "reclaim")) {
+	else if (refcount == 0 && strcmp(opstr, "reclaim")) {
 		panic("vnode_check: vop_%s: zero refcount\n", opstr);
 	}
-	else if (v->vn_refcount > 0x100000) {
+	else if (refcount > 0x100000) {
 		kprintf("vnode_check: vop_%s: warning: large refcount %d\n",
-			opstr, v->vn_refcount);
+			opstr, refcount);
 	}
 
-	if (v->vn_opencount < 0) {
+	if (opencount < 0) {
 		panic("vnode_check: vop_%s: negative opencount %d\n", opstr,
-		      v->vn_opencount);
+		      opencount);
 	}
-	else if (v->vn_opencount > 0x100000) {
+	else if (opencount > 0x100000) {
 		kprintf("vnode_check: vop_%s: warning: large opencount %d\n",
-			opstr, v->vn_opencount);
+			opstr, opencount);
 	}
-
-	vfs_biglock_release();
 }
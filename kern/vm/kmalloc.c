@@ -28,9 +28,15 @@
  */
 
 #include <types.h>
+#include <kern/errno.h>
 #include <lib.h>
+#include <spl.h>
 #include <spinlock.h>
+#include <cpu.h>
+#include <current.h>
 #include <vm.h>
+#include <kmem_cache.h>
+#include <kmprof.h>
 
 /*
  * Kernel malloc.
@@ -95,6 +101,10 @@ static const size_t sizes[NSIZES] = { 16, 32, 64, 128, 256, 512, 1024, 2048 };
 #error "Odd page size"
 #endif
 
+#if NSIZES != KMALLOC_NSIZES
+#error "KMALLOC_NSIZES in cpu.h doesn't match"
+#endif
+
 ////////////////////////////////////////
 
 struct freelist {
@@ -118,81 +128,100 @@ struct pageref {
 ////////////////////////////////////////
 
 /*
- * This is cheesy.
- *
- * The problem is not that it's wasteful - we can only allocate whole
- * pages of pageref structures at a time anyway. The problem is that
- * we really ought to be able to have more than one of these pages.
- *
- * However, for the time being, one page worth of pagerefs gives us
- * 256 pagerefs; this lets us manage 256 * 4k = 1M of kernel heap.
- * That would be twice as much memory as we get for *everything*.
- * Thus, we will cheat and not allow any mechanism for having a second
- * page of pageref structs.
- *
- * Then, since the size is fixed at one page, we'll simplify a bit
- * further by allocating the page in the kernel BSS instead of calling
- * alloc_kpages to get it.
+ * Pagerefs come a page at a time. The first page of them is in the
+ * kernel BSS, so that kmalloc works before there's anything to
+ * alloc_kpages from; when those run out, subpage_kmalloc gets another
+ * page for more. Pages of pagerefs are never given back. Free pagerefs
+ * are kept on freerefs, linked through next_all.
  */
 
 #define NPAGEREFS (PAGE_SIZE / sizeof(struct pageref))
 static struct pageref pagerefs[NPAGEREFS];
+static bool pagerefs_ready;
+static struct pageref *freerefs;
+static unsigned npagerefs;	/* in all, on every page */
+
+/*
+ * Add the NPAGEREFS pagerefs in the page at refs to the free list.
+ */
+static
+void
+addpagerefs(struct pageref *refs)
+{
+	unsigned i;
 
-#define INUSE_WORDS (NPAGEREFS/32)
-static uint32_t pagerefs_inuse[INUSE_WORDS];
+	for (i=0; i<NPAGEREFS; i++) {
+		refs[i].next_all = freerefs;
+		freerefs = &refs[i];
+	}
+	npagerefs += NPAGEREFS;
+}
 
 static
 struct pageref *
 allocpageref(void)
 {
-	unsigned i,j;
-	uint32_t k;
+	struct pageref *p;
 
-	for (i=0; i<INUSE_WORDS; i++) {
-		if (pagerefs_inuse[i]==0xffffffff) {
-			/* full */
-			continue;
-		}
-		for (k=1,j=0; k!=0; k<<=1,j++) {
-			if ((pagerefs_inuse[i] & k)==0) {
-				pagerefs_inuse[i] |= k;
-				return &pagerefs[i*32 + j];
-			}
-		}
-		KASSERT(0);
+	if (!pagerefs_ready) {
+		addpagerefs(pagerefs);
+		pagerefs_ready = true;
 	}
 
-	/* ran out */
-	return NULL;
+	p = freerefs;
+	if (p == NULL) {
+		/* ran out */
+		return NULL;
+	}
+	freerefs = p->next_all;
+	return p;
 }
 
 static
 void
 freepageref(struct pageref *p)
 {
-	size_t i, j;
-	uint32_t k;
-
-	j = p-pagerefs;
-	KASSERT(j < NPAGEREFS);  /* note: j is unsigned, don't test < 0 */
-	i = j/32;
-	k = ((uint32_t)1) << (j%32);
-	KASSERT((pagerefs_inuse[i] & k) != 0);
-	pagerefs_inuse[i] &= ~k;
+	p->pageaddr_and_blocktype = 0;
+	p->next_samesize = NULL;
+	p->next_all = freerefs;
+	freerefs = p;
 }
 
 ////////////////////////////////////////
 
+/*
+ * Map from kernel heap page to the pageref for it, so kfree can find
+ * a block's page in constant time.
+ *
+ * Kernel heap pages are all in kseg0, so this is a two-level table over
+ * kseg0, like a page table: the top level (pagerefmap) has an entry for
+ * each 4M, pointing to a page of pageref pointers, one per page in that
+ * 4M, or NULL if no page there has ever been a subpage page. Second-level
+ * tables are never freed.
+ *
+ * Entries are set and cleared under kmalloc_spinlock, but read without
+ * it: the entry for a page with a block on it that's still allocated
+ * can't change until that block is freed.
+ */
+
+#define PRMAP_NENTRIES  (PAGE_SIZE / sizeof(struct pageref *))	/* 1024 */
+#define PRMAP_NTABLES \
+	((MIPS_KSEG1 - MIPS_KSEG0) / PAGE_SIZE / PRMAP_NENTRIES)	/* 128 */
+#define PRMAP_L1(va)  ((((va) - MIPS_KSEG0) / PAGE_SIZE) / PRMAP_NENTRIES)
+#define PRMAP_L2(va)  ((((va) - MIPS_KSEG0) / PAGE_SIZE) % PRMAP_NENTRIES)
+
+static struct pageref **pagerefmap[PRMAP_NTABLES];
+
+////////////////////////////////////////
+
 static struct pageref *sizebases[NSIZES];
 static struct pageref *allbase;
 
 ////////////////////////////////////////
 
 /*
- * Use one spinlock for the whole thing. Making parts of the kmalloc
- * logic per-cpu is worthwhile for scalability; however, for the time
- * being at least we won't, because it adds a lot of complexity and in
- * OS/161 performance and scalability aren't super-critical.
+ * Use one spinlock for the subpage pages and lists. Most kmallocs and
+ * kfrees don't take it, though; they use the per-cpu magazines below.
  */
 
 static struct spinlock kmalloc_spinlock = SPINLOCK_INITIALIZER;
@@ -254,21 +283,26 @@ checksubpages(void)
 	struct pageref *pr;
 	int i;
 	unsigned sc=0, ac=0;
+	vaddr_t prpage;
 
 	KASSERT(spinlock_do_i_hold(&kmalloc_spinlock));
 
 	for (i=0; i<NSIZES; i++) {
 		for (pr = sizebases[i]; pr != NULL; pr = pr->next_samesize) {
 			checksubpage(pr);
-			KASSERT(sc < NPAGEREFS);
+			KASSERT(sc < npagerefs);
 			sc++;
 		}
 	}
 
 	for (pr = allbase; pr != NULL; pr = pr->next_all) {
 		checksubpage(pr);
-		KASSERT(ac < NPAGEREFS);
+		KASSERT(ac < npagerefs);
 		ac++;
+
+		prpage = PR_PAGEADDR(pr);
+		KASSERT(pagerefmap[PRMAP_L1(prpage)] != NULL);
+		KASSERT(pagerefmap[PRMAP_L1(prpage)][PRMAP_L2(prpage)] == pr);
 	}
 
 	KASSERT(sc==ac);
@@ -338,13 +372,22 @@ kheap_printstats(void)
 	/* print the whole thing with interrupts off */
 	spinlock_acquire(&kmalloc_spinlock);
 
+	/*
+	 * The magazine refill and drain paths don't check the heap, so
+	 * as not to walk all of it each time; do it here instead.
+	 */
+	checksubpages();
+
 	kprintf("Subpage allocator status:\n");
+	kprintf("(blocks cached in per-cpu magazines show as in use)\n");
 
 	for (pr = allbase; pr != NULL; pr = pr->next_all) {
 		dumpsubpage(pr);
 	}
 
 	spinlock_release(&kmalloc_spinlock);
+
+	kmem_cache_printstats();
 }
 
 ////////////////////////////////////////
@@ -392,6 +435,147 @@ int blocktype(size_t sz)
 	return 0;
 }
 
+/*
+ * Find the pageref for the subpage page ptraddr is on, or return NULL
+ * if it isn't on one. This doesn't need the lock, as long as ptraddr
+ * is a block that is allocated (see pagerefmap).
+ */
+static
+struct pageref *
+subpage_lookup(vaddr_t ptraddr)
+{
+	struct pageref **table;
+
+	if (ptraddr < MIPS_KSEG0 || ptraddr >= MIPS_KSEG1) {
+		return NULL;
+	}
+	table = pagerefmap[PRMAP_L1(ptraddr)];
+	if (table == NULL) {
+		return NULL;
+	}
+	return table[PRMAP_L2(ptraddr)];
+}
+
+/*
+ * Make sure pagerefmap has a second-level table for prpage, allocating
+ * one if need be. Call without the lock. Returns nonzero if out of
+ * memory.
+ */
+static
+int
+pagerefmap_prepare(vaddr_t prpage)
+{
+	struct pageref **table;
+	unsigned i;
+
+	if (pagerefmap[PRMAP_L1(prpage)] != NULL) {
+		/* tables are never freed, so it's still there */
+		return 0;
+	}
+
+	table = (struct pageref **)alloc_kpages(1);
+	if (table == NULL) {
+		return ENOMEM;
+	}
+	for (i=0; i<PRMAP_NENTRIES; i++) {
+		table[i] = NULL;
+	}
+
+	spinlock_acquire(&kmalloc_spinlock);
+	if (pagerefmap[PRMAP_L1(prpage)] == NULL) {
+		pagerefmap[PRMAP_L1(prpage)] = table;
+		table = NULL;
+	}
+	spinlock_release(&kmalloc_spinlock);
+
+	if (table != NULL) {
+		/* someone else got there first */
+		free_kpages((vaddr_t)table);
+	}
+	return 0;
+}
+
+/*
+ * Take a block off the free list of pr, which must have one.
+ */
+static
+void *
+subpage_take(struct pageref *pr)
+{
+	vaddr_t prpage;		// PR_PAGEADDR(pr)
+	vaddr_t fla;		// free list entry address
+	struct freelist *fl;	// free list entry
+	void *retptr;		// our result
+
+	KASSERT(spinlock_do_i_hold(&kmalloc_spinlock));
+	KASSERT(pr->nfree > 0);
+	KASSERT(pr->freelist_offset < PAGE_SIZE);
+
+	prpage = PR_PAGEADDR(pr);
+	fla = prpage + pr->freelist_offset;
+	fl = (struct freelist *)fla;
+
+	retptr = fl;
+	fl = fl->next;
+	pr->nfree--;
+
+	if (fl != NULL) {
+		KASSERT(pr->nfree > 0);
+		fla = (vaddr_t)fl;
+		KASSERT(fla - prpage < PAGE_SIZE);
+		pr->freelist_offset = fla - prpage;
+	}
+	else {
+		KASSERT(pr->nfree == 0);
+		pr->freelist_offset = INVALID_OFFSET;
+	}
+
+	return retptr;
+}
+
+/*
+ * Put the block at ptr back on the free list of pr. If that makes the
+ * whole page free, pr is released and the page's address is returned
+ * for the caller to free_kpages once it has dropped the lock;
+ * otherwise returns 0.
+ */
+static
+vaddr_t
+subpage_put(struct pageref *pr, void *ptr)
+{
+	int blktype;		// index into sizes[] that we're using
+	vaddr_t prpage;		// PR_PAGEADDR(pr)
+	vaddr_t fla;		// free list entry address
+	struct freelist *fl;	// free list entry
+	vaddr_t offset;		// offset into page
+
+	KASSERT(spinlock_do_i_hold(&kmalloc_spinlock));
+
+	prpage = PR_PAGEADDR(pr);
+	blktype = PR_BLOCKTYPE(pr);
+	offset = (vaddr_t)ptr - prpage;
+
+	fla = prpage + offset;
+	fl = (struct freelist *)fla;
+	if (pr->freelist_offset == INVALID_OFFSET) {
+		fl->next = NULL;
+	} else {
+		fl->next = (struct freelist *)(prpage + pr->freelist_offset);
+	}
+	pr->freelist_offset = offset;
+	pr->nfree++;
+
+	KASSERT(pr->nfree <= PAGE_SIZE / sizes[blktype]);
+	if (pr->nfree == PAGE_SIZE / sizes[blktype]) {
+		/* Whole page is free. */
+		remove_lists(pr, blktype);
+		pagerefmap[PRMAP_L1(prpage)][PRMAP_L2(prpage)] = NULL;
+		freepageref(pr);
+		return prpage;
+	}
+	return 0;
+}
+
 static
 void *
 subpage_kmalloc(size_t sz)
@@ -420,31 +604,8 @@ subpage_kmalloc(size_t sz)
 		checksubpage(pr);
 
 		if (pr->nfree > 0) {
-
-		doalloc: /* comes here after getting a whole fresh page */
-
-			KASSERT(pr->freelist_offset < PAGE_SIZE);
-			prpage = PR_PAGEADDR(pr);
-			fla = prpage + pr->freelist_offset;
-			fl = (struct freelist *)fla;
-
-			retptr = fl;
-			fl = fl->next;
-			pr->nfree--;
-
-			if (fl != NULL) {
-				KASSERT(pr->nfree > 0);
-				fla = (vaddr_t)fl;
-				KASSERT(fla - prpage < PAGE_SIZE);
-				pr->freelist_offset = fla - prpage;
-			}
-			else {
-				KASSERT(pr->nfree == 0);
-				pr->freelist_offset = INVALID_OFFSET;
-			}
-
+			retptr = subpage_take(pr);
 			checksubpages();
-
 			spinlock_release(&kmalloc_spinlock);
 			return retptr;
 		}
@@ -466,19 +627,32 @@ subpage_kmalloc(size_t sz)
 		kprintf("kmalloc: Subpage allocator couldn't get a page\n");
 		return NULL;
 	}
+	if (pagerefmap_prepare(prpage)) {
+		free_kpages(prpage);
+		kprintf("kmalloc: Subpage allocator couldn't get a map table\n");
+		return NULL;
+	}
 	spinlock_acquire(&kmalloc_spinlock);
 
-	pr = allocpageref();
-	if (pr==NULL) {
-		/* Couldn't allocate accounting space for the new page. */
+	while ((pr = allocpageref()) == NULL) {
+		/* Out of pagerefs; get another page of them. */
+		vaddr_t refpage;
+
 		spinlock_release(&kmalloc_spinlock);
-		free_kpages(prpage);
-		kprintf("kmalloc: Subpage allocator couldn't get pageref\n");
-		return NULL;
+		refpage = alloc_kpages(1);
+		if (refpage==0) {
+			/* Couldn't allocate accounting space for the new page. */
+			free_kpages(prpage);
+			kprintf("kmalloc: Subpage allocator couldn't get pageref\n");
+			return NULL;
+		}
+		spinlock_acquire(&kmalloc_spinlock);
+		addpagerefs((struct pageref *)refpage);
 	}
 
 	pr->pageaddr_and_blocktype = MKPAB(prpage, blktype);
 	pr->nfree = PAGE_SIZE / sizes[blktype];
+	pagerefmap[PRMAP_L1(prpage)][PRMAP_L2(prpage)] = pr;
 
 	/*
 	 * Note: fl is volatile because the MIPS toolchain we were
@@ -504,10 +678,146 @@ subpage_kmalloc(size_t sz)
 	pr->next_all = allbase;
 	allbase = pr;
 
-	/* This is kind of cheesy, but avoids duplicating the alloc code. */
-	goto doalloc;
+	retptr = subpage_take(pr);
+	checksubpages();
+	spinlock_release(&kmalloc_spinlock);
+	return retptr;
 }
 
+////////////////////////////////////////
+
+/*
+ * Per-cpu magazines.
+ *
+ * Each cpu keeps a few free blocks of every size in its struct cpu
+ * (c_kmalloc), which kmalloc and kfree use without kmalloc_spinlock;
+ * being at splhigh keeps us on the cpu and away from interrupt
+ * handlers that might kmalloc too. An empty magazine is refilled with
+ * half a magazine of blocks from pages that already have free ones,
+ * and a full one hands its older half back, each under the lock once.
+ * Only if no page has a free block does kmalloc go to subpage_kmalloc
+ * for a new one.
+ *
+ * Blocks in a magazine still count as allocated on their pages. So
+ * that big blocks don't tie up too much memory, a magazine holds at
+ * most half a page's worth.
+ */
+
+static
+unsigned
+mag_capacity(unsigned blktype)
+{
+	unsigned n = PAGE_SIZE / 2 / sizes[blktype];
+
+	return n < KMALLOC_MAGSIZE ? n : KMALLOC_MAGSIZE;
+}
+
+/*
+ * This cpu's magazine for blktype, or NULL this early in boot. Call at
+ * splhigh.
+ */
+static
+struct kmalloc_mag *
+mag_get(unsigned blktype)
+{
+	if (!CURCPU_EXISTS() || curcpu == NULL) {
+		return NULL;
+	}
+	return &curcpu->c_kmalloc[blktype];
+}
+
+static
+void *
+mag_alloc(unsigned blktype)
+{
+	struct kmalloc_mag *mag;
+	struct pageref *pr;
+	unsigned want;
+	void *retptr = NULL;
+	int spl;
+
+	spl = splhigh();
+	mag = mag_get(blktype);
+	if (mag == NULL) {
+		splx(spl);
+		return NULL;
+	}
+
+	if (mag->km_nobjs == 0) {
+		want = (mag_capacity(blktype) + 1) / 2;
+
+		spinlock_acquire(&kmalloc_spinlock);
+		for (pr = sizebases[blktype];
+		     pr != NULL && mag->km_nobjs < want;
+		     pr = pr->next_samesize) {
+			while (pr->nfree > 0 && mag->km_nobjs < want) {
+				mag->km_objs[mag->km_nobjs++] =
+					subpage_take(pr);
+			}
+		}
+		spinlock_release(&kmalloc_spinlock);
+	}
+
+	if (mag->km_nobjs > 0) {
+		retptr = mag->km_objs[--mag->km_nobjs];
+	}
+	splx(spl);
+	return retptr;
+}
+
+/*
+ * Put ptr in this cpu's magazine for blktype. Returns false if there
+ * are no magazines yet.
+ */
+static
+bool
+mag_free(unsigned blktype, void *ptr)
+{
+	struct kmalloc_mag *mag;
+	vaddr_t freepages[KMALLOC_MAGSIZE];
+	unsigned i, n, nfreepages = 0;
+	int spl;
+
+	spl = splhigh();
+	mag = mag_get(blktype);
+	if (mag == NULL) {
+		splx(spl);
+		return false;
+	}
+
+	if (mag->km_nobjs >= mag_capacity(blktype)) {
+		n = (mag_capacity(blktype) + 1) / 2;
+
+		spinlock_acquire(&kmalloc_spinlock);
+		for (i=0; i<n; i++) {
+			void *obj = mag->km_objs[i];
+			vaddr_t prpage;
+
+			prpage = subpage_put(subpage_lookup((vaddr_t)obj), obj);
+			if (prpage != 0) {
+				freepages[nfreepages++] = prpage;
+			}
+		}
+		spinlock_release(&kmalloc_spinlock);
+
+		for (i=n; i<mag->km_nobjs; i++) {
+			mag->km_objs[i-n] = mag->km_objs[i];
+		}
+		mag->km_nobjs -= n;
+	}
+
+	mag->km_objs[mag->km_nobjs++] = ptr;
+	splx(spl);
+
+	/* Call free_kpages without kmalloc_spinlock. */
+	for (i=0; i<nfreepages; i++) {
+		free_kpages(freepages[i]);
+	}
+	return true;
+}
+
+////////////////////////////////////////
+
 static
 int
 subpage_kfree(void *ptr)
@@ -516,35 +826,22 @@ subpage_kfree(void *ptr)
 	vaddr_t ptraddr;	// same as ptr
 	struct pageref *pr;	// pageref for page we're freeing in
 	vaddr_t prpage;		// PR_PAGEADDR(pr)
-	vaddr_t fla;		// free list entry address
-	struct freelist *fl;	// free list entry
 	vaddr_t offset;		// offset into page
 
 	ptraddr = (vaddr_t)ptr;
 
-	spinlock_acquire(&kmalloc_spinlock);
-
-	checksubpages();
-
-	for (pr = allbase; pr; pr = pr->next_all) {
-		prpage = PR_PAGEADDR(pr);
-		blktype = PR_BLOCKTYPE(pr);
-
-		/* check for corruption */
-		KASSERT(blktype>=0 && blktype<NSIZES);
-		checksubpage(pr);
-
-		if (ptraddr >= prpage && ptraddr < prpage + PAGE_SIZE) {
-			break;
-		}
-	}
-
+	pr = subpage_lookup(ptraddr);
 	if (pr==NULL) {
 		/* Not on any of our pages - not a subpage allocation */
-		spinlock_release(&kmalloc_spinlock);
 		return -1;
 	}
 
+	prpage = PR_PAGEADDR(pr);
+	blktype = PR_BLOCKTYPE(pr);
+
+	/* check for corruption */
+	KASSERT(blktype>=0 && blktype<NSIZES);
+
 	offset = ptraddr - prpage;
 
 	/* Check for proper positioning and alignment */
@@ -563,28 +860,19 @@ subpage_kfree(void *ptr)
 	 * is already on the free list. But that's expensive, so we don't.
 	 */
 
-	fla = prpage + offset;
-	fl = (struct freelist *)fla;
-	if (pr->freelist_offset == INVALID_OFFSET) {
-		fl->next = NULL;
-	} else {
-		fl->next = (struct freelist *)(prpage + pr->freelist_offset);
+	if (mag_free(blktype, ptr)) {
+		return 0;
 	}
-	pr->freelist_offset = offset;
-	pr->nfree++;
 
-	KASSERT(pr->nfree <= PAGE_SIZE / sizes[blktype]);
-	if (pr->nfree == PAGE_SIZE / sizes[blktype]) {
-		/* Whole page is free. */
-		remove_lists(pr, blktype);
-		freepageref(pr);
+	spinlock_acquire(&kmalloc_spinlock);
+	checksubpages();
+	prpage = subpage_put(pr, ptr);
+	spinlock_release(&kmalloc_spinlock);
+
+	if (prpage != 0) {
 		/* Call free_kpages without kmalloc_spinlock. */
-		spinlock_release(&kmalloc_spinlock);
 		free_kpages(prpage);
 	}
-	else {
-		spinlock_release(&kmalloc_spinlock);
-	}
 
 #ifdef SLOWER /* Don't get the lock unless checksubpages does something. */
 	spinlock_acquire(&kmalloc_spinlock);
@@ -601,6 +889,9 @@ subpage_kfree(void *ptr)
 void *
 kmalloc(size_t sz)
 {
+	void *ptr;
+	size_t realsz;
+
 	if (sz>=LARGEST_SUBPAGE_SIZE) {
 		unsigned long npages;
 		vaddr_t address;
@@ -612,15 +903,31 @@ kmalloc(size_t sz)
 			return NULL;
 		}
 
-		return (void *)address;
+		ptr = (void *)address;
+		realsz = npages * PAGE_SIZE;
+	}
+	else {
+		realsz = sizes[blocktype(sz)];
+		ptr = mag_alloc(blocktype(sz));
+		if (ptr == NULL) {
+			ptr = subpage_kmalloc(sz);
+		}
 	}
 
-	return subpage_kmalloc(sz);
+	if (kmprof_active && ptr != NULL) {
+		kmprof_alloc(ptr, realsz,
+			     (vaddr_t)__builtin_return_address(0));
+	}
+	return ptr;
 }
 
 void
 kfree(void *ptr)
 {
+	if (kmprof_tracking && ptr != NULL) {
+		kmprof_free(ptr);
+	}
+
 	/*
 	 * Try subpage first; if that fails, assume it's a big allocation.
 	 */
@@ -0,0 +1,305 @@
+/*
+ * Object caches (slab allocator). See kmem_cache.h.
+ */
+
+#include <types.h>
+#include <lib.h>
+#include <spinlock.h>
+#include <vm.h>
+#include <kmem_cache.h>
+
+/*
+ * A slab is one page. It starts with this header; the rest is divided
+ * into equal slots, each a bufctl followed by the object. The bufctl
+ * links free objects and remembers whether the object has been
+ * constructed, without touching the object itself, so an object's
+ * constructed state survives being on the free list.
+ *
+ * Since a slab is exactly one page, the slab an object is on is found
+ * by masking the object's address.
+ */
+struct kmem_bufctl {
+	struct kmem_bufctl *kb_next;	/* next free object in the slab */
+	bool kb_constructed;		/* the ctor has been run on it */
+};
+
+struct kmem_slab {
+	struct kmem_cache *ks_cache;
+	struct kmem_slab *ks_next;	/* on kc_partial or kc_full */
+	struct kmem_slab *ks_prev;
+	struct kmem_bufctl *ks_free;	/* free objects */
+	unsigned ks_nfree;
+	unsigned ks_nobjs;
+	size_t ks_stride;		/* bytes per slot */
+};
+
+#define KMEM_ALIGN      8
+#define SLAB_HDRSIZE    ROUNDUP(sizeof(struct kmem_slab), KMEM_ALIGN)
+#define BUFCTL_SIZE     ROUNDUP(sizeof(struct kmem_bufctl), KMEM_ALIGN)
+
+#define SLAB_BUFCTL(ks, i) \
+	((struct kmem_bufctl *)((char *)(ks) + SLAB_HDRSIZE + (i) * (ks)->ks_stride))
+#define BUFCTL_OBJ(bc)   ((void *)((char *)(bc) + BUFCTL_SIZE))
+#define OBJ_BUFCTL(obj)  ((struct kmem_bufctl *)((char *)(obj) - BUFCTL_SIZE))
+#define OBJ_SLAB(obj)    ((struct kmem_slab *)((vaddr_t)(obj) & PAGE_FRAME))
+
+/*
+ * How many completely free slabs a cache holds on to. Past that, a
+ * slab that empties goes back to the VM system.
+ */
+#define KMEM_MAXEMPTY   1
+
+/* All caches that have ever had a slab, for kmem_cache_printstats. */
+static struct kmem_cache *kmem_caches;
+static struct spinlock kmem_caches_lock = SPINLOCK_INITIALIZER;
+
+////////////////////////////////////////
+
+static
+void
+slab_push(struct kmem_slab **list, struct kmem_slab *ks)
+{
+	ks->ks_prev = NULL;
+	ks->ks_next = *list;
+	if (*list != NULL) {
+		(*list)->ks_prev = ks;
+	}
+	*list = ks;
+}
+
+static
+void
+slab_remove(struct kmem_slab **list, struct kmem_slab *ks)
+{
+	if (ks->ks_prev != NULL) {
+		ks->ks_prev->ks_next = ks->ks_next;
+	}
+	else {
+		KASSERT(*list == ks);
+		*list = ks->ks_next;
+	}
+	if (ks->ks_next != NULL) {
+		ks->ks_next->ks_prev = ks->ks_prev;
+	}
+	ks->ks_next = ks->ks_prev = NULL;
+}
+
+/*
+ * Get a page and set it up as a slab of unconstructed objects.
+ */
+static
+struct kmem_slab *
+slab_create(struct kmem_cache *kc)
+{
+	struct kmem_slab *ks;
+	struct kmem_bufctl *bc;
+	unsigned i;
+
+	ks = (struct kmem_slab *)alloc_kpages(1);
+	if (ks == NULL) {
+		return NULL;
+	}
+
+	ks->ks_cache = kc;
+	ks->ks_next = ks->ks_prev = NULL;
+	ks->ks_stride = BUFCTL_SIZE + ROUNDUP(kc->kc_size, KMEM_ALIGN);
+	ks->ks_nobjs = (PAGE_SIZE - SLAB_HDRSIZE) / ks->ks_stride;
+	if (ks->ks_nobjs == 0) {
+		panic("kmem_cache %s: objects of %lu bytes don't fit in a page\n",
+		      kc->kc_name, (unsigned long)kc->kc_size);
+	}
+
+	/* thread the free list in address order */
+	ks->ks_free = NULL;
+	for (i=ks->ks_nobjs; i-- > 0; ) {
+		bc = SLAB_BUFCTL(ks, i);
+		bc->kb_constructed = false;
+		bc->kb_next = ks->ks_free;
+		ks->ks_free = bc;
+	}
+	ks->ks_nfree = ks->ks_nobjs;
+	return ks;
+}
+
+/*
+ * Destroy whatever was constructed in a slab that's entirely free,
+ * and give the page back.
+ */
+static
+void
+slab_destroy(struct kmem_cache *kc, struct kmem_slab *ks)
+{
+	struct kmem_bufctl *bc;
+	unsigned i;
+
+	KASSERT(ks->ks_nfree == ks->ks_nobjs);
+
+	for (i=0; i<ks->ks_nobjs; i++) {
+		bc = SLAB_BUFCTL(ks, i);
+		if (bc->kb_constructed && kc->kc_dtor != NULL) {
+			kc->kc_dtor(BUFCTL_OBJ(bc));
+		}
+	}
+	ks->ks_cache = NULL;
+	free_kpages((vaddr_t)ks);
+}
+
+static
+void
+cache_register(struct kmem_cache *kc)
+{
+	spinlock_acquire(&kmem_caches_lock);
+	if (!kc->kc_listed) {
+		kc->kc_next = kmem_caches;
+		kmem_caches = kc;
+		kc->kc_listed = true;
+	}
+	spinlock_release(&kmem_caches_lock);
+}
+
+/*
+ * Put an object back on its slab's free list. Returns a slab to be
+ * destroyed if this emptied one the cache doesn't want to keep, or
+ * NULL. Call with the cache locked.
+ */
+static
+struct kmem_slab *
+cache_put(struct kmem_cache *kc, struct kmem_bufctl *bc)
+{
+	struct kmem_slab *ks = OBJ_SLAB(bc);
+
+	KASSERT(ks->ks_cache == kc);
+	KASSERT(ks->ks_nfree < ks->ks_nobjs);
+
+	bc->kb_next = ks->ks_free;
+	ks->ks_free = bc;
+	if (ks->ks_nfree == 0) {
+		slab_remove(&kc->kc_full, ks);
+		slab_push(&kc->kc_partial, ks);
+	}
+	ks->ks_nfree++;
+	kc->kc_inuse--;
+
+	if (ks->ks_nfree == ks->ks_nobjs) {
+		if (kc->kc_nempty >= KMEM_MAXEMPTY) {
+			slab_remove(&kc->kc_partial, ks);
+			kc->kc_slabs--;
+			return ks;
+		}
+		kc->kc_nempty++;
+	}
+	return NULL;
+}
+
+////////////////////////////////////////
+
+void *
+kmem_cache_alloc(struct kmem_cache *kc)
+{
+	struct kmem_slab *ks, *dead;
+	struct kmem_bufctl *bc;
+	bool constructed;
+	int result;
+
+	spinlock_acquire(&kc->kc_lock);
+	if (kc->kc_partial == NULL) {
+		/*
+		 * Out of free objects; get another slab. As in kmalloc,
+		 * drop the lock while talking to the VM system.
+		 */
+		spinlock_release(&kc->kc_lock);
+		ks = slab_create(kc);
+		if (ks == NULL) {
+			return NULL;
+		}
+		cache_register(kc);
+		spinlock_acquire(&kc->kc_lock);
+		slab_push(&kc->kc_partial, ks);
+		kc->kc_slabs++;
+		kc->kc_nempty++;
+	}
+
+	/* prefer the slab we used last; it's the likeliest to be in cache */
+	ks = kc->kc_partial;
+	bc = ks->ks_free;
+	KASSERT(bc != NULL);
+	ks->ks_free = bc->kb_next;
+	if (ks->ks_nfree == ks->ks_nobjs) {
+		kc->kc_nempty--;
+	}
+	ks->ks_nfree--;
+	if (ks->ks_nfree == 0) {
+		slab_remove(&kc->kc_partial, ks);
+		slab_push(&kc->kc_full, ks);
+	}
+	kc->kc_inuse++;
+
+	constructed = bc->kb_constructed;
+	if (constructed) {
+		kc->kc_hits++;
+	}
+	else {
+		kc->kc_misses++;
+	}
+	spinlock_release(&kc->kc_lock);
+
+	if (!constructed) {
+		if (kc->kc_ctor != NULL) {
+			result = kc->kc_ctor(BUFCTL_OBJ(bc));
+			if (result) {
+				spinlock_acquire(&kc->kc_lock);
+				dead = cache_put(kc, bc);
+				spinlock_release(&kc->kc_lock);
+				if (dead != NULL) {
+					slab_destroy(kc, dead);
+				}
+				return NULL;
+			}
+		}
+		bc->kb_constructed = true;
+	}
+
+	return BUFCTL_OBJ(bc);
+}
+
+void
+kmem_cache_free(struct kmem_cache *kc, void *obj)
+{
+	struct kmem_slab *dead;
+
+	KASSERT(obj != NULL);
+	KASSERT(OBJ_BUFCTL(obj)->kb_constructed);
+
+	spinlock_acquire(&kc->kc_lock);
+	dead = cache_put(kc, OBJ_BUFCTL(obj));
+	kc->kc_frees++;
+	spinlock_release(&kc->kc_lock);
+
+	if (dead != NULL) {
+		slab_destroy(kc, dead);
+	}
+}
+
+void
+kmem_cache_printstats(void)
+{
+	struct kmem_cache *kc;
+	unsigned total;
+
+	kprintf("Object caches:\n");
+	kprintf("%-12s %6s %6s %6s %8s %8s %5s\n",
+		"name", "size", "slabs", "inuse", "hits", "misses", "hit%");
+
+	spinlock_acquire(&kmem_caches_lock);
+	for (kc = kmem_caches; kc != NULL; kc = kc->kc_next) {
+		spinlock_acquire(&kc->kc_lock);
+		total = kc->kc_hits + kc->kc_misses;
+		kprintf("%-12s %6lu %6u %6u %8u %8u %4u%%\n",
+			kc->kc_name, (unsigned long)kc->kc_size,
+			kc->kc_slabs, kc->kc_inuse,
+			kc->kc_hits, kc->kc_misses,
+			total == 0 ? 0 : kc->kc_hits * 100 / total);
+		spinlock_release(&kc->kc_lock);
+	}
+	spinlock_release(&kmem_caches_lock);
+}
@@ -0,0 +1,414 @@
+/*
+ * Kernel heap profiler. See kmprof.h.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <spinlock.h>
+#include <vm.h>
+#include <kmprof.h>
+
+/*
+ * Each tracked block has a kmprof_block saying which site to credit
+ * when it's freed. They live in a hash table on the block address.
+ *
+ * So that profiling doesn't send every kmalloc and kfree on every cpu
+ * through one lock, the tables are split into KMPROF_NSTRIPES stripes
+ * by block address. Each stripe has its own lock, its own part of the
+ * hash table, its own share of the free kmprof_blocks, and its own
+ * site table. A block is charged and credited in the same stripe, so
+ * each stripe's counts add up on their own; kmprof_get adds the
+ * stripes together. The cost is that a stripe can run out of blocks
+ * or sites while others have some left, and that a site's peak is the
+ * sum of the stripes' peaks, which can be more than the true peak.
+ *
+ * Everything is carved out of one run of pages from alloc_kpages (not
+ * kmalloc, which would come back here), allocated the first time
+ * profiling is started. kmprof_lock covers installing it, turning
+ * profiling on and off, and kmprof_get's merging; it's taken before
+ * any stripe lock.
+ */
+struct kmprof_block {
+	struct kmprof_block *kb_next;	/* hash chain, or free list */
+	vaddr_t kb_ptr;			/* the block */
+	unsigned kb_site;		/* index into st_sites[] */
+	size_t kb_size;			/* its size */
+};
+
+#define KMPROF_NSTRIPES    8
+#define KMPROF_NBUCKETS    64	/* per stripe */
+
+#define KMPROF_HASH(p)     (((p) >> 4) ^ ((p) >> 13))
+#define KMPROF_STRIPE(p)   (KMPROF_HASH(p) % KMPROF_NSTRIPES)
+#define KMPROF_BUCKET(p)   (KMPROF_HASH(p) / KMPROF_NSTRIPES % KMPROF_NBUCKETS)
+
+/*
+ * Sites are found through a small open-addressed hash on pc and size;
+ * st_sitehash[] holds index+1 into st_sites[], or 0 if empty. Sites
+ * are only removed by kmprof_reset. st_sites[0] is the catch-all for
+ * when st_sites[] is full.
+ */
+#define KMPROF_SITEHASH    (2 * KMPROF_NSITES)
+
+struct kmprof_stripe {
+	struct spinlock st_lock;
+	struct kmprof_block *st_buckets[KMPROF_NBUCKETS];
+	struct kmprof_block *st_free;
+	unsigned st_untracked;	/* allocations there was no room to track */
+	struct kmprof_site st_sites[KMPROF_NSITES];
+	unsigned st_nsites;
+	uint8_t st_sitehash[KMPROF_SITEHASH];
+};
+
+/* The kmprof_blocks follow it, filling out the pages */
+struct kmprof_table {
+	struct kmprof_stripe kt_stripes[KMPROF_NSTRIPES];
+	struct kmprof_site kt_merged[KMPROF_NSITES];	/* for kmprof_get */
+};
+
+#define KMPROF_TABLEPAGES  16
+#define KMPROF_NBLOCKS \
+	((KMPROF_TABLEPAGES * PAGE_SIZE - sizeof(struct kmprof_table)) / \
+	 sizeof(struct kmprof_block))
+
+static struct kmprof_table *table;
+static struct spinlock kmprof_lock = SPINLOCK_INITIALIZER;
+
+volatile bool kmprof_active;
+volatile bool kmprof_tracking;
+
+/*
+ * Empty a stripe's site and block tables, giving it every
+ * KMPROF_NSTRIPES-th block. Call with its lock held.
+ */
+static
+void
+kmprof_clear(struct kmprof_stripe *st, unsigned stripe)
+{
+	struct kmprof_block *blocks;
+	unsigned i;
+
+	bzero(st->st_sites, sizeof(st->st_sites));
+	bzero(st->st_sitehash, sizeof(st->st_sitehash));
+	st->st_nsites = 1;	/* st_sites[0] is the catch-all */
+	st->st_untracked = 0;
+
+	for (i=0; i<KMPROF_NBUCKETS; i++) {
+		st->st_buckets[i] = NULL;
+	}
+	blocks = (struct kmprof_block *)(table + 1);
+	st->st_free = NULL;
+	for (i=stripe; i<KMPROF_NBLOCKS; i+=KMPROF_NSTRIPES) {
+		blocks[i].kb_next = st->st_free;
+		st->st_free = &blocks[i];
+	}
+}
+
+/*
+ * Empty every stripe. Call with kmprof_lock held and the table
+ * allocated.
+ */
+static
+void
+kmprof_clearall(void)
+{
+	struct kmprof_stripe *st;
+	unsigned i;
+
+	for (i=0; i<KMPROF_NSTRIPES; i++) {
+		st = &table->kt_stripes[i];
+		spinlock_acquire(&st->st_lock);
+		kmprof_clear(st, i);
+		spinlock_release(&st->st_lock);
+	}
+}
+
+/*
+ * Find or make the site for (pc, size) in a stripe. Call with its
+ * lock held.
+ */
+static
+unsigned
+kmprof_site(struct kmprof_stripe *st, vaddr_t pc, size_t size)
+{
+	struct kmprof_site *sites = st->st_sites;
+	unsigned h, i, ix;
+
+	h = ((pc >> 2) ^ size) % KMPROF_SITEHASH;
+	for (i=0; i<KMPROF_SITEHASH; i++) {
+		ix = st->st_sitehash[(h + i) % KMPROF_SITEHASH];
+		if (ix == 0) {
+			break;
+		}
+		if (sites[ix-1].ks_pc == pc && sites[ix-1].ks_size == size) {
+			return ix-1;
+		}
+	}
+
+	if (st->st_nsites >= KMPROF_NSITES) {
+		return 0;
+	}
+	ix = st->st_nsites++;
+	sites[ix].ks_pc = pc;
+	sites[ix].ks_size = size;
+	st->st_sitehash[(h + i) % KMPROF_SITEHASH] = ix+1;
+	return ix;
+}
+
+void
+kmprof_alloc(void *ptr, size_t size, vaddr_t pc)
+{
+	struct kmprof_stripe *st;
+	struct kmprof_block *kb;
+	struct kmprof_site *ks;
+	unsigned site, b;
+
+	/* kmprof_active means the table is there */
+	st = &table->kt_stripes[KMPROF_STRIPE((vaddr_t)ptr)];
+	spinlock_acquire(&st->st_lock);
+	if (!kmprof_active) {
+		/* turned off behind our back */
+		spinlock_release(&st->st_lock);
+		return;
+	}
+
+	kb = st->st_free;
+	if (kb == NULL) {
+		st->st_untracked++;
+		spinlock_release(&st->st_lock);
+		return;
+	}
+	st->st_free = kb->kb_next;
+
+	site = kmprof_site(st, pc, size);
+	ks = &st->st_sites[site];
+	ks->ks_allocs++;
+	ks->ks_live += size;
+	if (ks->ks_live > ks->ks_peak) {
+		ks->ks_peak = ks->ks_live;
+	}
+
+	kb->kb_ptr = (vaddr_t)ptr;
+	kb->kb_site = site;
+	kb->kb_size = size;
+	b = KMPROF_BUCKET(kb->kb_ptr);
+	kb->kb_next = st->st_buckets[b];
+	st->st_buckets[b] = kb;
+
+	spinlock_release(&st->st_lock);
+}
+
+void
+kmprof_free(void *ptr)
+{
+	struct kmprof_stripe *st;
+	struct kmprof_block **kbp, *kb;
+	struct kmprof_site *ks;
+
+	/* kmprof_tracking means the table is there */
+	st = &table->kt_stripes[KMPROF_STRIPE((vaddr_t)ptr)];
+	spinlock_acquire(&st->st_lock);
+	for (kbp = &st->st_buckets[KMPROF_BUCKET((vaddr_t)ptr)]; *kbp != NULL;
+	     kbp = &(*kbp)->kb_next) {
+		kb = *kbp;
+		if (kb->kb_ptr == (vaddr_t)ptr) {
+			*kbp = kb->kb_next;
+			ks = &st->st_sites[kb->kb_site];
+			ks->ks_frees++;
+			KASSERT(ks->ks_live >= kb->kb_size);
+			ks->ks_live -= kb->kb_size;
+			kb->kb_next = st->st_free;
+			st->st_free = kb;
+			break;
+		}
+	}
+	spinlock_release(&st->st_lock);
+}
+
+int
+kmprof_start(void)
+{
+	vaddr_t pages;
+	unsigned i;
+
+	if (table == NULL) {
+		pages = alloc_kpages(KMPROF_TABLEPAGES);
+		if (pages == 0) {
+			return ENOMEM;
+		}
+
+		spinlock_acquire(&kmprof_lock);
+		if (table == NULL) {
+			table = (struct kmprof_table *)pages;
+			pages = 0;
+			for (i=0; i<KMPROF_NSTRIPES; i++) {
+				spinlock_init(&table->kt_stripes[i].st_lock);
+			}
+			kmprof_clearall();
+		}
+		spinlock_release(&kmprof_lock);
+
+		if (pages != 0) {
+			/* someone else got there first */
+			free_kpages(pages);
+		}
+	}
+
+	spinlock_acquire(&kmprof_lock);
+	kmprof_tracking = true;
+	kmprof_active = true;
+	spinlock_release(&kmprof_lock);
+	return 0;
+}
+
+void
+kmprof_stop(void)
+{
+	spinlock_acquire(&kmprof_lock);
+	kmprof_active = false;
+	spinlock_release(&kmprof_lock);
+}
+
+void
+kmprof_reset(void)
+{
+	spinlock_acquire(&kmprof_lock);
+	if (table != NULL) {
+		kmprof_clearall();
+	}
+	/* nothing allocated from here on is tracked unless we're on */
+	kmprof_tracking = kmprof_active;
+	spinlock_release(&kmprof_lock);
+}
+
+/*
+ * Add up the stripes' sites into kt_merged, matching them on (pc,
+ * size); sites past KMPROF_NSITES go into the catch-all. Returns how
+ * many there are. Call with kmprof_lock held and the table allocated.
+ */
+static
+unsigned
+kmprof_merge(void)
+{
+	struct kmprof_site *merged = table->kt_merged;
+	struct kmprof_stripe *st;
+	struct kmprof_site *ks;
+	unsigned s, i, j, n;
+
+	bzero(merged, sizeof(table->kt_merged));
+	n = 1;		/* merged[0] is the catch-all */
+
+	for (s=0; s<KMPROF_NSTRIPES; s++) {
+		st = &table->kt_stripes[s];
+		spinlock_acquire(&st->st_lock);
+		for (i=0; i<st->st_nsites; i++) {
+			ks = &st->st_sites[i];
+			if (ks->ks_allocs == 0) {
+				continue;
+			}
+			for (j=0; j<n; j++) {
+				if (merged[j].ks_pc == ks->ks_pc &&
+				    merged[j].ks_size == ks->ks_size) {
+					break;
+				}
+			}
+			if (j == n) {
+				if (n < KMPROF_NSITES) {
+					n++;
+					merged[j].ks_pc = ks->ks_pc;
+					merged[j].ks_size = ks->ks_size;
+				}
+				else {
+					j = 0;
+				}
+			}
+			merged[j].ks_allocs += ks->ks_allocs;
+			merged[j].ks_frees += ks->ks_frees;
+			merged[j].ks_live += ks->ks_live;
+			merged[j].ks_peak += ks->ks_peak;
+		}
+		spinlock_release(&st->st_lock);
+	}
+	return n;
+}
+
+unsigned
+kmprof_get(struct kmprof_site *buf, unsigned max)
+{
+	struct kmprof_site *sites;
+	unsigned i, j, n, nsites;
+
+	n = 0;
+	spinlock_acquire(&kmprof_lock);
+	if (table == NULL) {
+		spinlock_release(&kmprof_lock);
+		return 0;
+	}
+	nsites = kmprof_merge();
+	sites = table->kt_merged;
+
+	/* insertion sort into buf, keeping the max largest */
+	for (i=0; i<nsites; i++) {
+		if (sites[i].ks_allocs == 0) {
+			continue;
+		}
+		for (j=n; j>0 && buf[j-1].ks_live < sites[i].ks_live; j--) {
+			if (j < max) {
+				buf[j] = buf[j-1];
+			}
+		}
+		if (j < max) {
+			buf[j] = sites[i];
+			if (n < max) {
+				n++;
+			}
+		}
+	}
+	spinlock_release(&kmprof_lock);
+	return n;
+}
+
+void
+kmprof_printstats(void)
+{
+	struct kmprof_site *buf;
+	unsigned i, n, live, nuntracked;
+
+	buf = kmalloc(KMPROF_NSITES * sizeof(*buf));
+	if (buf == NULL) {
+		kprintf("kmprof: Out of memory\n");
+		return;
+	}
+	n = kmprof_get(buf, KMPROF_NSITES);
+	nuntracked = 0;
+	if (table != NULL) {
+		/* unlocked, but good enough for a report */
+		for (i=0; i<KMPROF_NSTRIPES; i++) {
+			nuntracked += table->kt_stripes[i].st_untracked;
+		}
+	}
+
+	kprintf("kmalloc profile (%s):\n", kmprof_active ? "on" : "off");
+	kprintf("%-10s %6s %8s %8s %8s %8s\n",
+		"caller", "size", "allocs", "frees", "live", "peak");
+	live = 0;
+	for (i=0; i<n; i++) {
+		if (buf[i].ks_pc == 0) {
+			kprintf("%-10s %6s %8u %8u %8u %8u\n", "(other)", "-",
+				buf[i].ks_allocs, buf[i].ks_frees,
+				buf[i].ks_live, buf[i].ks_peak);
+		}
+		else {
+			kprintf("0x%08x %6u %8u %8u %8u %8u\n",
+				buf[i].ks_pc, buf[i].ks_size,
+				buf[i].ks_allocs, buf[i].ks_frees,
+				buf[i].ks_live, buf[i].ks_peak);
+		}
+		live += buf[i].ks_live;
+	}
+	kprintf("%u bytes live in %u sites; %u allocations not tracked\n",
+		live, n, nuntracked);
+
+	kfree(buf);
+}
@@ -0,0 +1,193 @@
+/*
+ * Shared memory segments for smartvm. See shm.h.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <kern/mman.h>
+#include <lib.h>
+#include <synch.h>
+#include <vm.h>
+#include <addrspace.h>
+#include <vmobj.h>
+#include <swap.h>
+#include <shm.h>
+
+/*
+ * A segment's id is its slot in the table plus SHM_MAX times the slot's
+ * generation, which goes up every time the slot is freed, so a stale id
+ * doesn't find whatever reused the slot.
+ */
+struct shmseg {
+	struct vmobj *sh_obj;	/* the pages, or NULL if the slot is empty */
+	int sh_key;
+	size_t sh_npages;
+	unsigned sh_gen;
+};
+
+#define SHM_MAXGEN  (0x7fffffff / SHM_MAX)
+#define SHM_ID(i)   ((int)(segs[i].sh_gen * SHM_MAX + (i)))
+
+static struct shmseg segs[SHM_MAX];
+static size_t shm_npages;	/* pages in all the segments in segs */
+static struct lock *shm_lock;
+
+/*
+ * Most pages the segments in the table may have between them; see
+ * shm.h.
+ */
+static
+size_t
+shm_maxpages(void)
+{
+	return ((size_t)totalpagecount + swap_npages()) / 2;
+}
+
+void
+shm_bootstrap(void)
+{
+	unsigned i;
+
+	shm_lock = lock_create("shm");
+	if (shm_lock == NULL) {
+		panic("shm_bootstrap: out of memory\n");
+	}
+	for (i=0; i<SHM_MAX; i++) {
+		segs[i].sh_obj = NULL;
+		segs[i].sh_gen = 1;
+	}
+	shm_npages = 0;
+}
+
+/*
+ * The slot for id, or -1. Call with shm_lock held.
+ */
+static
+int
+shm_find(int id)
+{
+	unsigned i;
+
+	if (id < 0) {
+		return -1;
+	}
+	i = id % SHM_MAX;
+	if (segs[i].sh_obj == NULL || SHM_ID(i) != id) {
+		return -1;
+	}
+	return i;
+}
+
+int
+shm_create(int key, size_t size, int *id)
+{
+	size_t npages;
+	int i, empty;
+	int result;
+
+	if (size == 0 || size > SHM_MAXPAGES * PAGE_SIZE) {
+		return EINVAL;
+	}
+	npages = (size + PAGE_SIZE - 1) / PAGE_SIZE;
+
+	lock_acquire(shm_lock);
+	empty = -1;
+	for (i=0; i<SHM_MAX; i++) {
+		if (segs[i].sh_obj == NULL) {
+			if (empty < 0) {
+				empty = i;
+			}
+			continue;
+		}
+		if (key != SHM_PRIVATE && segs[i].sh_key == key) {
+			if (segs[i].sh_npages < npages) {
+				lock_release(shm_lock);
+				return EINVAL;
+			}
+			*id = SHM_ID(i);
+			lock_release(shm_lock);
+			return 0;
+		}
+	}
+	if (empty < 0) {
+		lock_release(shm_lock);
+		return ENOSPC;
+	}
+	if (shm_npages + npages > shm_maxpages()) {
+		lock_release(shm_lock);
+		return ENOMEM;
+	}
+
+	result = vmobj_get(NULL, &segs[empty].sh_obj);
+	if (result) {
+		segs[empty].sh_obj = NULL;
+		lock_release(shm_lock);
+		return result;
+	}
+	segs[empty].sh_key = key;
+	segs[empty].sh_npages = npages;
+	shm_npages += npages;
+	*id = SHM_ID(empty);
+	lock_release(shm_lock);
+	return 0;
+}
+
+int
+shm_attach(struct addrspace *as, int id, vaddr_t vaddr, vaddr_t *ret)
+{
+	struct vmobj *vo;
+	size_t npages;
+	int i, result;
+
+	lock_acquire(shm_lock);
+	i = shm_find(id);
+	if (i < 0) {
+		lock_release(shm_lock);
+		return EINVAL;
+	}
+	vo = segs[i].sh_obj;
+	npages = segs[i].sh_npages;
+	vmobj_ref(vo);	/* in case it's removed meanwhile */
+	lock_release(shm_lock);
+
+	result = as_mapobj(as, vaddr, npages * PAGE_SIZE,
+			   PROT_READ | PROT_WRITE, MAP_SHARED | AS_MAP_SHM, vo, 0,
+			   ret);
+	vmobj_release(vo);
+	return result;
+}
+
+int
+shm_detach(struct addrspace *as, vaddr_t vaddr)
+{
+	size_t len;
+
+	/* Only a segment attachment, not just any shared mapping */
+	if (as_shmat(as, vaddr, &len) == NULL) {
+		return EINVAL;
+	}
+	return as_munmap(as, vaddr, len);
+}
+
+int
+shm_remove(int id)
+{
+	struct vmobj *vo;
+	int i;
+
+	lock_acquire(shm_lock);
+	i = shm_find(id);
+	if (i < 0) {
+		lock_release(shm_lock);
+		return EINVAL;
+	}
+	vo = segs[i].sh_obj;
+	segs[i].sh_obj = NULL;
+	shm_npages -= segs[i].sh_npages;
+	segs[i].sh_gen = segs[i].sh_gen % SHM_MAXGEN + 1;
+	lock_release(shm_lock);
+
+	/* Attachments keep their own references */
+	vmobj_release(vo);
+	return 0;
+}
@@ -0,0 +1,186 @@
+/*
+ * Swap space for smartvm. See swap.h.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <kern/fcntl.h>
+#include <kern/stat.h>
+#include <lib.h>
+#include <spinlock.h>
+#include <uio.h>
+#include <vfs.h>
+#include <vnode.h>
+#include <vm.h>
+#include <swap.h>
+#include <uw-vmstats.h>
+
+static struct vnode *swapvn = NULL;
+
+/*
+ * swaprefs[i] is the number of page tables referring to slot i; 0 means
+ * the slot is free. swapused counts the slots in use and swaphint is
+ * where to start looking for the next free one.
+ */
+static unsigned *swaprefs = NULL;
+static unsigned swapslots = 0;
+static unsigned swapused = 0;
+static unsigned swaphint = 0;
+
+static struct spinlock swap_lock = SPINLOCK_INITIALIZER;
+
+void
+swap_bootstrap(void)
+{
+	char path[] = SWAP_DEVICE;
+	struct stat st;
+	unsigned i, nslots;
+	int result;
+
+	result = vfs_open(path, O_RDWR, 0, &swapvn);
+	if (result) {
+		kprintf("swap: no %s (%s); running without swap\n",
+			SWAP_DEVICE, strerror(result));
+		swapvn = NULL;
+		return;
+	}
+
+	result = VOP_STAT(swapvn, &st);
+	if (result) {
+		kprintf("swap: cannot stat %s: %s\n", SWAP_DEVICE,
+			strerror(result));
+		vfs_close(swapvn);
+		swapvn = NULL;
+		return;
+	}
+
+	nslots = st.st_size / PAGE_SIZE;
+	swaprefs = kmalloc(nslots * sizeof(unsigned));
+	if (swaprefs == NULL) {
+		kprintf("swap: out of memory for swap map\n");
+		vfs_close(swapvn);
+		swapvn = NULL;
+		return;
+	}
+	for (i=0; i<nslots; i++) {
+		swaprefs[i] = 0;
+	}
+	swapslots = nslots;
+
+	kprintf("swap: %u pages on %s\n", swapslots, SWAP_DEVICE);
+}
+
+int
+swap_alloc(unsigned *slot)
+{
+	unsigned i, n;
+
+	spinlock_acquire(&swap_lock);
+	for (n=0; n<swapslots; n++) {
+		i = (swaphint + n) % swapslots;
+		if (swaprefs[i] == 0) {
+			swaprefs[i] = 1;
+			swapused++;
+			swaphint = (i + 1) % swapslots;
+			spinlock_release(&swap_lock);
+			*slot = i;
+			return 0;
+		}
+	}
+	spinlock_release(&swap_lock);
+	return ENOSPC;
+}
+
+void
+swap_share(unsigned slot)
+{
+	spinlock_acquire(&swap_lock);
+	KASSERT(slot < swapslots);
+	KASSERT(swaprefs[slot] > 0);
+	swaprefs[slot]++;
+	spinlock_release(&swap_lock);
+}
+
+void
+swap_free(unsigned slot)
+{
+	spinlock_acquire(&swap_lock);
+	KASSERT(slot < swapslots);
+	KASSERT(swaprefs[slot] > 0);
+	if (--swaprefs[slot] == 0) {
+		swapused--;
+	}
+	spinlock_release(&swap_lock);
+}
+
+/*
+ * Move one page between memory and a swap slot.
+ */
+static
+int
+swap_io(unsigned slot, paddr_t paddr, enum uio_rw rw)
+{
+	struct iovec iov;
+	struct uio ku;
+	int result;
+
+	KASSERT(swapvn != NULL);
+	KASSERT(slot < swapslots);
+
+	uio_kinit(&iov, &ku, (void *)PADDR_TO_KVADDR(paddr), PAGE_SIZE,
+		  (off_t)slot * PAGE_SIZE, rw);
+	if (rw == UIO_READ) {
+		result = VOP_READ(swapvn, &ku);
+	}
+	else {
+		result = VOP_WRITE(swapvn, &ku);
+	}
+	if (result) {
+		return result;
+	}
+	if (ku.uio_resid != 0) {
+		kprintf("swap: short %s on slot %u\n",
+			rw == UIO_READ ? "read" : "write", slot);
+		return EIO;
+	}
+	return 0;
+}
+
+int
+swap_read(unsigned slot, paddr_t paddr)
+{
+	vmstats_inc(VMSTAT_SWAP_FILE_READ);
+	return swap_io(slot, paddr, UIO_READ);
+}
+
+int
+swap_write(unsigned slot, paddr_t paddr)
+{
+	vmstats_inc(VMSTAT_SWAP_FILE_WRITE);
+	return swap_io(slot, paddr, UIO_WRITE);
+}
+
+unsigned
+swap_npages(void)
+{
+	/* Set once at boot */
+	return swapslots;
+}
+
+void
+swap_printstats(void)
+{
+	unsigned used, total;
+
+	spinlock_acquire(&swap_lock);
+	used = swapused;
+	total = swapslots;
+	spinlock_release(&swap_lock);
+
+	if (swapvn == NULL) {
+		kprintf("Swap: none\n");
+	}
+	else {
+		kprintf("Swap: %u of %u pages in use\n", used, total);
+	}
+}
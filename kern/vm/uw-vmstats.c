@@ -33,6 +33,10 @@ static const char *stats_names[] = {
  /*  7 */ "Page Faults from ELF",
  /*  8 */ "Page Faults from Swapfile",
  /*  9 */ "Swapfile Writes",
+ /* 10 */ "TLB Shootdowns",
+ /* 11 */ "TLB Shootdown Pages",
+ /* 12 */ "TLB Shootdown IPIs",
+ /* 13 */ "TLB Shootdown Wait (us)",
 };
 
 
@@ -46,6 +50,16 @@ vmstats_inc(unsigned int index)
     spinlock_release(&stats_lock);
 }
 
+/* ---------------------------------------------------------------------- */
+/* Assumes vmstat_init has already been called */
+void
+vmstats_add(unsigned int index, unsigned int amount)
+{
+    spinlock_acquire(&stats_lock);
+      _vmstats_add(index, amount);
+    spinlock_release(&stats_lock);
+}
+
 /* ---------------------------------------------------------------------- */
 void
 vmstats_init(void)
@@ -68,6 +82,14 @@ _vmstats_inc(unsigned int index)
   stats_counts[index]++;
 }
 
+/* ---------------------------------------------------------------------- */
+void
+_vmstats_add(unsigned int index, unsigned int amount)
+{
+  KASSERT(index < VMSTAT_COUNT);
+  stats_counts[index] += amount;
+}
+
 /* ---------------------------------------------------------------------- */
 void
 _vmstats_init(void)
@@ -102,6 +124,7 @@ vmstats_print(void)
   int tlb_faults = 0;
   int elf_plus_swap_reads = 0;
   int disk_reads = 0;
+  int shootdowns = 0;
 
   kprintf("VMSTATS:\n");
   for (i=0; i<VMSTAT_COUNT; i++) {
@@ -114,6 +137,7 @@ vmstats_print(void)
     stats_counts[VMSTAT_PAGE_FAULT_ZERO] + stats_counts[VMSTAT_TLB_RELOAD];
   elf_plus_swap_reads = stats_counts[VMSTAT_ELF_FILE_READ] + stats_counts[VMSTAT_SWAP_FILE_READ];
   disk_reads = stats_counts[VMSTAT_PAGE_FAULT_DISK];
+  shootdowns = stats_counts[VMSTAT_TLB_SHOOTDOWN];
 
   kprintf("VMSTAT TLB Faults with Free + TLB Faults with Replace = %d\n", free_plus_replace);
   if (tlb_faults != free_plus_replace) {
@@ -133,5 +157,10 @@ vmstats_print(void)
     kprintf("WARNING: ELF File reads + Swapfile reads != Page Faults (Disk) %d\n",
       elf_plus_swap_reads);
   }
+
+  if (shootdowns > 0) {
+    kprintf("VMSTAT TLB Shootdown Wait (us) / TLB Shootdowns = %d\n",
+      (int)(stats_counts[VMSTAT_TLB_SHOOTDOWN_USEC] / shootdowns));
+  }
 }
 /* ---------------------------------------------------------------------- */
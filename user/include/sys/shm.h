@@ -0,0 +1,15 @@
+#ifndef _SYS_SHM_H_
+#define _SYS_SHM_H_
+
+/*
+ * Shared memory segments. See <kern/shm.h> for what the calls do.
+ */
+#include <sys/types.h>
+#include <kern/shm.h>
+
+int shm_create(int key, size_t size);
+void *shm_attach(int id, void *addr);
+int shm_detach(void *addr);
+int shm_remove(int id);
+
+#endif /* _SYS_SHM_H_ */
@@ -0,0 +1,105 @@
+/*
+ * faultio - read and write files from pages that aren't loaded yet.
+ *
+ * Usage: faultio [file]
+ *
+ * Program pages are loaded on demand, from the executable, the first
+ * time they're touched. This writes FILE (default emu0:faultio.dat)
+ * straight out of initialized .rodata and .data arrays nothing has
+ * touched yet, and then reads it back into another untouched .data
+ * array, so each copy to or from the user buffer faults and has to
+ * read the executable in the middle of the file system call. With
+ * the program on emu0, as /bin and /my-testbin normally are, that's
+ * the same device the file is on.
+ *
+ * If this hangs, the file system is holding a lock across the copy.
+ *
+ * Last, it reads into .rodata, which is read-only: that must fail with
+ * EFAULT and leave the file usable, not kill the process.
+ */
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+#include <err.h>
+
+#define SIZE 12288	/* three pages */
+
+/* Initialized, so they live in the executable, not zero-filled */
+static const char rodata[SIZE] = { 'r', 'o' };
+static char data[SIZE] = { 'd', 'a' };
+static char readback[SIZE] = { 'x' };
+
+static
+void
+writefrom(const char *file, const char *buf)
+{
+	int fd;
+
+	fd = open(file, O_WRONLY | O_CREAT | O_TRUNC, 0664);
+	if (fd < 0) {
+		err(1, "%s", file);
+	}
+	if (write(fd, buf, SIZE) != SIZE) {
+		err(1, "%s: write", file);
+	}
+	close(fd);
+}
+
+static
+void
+readcheck(const char *file, const char *want)
+{
+	int fd;
+
+	fd = open(file, O_RDONLY);
+	if (fd < 0) {
+		err(1, "%s", file);
+	}
+	if (read(fd, readback, SIZE) != SIZE) {
+		err(1, "%s: read", file);
+	}
+	close(fd);
+	if (memcmp(readback, want, SIZE) != 0) {
+		errx(1, "%s: read back the wrong data", file);
+	}
+}
+
+static
+void
+readonly(const char *file)
+{
+	int fd;
+
+	fd = open(file, O_RDONLY);
+	if (fd < 0) {
+		err(1, "%s", file);
+	}
+	if (read(fd, (char *)rodata, SIZE) != -1 || errno != EFAULT) {
+		errx(1, "%s: read into .rodata didn't fail with EFAULT", file);
+	}
+	close(fd);
+	readcheck(file, data);
+}
+
+int
+main(int argc, char *argv[])
+{
+	const char *file = "emu0:faultio.dat";
+
+	if (argc > 1) {
+		file = argv[1];
+	}
+
+	/* each array is untouched until the system call copies it */
+	writefrom(file, rodata);
+	readcheck(file, rodata);
+	writefrom(file, data);
+	readcheck(file, data);
+	readonly(file);
+
+	printf("faultio: passed\n");
+	return 0;
+}
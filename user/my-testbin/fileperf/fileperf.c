@@ -0,0 +1,212 @@
+/*
+ * fileperf - measure file read and write throughput.
+ *
+ * Usage: fileperf [kbytes] [file]
+ *
+ * For each transfer size from 512 bytes to 64K, writes KBYTES
+ * kilobytes (default 512) to FILE (default fileperf.dat) and then
+ * reads it back, and prints the rate of each in KB/s. Only the time
+ * spent in read and write counts. The data read back is checked
+ * against what was written.
+ *
+ * Before that, checks that lseek, dup2, and fork all leave
+ * descriptors sharing one offset the way they should.
+ */
+
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <err.h>
+
+#define MAXSIZE     65536
+#define DEFAULT_KB  512
+
+static char buf[MAXSIZE];
+
+static
+void
+fill(unsigned long pos, size_t len)
+{
+	size_t i;
+
+	for (i=0; i<len; i++) {
+		buf[i] = (char)((pos + i) * 7);
+	}
+}
+
+static
+void
+check(unsigned long pos, size_t len)
+{
+	size_t i;
+
+	for (i=0; i<len; i++) {
+		if (buf[i] != (char)((pos + i) * 7)) {
+			errx(1, "wrong byte at offset %lu", pos + i);
+		}
+	}
+}
+
+static
+unsigned long
+elapsed(time_t secs0, unsigned long nsecs0)
+{
+	time_t secs1;
+	unsigned long nsecs1, usecs;
+
+	__time(&secs1, &nsecs1);
+	usecs = (secs1 - secs0) * 1000000UL;
+	usecs = usecs + nsecs1 / 1000 - nsecs0 / 1000;
+	return usecs == 0 ? 1 : usecs;
+}
+
+/*
+ * Check that descriptors from one open share the offset.
+ */
+static
+void
+sharetest(const char *file)
+{
+	int fd, status;
+	pid_t pid;
+	off_t pos;
+
+	fd = open(file, O_RDWR | O_CREAT | O_TRUNC, 0664);
+	if (fd < 0) {
+		err(1, "%s", file);
+	}
+	fill(0, 300);
+	if (write(fd, buf, 100) != 100) {
+		err(1, "write");
+	}
+
+	/* a dup2'd descriptor writes where the original left off */
+	if (dup2(fd, 10) != 10) {
+		err(1, "dup2");
+	}
+	if (write(10, buf + 100, 100) != 100) {
+		err(1, "write via dup2");
+	}
+	close(10);
+
+	/* and so does a forked child */
+	pid = fork();
+	if (pid < 0) {
+		err(1, "fork");
+	}
+	if (pid == 0) {
+		if (write(fd, buf + 200, 100) != 100) {
+			err(1, "write in child");
+		}
+		_exit(0);
+	}
+	if (waitpid(pid, &status, 0) < 0) {
+		err(1, "waitpid");
+	}
+
+	pos = lseek(fd, 0, SEEK_CUR);
+	if (pos != 300) {
+		errx(1, "offset after shared writes is %ld, not 300",
+		     (long)pos);
+	}
+	if (lseek(fd, 0, SEEK_END) != 300) {
+		errx(1, "file size is wrong after shared writes");
+	}
+
+	if (lseek(fd, 0, SEEK_SET) != 0) {
+		err(1, "lseek");
+	}
+	memset(buf, 0, 300);
+	if (read(fd, buf, 300) != 300) {
+		err(1, "read");
+	}
+	check(0, 300);
+	close(fd);
+}
+
+static
+void
+runsize(const char *file, size_t size, unsigned long total)
+{
+	time_t secs0;
+	unsigned long nsecs0, wusecs, rusecs, pos;
+	ssize_t r;
+	int fd;
+
+	fd = open(file, O_WRONLY | O_CREAT | O_TRUNC, 0664);
+	if (fd < 0) {
+		err(1, "%s", file);
+	}
+	wusecs = 0;
+	for (pos=0; pos<total; pos+=size) {
+		fill(pos, size);
+		__time(&secs0, &nsecs0);
+		r = write(fd, buf, size);
+		wusecs += elapsed(secs0, nsecs0);
+		if (r < 0) {
+			err(1, "%s: write", file);
+		}
+		if ((size_t)r != size) {
+			errx(1, "%s: short write", file);
+		}
+	}
+	close(fd);
+
+	fd = open(file, O_RDONLY);
+	if (fd < 0) {
+		err(1, "%s", file);
+	}
+	rusecs = 0;
+	for (pos=0; pos<total; pos+=size) {
+		__time(&secs0, &nsecs0);
+		r = read(fd, buf, size);
+		rusecs += elapsed(secs0, nsecs0);
+		if (r < 0) {
+			err(1, "%s: read", file);
+		}
+		if ((size_t)r != size) {
+			errx(1, "%s: short read", file);
+		}
+		check(pos, size);
+	}
+	close(fd);
+
+	/* bytes per usec * 1000000/1024 is (about) KB/s */
+	printf("%6lu %9lu %9lu\n", (unsigned long)size,
+	       (unsigned long)((unsigned long long)total * 976 / wusecs),
+	       (unsigned long)((unsigned long long)total * 976 / rusecs));
+}
+
+int
+main(int argc, char *argv[])
+{
+	const char *file = "fileperf.dat";
+	unsigned long total;
+	size_t size;
+
+	total = DEFAULT_KB;
+	if (argc > 1) {
+		total = atoi(argv[1]);
+	}
+	if (argc > 2) {
+		file = argv[2];
+	}
+	if (total == 0) {
+		errx(1, "Usage: fileperf [kbytes] [file]");
+	}
+	total *= 1024;
+
+	sharetest(file);
+	printf("fileperf: shared offsets ok\n");
+
+	printf("fileperf: KB/s for %lu KB\n", total / 1024);
+	printf("%6s %9s %9s\n", "size", "write", "read");
+	for (size=512; size<=MAXSIZE; size*=2) {
+		runsize(file, size, total);
+	}
+	return 0;
+}
@@ -0,0 +1,61 @@
+/*
+ * forkbench - measure fork+exit latency.
+ *
+ * Usage: forkbench [count]
+ *
+ * The parent forks COUNT children (default 200) one at a time. Each
+ * child exits at once; the parent waits for it before forking the
+ * next. Prints the average time for one fork, exit, and waitpid.
+ *
+ * To see what the kernel's thread pool saves, run it, then "tp off"
+ * at the kernel menu, run it again, and "tp on". "tp" shows how many
+ * thread_creates the pool served.
+ */
+
+#include <sys/wait.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <err.h>
+
+#define DEFAULT_COUNT 200
+
+int
+main(int argc, char *argv[])
+{
+	time_t secs0, secs1;
+	unsigned long nsecs0, nsecs1;
+	unsigned long usecs;
+	int count, i, status;
+	pid_t pid;
+
+	count = DEFAULT_COUNT;
+	if (argc > 1) {
+		count = atoi(argv[1]);
+	}
+	if (count <= 0) {
+		errx(1, "Usage: forkbench [count]");
+	}
+
+	__time(&secs0, &nsecs0);
+	for (i=0; i<count; i++) {
+		pid = fork();
+		if (pid < 0) {
+			err(1, "fork");
+		}
+		if (pid == 0) {
+			_exit(0);
+		}
+		if (waitpid(pid, &status, 0) < 0) {
+			err(1, "waitpid");
+		}
+	}
+	__time(&secs1, &nsecs1);
+
+	usecs = (secs1 - secs0) * 1000000UL;
+	usecs = usecs + nsecs1 / 1000 - nsecs0 / 1000;
+
+	printf("forkbench: %d fork+exit+waitpid in %lu us, %lu us each\n",
+	       count, usecs, usecs / count);
+	return 0;
+}
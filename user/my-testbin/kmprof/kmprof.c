@@ -0,0 +1,63 @@
+/*
+ * kmprof - show or control the kernel heap profiler.
+ *
+ * Usage: kmprof [on|off|reset]
+ *
+ * With no argument, prints the kernel's kmalloc call sites, largest
+ * live bytes first. Kernel addresses can be looked up in the kernel
+ * image with addr2line.
+ */
+
+#include <kern/types.h>
+#include <kern/kmprof.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdio.h>
+#include <err.h>
+
+#define MAXSITES 128
+
+static struct kmprof_site sites[MAXSITES];
+
+int
+main(int argc, char *argv[])
+{
+	int i, n, op;
+
+	if (argc == 2) {
+		if (!strcmp(argv[1], "on")) {
+			op = KMPROF_START;
+		}
+		else if (!strcmp(argv[1], "off")) {
+			op = KMPROF_STOP;
+		}
+		else if (!strcmp(argv[1], "reset")) {
+			op = KMPROF_RESET;
+		}
+		else {
+			errx(1, "Usage: kmprof [on|off|reset]");
+		}
+		if (__kmprof(op, NULL, 0) < 0) {
+			err(1, "__kmprof");
+		}
+		return 0;
+	}
+	if (argc != 1) {
+		errx(1, "Usage: kmprof [on|off|reset]");
+	}
+
+	n = __kmprof(KMPROF_GET, sites, MAXSITES);
+	if (n < 0) {
+		err(1, "__kmprof");
+	}
+
+	printf("%-10s %6s %8s %8s %8s %8s\n",
+	       "caller", "size", "allocs", "frees", "live", "peak");
+	for (i=0; i<n; i++) {
+		printf("0x%08x %6u %8u %8u %8u %8u\n",
+		       sites[i].ks_pc, sites[i].ks_size,
+		       sites[i].ks_allocs, sites[i].ks_frees,
+		       sites[i].ks_live, sites[i].ks_peak);
+	}
+	return 0;
+}
@@ -0,0 +1,188 @@
+/*
+ * memperf - measure memcpy, memmove, and bzero throughput.
+ *
+ * Usage: memperf [kbytes]
+ *
+ * For each size from 16 bytes to 64K (and a page-aligned 4K, to hit
+ * the page fast path) and each combination of destination and source
+ * offset 0-3, moves about KBYTES kilobytes (default 1024) in calls of
+ * that size and prints the rate in MB/s. memmove is run with the
+ * destination just above the source, so it has to copy backwards.
+ * A plain byte loop is timed alongside memcpy for comparison.
+ *
+ * Each test is checked once for correctness before it's timed.
+ */
+
+#include <unistd.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <err.h>
+
+#define MAXSIZE     65536
+#define PAGE        4096
+#define DEFAULT_KB  1024
+
+static char space[2 * MAXSIZE + 3 * PAGE];
+static char *dstbuf, *srcbuf;
+
+enum { T_BYTES, T_MEMCPY, T_MEMMOVE, T_BZERO, NTESTS };
+static const char *const testnames[NTESTS] = {
+	"byteloop", "memcpy", "memmove", "bzero",
+};
+
+static
+void
+bytecopy(char *dst, const char *src, size_t len)
+{
+	size_t i;
+
+	for (i=0; i<len; i++) {
+		dst[i] = src[i];
+	}
+}
+
+/*
+ * Fill the source with a pattern that depends on the offset, so that
+ * copying from the wrong place shows up.
+ */
+static
+void
+fill(void)
+{
+	size_t i;
+
+	for (i=0; i<MAXSIZE + PAGE; i++) {
+		srcbuf[i] = (char)(i * 7);
+	}
+}
+
+static
+void
+callone(int test, char *dst, const char *src, size_t size)
+{
+	switch (test) {
+	    case T_BYTES: bytecopy(dst, src, size); break;
+	    case T_MEMCPY: memcpy(dst, src, size); break;
+	    case T_MEMMOVE: memmove(dst, src, size); break;
+	    case T_BZERO: bzero(dst, size); break;
+	}
+}
+
+/*
+ * Run one test; return MB/s (which is bytes per microsecond).
+ */
+static
+unsigned long
+runtest(int test, size_t size, unsigned doff, unsigned soff,
+	unsigned long total)
+{
+	time_t secs0, secs1;
+	unsigned long nsecs0, nsecs1, usecs, count, i;
+	char *dst, *src;
+	char want;
+
+	src = srcbuf + soff;
+	if (test == T_MEMMOVE) {
+		/* overlapping, destination above source */
+		dst = srcbuf + 4 + doff;
+	}
+	else {
+		dst = dstbuf + doff;
+	}
+
+	/* check it once first */
+	callone(test, dst, src, size);
+	for (i=0; i<size; i++) {
+		want = test == T_BZERO ? 0 : (char)((soff + i) * 7);
+		if (dst[i] != want) {
+			errx(1, "%s: size %lu, offsets %u/%u: "
+			     "wrong byte at %lu", testnames[test],
+			     (unsigned long)size, doff, soff, i);
+		}
+	}
+	if (test == T_MEMMOVE) {
+		fill();
+	}
+
+	count = total / size;
+	if (count == 0) {
+		count = 1;
+	}
+
+	__time(&secs0, &nsecs0);
+	for (i=0; i<count; i++) {
+		callone(test, dst, src, size);
+	}
+	__time(&secs1, &nsecs1);
+
+	if (test == T_MEMMOVE) {
+		fill();
+	}
+
+	usecs = (secs1 - secs0) * 1000000UL;
+	usecs = usecs + nsecs1 / 1000 - nsecs0 / 1000;
+	if (usecs == 0) {
+		usecs = 1;
+	}
+	return count * size / usecs;
+}
+
+static
+void
+runsize(size_t size, int pagealigned, unsigned long total)
+{
+	unsigned doff, soff;
+	int test;
+
+	for (doff=0; doff<4; doff++) {
+		for (soff=0; soff<4; soff++) {
+			if (pagealigned && (doff != 0 || soff != 0)) {
+				continue;
+			}
+			printf("%6lu%c %u/%u", (unsigned long)size,
+			       pagealigned ? 'p' : ' ', doff, soff);
+			for (test=0; test<NTESTS; test++) {
+				printf(" %9lu", runtest(test, size, doff, soff,
+							total));
+			}
+			printf("\n");
+		}
+	}
+}
+
+int
+main(int argc, char *argv[])
+{
+	unsigned long total;
+	size_t size;
+	int test;
+
+	total = DEFAULT_KB;
+	if (argc > 1) {
+		total = atoi(argv[1]);
+	}
+	if (total == 0) {
+		errx(1, "Usage: memperf [kbytes]");
+	}
+	total *= 1024;
+
+	/* page-align both buffers */
+	dstbuf = (char *)(((unsigned long)space + PAGE - 1) & ~(PAGE - 1UL));
+	srcbuf = dstbuf + MAXSIZE + PAGE;
+	fill();
+
+	printf("memperf: MB/s; d/s is destination/source offset, "
+	       "p is page-aligned\n");
+	printf("%7s %3s", "size", "d/s");
+	for (test=0; test<NTESTS; test++) {
+		printf(" %9s", testnames[test]);
+	}
+	printf("\n");
+
+	for (size=16; size<=MAXSIZE; size*=4) {
+		runsize(size, 0, total);
+	}
+	runsize(PAGE, 1, total);
+	return 0;
+}
@@ -0,0 +1,148 @@
+/*
+ * mmapfile - check that a mapped file and read()/write() agree.
+ *
+ * Usage: mmapfile [file [pages]]
+ *
+ * Maps FILE (default emu0:mmapfile.dat) shared and writes to one byte
+ * through the mapping and to the next with write(): each must see the
+ * other's, and after munmap the file must have both, so writing the
+ * mapped page back didn't undo the write(). Then fills PAGES pages
+ * (default 4) through a mapping and checks them, and what read() gets
+ * afterwards; with more pages than fit in memory, that makes the
+ * mapped pages go out to swap and come back.
+ */
+
+#include <sys/mman.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <err.h>
+
+#define DEFAULT_PAGES 4
+#define PAGE 4096
+
+static char buf[PAGE];
+
+static
+void
+pwriteall(int fd, off_t pos, const char *p, size_t len)
+{
+	if (lseek(fd, pos, SEEK_SET) < 0) {
+		err(1, "lseek");
+	}
+	if (write(fd, p, len) != (ssize_t)len) {
+		err(1, "write");
+	}
+}
+
+static
+void
+preadall(int fd, off_t pos, char *p, size_t len)
+{
+	if (lseek(fd, pos, SEEK_SET) < 0) {
+		err(1, "lseek");
+	}
+	if (read(fd, p, len) != (ssize_t)len) {
+		err(1, "read");
+	}
+}
+
+static
+char *
+map(int fd, size_t len)
+{
+	void *p;
+
+	p = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (p == MAP_FAILED) {
+		err(1, "mmap");
+	}
+	return p;
+}
+
+/* What page I of the big mapping is filled with */
+static
+char
+pagebyte(size_t i)
+{
+	return 'A' + i % 26;
+}
+
+int
+main(int argc, char *argv[])
+{
+	const char *file = "emu0:mmapfile.dat";
+	size_t npages = DEFAULT_PAGES, i;
+	char *p;
+	int fd;
+
+	if (argc > 1) {
+		file = argv[1];
+	}
+	if (argc > 2) {
+		npages = atoi(argv[2]);
+	}
+	if (npages < 1) {
+		errx(1, "Usage: mmapfile [file [pages]]");
+	}
+
+	fd = open(file, O_RDWR | O_CREAT | O_TRUNC, 0664);
+	if (fd < 0) {
+		err(1, "%s", file);
+	}
+	for (i=0; i<PAGE; i++) {
+		buf[i] = '.';
+	}
+	pwriteall(fd, 0, buf, PAGE);
+
+	/* One byte each way, on the same page */
+	p = map(fd, PAGE);
+	p[0] = 'm';
+	pwriteall(fd, 1, "w", 1);
+	if (p[1] != 'w') {
+		errx(1, "the mapping didn't see write()");
+	}
+	preadall(fd, 0, buf, 2);
+	if (buf[0] != 'm' || buf[1] != 'w') {
+		errx(1, "read() didn't see the mapping's write");
+	}
+	if (munmap(p, PAGE) < 0) {
+		err(1, "munmap");
+	}
+	preadall(fd, 0, buf, 3);
+	if (buf[0] != 'm' || buf[1] != 'w' || buf[2] != '.') {
+		errx(1, "the file lost a write after munmap");
+	}
+
+	/* Lots of pages, each filled through the mapping */
+	for (i=0; i<PAGE; i++) {
+		buf[i] = 0;
+	}
+	for (i=0; i<npages; i++) {
+		pwriteall(fd, i * PAGE, buf, PAGE);
+	}
+	p = map(fd, npages * PAGE);
+	for (i=0; i<npages; i++) {
+		p[i * PAGE] = pagebyte(i);
+		p[i * PAGE + PAGE - 1] = pagebyte(i);
+	}
+	for (i=0; i<npages; i++) {
+		if (p[i * PAGE] != pagebyte(i) ||
+		    p[i * PAGE + PAGE - 1] != pagebyte(i)) {
+			errx(1, "mapped page %lu is wrong", (unsigned long)i);
+		}
+		preadall(fd, i * PAGE + PAGE - 1, buf, 1);
+		if (buf[0] != pagebyte(i)) {
+			errx(1, "read() of mapped page %lu is wrong",
+			     (unsigned long)i);
+		}
+	}
+	if (munmap(p, npages * PAGE) < 0) {
+		err(1, "munmap");
+	}
+	close(fd);
+
+	printf("mmapfile: passed\n");
+	return 0;
+}
@@ -0,0 +1,127 @@
+/*
+ * mmaptest - exercise anonymous mmap and munmap.
+ *
+ * Usage: mmaptest [pages]
+ *
+ * Maps PAGES pages (default 64) of private and of shared anonymous
+ * memory, checks they start out zeroed and hold what's written to
+ * them, and forks: the child's writes to the private mapping must not
+ * show up in the parent, and its writes to the shared one must. Then
+ * unmaps the middle of a mapping and checks the rest is still there.
+ */
+
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <err.h>
+
+#define DEFAULT_PAGES 64
+#define PAGE 4096
+
+static
+char *
+map(size_t len, int flags)
+{
+	void *p;
+
+	p = mmap(NULL, len, PROT_READ | PROT_WRITE, flags | MAP_ANON, -1, 0);
+	if (p == MAP_FAILED) {
+		err(1, "mmap");
+	}
+	return p;
+}
+
+static
+void
+fill(char *p, size_t npages, char c)
+{
+	size_t i;
+
+	for (i=0; i<npages; i++) {
+		p[i * PAGE] = c;
+		p[i * PAGE + PAGE - 1] = c;
+	}
+}
+
+static
+void
+check(const char *what, char *p, size_t npages, char c)
+{
+	size_t i;
+
+	for (i=0; i<npages; i++) {
+		if (p[i * PAGE] != c || p[i * PAGE + PAGE - 1] != c) {
+			errx(1, "%s: page %lu is wrong", what,
+			     (unsigned long)i);
+		}
+	}
+}
+
+int
+main(int argc, char *argv[])
+{
+	char *priv, *shared;
+	size_t npages, len;
+	int status;
+	pid_t pid;
+
+	npages = DEFAULT_PAGES;
+	if (argc > 1) {
+		npages = atoi(argv[1]);
+	}
+	if (npages < 3) {
+		errx(1, "Usage: mmaptest [pages]   (at least 3)");
+	}
+	len = npages * PAGE;
+
+	priv = map(len, MAP_PRIVATE);
+	shared = map(len, MAP_SHARED);
+	if (((unsigned long)priv | (unsigned long)shared) % PAGE != 0) {
+		errx(1, "mmap handed back an unaligned address");
+	}
+	check("new private mapping", priv, npages, 0);
+	check("new shared mapping", shared, npages, 0);
+	fill(priv, npages, 'p');
+	fill(shared, npages, 's');
+
+	pid = fork();
+	if (pid < 0) {
+		err(1, "fork");
+	}
+	if (pid == 0) {
+		check("child's private mapping", priv, npages, 'p');
+		check("child's shared mapping", shared, npages, 's');
+		fill(priv, npages, 'c');
+		fill(shared, npages, 'c');
+		_exit(0);
+	}
+	if (waitpid(pid, &status, 0) < 0) {
+		err(1, "waitpid");
+	}
+	if (WIFEXITED(status) == 0 || WEXITSTATUS(status) != 0) {
+		errx(1, "child failed");
+	}
+	check("private mapping after fork", priv, npages, 'p');
+	check("shared mapping after fork", shared, npages, 'c');
+
+	/* Punch a hole in the middle; both ends should survive */
+	if (munmap(priv + PAGE, len - 2 * PAGE) < 0) {
+		err(1, "munmap (middle)");
+	}
+	check("bottom of split mapping", priv, 1, 'p');
+	check("top of split mapping", priv + len - PAGE, 1, 'p');
+	if (munmap(priv, PAGE) < 0 || munmap(priv + len - PAGE, PAGE) < 0) {
+		err(1, "munmap (ends)");
+	}
+	if (munmap(shared, len) < 0) {
+		err(1, "munmap (shared)");
+	}
+	if (munmap(shared, len) == 0) {
+		errx(1, "munmap of an unmapped range succeeded");
+	}
+
+	printf("mmaptest: passed\n");
+	return 0;
+}
@@ -0,0 +1,146 @@
+/*
+ * shmtest - exercise shared memory segments.
+ *
+ * Usage: shmtest [count]
+ *
+ * Makes a segment and attaches it, then forks. The child finds the
+ * segment again by its key and attaches it a second time, and the two
+ * run a producer/consumer loop through a one-slot mailbox: the parent
+ * writes COUNT values (default 1000) through the mapping it had before
+ * the fork, the child reads them through its own attachment, and they
+ * take turns. Finally the segment is removed while still attached,
+ * which must leave the memory usable until it's detached. shm_detach
+ * must also refuse a shared mapping made by mmap.
+ */
+
+#include <sys/shm.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <err.h>
+
+#define KEY 0x5eed
+#define DEFAULT_COUNT 1000
+
+struct mailbox {
+	volatile int full;
+	volatile int value;
+	volatile int sum;
+};
+
+static
+struct mailbox *
+attach(int id)
+{
+	void *p;
+
+	p = shm_attach(id, NULL);
+	if (p == (void *)-1) {
+		err(1, "shm_attach");
+	}
+	return p;
+}
+
+int
+main(int argc, char *argv[])
+{
+	struct mailbox *mb, *mb2;
+	void *p;
+	int count, id, id2, i, sum, status;
+	pid_t pid;
+
+	count = DEFAULT_COUNT;
+	if (argc > 1) {
+		count = atoi(argv[1]);
+	}
+	if (count <= 0) {
+		errx(1, "Usage: shmtest [count]");
+	}
+
+	id = shm_create(KEY, sizeof(struct mailbox));
+	if (id < 0) {
+		err(1, "shm_create");
+	}
+	mb = attach(id);
+	if (mb->full != 0 || mb->value != 0 || mb->sum != 0) {
+		errx(1, "new segment isn't zeroed");
+	}
+
+	pid = fork();
+	if (pid < 0) {
+		err(1, "fork");
+	}
+	if (pid == 0) {
+		id2 = shm_create(KEY, sizeof(struct mailbox));
+		if (id2 != id) {
+			errx(1, "child got segment %d, not %d", id2, id);
+		}
+		mb2 = attach(id2);
+		if (mb2 == mb) {
+			errx(1, "second attach went on top of the first");
+		}
+		sum = 0;
+		for (i=0; i<count; i++) {
+			while (!mb2->full) {
+				/* wait for the parent */
+			}
+			sum += mb2->value;
+			mb2->full = 0;
+		}
+		mb2->sum = sum;
+		if (shm_detach(mb2) < 0) {
+			err(1, "shm_detach (child)");
+		}
+		_exit(0);
+	}
+
+	sum = 0;
+	for (i=1; i<=count; i++) {
+		while (mb->full) {
+			/* wait for the child */
+		}
+		mb->value = i;
+		sum += i;
+		mb->full = 1;
+	}
+	if (waitpid(pid, &status, 0) < 0) {
+		err(1, "waitpid");
+	}
+	if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+		errx(1, "child failed");
+	}
+	if (mb->sum != sum) {
+		errx(1, "child saw a sum of %d, not %d", mb->sum, sum);
+	}
+
+	if (shm_remove(id) < 0) {
+		err(1, "shm_remove");
+	}
+	mb->value = 42;
+	if (mb->value != 42) {
+		errx(1, "removed segment stopped working");
+	}
+	if (shm_detach(mb) < 0) {
+		err(1, "shm_detach");
+	}
+	if (shm_attach(id, NULL) != (void *)-1) {
+		errx(1, "attached a removed segment");
+	}
+
+	p = mmap(NULL, 4096, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANON,
+		 -1, 0);
+	if (p == MAP_FAILED) {
+		err(1, "mmap");
+	}
+	if (shm_detach(p) == 0) {
+		errx(1, "shm_detach unmapped an mmap mapping");
+	}
+	if (munmap(p, 4096) < 0) {
+		err(1, "munmap");
+	}
+
+	printf("shmtest: passed (%d values)\n", count);
+	return 0;
+}